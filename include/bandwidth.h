@@ -0,0 +1,46 @@
+#ifndef LIBERO_INSTALLER_BANDWIDTH_H
+#define LIBERO_INSTALLER_BANDWIDTH_H
+
+#include "common.h"
+
+/* Optional cap for everything this installer downloads, in bytes per second
+ * with an optional K, M or G suffix; 0 means unlimited. LIBERO_BANDWIDTH_LIMIT
+ * takes precedence, so a site running many installers behind one WAN link
+ * can hand each a slice of it. */
+#define BANDWIDTH_LIMIT_PATH "/etc/libero-installer/bandwidth"
+#define BANDWIDTH_MAX_FLOWS 16
+/* What background transfers keep while anything more urgent is running. */
+#define BANDWIDTH_BACKGROUND_FLOOR (64LL * 1024)
+/* Smallest allocation handed to any flow, so nothing stalls outright. */
+#define BANDWIDTH_MIN_RATE (16LL * 1024)
+
+typedef enum {
+    BANDWIDTH_CRITICAL = 0, /* artifacts the user is waiting for */
+    BANDWIDTH_BULK,         /* package fetches and clones inside the chroot */
+    BANDWIDTH_BACKGROUND,   /* speculative prefetch */
+    BANDWIDTH_CLASS_COUNT
+} BandwidthClass;
+
+int bandwidth_init(void);
+const char *bandwidth_class_name(BandwidthClass cls);
+long long bandwidth_parse_rate(const char *text);
+void bandwidth_set_limit(long long bytes_per_second);
+long long bandwidth_limit(void);
+/* Class used by fetch engine transfers started from this process. */
+void bandwidth_set_default_class(BandwidthClass cls);
+BandwidthClass bandwidth_default_class(void);
+
+int bandwidth_register(BandwidthClass cls, const char *label);
+void bandwidth_release(int flow);
+long long bandwidth_allocation(int flow);
+/* Token bucket for transfers the installer reads itself: account for bytes
+ * received, and ask how long to hold off before reading more. */
+void bandwidth_consume(int flow, long long bytes);
+long long bandwidth_wait_ms(int flow);
+/* Shell exports that make Portage's wget and rsync honour the allocation of
+ * flow; empty when it is unlimited. */
+int bandwidth_portage_env(int flow, char *buffer, size_t len);
+int bandwidth_run_chroot_script(const char *root, BandwidthClass cls, const char *label, const char *script_body);
+void bandwidth_describe(char *buffer, size_t len);
+
+#endif /* LIBERO_INSTALLER_BANDWIDTH_H */
@@ -0,0 +1,58 @@
+#ifndef LIBERO_INSTALLER_BLOCK_PROBE_H
+#define LIBERO_INSTALLER_BLOCK_PROBE_H
+
+#include "common.h"
+
+/* In-process replacement for blkid, blockdev and lsblk: sizes come from
+ * BLKGETSIZE64, relations from sysfs and filesystem identity from the
+ * superblocks of ext2/3/4, xfs, btrfs, vfat, swap and LUKS. Results are
+ * cached per device until a block uevent arrives or an external command
+ * runs (see block_probe_invalidate); mount and swap state is always read
+ * fresh since mounting raises no uevent. */
+#define BLOCK_PROBE_MAX_HOLDERS 8
+#define BLOCK_PROBE_CACHE_SIZE 32
+/* Deep enough for disk -> partition -> crypt -> LVM volumes. */
+#define BLOCK_PROBE_TREE_MAX 64
+
+typedef struct {
+    char path[PATH_MAX];  /* /dev/sda1, /dev/mapper/name for device-mapper */
+    char name[64];        /* kernel name, e.g. "sda1" or "dm-0" */
+    char kind[8];         /* "disk", "part", "crypt", "lvm" or "dm" */
+    dev_t devno;
+    uint64_t size_bytes;
+    unsigned sector_size; /* logical */
+    char fs_type[16];     /* blkid's names: "ext4", "vfat", "swap", "crypto_LUKS"...; empty when unknown */
+    char uuid[64];
+    char label[128];
+    int holder_count;
+    char holders[BLOCK_PROBE_MAX_HOLDERS][64]; /* kernel names of devices stacked on this one */
+    char mountpoint[PATH_MAX];                 /* first mount, empty when not mounted */
+    bool swap_active;
+} BlockInfo;
+
+/* I/O topology from /sys/block/<dev>/queue, in bytes; minimum_io is the
+ * preferred unit (a RAID chunk, or the physical sector) and optimal_io the
+ * preferred stream size (a full stripe), 0 when the device does not say. */
+typedef struct {
+    unsigned logical_block;
+    unsigned physical_block;
+    unsigned minimum_io;
+    unsigned optimal_io;
+    unsigned alignment_offset; /* where the first naturally aligned byte sits */
+    bool rotational;
+    unsigned discard_granularity;
+    uint64_t discard_max;      /* 0 when the device cannot discard */
+    uint64_t write_zeroes_max; /* 0 when zeroing is not offloaded to the device */
+} BlockTopology;
+
+/* Fills info for the block device at path. */
+int block_probe(const char *path, BlockInfo *info);
+/* The devices stacked on disk (partitions, mappings on them and so on),
+ * deepest first, so they can be torn down in order. The disk itself is not
+ * included. Returns the number found, or -1 when disk cannot be probed. */
+int block_probe_tree(const char *disk, BlockInfo *out, int max);
+/* Partitions report the queue of their disk but their own offset. */
+int block_probe_topology(const char *path, BlockTopology *topology);
+void block_probe_invalidate(void);
+
+#endif /* LIBERO_INSTALLER_BLOCK_PROBE_H */
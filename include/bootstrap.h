@@ -7,5 +7,6 @@
 #include "log.h"
 
 int bootstrap_workflow(InstallerState *state);
+int bootstrap_prefetch(InstallerState *state);
 
 #endif /* LIBERO_INSTALLER_BOOTSTRAP_H */
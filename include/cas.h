@@ -0,0 +1,19 @@
+#ifndef LIBERO_INSTALLER_CAS_H
+#define LIBERO_INSTALLER_CAS_H
+
+#include "common.h"
+#include "hash.h"
+
+/* Objects live under <cache>/cas/<algorithm>/<hex digest>. */
+#define CAS_DIR_NAME "cas"
+/* Directory name looked up at the top of attached media, e.g. a USB stick
+ * prepared once and reused to reimage many machines. */
+#define CAS_MEDIA_DIR_NAME "libero-cache"
+#define CAS_MAX_BUDGET_BYTES (4LL * 1024 * 1024 * 1024)
+
+int cas_restore(const char *cache_dir, const DigestSet *digests, const char *destination);
+int cas_lookup(const char *cache_dir, HashAlgorithm algorithm, const char *hex, char *path, size_t len);
+int cas_store(const char *cache_dir, const char *path, const DigestSet *digests);
+void cas_evict(const char *cache_dir, const char *keep_path);
+
+#endif /* LIBERO_INSTALLER_CAS_H */
@@ -23,6 +23,9 @@
 #define INSTALL_ROOT_DEFAULT "/mnt/gentoo"
 #define INSTALL_CACHE_DIR "/var/tmp/libero-installer"
 #define INSTALL_LOG_PATH "/var/log/libero-installer.log"
+/* Decisions made from measurements (benchmarks, tuning), kept apart from
+ * the log so they can be read at a glance. */
+#define INSTALL_REPORT_PATH "/var/log/libero-installer-report.txt"
 #define MIRROR_URL_MAX 512
 #define REMOTE_URL_MAX 2048
 
@@ -34,8 +37,13 @@
 #define LIBERO_BINHOST_I486 "https://distfiles.gentoo.org/releases/x86/binpackages/23.0/i486/"
 #define LIBERO_BINHOST_I686 "https://distfiles.gentoo.org/releases/x86/binpackages/23.0/i686/"
 
-#define STAGE3_BASE_URL "https://distfiles.gentoo.org/releases/x86/autobuilds"
-#define PORTAGE_BASE_URL "https://distfiles.gentoo.org/snapshots"
+#define GENTOO_MIRROR_DEFAULT "https://distfiles.gentoo.org"
+#define STAGE3_MIRROR_PATH "/releases/x86/autobuilds"
+#define PORTAGE_MIRROR_PATH "/snapshots"
+#define STAGE3_BASE_URL GENTOO_MIRROR_DEFAULT STAGE3_MIRROR_PATH
+#define PORTAGE_BASE_URL GENTOO_MIRROR_DEFAULT PORTAGE_MIRROR_PATH
+/* Optional extra mirror roots for the benchmark, one URL per line. */
+#define MIRROR_LIST_PATH "/etc/libero-installer/mirrors"
 #define PORTAGE_SNAPSHOT_NAME "portage-latest.tar.xz"
 
 #define DEFAULT_HOSTNAME "gentoo"
@@ -0,0 +1,36 @@
+#ifndef LIBERO_INSTALLER_DELTA_H
+#define LIBERO_INSTALLER_DELTA_H
+
+#include "common.h"
+
+/* Block-level delta transfer in the style of zsync: the target artifact is
+ * described by a block index (a rolling weak checksum and a truncated MD5 per
+ * block), every block found anywhere in an older local copy is copied from
+ * it, and only the remaining byte ranges are fetched from the mirrors. */
+#define DELTA_BLOCK_SIZE 8192
+#define DELTA_STRONG_BYTES 8
+#define DELTA_INDEX_SUFFIX ".blocks"
+#define DELTA_INDEX_MAGIC "LIBERO-BLOCKS 1"
+/* Neighbouring missing ranges closer than this are fetched as one request. */
+#define DELTA_COALESCE_GAP (256LL * 1024)
+/* Below this share of reusable bytes a plain download is cheaper. */
+#define DELTA_MIN_REUSE_PERCENT 10
+
+typedef struct {
+    long long length;
+    int block_size;
+    long long block_count;
+    uint32_t *weak;
+    unsigned char *strong; /* block_count * DELTA_STRONG_BYTES */
+} DeltaIndex;
+
+int delta_index_build(const char *path, DeltaIndex *index);
+int delta_index_write(const DeltaIndex *index, const char *path);
+int delta_index_load(const char *path, DeltaIndex *index);
+void delta_index_free(DeltaIndex *index);
+/* Builds destination from seed plus the ranges of urls the seed lacks. The
+ * caller verifies the result against the published digest. */
+int delta_fetch(const char *const *urls, int url_count, const DeltaIndex *index, const char *seed,
+                const char *destination);
+
+#endif /* LIBERO_INSTALLER_DELTA_H */
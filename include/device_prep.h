@@ -0,0 +1,29 @@
+#ifndef LIBERO_INSTALLER_DEVICE_PREP_H
+#define LIBERO_INSTALLER_DEVICE_PREP_H
+
+#include "common.h"
+
+/* Before partitioning, the whole target is discarded once (BLKDISCARD) on
+ * flash, or zeroed (BLKZEROOUT) when discard is missing or fails but the
+ * device zeroes ranges itself. mkfs then skips its own discard and lazy
+ * init. LIBERO_DEVICE_PREP, or the first line of DEVICE_PREP_CONFIG_PATH,
+ * picks "auto" (the default), "discard" (also on rotational media),
+ * "zeroout" (for cards whose discard cannot be trusted, even when the
+ * kernel has to write the zeroes itself) or "off". */
+#define DEVICE_PREP_CONFIG_PATH "/etc/libero-installer/device-prep"
+/* Ranges are issued in pieces this large so progress can be shown. */
+#define DEVICE_PREP_DISCARD_CHUNK (1024ULL * 1024 * 1024)
+#define DEVICE_PREP_ZEROOUT_CHUNK (256ULL * 1024 * 1024)
+
+typedef enum {
+    DEVICE_PREP_SKIPPED = 0,
+    DEVICE_PREP_DISCARDED,
+    DEVICE_PREP_ZEROED
+} DevicePrepMethod;
+
+/* Fails only when path cannot be opened exclusively; a device that can do
+ * neither is reported as DEVICE_PREP_SKIPPED. */
+int device_prepare(const char *path, DevicePrepMethod *method);
+const char *device_prep_method_name(DevicePrepMethod method);
+
+#endif /* LIBERO_INSTALLER_DEVICE_PREP_H */
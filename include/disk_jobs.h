@@ -0,0 +1,62 @@
+#ifndef LIBERO_INSTALLER_DISK_JOBS_H
+#define LIBERO_INSTALLER_DISK_JOBS_H
+
+#include "common.h"
+#include "progress.h"
+#include "system_utils.h"
+
+/* Disk preparation as a small dependency graph: every job is one command
+ * (mkfs, mkswap, luksFormat, ...) and starts as soon as the jobs it depends
+ * on have finished, its device node exists and no running job holds the
+ * same resource. Independent partitions are therefore formatted side by
+ * side while, for example, root still waits for its LUKS mapping. */
+#define DISK_JOBS_MAX 12
+#define DISK_JOB_MAX_DEPS 4
+#define DISK_JOB_COMMAND_MAX 1024
+
+typedef enum {
+    DISK_JOB_WAITING = 0,
+    DISK_JOB_RUNNING,
+    DISK_JOB_DONE,
+    DISK_JOB_FAILED,
+    DISK_JOB_SKIPPED /* something it depends on failed */
+} DiskJobState;
+
+typedef struct {
+    char label[48];
+    char device[PATH_MAX];   /* must be a block node before the job starts; its I/O is reported */
+    char resource[PATH_MAX]; /* jobs sharing a resource never overlap; defaults to device */
+    char command[DISK_JOB_COMMAND_MAX];
+    int deps[DISK_JOB_MAX_DEPS];
+    int dep_count;
+    DiskJobState state;
+    SpawnedCommand spawned;
+    ProgressState progress;
+    long long ready_ms; /* when its dependencies were met */
+    long long started_ms;
+    long long finished_ms;
+    int exit_code;
+} DiskJob;
+
+typedef struct {
+    DiskJob jobs[DISK_JOBS_MAX];
+    int count;
+    bool broken; /* a job could not be added; running the graph fails */
+} DiskJobGraph;
+
+void disk_jobs_init(DiskJobGraph *graph);
+/* Returns the job index, or -1 when the graph is full or the command does
+ * not fit. device may be NULL for jobs that create their device. */
+int disk_jobs_add(DiskJobGraph *graph, const char *label, const char *device, const char *fmt, ...)
+    __attribute__((format(printf, 4, 5)));
+/* job starts only after dependency succeeded. Dependencies must be added
+ * first, so the graph cannot contain a cycle; a negative dependency (a job
+ * that was never added) is ignored. */
+int disk_jobs_after(DiskJobGraph *graph, int job, int dependency);
+int disk_jobs_set_resource(DiskJobGraph *graph, int job, const char *resource);
+/* Runs every job, drawing one status line each. After a failure no new jobs
+ * start; the running ones are allowed to finish. Returns 0 when all jobs
+ * succeeded. */
+int disk_jobs_run(DiskJobGraph *graph, const char *title);
+
+#endif /* LIBERO_INSTALLER_DISK_JOBS_H */
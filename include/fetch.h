@@ -0,0 +1,50 @@
+#ifndef LIBERO_INSTALLER_FETCH_H
+#define LIBERO_INSTALLER_FETCH_H
+
+#include "common.h"
+
+#define FETCH_DEFAULT_SEGMENTS 4
+#define FETCH_MAX_SEGMENTS 8
+#define FETCH_MIN_SEGMENT_BYTES (8LL * 1024 * 1024)
+/* Smaller artifacts come from one mirror over one stream. */
+#define FETCH_SEGMENTED_MIN_BYTES (2 * FETCH_MIN_SEGMENT_BYTES)
+#define FETCH_MAX_SOURCES 4
+#define FETCH_CHUNK_BYTES (4LL * 1024 * 1024)
+
+/* Sidecars kept next to an interrupted download so it can be resumed. */
+#define FETCH_PARTIAL_SUFFIX ".part"
+#define FETCH_MANIFEST_SUFFIX ".part.manifest"
+
+typedef struct {
+    long long content_length;
+    bool accepts_ranges;
+    char validator[128]; /* ETag, else Last-Modified; empty when neither is sent */
+} FetchProbe;
+
+/* Validators remembered from an earlier response to a small, frequently
+ * polled file; empty strings when the server sent none. */
+typedef struct {
+    char etag[128];
+    char last_modified[64];
+} FetchValidators;
+
+/* Inclusive byte range of a remote artifact. */
+typedef struct {
+    long long start;
+    long long end;
+} FetchRange;
+
+/* Receives downloaded bytes in order; returns non-zero to abort the transfer. */
+typedef int (*FetchSink)(const char *data, size_t len, void *ctx);
+
+int fetch_probe(const char *url, FetchProbe *probe);
+int fetch_file(const char *url, const char *destination, int max_segments);
+/* urls are the same artifact on different mirrors, best ranked first. */
+int fetch_file_mirrors(const char *const *urls, int url_count, const char *destination, int max_segments);
+int fetch_stream(const char *url, FetchSink sink, void *ctx);
+int fetch_stream_mirrors(const char *const *urls, int url_count, FetchSink sink, void *ctx);
+int fetch_ranges_mirrors(const char *const *urls, int url_count, int fd, long long expected_length,
+                         const FetchRange *ranges, int range_count);
+int fetch_conditional(const char *url, const char *destination, FetchValidators *validators);
+
+#endif /* LIBERO_INSTALLER_FETCH_H */
@@ -0,0 +1,36 @@
+#ifndef LIBERO_INSTALLER_FS_PROFILE_H
+#define LIBERO_INSTALLER_FS_PROFILE_H
+
+#include "common.h"
+#include "state.h"
+
+/* A profile picks the root filesystem's mkfs options, mount options and
+ * the matching fstab entry. Unless one is pinned from the disk menu, the
+ * hardware decides: disks under FS_PROFILE_SMALL_DISK_MB get "small-disk",
+ * other non-rotational ones "flash" and the rest "throughput";
+ * "low-latency" is only ever chosen by hand. btrfs compression follows the
+ * CPU as well: zstd costs an i486 more than the disk time it saves, so it
+ * gets lzo (or the cheapest zstd level where space matters). */
+#define FS_PROFILE_SMALL_DISK_MB 16384L
+/* Below this the larger throughput journal and log would eat too much of
+ * the filesystem. */
+#define FS_PROFILE_BIG_LOG_MIN_MB 8192L
+/* btrfs root and /home live in subvolumes, so snapshots of / leave /home
+ * alone. */
+#define FS_PROFILE_BTRFS_ROOT_SUBVOL "@"
+#define FS_PROFILE_BTRFS_HOME_SUBVOL "@home"
+
+/* Picks the hardware default for state->target_disk unless the profile
+ * was pinned. */
+void fs_profile_resolve(InstallerState *state);
+const char *fs_profile_description(FsProfile profile);
+/* Options for mkfs of a root filesystem of root_mb; empty or starting with
+ * a space. */
+void fs_profile_mkfs_options(FsProfile profile, FilesystemType fs, long root_mb, char *buffer, size_t len);
+/* Whether ext inode tables and journal are written out at mkfs time rather
+ * than by the kernel in the background after mounting. */
+bool fs_profile_eager_init(FsProfile profile);
+/* Comma separated options for mount and fstab, without subvol=. */
+void fs_profile_mount_options(FsProfile profile, GentooArch arch, FilesystemType fs, char *buffer, size_t len);
+
+#endif /* LIBERO_INSTALLER_FS_PROFILE_H */
@@ -0,0 +1,61 @@
+#ifndef LIBERO_INSTALLER_HASH_H
+#define LIBERO_INSTALLER_HASH_H
+
+#include "common.h"
+
+typedef enum {
+    HASH_MD5 = 0,
+    HASH_SHA256,
+    HASH_SHA512,
+    HASH_BLAKE2S,
+    HASH_BLAKE2B,
+    HASH_ALGORITHM_COUNT
+} HashAlgorithm;
+
+#define HASH_MAX_DIGEST 64
+#define HASH_MAX_HEX (HASH_MAX_DIGEST * 2 + 1)
+
+typedef struct {
+    uint32_t h[8];
+    uint64_t length;
+    unsigned char block[64];
+    size_t used;
+} Hash32State;
+
+typedef struct {
+    uint64_t h[8];
+    uint64_t length[2];
+    unsigned char block[128];
+    size_t used;
+} Hash64State;
+
+typedef struct {
+    HashAlgorithm algorithm;
+    union {
+        Hash32State s32;
+        Hash64State s64;
+    } u;
+} HashContext;
+
+/* Published hashes for one artifact, indexed by algorithm. */
+typedef struct {
+    bool present[HASH_ALGORITHM_COUNT];
+    char hex[HASH_ALGORITHM_COUNT][HASH_MAX_HEX];
+} DigestSet;
+
+const char *hash_algorithm_name(HashAlgorithm algorithm);
+int hash_algorithm_from_name(const char *name, HashAlgorithm *algorithm);
+size_t hash_digest_size(HashAlgorithm algorithm);
+const char *hash_backend_name(HashAlgorithm algorithm);
+
+void hash_init(HashContext *ctx, HashAlgorithm algorithm);
+void hash_update(HashContext *ctx, const void *data, size_t len);
+void hash_final(HashContext *ctx, unsigned char *digest);
+void hash_final_hex(HashContext *ctx, char *hex, size_t len);
+int hash_file_hex(const char *path, HashAlgorithm algorithm, char *hex, size_t len);
+
+HashAlgorithm hash_select_fastest(const HashAlgorithm *candidates, size_t count);
+int hash_parse_digest_file(const char *path, const char *filename, HashAlgorithm default_algorithm, DigestSet *set);
+int digest_set_select(const DigestSet *set, HashAlgorithm *algorithm);
+
+#endif /* LIBERO_INSTALLER_HASH_H */
@@ -0,0 +1,49 @@
+#ifndef LIBERO_INSTALLER_LUKS_TUNING_H
+#define LIBERO_INSTALLER_LUKS_TUNING_H
+
+#include "common.h"
+
+/* Before luksFormat, every candidate cipher the kernel offers is run
+ * through "cryptsetup benchmark" and the fastest one whose strength meets
+ * the floor wins; within LUKS_TIE_PERCENT the stronger key is preferred.
+ * XTS splits its key in two, so a 256-bit aes-xts key is 128-bit AES.
+ * LIBERO_LUKS_CIPHER ("cipher:bits") skips the benchmark,
+ * LIBERO_LUKS_MIN_BITS raises the floor and LIBERO_LUKS_UNLOCK_MS sets the
+ * PBKDF target. */
+#define LUKS_MIN_SECURITY_BITS 128
+#define LUKS_TIE_PERCENT 5
+/* cryptsetup calibrates the PBKDF so one unlock takes this long here.
+ * GRUB derives the key several times slower than the kernel does, so a
+ * root it has to unlock itself gets a shorter target. */
+#define LUKS_UNLOCK_MS 2000
+#define LUKS_GRUB_UNLOCK_MS 1000
+/* argon2id gets a quarter of RAM, within these bounds (KiB). */
+#define LUKS_ARGON2_MIN_KIB 8192
+#define LUKS_ARGON2_MAX_KIB (1024 * 1024)
+#define LUKS_ARGON2_MAX_THREADS 4
+
+typedef struct {
+    char cipher[48]; /* dm-crypt spec, e.g. "aes-xts-plain64" */
+    unsigned key_bits;
+    double encrypt_mibs; /* 0 when not benchmarked */
+    double decrypt_mibs;
+    bool luks2;
+    const char *pbkdf; /* "argon2id" or "pbkdf2" */
+    unsigned iter_time_ms;
+    unsigned pbkdf_memory_kib; /* argon2id only */
+    unsigned pbkdf_threads;
+    unsigned sector_size;  /* 0 keeps 512-byte sectors */
+    bool bypass_workqueues;
+    /* Each empty or starting with a space. */
+    char format_options[256];
+    char open_options[96];
+} LuksTuning;
+
+/* Plans luksFormat and open for device. When GRUB has to unlock it (no
+ * separate /boot) the header stays LUKS1 with pbkdf2 and a cipher GRUB
+ * implements; otherwise it is LUKS2 with argon2id. Never fails: without a
+ * usable benchmark it falls back to aes-xts-plain64 with a 512-bit key. The
+ * choice is recorded in the install report. */
+void luks_tuning_plan(const char *device, bool grub_unlocks, LuksTuning *tuning);
+
+#endif /* LIBERO_INSTALLER_LUKS_TUNING_H */
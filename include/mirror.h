@@ -0,0 +1,22 @@
+#ifndef LIBERO_INSTALLER_MIRROR_H
+#define LIBERO_INSTALLER_MIRROR_H
+
+#include "common.h"
+
+#define MIRROR_MAX_CANDIDATES 16
+#define MIRROR_SAMPLE_PARALLEL 4
+#define MIRROR_SAMPLE_BYTES (1024 * 1024)
+#define MIRROR_CONNECT_TIMEOUT_MS 3000
+#define MIRROR_SAMPLE_TIMEOUT_MS 10000
+
+typedef struct {
+    char root[MIRROR_URL_MAX];
+    long connect_ms;    /* TCP connect time, -1 when unreachable */
+    long first_byte_ms; /* request to first payload byte, -1 when not sampled */
+    double throughput;  /* MB/s over the sample, 0 when not sampled */
+} MirrorResult;
+
+int mirror_candidates(const char *current_root, MirrorResult *results, int max);
+int mirror_benchmark(MirrorResult *results, int count);
+
+#endif /* LIBERO_INSTALLER_MIRROR_H */
@@ -0,0 +1,83 @@
+#ifndef LIBERO_INSTALLER_PARTITION_TABLE_H
+#define LIBERO_INSTALLER_PARTITION_TABLE_H
+
+#include "block_probe.h"
+#include "common.h"
+
+#define MAX_PARTITION_SPECS 8
+/* Partitions start on at least this boundary, as fdisk and parted do by
+ * default. */
+#define PTABLE_ALIGN_BYTES (1024ULL * 1024)
+/* Stripe alignment is given up beyond this boundary. */
+#define PTABLE_ALIGN_MAX_BYTES (64ULL * 1024 * 1024)
+#define PTABLE_GPT_ENTRIES 128
+#define PTABLE_GPT_ENTRY_SIZE 128
+#define PTABLE_GPT_NAME_CHARS 36
+#define PTABLE_MBR_PRIMARY 4
+
+/* One partition of the install layout. size_spec follows fdisk: "+512M" is
+ * a size, "-8M" ends that far before the end of the disk and an empty spec
+ * takes the rest. K, M, G and T are binary multiples. */
+typedef struct {
+    const char *role;
+    const char *label;
+    const char *gpt_type;
+    const char *mbr_type;
+    int part_number;
+    bool bootable; /* MBR active flag, GPT legacy BIOS bootable attribute */
+    char size_spec[32];
+    char device[PATH_MAX];
+} PartitionSpec;
+
+/* Every partition starts grain bytes apart, shifted by offset for devices
+ * whose natural alignment does not begin at byte 0. */
+typedef struct {
+    uint64_t grain;
+    uint64_t offset;
+} PartitionAlignment;
+
+typedef struct {
+    int number;
+    uint64_t first_lba;
+    uint64_t last_lba;
+    uint8_t type_guid[16];
+    uint8_t unique_guid[16];
+    uint8_t mbr_type;
+    bool bootable;
+    char name[PTABLE_GPT_NAME_CHARS + 1];
+} PartitionTableEntry;
+
+typedef struct {
+    bool gpt;
+    unsigned sector_size;
+    uint64_t total_sectors;
+    uint64_t alignment;        /* in sectors */
+    uint64_t alignment_offset; /* in sectors */
+    uint8_t disk_guid[16];
+    uint32_t mbr_signature;
+    int count;
+    PartitionTableEntry entries[MAX_PARTITION_SPECS];
+} PartitionTable;
+
+/* The smallest boundary that is a multiple of PTABLE_ALIGN_BYTES, the
+ * physical block and the preferred I/O sizes, so every partition starts on
+ * a full stripe of RAID and 4K drives alike. */
+void partition_table_alignment(const BlockTopology *topology, PartitionAlignment *alignment);
+/* Logical sector size and length of a block device or image file. */
+int partition_table_geometry(int fd, unsigned *sector_size, uint64_t *total_sectors);
+/* Resolves plan into sector ranges; fails when it does not fit. A partition
+ * that takes the rest of the disk ends on an alignment boundary too.
+ * alignment may be NULL for the PTABLE_ALIGN_BYTES default. */
+int partition_table_build(PartitionTable *table, bool gpt, unsigned sector_size, uint64_t total_sectors,
+                          const PartitionAlignment *alignment, const PartitionSpec *plan, size_t count);
+/* Writes the complete label (protective MBR plus primary and backup GPT, or
+ * a DOS MBR) and flushes it. */
+int partition_table_write(int fd, const PartitionTable *table);
+/* Tells the kernel about the new table: BLKRRPART, or BLKPG per partition
+ * when the disk cannot be reread as a whole. No-op for image files. */
+int partition_table_reread(int fd, const PartitionTable *table);
+/* Build, write and reread in one go against path. */
+int partition_table_apply(const char *path, bool gpt, const PartitionAlignment *alignment, const PartitionSpec *plan,
+                          size_t count);
+
+#endif /* LIBERO_INSTALLER_PARTITION_TABLE_H */
@@ -0,0 +1,35 @@
+#ifndef LIBERO_INSTALLER_PEER_H
+#define LIBERO_INSTALLER_PEER_H
+
+#include "common.h"
+#include "hash.h"
+
+/* Installers on the same network segment can serve their verified artifact
+ * cache to each other over plain HTTP. A peer is only ever a faster source:
+ * nothing it sends is kept unless it matches the digest published upstream. */
+#define PEER_DEFAULT_PORT 8737
+#define PEER_DISCOVERY_PORT 8737
+/* Optional static peers, one host or host:port per line. LIBERO_PEERS takes a
+ * comma separated list in the same format. */
+#define PEER_LIST_PATH "/etc/libero-installer/peers"
+#define PEER_MAX 8
+#define PEER_HOST_MAX 64
+#define PEER_DISCOVERY_TIMEOUT_MS 700
+#define PEER_PROBE_TIMEOUT_MS 1000
+#define PEER_INDEX_TIMEOUT_S 10
+
+typedef struct {
+    char host[PEER_HOST_MAX];
+    int port;
+} PeerAddress;
+
+int peer_default_port(void);
+int peer_server_start(const char *cache_dir, int port);
+void peer_server_stop(void);
+int peer_server_port(void);
+int peer_list(PeerAddress *peers, int max);
+int peer_object_urls(const DigestSet *digests, char urls[][REMOTE_URL_MAX], int max);
+int peer_fetch(const DigestSet *digests, const char *destination);
+int peer_fetch_index(const DigestSet *digests, const char *destination);
+
+#endif /* LIBERO_INSTALLER_PEER_H */
@@ -0,0 +1,27 @@
+#ifndef LIBERO_INSTALLER_PORTAGE_IMAGE_H
+#define LIBERO_INSTALLER_PORTAGE_IMAGE_H
+
+#include "common.h"
+
+/* Paths inside the target root. The image is kept after installation so a
+ * sync can swap in a new one instead of rewriting the tree file by file. */
+#define PORTAGE_REPO_DIR "/usr/portage"
+#define PORTAGE_IMAGE_DIR "/var/cache/portage"
+#define PORTAGE_IMAGE_PATH PORTAGE_IMAGE_DIR "/gentoo.sqfs"
+#define PORTAGE_IMAGE_LOWER PORTAGE_IMAGE_DIR "/gentoo-ro"
+#define PORTAGE_IMAGE_UPPER PORTAGE_IMAGE_DIR "/gentoo-rw/upper"
+#define PORTAGE_IMAGE_WORK PORTAGE_IMAGE_DIR "/gentoo-rw/work"
+
+/* Prebuilt images published next to the tarball snapshots. */
+#define PORTAGE_SQUASHFS_MIRROR_PATH "/snapshots/squashfs"
+#define PORTAGE_SQUASHFS_NAME "gentoo-current.xz.sqfs"
+#define PORTAGE_SQUASHFS_DIGESTS "sha512sum.txt"
+
+int portage_image_build(const char *archive, const char *image);
+int portage_image_mount(const char *root);
+int portage_image_unmount(const char *root);
+bool portage_image_mounted(const char *root);
+int portage_image_lowerdir(const char *root, char *buffer, size_t len);
+void portage_image_write_fstab(FILE *f, const char *root);
+
+#endif /* LIBERO_INSTALLER_PORTAGE_IMAGE_H */
@@ -0,0 +1,38 @@
+#ifndef LIBERO_INSTALLER_PREFETCH_H
+#define LIBERO_INSTALLER_PREFETCH_H
+
+#include "common.h"
+#include "fetch.h"
+
+/* Large artifacts start downloading in a background process as soon as the
+ * network is up, long before a target disk is mounted. Until then they are
+ * staged in the live medium cache, which on most live systems is RAM, so the
+ * staging budget is the smaller of PREFETCH_RAM_PERCENT of available memory
+ * and available memory less PREFETCH_RAM_RESERVE. On disk backed caches it
+ * is the free space less PREFETCH_DISK_RESERVE. LIBERO_PREFETCH_BUDGET, or
+ * the first line of PREFETCH_BUDGET_PATH, replaces the heuristic with an
+ * explicit size in bytes with an optional K, M or G suffix; 0 disables
+ * prefetching. */
+#define PREFETCH_BUDGET_PATH "/etc/libero-installer/prefetch"
+#define PREFETCH_RAM_PERCENT 50
+#define PREFETCH_RAM_RESERVE (384LL * 1024 * 1024)
+#define PREFETCH_DISK_RESERVE (512LL * 1024 * 1024)
+#define PREFETCH_MAX_ITEMS 4
+
+typedef struct {
+    char urls[FETCH_MAX_SOURCES][REMOTE_URL_MAX]; /* same artifact, best mirror first */
+    int url_count;
+    char destination[PATH_MAX];
+} PrefetchItem;
+
+long long prefetch_budget(const char *directory);
+int prefetch_start(const PrefetchItem *items, int count);
+/* Stops the prefetcher and waits for it; partial downloads stay resumable. */
+void prefetch_stop(void);
+bool prefetch_running(void);
+/* True once a run has finished or failed, as opposed to being stopped. */
+bool prefetch_settled(void);
+void prefetch_poll(void);
+void prefetch_summary(char *buffer, size_t len);
+
+#endif /* LIBERO_INSTALLER_PREFETCH_H */
@@ -0,0 +1,53 @@
+#ifndef LIBERO_INSTALLER_PROGRESS_H
+#define LIBERO_INSTALLER_PROGRESS_H
+
+#include "common.h"
+
+/* Child processes started through run_command() find the write end of a
+ * progress pipe in this environment variable. Each line is a record of
+ * space separated key=value fields:
+ *
+ *   phase=<word> bytes=<done>[/<total>] items=<done>[/<total>] item=<text>
+ *
+ * Every field is optional; item must come last and runs to the end of the
+ * line. Fields not repeated keep their previous value. */
+#define PROGRESS_FD_ENV "LIBERO_PROGRESS_FD"
+#define PROGRESS_CHILD_FD 9
+#define PROGRESS_LINE_MAX 256
+/* A job whose counters have not moved for this long is flagged as idle. */
+#define PROGRESS_IDLE_MS 60000
+
+typedef struct {
+    char phase[64];
+    char item[128];
+    long long bytes_done;
+    long long bytes_total; /* 0 when unknown */
+    long long items_done;
+    long long items_total; /* 0 when unknown */
+    long long started_ms;
+    long long advanced_ms; /* last time a counter moved */
+    long long sample_ms;
+    long long sample_bytes;
+    long long sample_items;
+    double byte_rate; /* smoothed, per second */
+    double item_rate;
+    bool reported;    /* at least one record was received */
+    char partial[PROGRESS_LINE_MAX];
+    size_t partial_len;
+} ProgressState;
+
+void progress_init(ProgressState *progress, const char *phase);
+void progress_set_phase(ProgressState *progress, const char *phase, const char *item);
+void progress_update(ProgressState *progress, long long bytes_done, long long bytes_total, long long items_done,
+                     long long items_total);
+int progress_parse_line(ProgressState *progress, const char *line);
+int progress_read(ProgressState *progress, int fd);
+int progress_percent(const ProgressState *progress);
+void progress_describe(const ProgressState *progress, char *buffer, size_t len);
+
+/* Job side of the channel. */
+int progress_channel(void);
+int progress_emit(int fd, const char *phase, long long bytes_done, long long bytes_total, long long items_done,
+                  long long items_total, const char *item);
+
+#endif /* LIBERO_INSTALLER_PROGRESS_H */
@@ -0,0 +1,36 @@
+#ifndef LIBERO_INSTALLER_REPO_SYNC_H
+#define LIBERO_INSTALLER_REPO_SYNC_H
+
+#include "common.h"
+#include "state.h"
+
+/* A tree newer than this is used as is; LIBERO_SYNC_MAX_AGE_HOURS overrides. */
+#define REPO_SYNC_DEFAULT_MAX_AGE_HOURS 24
+/* rsync moves only the delta, which stops paying off for very old trees. */
+#define REPO_SYNC_RSYNC_MAX_AGE_DAYS 30
+#define REPO_SYNC_CONNECT_TIMEOUT_MS 3000
+
+/* Recorded in the target after every sync or skipped sync. */
+#define REPO_SYNC_STATE_PATH "/var/lib/libero-installer/portage-sync"
+/* Durations of past syncs, per method, kept in the installer cache. */
+#define REPO_SYNC_TIMINGS_NAME "sync-timings"
+#define REPO_SYNC_REPOS_CONF "/etc/portage/repos.conf/gentoo.conf"
+#define REPO_SYNC_DEFAULT_LOCATION "/var/db/repos/gentoo"
+
+#define REPO_SYNC_RSYNC_HOST "rsync.gentoo.org"
+#define REPO_SYNC_RSYNC_URI "rsync://" REPO_SYNC_RSYNC_HOST "/gentoo-portage"
+#define REPO_SYNC_GIT_HOST "github.com"
+#define REPO_SYNC_GIT_URI "https://" REPO_SYNC_GIT_HOST "/gentoo-mirror/gentoo.git"
+
+typedef enum {
+    REPO_SYNC_WEBRSYNC = 0,
+    REPO_SYNC_RSYNC,
+    REPO_SYNC_GIT,
+    REPO_SYNC_METHOD_COUNT
+} RepoSyncMethod;
+
+const char *repo_sync_method_name(RepoSyncMethod method);
+long long repo_snapshot_timestamp(const char *tree);
+int repo_sync_ensure_fresh(const InstallerState *state);
+
+#endif /* LIBERO_INSTALLER_REPO_SYNC_H */
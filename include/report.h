@@ -0,0 +1,10 @@
+#ifndef LIBERO_INSTALLER_REPORT_H
+#define LIBERO_INSTALLER_REPORT_H
+
+#include "common.h"
+
+/* Appends "[section] line" to INSTALL_REPORT_PATH and mirrors it to the
+ * log. A report that cannot be written is not an install failure. */
+void report_add(const char *section, const char *fmt, ...) __attribute__((format(printf, 2, 3)));
+
+#endif /* LIBERO_INSTALLER_REPORT_H */
@@ -3,6 +3,8 @@
 
 #include "common.h"
 
+#define MIRROR_RANK_MAX 4
+
 typedef enum {
     ARCH_I486 = 0,
     ARCH_I686
@@ -19,15 +21,26 @@ typedef enum {
     FS_BTRFS
 } FilesystemType;
 
+/* Tuning of mkfs, mount and fstab options; see fs_profile.h. */
+typedef enum {
+    FS_PROFILE_THROUGHPUT = 0,
+    FS_PROFILE_LOW_LATENCY,
+    FS_PROFILE_FLASH,
+    FS_PROFILE_SMALL_DISK
+} FsProfile;
+
 typedef struct InstallerState {
     GentooArch arch;
     BootMode boot_mode;
     FilesystemType root_fs;
+    FsProfile fs_profile;
+    bool fs_profile_pinned; /* chosen by hand rather than from the hardware */
     bool use_luks;
     bool use_lvm;
     bool disk_prepared;
     bool network_configured;
     bool stage3_ready;
+    bool portage_squashfs;
     bool bootloader_installed;
 
     char install_root[PATH_MAX];
@@ -62,7 +75,11 @@ typedef struct InstallerState {
     char static_gateway[64];
     char static_dns[128];
 
+    char mirror_root[MIRROR_URL_MAX];
     char mirror_url[MIRROR_URL_MAX];
+    char mirror_ranked[MIRROR_RANK_MAX][MIRROR_URL_MAX];
+    int mirror_ranked_count;
+    bool mirror_pinned;
     char stage3_url[REMOTE_URL_MAX];
     char stage3_digest_url[REMOTE_URL_MAX];
     char stage3_local[PATH_MAX];
@@ -75,7 +92,9 @@ void installer_state_init(InstallerState *state);
 const char *arch_to_string(GentooArch arch);
 const char *boot_mode_to_string(BootMode mode);
 const char *fs_to_string(FilesystemType fs);
+const char *fs_profile_to_string(FsProfile profile);
 int installer_state_cache_dir(const InstallerState *state, bool prefer_install_root, char *buffer, size_t len);
 void installer_state_set_cache_dir(InstallerState *state, const char *cache_dir);
+void installer_state_set_mirror(InstallerState *state, const char *mirror_root);
 
 #endif /* LIBERO_INSTALLER_STATE_H */
@@ -4,9 +4,27 @@
 #include "common.h"
 
 int run_command(const char *fmt, ...) __attribute__((format(printf, 1, 2)));
+/* Like run_command, also reporting the I/O the command does on device. */
+int run_command_on_device(const char *device, const char *fmt, ...) __attribute__((format(printf, 2, 3)));
+/* A command started without waiting for it. */
+typedef struct {
+    pid_t pid;
+    pid_t watcher;
+    int watcher_stop; /* closing it makes the watcher exit */
+    int progress_fd; /* read end of the progress channel, non-blocking */
+    char command[MAX_CMD_LEN];
+} SpawnedCommand;
+/* Starts cmd the way run_command_on_device runs it (output to the log, a
+ * progress channel, I/O on device reported when device is set) and returns
+ * as soon as it runs. The caller reaps pid and then calls
+ * spawned_command_finish, which returns the exit code (-1 on a signal). */
+int spawn_command_on_device(const char *device, const char *cmd, SpawnedCommand *spawned);
+int spawned_command_finish(SpawnedCommand *spawned, int wait_status);
 int run_command_chroot(const char *root, const char *fmt, ...) __attribute__((format(printf, 2, 3)));
 int chroot_run_script(const char *root, const char *script_body);
 int capture_command(const char *cmd, char *output, size_t output_len);
+pid_t spawn_command_reader(const char *cmd, int *stdout_fd);
+pid_t spawn_command_writer(const char *cmd, int *stdin_fd);
 int ensure_directory(const char *path, mode_t mode);
 int copy_file_simple(const char *source, const char *destination);
 int write_text_file(const char *path, const char *content);
@@ -17,5 +35,7 @@ int get_block_uuid(const char *device, char *buffer, size_t buffer_len);
 long get_disk_size_mb(const char *device);
 int shell_escape_single_quotes(const char *input, char *output, size_t output_len);
 bool is_path_mounted(const char *path);
+int remove_tree(const char *path);
+int merge_directory_tree(const char *source, const char *destination);
 
 #endif /* LIBERO_INSTALLER_SYSTEM_UTILS_H */
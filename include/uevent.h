@@ -0,0 +1,33 @@
+#ifndef LIBERO_INSTALLER_UEVENT_H
+#define LIBERO_INSTALLER_UEVENT_H
+
+#include "common.h"
+
+/* How long a freshly created partition or mapping may take to show up in
+ * /dev before the step that created it is considered failed. */
+#define UEVENT_DEVICE_TIMEOUT_MS 15000
+
+/* Listens for kernel and udev device events. Open it before the command
+ * that creates a device, so the event cannot arrive before anyone listens.
+ * When netlink is unavailable fd stays -1 and waits fall back to polling. */
+typedef struct {
+    int fd;
+} UeventMonitor;
+
+typedef struct {
+    bool from_udev; /* sent after udev ran its rules, not straight from the kernel */
+    char action[16];
+    char subsystem[32];
+    char devtype[16];
+    char devname[64]; /* relative to /dev, e.g. "sda1" or "dm-0" */
+} UeventMessage;
+
+int uevent_monitor_open(UeventMonitor *monitor);
+void uevent_monitor_close(UeventMonitor *monitor);
+/* Returns 1 when a message was read, 0 when none is pending, -1 on error. */
+int uevent_monitor_read(UeventMonitor *monitor, UeventMessage *message);
+/* Blocks until every path is a block device node, or timeout_ms passes. */
+int uevent_wait_for_devices(UeventMonitor *monitor, const char *const *paths, int count, int timeout_ms);
+int uevent_wait_for_device(UeventMonitor *monitor, const char *path, int timeout_ms);
+
+#endif /* LIBERO_INSTALLER_UEVENT_H */
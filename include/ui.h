@@ -2,9 +2,11 @@
 #define LIBERO_INSTALLER_UI_H
 
 #include "common.h"
+#include "progress.h"
 
 int ui_init(void);
 void ui_shutdown(void);
+void ui_detach(int progress_fd);
 void ui_status(const char *message);
 void ui_message(const char *title, const char *message);
 bool ui_confirm(const char *title, const char *message);
@@ -14,7 +16,17 @@ int ui_menu(const char *title,
             size_t count,
             int selected);
 void ui_error(const char *title, const char *message);
-int ui_wait_for_process(const char *title, const char *message, pid_t pid);
+int ui_wait_for_process(const char *title, const char *message, pid_t pid, int progress_fd);
+void ui_progress(const char *title, const char *message, int percent);
+void ui_progress_state(const char *title, const char *message, const ProgressState *progress);
+/* One row of ui_job_status; a negative percent leaves the bar empty. */
+typedef struct {
+    const char *label;
+    const char *state;
+    const char *detail;
+    int percent;
+} UiJobRow;
+void ui_job_status(const char *title, const char *message, const UiJobRow *rows, int count);
 int ui_prompt_input(const char *title,
                     const char *prompt,
                     char *buffer,
@@ -0,0 +1,38 @@
+#ifndef LIBERO_INSTALLER_UNTAR_H
+#define LIBERO_INSTALLER_UNTAR_H
+
+#include "common.h"
+
+/* Restore every extended attribute in the archive, like
+ * tar --xattrs-include='*.*'. */
+#define UNTAR_XATTRS 0x01
+/* Use the numeric uid/gid from the archive instead of looking up the user
+ * and group names, like tar --numeric-owner. */
+#define UNTAR_NUMERIC_OWNER 0x02
+
+#define UNTAR_PROGRESS_INTERVAL_MS 250
+
+typedef struct {
+    long long entries;
+    long long files;
+    long long directories;
+    long long symlinks;
+    long long hardlinks;
+    long long sparse_files;
+    long long bytes;         /* file payload written */
+    long long metadata_ops;  /* ownership, xattr, mode and time updates */
+    double seconds;
+} UntarStats;
+
+/* In-process extractor for ustar, GNU and pax archives fed as a byte stream.
+ * File data is written as it arrives; ownership, xattrs, special mode bits
+ * and timestamps are recorded and applied in one pass per directory when the
+ * archive ends, followed by a single syncfs() instead of per-file fsync. */
+typedef struct Untar Untar;
+
+Untar *untar_open(const char *root, int flags, const char *label, long long expected_bytes);
+int untar_sink(const char *data, size_t len, void *untar);
+int untar_close(Untar *untar, UntarStats *stats);
+void untar_log_stats(const char *label, const UntarStats *stats);
+
+#endif /* LIBERO_INSTALLER_UNTAR_H */
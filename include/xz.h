@@ -0,0 +1,33 @@
+#ifndef LIBERO_INSTALLER_XZ_H
+#define LIBERO_INSTALLER_XZ_H
+
+#include "common.h"
+
+/* Output buffer handed to the consumer per call. */
+#define XZ_OUTPUT_CHUNK (1024 * 1024)
+
+typedef struct {
+    long long in_bytes;
+    long long out_bytes;
+    double seconds;
+    double cpu_seconds;
+    unsigned int threads;
+} XzStats;
+
+/* Receives decoded bytes in order; returns non-zero to abort decoding. */
+typedef int (*XzSink)(const char *data, size_t len, void *ctx);
+
+/* In-process .xz decoder feeding a sink. Independent blocks are
+ * decoded on a worker pool sized to the online CPUs; single-block streams,
+ * or those too large for the memory limit, decode on one thread with
+ * output in the original order either way. */
+typedef struct XzStream XzStream;
+
+XzStream *xz_stream_open(XzSink sink, void *ctx);
+int xz_stream_write(XzStream *xz, const void *data, size_t len);
+int xz_stream_close(XzStream *xz, XzStats *stats);
+int xz_decompress_file(const char *path, XzSink sink, void *ctx, XzStats *stats);
+long long xz_uncompressed_size(const char *path);
+void xz_log_stats(const char *label, const XzStats *stats);
+
+#endif /* LIBERO_INSTALLER_XZ_H */
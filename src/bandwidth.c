@@ -0,0 +1,440 @@
+#include "bandwidth.h"
+
+#include <pthread.h>
+#include <signal.h>
+#include <sys/mman.h>
+
+#include "log.h"
+#include "system_utils.h"
+
+/* Shares of the cap between the foreground classes while both are active. */
+#define BANDWIDTH_CRITICAL_WEIGHT 3
+#define BANDWIDTH_BULK_WEIGHT 1
+/* Burst a flow may take at once, as a fraction of a second of its rate. */
+#define BANDWIDTH_BURST_DIVISOR 4
+#define BANDWIDTH_MIN_BURST (16LL * 1024)
+
+typedef struct {
+    pid_t pid; /* 0 when the slot is free */
+    BandwidthClass cls;
+    char label[48];
+    long long rate; /* bytes per second, 0 when unlimited */
+    long long tokens;
+    long long refilled_ms;
+    long long bytes;
+} BandwidthFlow;
+
+/* Lives in a shared mapping created before any child is forked, so the
+ * background prefetcher and the foreground share one budget. */
+typedef struct {
+    pthread_mutex_t lock;
+    long long limit;
+    BandwidthFlow flows[BANDWIDTH_MAX_FLOWS];
+} BandwidthTable;
+
+static BandwidthTable *table;
+static BandwidthClass default_class = BANDWIDTH_CRITICAL;
+
+static const char *const class_names[BANDWIDTH_CLASS_COUNT] = {"critical", "bulk", "background"};
+
+static long long monotonic_ms(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (long long)ts.tv_sec * 1000 + ts.tv_nsec / 1000000;
+}
+
+const char *bandwidth_class_name(BandwidthClass cls)
+{
+    return cls >= 0 && cls < BANDWIDTH_CLASS_COUNT ? class_names[cls] : "unknown";
+}
+
+/* Accepts "0", "750000", "512K", "2.5M" or "1G"; returns -1 when malformed. */
+long long bandwidth_parse_rate(const char *text)
+{
+    while (text && isspace((unsigned char)*text)) {
+        text++;
+    }
+    if (!text || !*text) {
+        return -1;
+    }
+    char *end = NULL;
+    double value = strtod(text, &end);
+    if (end == text || value < 0) {
+        return -1;
+    }
+    switch (toupper((unsigned char)*end)) {
+    case 'K':
+        value *= 1024;
+        end++;
+        break;
+    case 'M':
+        value *= 1024 * 1024;
+        end++;
+        break;
+    case 'G':
+        value *= 1024.0 * 1024 * 1024;
+        end++;
+        break;
+    default:
+        break;
+    }
+    while (isspace((unsigned char)*end)) {
+        end++;
+    }
+    return *end ? -1 : (long long)value;
+}
+
+static long long configured_limit(void)
+{
+    const char *env = getenv("LIBERO_BANDWIDTH_LIMIT");
+    if (env && *env) {
+        long long rate = bandwidth_parse_rate(env);
+        if (rate >= 0) {
+            return rate;
+        }
+        log_error("Ignoring malformed LIBERO_BANDWIDTH_LIMIT '%s'", env);
+    }
+    FILE *f = fopen(BANDWIDTH_LIMIT_PATH, "r");
+    if (!f) {
+        return 0;
+    }
+    char line[64];
+    long long rate = 0;
+    while (fgets(line, sizeof(line), f)) {
+        line[strcspn(line, "#\r\n")] = '\0';
+        long long parsed = bandwidth_parse_rate(line);
+        if (parsed >= 0) {
+            rate = parsed;
+            break;
+        }
+    }
+    fclose(f);
+    return rate;
+}
+
+int bandwidth_init(void)
+{
+    if (table) {
+        return 0;
+    }
+    void *map = mmap(NULL, sizeof(BandwidthTable), PROT_READ | PROT_WRITE, MAP_SHARED | MAP_ANONYMOUS, -1, 0);
+    if (map == MAP_FAILED) {
+        log_error("Unable to set up the bandwidth scheduler: %s", strerror(errno));
+        return -1;
+    }
+    BandwidthTable *t = map;
+    memset(t, 0, sizeof(*t));
+    pthread_mutexattr_t attr;
+    pthread_mutexattr_init(&attr);
+    pthread_mutexattr_setpshared(&attr, PTHREAD_PROCESS_SHARED);
+    /* The prefetcher is killed whenever the foreground takes over. */
+    pthread_mutexattr_setrobust(&attr, PTHREAD_MUTEX_ROBUST);
+    pthread_mutex_init(&t->lock, &attr);
+    pthread_mutexattr_destroy(&attr);
+    t->limit = configured_limit();
+    table = t;
+    if (t->limit > 0) {
+        log_info("Bandwidth cap: %.2f MB/s", t->limit / 1048576.0);
+    }
+    return 0;
+}
+
+static void lock_table(void)
+{
+    if (pthread_mutex_lock(&table->lock) == EOWNERDEAD) {
+        /* The table is only ever updated field by field, so whatever the
+         * dead holder left behind is still usable. */
+        pthread_mutex_consistent(&table->lock);
+    }
+}
+
+static bool flow_valid(int flow)
+{
+    return table && flow >= 0 && flow < BANDWIDTH_MAX_FLOWS && table->flows[flow].pid != 0;
+}
+
+/* Background flows drop to a trickle while anything else runs; the
+ * foreground classes split what is left by weight. Caller holds the lock. */
+static void reallocate(void)
+{
+    int counts[BANDWIDTH_CLASS_COUNT] = {0};
+    for (int i = 0; i < BANDWIDTH_MAX_FLOWS; ++i) {
+        BandwidthFlow *f = &table->flows[i];
+        if (f->pid != 0 && kill(f->pid, 0) != 0 && errno == ESRCH) {
+            f->pid = 0;
+        }
+        if (f->pid != 0) {
+            counts[f->cls]++;
+        }
+    }
+
+    long long limit = table->limit;
+    bool foreground = counts[BANDWIDTH_CRITICAL] + counts[BANDWIDTH_BULK] > 0;
+    long long rates[BANDWIDTH_CLASS_COUNT] = {0};
+    if (foreground) {
+        rates[BANDWIDTH_BACKGROUND] = BANDWIDTH_BACKGROUND_FLOOR;
+    }
+    if (limit > 0) {
+        long long spare = limit;
+        if (foreground) {
+            spare -= counts[BANDWIDTH_BACKGROUND] * BANDWIDTH_BACKGROUND_FLOOR;
+            int weights = (counts[BANDWIDTH_CRITICAL] > 0 ? BANDWIDTH_CRITICAL_WEIGHT : 0) +
+                          (counts[BANDWIDTH_BULK] > 0 ? BANDWIDTH_BULK_WEIGHT : 0);
+            if (counts[BANDWIDTH_CRITICAL] > 0) {
+                rates[BANDWIDTH_CRITICAL] =
+                    spare * BANDWIDTH_CRITICAL_WEIGHT / weights / counts[BANDWIDTH_CRITICAL];
+            }
+            if (counts[BANDWIDTH_BULK] > 0) {
+                rates[BANDWIDTH_BULK] = spare * BANDWIDTH_BULK_WEIGHT / weights / counts[BANDWIDTH_BULK];
+            }
+        } else if (counts[BANDWIDTH_BACKGROUND] > 0) {
+            rates[BANDWIDTH_BACKGROUND] = spare / counts[BANDWIDTH_BACKGROUND];
+        }
+        for (int c = 0; c < BANDWIDTH_CLASS_COUNT; ++c) {
+            if (rates[c] < BANDWIDTH_MIN_RATE) {
+                rates[c] = BANDWIDTH_MIN_RATE;
+            }
+        }
+    }
+
+    for (int i = 0; i < BANDWIDTH_MAX_FLOWS; ++i) {
+        BandwidthFlow *f = &table->flows[i];
+        if (f->pid != 0) {
+            f->rate = rates[f->cls];
+        }
+    }
+}
+
+void bandwidth_set_limit(long long bytes_per_second)
+{
+    if (bandwidth_init() != 0) {
+        return;
+    }
+    lock_table();
+    table->limit = bytes_per_second > 0 ? bytes_per_second : 0;
+    reallocate();
+    pthread_mutex_unlock(&table->lock);
+    if (bytes_per_second > 0) {
+        log_info("Bandwidth cap set to %.2f MB/s", bytes_per_second / 1048576.0);
+    } else {
+        log_info("Bandwidth cap removed");
+    }
+}
+
+long long bandwidth_limit(void)
+{
+    return bandwidth_init() == 0 ? table->limit : 0;
+}
+
+void bandwidth_set_default_class(BandwidthClass cls)
+{
+    default_class = cls;
+}
+
+BandwidthClass bandwidth_default_class(void)
+{
+    return default_class;
+}
+
+/* Returns a flow handle, or -1 when the table is full; transfers without a
+ * handle simply run unthrottled. */
+int bandwidth_register(BandwidthClass cls, const char *label)
+{
+    if (bandwidth_init() != 0 || cls < 0 || cls >= BANDWIDTH_CLASS_COUNT) {
+        return -1;
+    }
+    lock_table();
+    int flow = -1;
+    for (int i = 0; i < BANDWIDTH_MAX_FLOWS; ++i) {
+        if (table->flows[i].pid == 0) {
+            flow = i;
+            break;
+        }
+    }
+    if (flow >= 0) {
+        BandwidthFlow *f = &table->flows[flow];
+        memset(f, 0, sizeof(*f));
+        f->pid = getpid();
+        f->cls = cls;
+        snprintf(f->label, sizeof(f->label), "%s", label ? label : "");
+        f->refilled_ms = monotonic_ms();
+        reallocate();
+    }
+    pthread_mutex_unlock(&table->lock);
+    if (flow < 0) {
+        log_error("Bandwidth scheduler is full; %s runs unthrottled", label ? label : "transfer");
+    }
+    return flow;
+}
+
+void bandwidth_release(int flow)
+{
+    if (!flow_valid(flow)) {
+        return;
+    }
+    lock_table();
+    table->flows[flow].pid = 0;
+    reallocate();
+    pthread_mutex_unlock(&table->lock);
+}
+
+long long bandwidth_allocation(int flow)
+{
+    if (!flow_valid(flow)) {
+        return 0;
+    }
+    lock_table();
+    long long rate = table->flows[flow].rate;
+    pthread_mutex_unlock(&table->lock);
+    return rate;
+}
+
+/* Tokens may go negative: a read is accounted after the fact and the debt
+ * is paid off by waiting. Caller holds the lock. */
+static void refill(BandwidthFlow *f, long long now)
+{
+    long long burst = f->rate / BANDWIDTH_BURST_DIVISOR;
+    if (burst < BANDWIDTH_MIN_BURST) {
+        burst = BANDWIDTH_MIN_BURST;
+    }
+    f->tokens += f->rate * (now - f->refilled_ms) / 1000;
+    if (f->tokens > burst) {
+        f->tokens = burst;
+    }
+    f->refilled_ms = now;
+}
+
+void bandwidth_consume(int flow, long long bytes)
+{
+    if (!flow_valid(flow)) {
+        return;
+    }
+    lock_table();
+    BandwidthFlow *f = &table->flows[flow];
+    refill(f, monotonic_ms());
+    f->bytes += bytes;
+    if (f->rate > 0) {
+        f->tokens -= bytes;
+    }
+    pthread_mutex_unlock(&table->lock);
+}
+
+long long bandwidth_wait_ms(int flow)
+{
+    if (!flow_valid(flow)) {
+        return 0;
+    }
+    lock_table();
+    BandwidthFlow *f = &table->flows[flow];
+    long long wait = 0;
+    if (f->rate > 0) {
+        refill(f, monotonic_ms());
+        if (f->tokens < 0) {
+            wait = (-f->tokens * 1000) / f->rate + 1;
+        }
+    } else {
+        f->tokens = 0;
+    }
+    pthread_mutex_unlock(&table->lock);
+    return wait;
+}
+
+int bandwidth_portage_env(int flow, char *buffer, size_t len)
+{
+    long long rate = bandwidth_allocation(flow);
+    if (len == 0) {
+        return -1;
+    }
+    buffer[0] = '\0';
+    if (rate <= 0) {
+        return 0;
+    }
+    long long kib = rate / 1024 > 0 ? rate / 1024 : 1;
+    int n = snprintf(buffer, len,
+                     "export FETCHCOMMAND='wget -t 3 -T 60 --passive-ftp --limit-rate=%lldk -O \"${DISTDIR}/${FILE}\" \"${URI}\"'\n"
+                     "export RESUMECOMMAND='wget -c -t 3 -T 60 --passive-ftp --limit-rate=%lldk -O \"${DISTDIR}/${FILE}\" \"${URI}\"'\n"
+                     "export PORTAGE_RSYNC_EXTRA_OPTS='--bwlimit=%lld'\n",
+                     kib, kib, kib);
+    return n > 0 && n < (int)len ? 0 : -1;
+}
+
+/* Runs a chroot script as one flow of cls. Processes inside cannot read the
+ * token bucket, so the allocation at start is handed to Portage's fetchers;
+ * tools without a rate option still count against the other flows. */
+int bandwidth_run_chroot_script(const char *root, BandwidthClass cls, const char *label, const char *script_body)
+{
+    int flow = bandwidth_register(cls, label);
+    char env[1024];
+    if (bandwidth_portage_env(flow, env, sizeof(env)) != 0) {
+        env[0] = '\0';
+    }
+    size_t len = strlen(env) + strlen(script_body) + 1;
+    char *script = malloc(len);
+    if (!script) {
+        bandwidth_release(flow);
+        return -1;
+    }
+    snprintf(script, len, "%s%s", env, script_body);
+    if (env[0]) {
+        log_info("%s runs as a %s flow at %lld KB/s", label, class_names[cls], bandwidth_allocation(flow) / 1024);
+    }
+    int rc = chroot_run_script(root, script);
+    free(script);
+    bandwidth_release(flow);
+    return rc;
+}
+
+static void format_rate(long long rate, char *buffer, size_t len)
+{
+    if (rate <= 0) {
+        snprintf(buffer, len, "unlimited");
+    } else if (rate >= 1048576) {
+        snprintf(buffer, len, "%.1f MB/s", rate / 1048576.0);
+    } else {
+        snprintf(buffer, len, "%lld KB/s", rate / 1024);
+    }
+}
+
+/* One line for menus and progress screens, e.g.
+ * "Cap 4.0 MB/s: critical 1x3.0 MB/s, bulk 1x1.0 MB/s". */
+void bandwidth_describe(char *buffer, size_t len)
+{
+    if (len == 0) {
+        return;
+    }
+    if (bandwidth_init() != 0) {
+        snprintf(buffer, len, "Bandwidth: unmanaged");
+        return;
+    }
+    lock_table();
+    reallocate();
+    int counts[BANDWIDTH_CLASS_COUNT] = {0};
+    long long rates[BANDWIDTH_CLASS_COUNT] = {0};
+    for (int i = 0; i < BANDWIDTH_MAX_FLOWS; ++i) {
+        const BandwidthFlow *f = &table->flows[i];
+        if (f->pid != 0) {
+            counts[f->cls]++;
+            rates[f->cls] = f->rate;
+        }
+    }
+    long long limit = table->limit;
+    pthread_mutex_unlock(&table->lock);
+
+    char rate[32];
+    format_rate(limit, rate, sizeof(rate));
+    size_t used = (size_t)snprintf(buffer, len, "Cap %s", rate);
+    bool any = false;
+    for (int c = 0; c < BANDWIDTH_CLASS_COUNT && used < len; ++c) {
+        if (counts[c] == 0) {
+            continue;
+        }
+        format_rate(rates[c], rate, sizeof(rate));
+        used += (size_t)snprintf(buffer + used, len - used, "%s%s %dx%s", any ? ", " : ": ", class_names[c],
+                                 counts[c], rate);
+        any = true;
+    }
+    if (!any && used < len) {
+        snprintf(buffer + used, len - used, ": idle");
+    }
+}
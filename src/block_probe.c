@@ -0,0 +1,528 @@
+#include "block_probe.h"
+
+#include <dirent.h>
+#include <fcntl.h>
+#include <linux/fs.h>
+#include <sys/ioctl.h>
+#include <sys/sysmacros.h>
+
+#include "log.h"
+#include "uevent.h"
+
+/* Covers every superblock probed below; btrfs sits furthest out at 64K and
+ * the swap signature ends a page of up to 64K. */
+#define PROBE_READ_BYTES (64 * 1024 + 4096)
+#define PROBE_TREE_DEPTH 4
+
+typedef struct {
+    bool valid;
+    BlockInfo info;
+} ProbeCacheEntry;
+
+static ProbeCacheEntry probe_cache[BLOCK_PROBE_CACHE_SIZE];
+static int probe_cache_next;
+static UeventMonitor probe_monitor = {.fd = -1};
+static bool probe_monitor_tried;
+
+void block_probe_invalidate(void)
+{
+    for (int i = 0; i < BLOCK_PROBE_CACHE_SIZE; ++i) {
+        probe_cache[i].valid = false;
+    }
+}
+
+/* Drops the cache when block devices changed since the last probe. */
+static void process_uevents(void)
+{
+    if (!probe_monitor_tried) {
+        probe_monitor_tried = true;
+        uevent_monitor_open(&probe_monitor);
+    }
+    if (probe_monitor.fd < 0) {
+        return;
+    }
+    UeventMessage message;
+    int rc;
+    errno = 0;
+    while ((rc = uevent_monitor_read(&probe_monitor, &message)) > 0) {
+        if (strcmp(message.subsystem, "block") == 0) {
+            block_probe_invalidate();
+        }
+    }
+    /* Events may have been dropped on a full socket buffer. */
+    if (rc < 0 || errno == ENOBUFS) {
+        block_probe_invalidate();
+    }
+}
+
+static uint16_t le16(const unsigned char *p)
+{
+    return (uint16_t)(p[0] | (p[1] << 8));
+}
+
+static uint32_t le32(const unsigned char *p)
+{
+    return (uint32_t)p[0] | ((uint32_t)p[1] << 8) | ((uint32_t)p[2] << 16) | ((uint32_t)p[3] << 24);
+}
+
+static void format_uuid(char *out, size_t len, const unsigned char *u)
+{
+    snprintf(out, len, "%02x%02x%02x%02x-%02x%02x-%02x%02x-%02x%02x-%02x%02x%02x%02x%02x%02x", u[0], u[1], u[2], u[3],
+             u[4], u[5], u[6], u[7], u[8], u[9], u[10], u[11], u[12], u[13], u[14], u[15]);
+}
+
+/* Labels are fixed size fields, NUL padded or (vfat) space padded. */
+static void copy_label(char *out, size_t len, const unsigned char *field, size_t field_len)
+{
+    size_t n = strnlen((const char *)field, field_len);
+    while (n > 0 && field[n - 1] == ' ') {
+        --n;
+    }
+    if (n >= len) {
+        n = len - 1;
+    }
+    memcpy(out, field, n);
+    out[n] = '\0';
+}
+
+static bool probe_ext(const unsigned char *buf, size_t len, BlockInfo *info)
+{
+    const unsigned char *sb = buf + 1024;
+    if (len < 2048 || le16(sb + 0x38) != 0xEF53) {
+        return false;
+    }
+    uint32_t compat = le32(sb + 0x5C);
+    uint32_t incompat = le32(sb + 0x60);
+    /* extents, 64bit or flex_bg make it ext4; a journal makes it ext3. */
+    if (incompat & (0x40 | 0x80 | 0x200)) {
+        snprintf(info->fs_type, sizeof(info->fs_type), "ext4");
+    } else if (compat & 0x4) {
+        snprintf(info->fs_type, sizeof(info->fs_type), "ext3");
+    } else {
+        snprintf(info->fs_type, sizeof(info->fs_type), "ext2");
+    }
+    format_uuid(info->uuid, sizeof(info->uuid), sb + 0x68);
+    copy_label(info->label, sizeof(info->label), sb + 0x78, 16);
+    return true;
+}
+
+static bool probe_xfs(const unsigned char *buf, size_t len, BlockInfo *info)
+{
+    if (len < 512 || memcmp(buf, "XFSB", 4) != 0) {
+        return false;
+    }
+    snprintf(info->fs_type, sizeof(info->fs_type), "xfs");
+    format_uuid(info->uuid, sizeof(info->uuid), buf + 32);
+    copy_label(info->label, sizeof(info->label), buf + 108, 12);
+    return true;
+}
+
+static bool probe_btrfs(const unsigned char *buf, size_t len, BlockInfo *info)
+{
+    const unsigned char *sb = buf + 0x10000;
+    if (len < 0x10000 + 0x12b + 256 || memcmp(sb + 0x40, "_BHRfS_M", 8) != 0) {
+        return false;
+    }
+    snprintf(info->fs_type, sizeof(info->fs_type), "btrfs");
+    format_uuid(info->uuid, sizeof(info->uuid), sb + 0x20);
+    copy_label(info->label, sizeof(info->label), sb + 0x12b, 256);
+    return true;
+}
+
+static bool probe_luks(const unsigned char *buf, size_t len, BlockInfo *info)
+{
+    static const unsigned char magic[] = {'L', 'U', 'K', 'S', 0xba, 0xbe};
+    if (len < 512 || memcmp(buf, magic, sizeof(magic)) != 0) {
+        return false;
+    }
+    unsigned version = (unsigned)((buf[6] << 8) | buf[7]);
+    snprintf(info->fs_type, sizeof(info->fs_type), "crypto_LUKS");
+    /* Both versions keep the UUID at 168; LUKS2 adds a label at 24. */
+    copy_label(info->uuid, sizeof(info->uuid), buf + 168, 40);
+    if (version == 2) {
+        copy_label(info->label, sizeof(info->label), buf + 24, 48);
+    }
+    return true;
+}
+
+static bool probe_swap(const unsigned char *buf, size_t len, BlockInfo *info)
+{
+    for (size_t page = 4096; page <= 65536; page *= 2) {
+        if (page > len) {
+            break;
+        }
+        if (memcmp(buf + page - 10, "SWAPSPACE2", 10) == 0) {
+            snprintf(info->fs_type, sizeof(info->fs_type), "swap");
+            format_uuid(info->uuid, sizeof(info->uuid), buf + 1036);
+            copy_label(info->label, sizeof(info->label), buf + 1052, 16);
+            return true;
+        }
+    }
+    return false;
+}
+
+static bool probe_vfat(const unsigned char *buf, size_t len, BlockInfo *info)
+{
+    if (len < 512 || buf[510] != 0x55 || buf[511] != 0xAA) {
+        return false;
+    }
+    /* FAT32 keeps its volume id and label further into the boot sector. */
+    const unsigned char *serial;
+    const unsigned char *label;
+    if (memcmp(buf + 0x52, "FAT32   ", 8) == 0) {
+        serial = buf + 0x43;
+        label = buf + 0x47;
+    } else if (memcmp(buf + 0x36, "FAT1", 4) == 0) {
+        serial = buf + 0x27;
+        label = buf + 0x2B;
+    } else {
+        return false;
+    }
+    snprintf(info->fs_type, sizeof(info->fs_type), "vfat");
+    snprintf(info->uuid, sizeof(info->uuid), "%02X%02X-%02X%02X", serial[3], serial[2], serial[1], serial[0]);
+    copy_label(info->label, sizeof(info->label), label, 11);
+    if (strcmp(info->label, "NO NAME") == 0) {
+        info->label[0] = '\0';
+    }
+    return true;
+}
+
+static void probe_superblock(int fd, BlockInfo *info)
+{
+    unsigned char *buf = malloc(PROBE_READ_BYTES);
+    if (!buf) {
+        return;
+    }
+    ssize_t got = pread(fd, buf, PROBE_READ_BYTES, 0);
+    if (got > 0) {
+        size_t len = (size_t)got;
+        /* LUKS and swap first: both may leave an older signature behind
+         * further out. */
+        if (!probe_luks(buf, len, info) && !probe_swap(buf, len, info) && !probe_ext(buf, len, info) &&
+            !probe_xfs(buf, len, info) && !probe_btrfs(buf, len, info)) {
+            probe_vfat(buf, len, info);
+        }
+    }
+    free(buf);
+}
+
+static int read_sysfs_line(const char *path, char *out, size_t len)
+{
+    FILE *f = fopen(path, "r");
+    if (!f) {
+        return -1;
+    }
+    if (!fgets(out, (int)len, f)) {
+        fclose(f);
+        return -1;
+    }
+    fclose(f);
+    out[strcspn(out, "\n")] = '\0';
+    return 0;
+}
+
+static void sysfs_path(char *out, size_t len, dev_t devno, const char *leaf)
+{
+    snprintf(out, len, "/sys/dev/block/%u:%u/%s", major(devno), minor(devno), leaf);
+}
+
+static dev_t devno_of(const char *name)
+{
+    char path[PATH_MAX];
+    char text[32];
+    unsigned maj = 0;
+    unsigned min = 0;
+    snprintf(path, sizeof(path), "/sys/class/block/%s/dev", name);
+    if (read_sysfs_line(path, text, sizeof(text)) != 0 || sscanf(text, "%u:%u", &maj, &min) != 2) {
+        return 0;
+    }
+    return makedev(maj, min);
+}
+
+static void probe_identity(dev_t devno, BlockInfo *info)
+{
+    char path[PATH_MAX];
+    char link[PATH_MAX];
+    snprintf(path, sizeof(path), "/sys/dev/block/%u:%u", major(devno), minor(devno));
+    ssize_t n = readlink(path, link, sizeof(link) - 1);
+    if (n > 0) {
+        link[n] = '\0';
+        const char *slash = strrchr(link, '/');
+        snprintf(info->name, sizeof(info->name), "%.*s", (int)sizeof(info->name) - 1, slash ? slash + 1 : link);
+    }
+
+    char dm_uuid[160];
+    char dm_name[128];
+    sysfs_path(path, sizeof(path), devno, "dm/uuid");
+    if (read_sysfs_line(path, dm_uuid, sizeof(dm_uuid)) == 0) {
+        if (strncmp(dm_uuid, "CRYPT-", 6) == 0) {
+            snprintf(info->kind, sizeof(info->kind), "crypt");
+        } else if (strncmp(dm_uuid, "LVM-", 4) == 0) {
+            snprintf(info->kind, sizeof(info->kind), "lvm");
+        } else {
+            snprintf(info->kind, sizeof(info->kind), "dm");
+        }
+        sysfs_path(path, sizeof(path), devno, "dm/name");
+        if (read_sysfs_line(path, dm_name, sizeof(dm_name)) == 0) {
+            snprintf(info->path, sizeof(info->path), "/dev/mapper/%s", dm_name);
+            return;
+        }
+    } else {
+        sysfs_path(path, sizeof(path), devno, "partition");
+        snprintf(info->kind, sizeof(info->kind), "%s", access(path, F_OK) == 0 ? "part" : "disk");
+    }
+    snprintf(info->path, sizeof(info->path), "/dev/%s", info->name);
+}
+
+static void probe_holders(dev_t devno, BlockInfo *info)
+{
+    char path[PATH_MAX];
+    sysfs_path(path, sizeof(path), devno, "holders");
+    DIR *dir = opendir(path);
+    if (!dir) {
+        return;
+    }
+    struct dirent *entry;
+    while ((entry = readdir(dir)) != NULL && info->holder_count < BLOCK_PROBE_MAX_HOLDERS) {
+        if (entry->d_name[0] == '.') {
+            continue;
+        }
+        snprintf(info->holders[info->holder_count++], sizeof(info->holders[0]), "%.*s",
+                 (int)sizeof(info->holders[0]) - 1, entry->d_name);
+    }
+    closedir(dir);
+}
+
+/* Everything except mount state, which the cache must not keep. */
+static void probe_uncached(dev_t devno, BlockInfo *info)
+{
+    memset(info, 0, sizeof(*info));
+    info->devno = devno;
+    info->sector_size = 512;
+    probe_identity(devno, info);
+    probe_holders(devno, info);
+
+    int fd = open(info->path, O_RDONLY | O_CLOEXEC);
+    if (fd >= 0) {
+        uint64_t bytes = 0;
+        int sector = 0;
+        if (ioctl(fd, BLKGETSIZE64, &bytes) == 0) {
+            info->size_bytes = bytes;
+        }
+        if (ioctl(fd, BLKSSZGET, &sector) == 0 && sector > 0) {
+            info->sector_size = (unsigned)sector;
+        }
+        probe_superblock(fd, info);
+        close(fd);
+    } else {
+        log_info("Unable to open %s for probing: %s", info->path, strerror(errno));
+    }
+    if (info->size_bytes == 0) {
+        char path[PATH_MAX];
+        char text[32];
+        sysfs_path(path, sizeof(path), devno, "size");
+        if (read_sysfs_line(path, text, sizeof(text)) == 0) {
+            info->size_bytes = strtoull(text, NULL, 10) * 512ULL;
+        }
+    }
+}
+
+/* The mount source after " - " in a mountinfo line, resolved to a device
+ * number, which also matches mounts made through /dev/mapper or /dev/<vg>
+ * aliases. Field 3 cannot be used: btrfs reports an anonymous 0:N device
+ * there for every subvolume. */
+static bool mount_source_is(const char *line, dev_t devno)
+{
+    const char *separator = strstr(line, " - ");
+    char source[PATH_MAX];
+    struct stat st;
+    if (!separator || sscanf(separator + 3, "%*s %4095s", source) != 1 || source[0] != '/') {
+        return false;
+    }
+    return stat(source, &st) == 0 && S_ISBLK(st.st_mode) && st.st_rdev == devno;
+}
+
+static void probe_mount_state(BlockInfo *info)
+{
+    info->mountpoint[0] = '\0';
+    info->swap_active = false;
+
+    FILE *f = fopen("/proc/self/mountinfo", "r");
+    if (f) {
+        char line[PATH_MAX * 2];
+        while (fgets(line, sizeof(line), f)) {
+            char mountpoint[PATH_MAX];
+            if (sscanf(line, "%*d %*d %*s %*s %4095s", mountpoint) == 1 && mount_source_is(line, info->devno)) {
+                snprintf(info->mountpoint, sizeof(info->mountpoint), "%s", mountpoint);
+                break;
+            }
+        }
+        fclose(f);
+    }
+
+    f = fopen("/proc/swaps", "r");
+    if (f) {
+        char line[PATH_MAX + 64];
+        while (fgets(line, sizeof(line), f)) {
+            char entry[PATH_MAX];
+            struct stat st;
+            if (sscanf(line, "%4095s", entry) == 1 && entry[0] == '/' && stat(entry, &st) == 0 &&
+                S_ISBLK(st.st_mode) && st.st_rdev == info->devno) {
+                info->swap_active = true;
+                break;
+            }
+        }
+        fclose(f);
+    }
+}
+
+static int probe_devno(dev_t devno, BlockInfo *info)
+{
+    process_uevents();
+    const ProbeCacheEntry *hit = NULL;
+    for (int i = 0; i < BLOCK_PROBE_CACHE_SIZE && !hit; ++i) {
+        if (probe_cache[i].valid && probe_cache[i].info.devno == devno) {
+            hit = &probe_cache[i];
+        }
+    }
+    if (hit) {
+        *info = hit->info;
+    } else {
+        probe_uncached(devno, info);
+        ProbeCacheEntry *slot = &probe_cache[probe_cache_next];
+        probe_cache_next = (probe_cache_next + 1) % BLOCK_PROBE_CACHE_SIZE;
+        slot->info = *info;
+        slot->valid = true;
+    }
+    probe_mount_state(info);
+    return 0;
+}
+
+int block_probe(const char *path, BlockInfo *info)
+{
+    struct stat st;
+    if (!path || stat(path, &st) != 0) {
+        log_error("Unable to probe %s: %s", path ? path : "(null)", strerror(errno));
+        return -1;
+    }
+    if (!S_ISBLK(st.st_mode)) {
+        log_error("Unable to probe %s: not a block device", path);
+        return -1;
+    }
+    return probe_devno(st.st_rdev, info);
+}
+
+static void tree_visit(dev_t devno, int depth, BlockInfo *out, int max, int *count)
+{
+    if (depth > PROBE_TREE_DEPTH || *count >= max) {
+        return;
+    }
+    BlockInfo info;
+    probe_devno(devno, &info);
+    for (int i = 0; i < info.holder_count; ++i) {
+        dev_t holder = devno_of(info.holders[i]);
+        if (holder != 0) {
+            tree_visit(holder, depth + 1, out, max, count);
+        }
+    }
+    /* A device below several others is reached once per path. */
+    for (int i = 0; i < *count; ++i) {
+        if (out[i].devno == devno) {
+            return;
+        }
+    }
+    if (*count < max) {
+        out[(*count)++] = info;
+    }
+}
+
+int block_probe_tree(const char *disk, BlockInfo *out, int max)
+{
+    BlockInfo root;
+    if (block_probe(disk, &root) != 0) {
+        return -1;
+    }
+    int count = 0;
+    char path[PATH_MAX];
+    snprintf(path, sizeof(path), "/sys/class/block/%s", root.name);
+    DIR *dir = opendir(path);
+    if (dir) {
+        struct dirent *entry;
+        while ((entry = readdir(dir)) != NULL) {
+            char partition[PATH_MAX];
+            if (entry->d_name[0] == '.' ||
+                snprintf(partition, sizeof(partition), "%s/%s/partition", path, entry->d_name) >=
+                    (int)sizeof(partition) ||
+                access(partition, F_OK) != 0) {
+                continue;
+            }
+            dev_t devno = devno_of(entry->d_name);
+            if (devno != 0) {
+                tree_visit(devno, 1, out, max, &count);
+            }
+        }
+        closedir(dir);
+    }
+    /* Whole-disk mappings, e.g. LUKS straight on the disk. */
+    for (int i = 0; i < root.holder_count; ++i) {
+        dev_t holder = devno_of(root.holders[i]);
+        if (holder != 0) {
+            tree_visit(holder, 1, out, max, &count);
+        }
+    }
+    return count;
+}
+
+static uint64_t read_sysfs_u64(dev_t devno, const char *leaf, uint64_t fallback)
+{
+    char path[PATH_MAX];
+    char text[32];
+    sysfs_path(path, sizeof(path), devno, leaf);
+    if (read_sysfs_line(path, text, sizeof(text)) != 0) {
+        return fallback;
+    }
+    return strtoull(text, NULL, 10);
+}
+
+static unsigned read_sysfs_unsigned(dev_t devno, const char *leaf, unsigned fallback)
+{
+    return (unsigned)read_sysfs_u64(devno, leaf, fallback);
+}
+
+int block_probe_topology(const char *path, BlockTopology *topology)
+{
+    BlockInfo info;
+    if (block_probe(path, &info) != 0) {
+        return -1;
+    }
+    const char *queue = strcmp(info.kind, "part") == 0 ? "../queue" : "queue";
+    char leaf[64];
+    memset(topology, 0, sizeof(*topology));
+    snprintf(leaf, sizeof(leaf), "%s/logical_block_size", queue);
+    topology->logical_block = read_sysfs_unsigned(info.devno, leaf, info.sector_size);
+    snprintf(leaf, sizeof(leaf), "%s/physical_block_size", queue);
+    topology->physical_block = read_sysfs_unsigned(info.devno, leaf, topology->logical_block);
+    snprintf(leaf, sizeof(leaf), "%s/minimum_io_size", queue);
+    topology->minimum_io = read_sysfs_unsigned(info.devno, leaf, topology->physical_block);
+    snprintf(leaf, sizeof(leaf), "%s/optimal_io_size", queue);
+    topology->optimal_io = read_sysfs_unsigned(info.devno, leaf, 0);
+    snprintf(leaf, sizeof(leaf), "%s/rotational", queue);
+    topology->rotational = read_sysfs_unsigned(info.devno, leaf, 1) != 0;
+    snprintf(leaf, sizeof(leaf), "%s/discard_granularity", queue);
+    topology->discard_granularity = read_sysfs_unsigned(info.devno, leaf, 0);
+    snprintf(leaf, sizeof(leaf), "%s/discard_max_bytes", queue);
+    topology->discard_max = read_sysfs_u64(info.devno, leaf, 0);
+    snprintf(leaf, sizeof(leaf), "%s/write_zeroes_max_bytes", queue);
+    topology->write_zeroes_max = read_sysfs_u64(info.devno, leaf, 0);
+    topology->alignment_offset = read_sysfs_unsigned(info.devno, "alignment_offset", 0);
+    if (topology->logical_block < 512) {
+        topology->logical_block = 512;
+    }
+    if (topology->physical_block < topology->logical_block) {
+        topology->physical_block = topology->logical_block;
+    }
+    if (topology->minimum_io < topology->physical_block) {
+        topology->minimum_io = topology->physical_block;
+    }
+    return 0;
+}
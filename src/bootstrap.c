@@ -1,5 +1,16 @@
 #include "bootstrap.h"
+#include "cas.h"
+#include "delta.h"
 #include "disk.h"
+#include "fetch.h"
+#include "hash.h"
+#include "mirror.h"
+#include "peer.h"
+#include "portage_image.h"
+#include "prefetch.h"
+#include "untar.h"
+#include "xz.h"
+#include <dirent.h>
 #include <stdarg.h>
 
 static int safe_format(char *buffer, size_t size, const char *fmt, ...)
@@ -56,36 +67,131 @@ static int select_arch(InstallerState *state)
     return (choice >= 0) ? 0 : -1;
 }
 
+/* Benchmarks the candidate mirrors and adopts the winner, or the user's pick
+ * from the ranked list when interactive. */
+static int benchmark_mirrors(InstallerState *state, bool interactive)
+{
+    MirrorResult results[MIRROR_MAX_CANDIDATES];
+    int count = mirror_candidates(state->mirror_root, results, MIRROR_MAX_CANDIDATES);
+    int reachable = mirror_benchmark(results, count);
+    if (reachable == 0) {
+        if (interactive) {
+            ui_message("Mirrors", "No mirror could be reached. Check the network configuration.");
+        }
+        return -1;
+    }
+
+    int choice = 0;
+    if (interactive) {
+        char labels[MIRROR_MAX_CANDIDATES][MIRROR_URL_MAX + 48];
+        const char *items[MIRROR_MAX_CANDIDATES];
+        for (int i = 0; i < reachable; ++i) {
+            if (results[i].throughput > 0) {
+                snprintf(labels[i], sizeof(labels[i]), "%.400s  (%ld ms, %.1f MB/s)", results[i].root,
+                         results[i].connect_ms, results[i].throughput);
+            } else {
+                snprintf(labels[i], sizeof(labels[i]), "%.400s  (%ld ms)", results[i].root, results[i].connect_ms);
+            }
+            items[i] = labels[i];
+        }
+        choice = ui_menu("Mirror Benchmark", "Fastest first. Select the mirror to use", items, reachable, 0);
+        if (choice < 0) {
+            return -1;
+        }
+    }
+
+    /* The chosen mirror leads; the next fastest become GENTOO_MIRRORS fallbacks. */
+    state->mirror_ranked_count = 0;
+    for (int i = -1; i < reachable && state->mirror_ranked_count < MIRROR_RANK_MAX; ++i) {
+        int pick = (i < 0) ? choice : i;
+        if (i == choice) {
+            continue;
+        }
+        char *slot = state->mirror_ranked[state->mirror_ranked_count++];
+        size_t len = strnlen(results[pick].root, MIRROR_URL_MAX - 1);
+        memcpy(slot, results[pick].root, len);
+        slot[len] = '\0';
+    }
+    installer_state_set_mirror(state, results[choice].root);
+    state->mirror_pinned = true;
+    state->stage3_url[0] = '\0';
+    log_info("Selected mirror %s", state->mirror_root);
+    return 0;
+}
+
+/* Picks a mirror automatically the first time one is needed, unless the user
+ * has already chosen or benchmarked one. */
+static void ensure_mirror_selected(InstallerState *state)
+{
+    if (state->mirror_pinned) {
+        return;
+    }
+    state->mirror_pinned = true;
+    if (benchmark_mirrors(state, false) != 0) {
+        log_info("Mirror benchmark failed; keeping %s", state->mirror_root);
+    }
+}
+
 static int configure_mirror(InstallerState *state)
 {
+    const char *items[] = {"Benchmark mirrors and pick the fastest", "Enter mirror URL manually"};
+    char subtitle[MAX_MESSAGE_LEN];
+    snprintf(subtitle, sizeof(subtitle), "Current: %s", state->mirror_url);
+    int mode = ui_menu("Download Mirror", subtitle, items, 2, 0);
+    if (mode < 0) {
+        return -1;
+    }
+    if (mode == 0) {
+        return benchmark_mirrors(state, true);
+    }
+
     char buffer[MIRROR_URL_MAX];
     snprintf(buffer, sizeof(buffer), "%s", state->mirror_url);
     if (ui_prompt_input("Mirror URL", "Enter Gentoo mirror URL", buffer, sizeof(buffer), buffer, false) != 0) {
         return -1;
     }
-    snprintf(state->mirror_url, sizeof(state->mirror_url), "%s", buffer);
+
+    /* A standard mirror layout also yields the Portage and GENTOO_MIRRORS
+     * locations; any other URL is used for stage3 only. */
+    size_t len = strlen(buffer);
+    while (len > 0 && buffer[len - 1] == '/') {
+        buffer[--len] = '\0';
+    }
+    size_t suffix = strlen(STAGE3_MIRROR_PATH);
+    if (len > suffix && strcmp(buffer + len - suffix, STAGE3_MIRROR_PATH) == 0) {
+        buffer[len - suffix] = '\0';
+        installer_state_set_mirror(state, buffer);
+    } else {
+        snprintf(state->mirror_url, sizeof(state->mirror_url), "%s", buffer);
+        state->mirror_root[0] = '\0';
+    }
+    state->mirror_ranked_count = 0;
+    state->mirror_pinned = true;
+    state->stage3_url[0] = '\0';
     return 0;
 }
 
-static int fetch_stage3_metadata(InstallerState *state)
-{
-    char meta_url[REMOTE_URL_MAX];
-    snprintf(meta_url, sizeof(meta_url), "%s/latest-stage3-%s-systemd.txt",
-             state->mirror_url, arch_to_string(state->arch));
-
-    char cmd[MAX_CMD_LEN];
-    snprintf(cmd, sizeof(cmd), "wget -qO- %s", meta_url);
+/* Parsed latest-stage3 pointer kept between runs together with the
+ * validators needed to revalidate it cheaply, and to fall back on when the
+ * network is unavailable. */
+typedef struct {
+    char url[REMOTE_URL_MAX];
+    FetchValidators validators;
+    char stage3_path[256];
+    char digest_path[256];
+    time_t fetched;
+} Stage3Metadata;
 
-    FILE *pipe = popen(cmd, "r");
-    if (!pipe) {
-        ui_message("Stage3", "Unable to query stage3 metadata.");
+static int parse_stage3_listing(const char *path, Stage3Metadata *meta)
+{
+    FILE *f = fopen(path, "r");
+    if (!f) {
         return -1;
     }
-
-    char stage3_path[256] = {0};
-    char digest_path[256] = {0};
+    meta->stage3_path[0] = '\0';
+    meta->digest_path[0] = '\0';
     char line[512];
-    while (fgets(line, sizeof(line), pipe)) {
+    while (fgets(line, sizeof(line), f)) {
         if (line[0] == '#') {
             continue;
         }
@@ -94,55 +200,262 @@ static int fetch_stage3_metadata(InstallerState *state)
             continue;
         }
         if (strstr(token, ".tar.xz.DIGESTS")) {
-            snprintf(digest_path, sizeof(digest_path), "%s", token);
+            snprintf(meta->digest_path, sizeof(meta->digest_path), "%s", token);
         } else if (strstr(token, ".tar.xz") && !strstr(token, ".CONTENTS")) {
-            if (!stage3_path[0]) {
-                snprintf(stage3_path, sizeof(stage3_path), "%s", token);
+            if (!meta->stage3_path[0]) {
+                snprintf(meta->stage3_path, sizeof(meta->stage3_path), "%s", token);
             }
         }
-        if (stage3_path[0] && digest_path[0]) {
+        if (meta->stage3_path[0] && meta->digest_path[0]) {
             break;
         }
     }
-    pclose(pipe);
+    fclose(f);
 
-    if (!stage3_path[0]) {
-        ui_message("Stage3", "Could not parse stage3 metadata.");
+    if (!meta->stage3_path[0]) {
         return -1;
     }
-
-    if (!digest_path[0]) {
-        snprintf(digest_path, sizeof(digest_path), "%s.DIGESTS", stage3_path);
+    if (!meta->digest_path[0] &&
+        safe_format(meta->digest_path, sizeof(meta->digest_path), "%s.DIGESTS", meta->stage3_path) != 0) {
+        return -1;
     }
+    return 0;
+}
 
-    if (safe_format(state->stage3_url, sizeof(state->stage3_url), "%s/%s", state->mirror_url, stage3_path) != 0) {
+static int stage3_metadata_path(const InstallerState *state, const char *cache_dir, const char *suffix,
+                                char *path, size_t len)
+{
+    return safe_format(path, len, "%s/latest-stage3-%s.%s", cache_dir, arch_to_string(state->arch), suffix);
+}
+
+static int load_stage3_metadata(const char *path, Stage3Metadata *meta)
+{
+    FILE *f = fopen(path, "r");
+    if (!f) {
         return -1;
     }
-    if (safe_format(state->stage3_digest_url, sizeof(state->stage3_digest_url), "%s/%s",
-                    state->mirror_url, digest_path) != 0) {
-        return -1;
+    memset(meta, 0, sizeof(*meta));
+    char line[REMOTE_URL_MAX + 32];
+    while (fgets(line, sizeof(line), f)) {
+        line[strcspn(line, "\n")] = '\0';
+        char *value = strchr(line, ' ');
+        if (line[0] == '#' || !value) {
+            continue;
+        }
+        *value++ = '\0';
+        if (strcmp(line, "url") == 0) {
+            snprintf(meta->url, sizeof(meta->url), "%s", value);
+        } else if (strcmp(line, "etag") == 0) {
+            snprintf(meta->validators.etag, sizeof(meta->validators.etag), "%s", value);
+        } else if (strcmp(line, "last-modified") == 0) {
+            snprintf(meta->validators.last_modified, sizeof(meta->validators.last_modified), "%s", value);
+        } else if (strcmp(line, "stage3") == 0) {
+            snprintf(meta->stage3_path, sizeof(meta->stage3_path), "%s", value);
+        } else if (strcmp(line, "digests") == 0) {
+            snprintf(meta->digest_path, sizeof(meta->digest_path), "%s", value);
+        } else if (strcmp(line, "fetched") == 0) {
+            meta->fetched = (time_t)strtoll(value, NULL, 10);
+        }
+    }
+    fclose(f);
+    return (meta->stage3_path[0] && meta->digest_path[0]) ? 0 : -1;
+}
+
+static void save_stage3_metadata(const char *path, const Stage3Metadata *meta)
+{
+    char temp[PATH_MAX];
+    if (safe_format(temp, sizeof(temp), "%s.tmp", path) != 0) {
+        return;
+    }
+    FILE *f = fopen(temp, "w");
+    if (!f) {
+        log_error("Unable to record stage3 metadata in %s: %s", path, strerror(errno));
+        return;
+    }
+    fprintf(f, "# Written by %s; latest stage3 pointer and HTTP validators\n", INSTALLER_NAME);
+    fprintf(f, "url %s\n", meta->url);
+    if (meta->validators.etag[0]) {
+        fprintf(f, "etag %s\n", meta->validators.etag);
+    }
+    if (meta->validators.last_modified[0]) {
+        fprintf(f, "last-modified %s\n", meta->validators.last_modified);
+    }
+    fprintf(f, "stage3 %s\n", meta->stage3_path);
+    fprintf(f, "digests %s\n", meta->digest_path);
+    fprintf(f, "fetched %lld\n", (long long)meta->fetched);
+    if (fclose(f) != 0 || rename(temp, path) != 0) {
+        unlink(temp);
+        log_error("Unable to record stage3 metadata in %s", path);
+    }
+}
+
+/* Looks for a recorded pointer in the active cache first, then in the live
+ * medium cache used before the target disk was mounted. */
+static bool find_stage3_metadata(const InstallerState *state, const char *cache_dir, Stage3Metadata *meta)
+{
+    const char *dirs[] = {cache_dir, INSTALL_CACHE_DIR};
+    for (size_t i = 0; i < sizeof(dirs) / sizeof(dirs[0]); ++i) {
+        char path[PATH_MAX];
+        if (stage3_metadata_path(state, dirs[i], "meta", path, sizeof(path)) == 0 &&
+            load_stage3_metadata(path, meta) == 0) {
+            return true;
+        }
     }
+    return false;
+}
 
-    const char *base_stage3 = strrchr(stage3_path, '/');
-    base_stage3 = base_stage3 ? base_stage3 + 1 : stage3_path;
-    const char *base_digest = strrchr(digest_path, '/');
-    base_digest = base_digest ? base_digest + 1 : digest_path;
+/* Quiet when not interactive: the background prefetch resolves the archive
+ * name without popping up dialogs. */
+static int fetch_stage3_metadata(InstallerState *state, bool interactive)
+{
+    ensure_mirror_selected(state);
+
+    char meta_url[REMOTE_URL_MAX];
+    snprintf(meta_url, sizeof(meta_url), "%s/latest-stage3-%s-systemd.txt",
+             state->mirror_url, arch_to_string(state->arch));
 
     char cache_dir[PATH_MAX];
     if (prepare_cache_dir(state, cache_dir, sizeof(cache_dir)) != 0) {
-        ui_message("Stage3", "Unable to prepare cache directory on the target disk.");
+        if (interactive) {
+            ui_message("Stage3", "Unable to prepare cache directory on the target disk.");
+        }
+        return -1;
+    }
+    char listing[PATH_MAX];
+    char record[PATH_MAX];
+    if (stage3_metadata_path(state, cache_dir, "txt", listing, sizeof(listing)) != 0 ||
+        stage3_metadata_path(state, cache_dir, "meta", record, sizeof(record)) != 0) {
+        return -1;
+    }
+
+    /* Validators only mean something to the server that issued them. */
+    Stage3Metadata meta;
+    bool cached = find_stage3_metadata(state, cache_dir, &meta);
+    FetchValidators validators = {{0}, {0}};
+    if (cached && strcmp(meta.url, meta_url) == 0) {
+        validators = meta.validators;
+    }
+
+    bool offline = false;
+    int rc = fetch_conditional(meta_url, listing, &validators);
+    if (rc == 0) {
+        Stage3Metadata fresh;
+        memset(&fresh, 0, sizeof(fresh));
+        if (parse_stage3_listing(listing, &fresh) != 0) {
+            log_error("Could not parse stage3 metadata from %s", meta_url);
+            if (interactive) {
+                ui_message("Stage3", "Could not parse stage3 metadata.");
+            }
+            return -1;
+        }
+        snprintf(fresh.url, sizeof(fresh.url), "%s", meta_url);
+        fresh.validators = validators;
+        fresh.fetched = time(NULL);
+        meta = fresh;
+        save_stage3_metadata(record, &meta);
+    } else if (rc > 0 && cached) {
+        meta.fetched = time(NULL);
+        save_stage3_metadata(record, &meta);
+    } else if (cached) {
+        offline = true;
+        log_info("Stage3 metadata unavailable from %s; using the pointer recorded at %lld", meta_url,
+                 (long long)meta.fetched);
+    } else {
+        log_error("Unable to query stage3 metadata from %s", meta_url);
+        if (interactive) {
+            ui_message("Stage3", "Unable to query stage3 metadata.");
+        }
+        return -1;
+    }
+
+    if (safe_format(state->stage3_url, sizeof(state->stage3_url), "%s/%s", state->mirror_url,
+                    meta.stage3_path) != 0) {
+        return -1;
+    }
+    if (safe_format(state->stage3_digest_url, sizeof(state->stage3_digest_url), "%s/%s",
+                    state->mirror_url, meta.digest_path) != 0) {
         return -1;
     }
+
+    const char *base_stage3 = strrchr(meta.stage3_path, '/');
+    base_stage3 = base_stage3 ? base_stage3 + 1 : meta.stage3_path;
+    const char *base_digest = strrchr(meta.digest_path, '/');
+    base_digest = base_digest ? base_digest + 1 : meta.digest_path;
+
     safe_format(state->stage3_local, sizeof(state->stage3_local), "%s/%s", cache_dir, base_stage3);
     safe_format(state->stage3_digest_local, sizeof(state->stage3_digest_local), "%s/%s", cache_dir, base_digest);
 
+    if (!interactive) {
+        return 0;
+    }
     char message[MAX_MESSAGE_LEN];
-    snprintf(message, sizeof(message), "Latest stage3: %s", base_stage3);
+    if (offline) {
+        char when[64] = "an earlier run";
+        struct tm tm_buf;
+        if (meta.fetched > 0 && localtime_r(&meta.fetched, &tm_buf)) {
+            strftime(when, sizeof(when), "%Y-%m-%d %H:%M", &tm_buf);
+        }
+        snprintf(message, sizeof(message),
+                 "Latest stage3: %s\n\nThe mirror could not be reached; using the pointer recorded %s.",
+                 base_stage3, when);
+    } else {
+        snprintf(message, sizeof(message), "Latest stage3: %s", base_stage3);
+    }
     ui_message("Stage3 Metadata", message);
     return 0;
 }
 
-static int download_file(const char *url, const char *destination)
+static const char *path_basename(const char *path)
+{
+    const char *slash = strrchr(path, '/');
+    return slash ? slash + 1 : path;
+}
+
+/* Verifies path against the fastest published digest this CPU can compute. */
+static int verify_file_digest(const char *path, const DigestSet *expected, HashAlgorithm *used)
+{
+    HashAlgorithm algorithm;
+    if (digest_set_select(expected, &algorithm) != 0) {
+        return -1;
+    }
+    char actual[HASH_MAX_HEX];
+    if (hash_file_hex(path, algorithm, actual, sizeof(actual)) != 0) {
+        return -1;
+    }
+    if (used) {
+        *used = algorithm;
+    }
+    if (strcasecmp(expected->hex[algorithm], actual) != 0) {
+        log_error("%s mismatch for %s: expected %s got %s", hash_algorithm_name(algorithm), path,
+                  expected->hex[algorithm], actual);
+        return 1;
+    }
+    return 0;
+}
+
+/* Expands url to the same path on every ranked mirror, url itself first, so
+ * transfers can be striped across mirrors and fail over between them. */
+static int mirror_urls_for(const InstallerState *state, const char *url, char urls[][REMOTE_URL_MAX], int max)
+{
+    int count = 0;
+    snprintf(urls[count++], REMOTE_URL_MAX, "%s", url);
+    size_t root_len = strlen(state->mirror_root);
+    if (root_len == 0 || strncmp(url, state->mirror_root, root_len) != 0) {
+        return count;
+    }
+    const char *path = url + root_len;
+    for (int i = 0; i < state->mirror_ranked_count && count < max; ++i) {
+        if (strcmp(state->mirror_ranked[i], state->mirror_root) == 0) {
+            continue;
+        }
+        if (snprintf(urls[count], REMOTE_URL_MAX, "%s%s", state->mirror_ranked[i], path) < REMOTE_URL_MAX) {
+            count++;
+        }
+    }
+    return count;
+}
+
+static int download_file(const InstallerState *state, const char *url, const char *destination)
 {
     if (!url[0] || !destination[0]) {
         return -1;
@@ -151,7 +464,92 @@ static int download_file(const char *url, const char *destination)
         log_error("Unable to prepare directory for %s", destination);
         return -1;
     }
-    return run_command("wget -O %s %s", destination, url);
+
+    char urls[FETCH_MAX_SOURCES][REMOTE_URL_MAX];
+    const char *list[FETCH_MAX_SOURCES];
+    int count = mirror_urls_for(state, url, urls, FETCH_MAX_SOURCES);
+    for (int i = 0; i < count; ++i) {
+        list[i] = urls[i];
+    }
+    return fetch_file_mirrors(list, count, destination, FETCH_DEFAULT_SEGMENTS);
+}
+
+/* Picks the newest complete archive next to destination that shares its
+ * name up to the last '-', e.g. last week's stage3 or the previous
+ * portage-latest.tar.xz still sitting at destination itself. */
+static int find_delta_seed(const char *destination, char *seed, size_t len)
+{
+    char dir[PATH_MAX];
+    const char *name = path_basename(destination);
+    const char *dash = strrchr(name, '-');
+    if (!dash || safe_format(dir, sizeof(dir), "%.*s", (int)(name - destination), destination) != 0) {
+        return -1;
+    }
+    size_t prefix_len = (size_t)(dash - name) + 1;
+    DIR *d = opendir(dir[0] ? dir : ".");
+    if (!d) {
+        return -1;
+    }
+    time_t newest = 0;
+    seed[0] = '\0';
+    struct dirent *entry;
+    while ((entry = readdir(d)) != NULL) {
+        size_t entry_len = strlen(entry->d_name);
+        if (strncmp(entry->d_name, name, prefix_len) != 0 || entry_len < 7 ||
+            strcmp(entry->d_name + entry_len - 7, ".tar.xz") != 0) {
+            continue;
+        }
+        char candidate[PATH_MAX];
+        struct stat st;
+        if (safe_format(candidate, sizeof(candidate), "%s%s", dir, entry->d_name) != 0 ||
+            stat(candidate, &st) != 0 || !S_ISREG(st.st_mode) || st.st_size < DELTA_BLOCK_SIZE) {
+            continue;
+        }
+        if (!seed[0] || st.st_mtime > newest) {
+            newest = st.st_mtime;
+            snprintf(seed, len, "%s", candidate);
+        }
+    }
+    closedir(d);
+    return seed[0] ? 0 : -1;
+}
+
+/* Rebuilds a new release of url from an older cached copy plus the blocks
+ * that changed. Mirrors publish no block index, so this is only tried when
+ * a LAN peer advertises one for the object; the changed blocks then come
+ * from the mirrors. */
+static int delta_download(const InstallerState *state, const char *url, const DigestSet *expected,
+                          const char *destination)
+{
+    char seed[PATH_MAX];
+    char index_local[PATH_MAX];
+    if (find_delta_seed(destination, seed, sizeof(seed)) != 0 ||
+        safe_format(index_local, sizeof(index_local), "%s%s", destination, DELTA_INDEX_SUFFIX) != 0) {
+        return -1;
+    }
+    bool have_index = peer_fetch_index(expected, index_local) == 0;
+    DeltaIndex index;
+    if (!have_index || delta_index_load(index_local, &index) != 0) {
+        unlink(index_local);
+        return -1;
+    }
+    unlink(index_local);
+
+    char urls[FETCH_MAX_SOURCES][REMOTE_URL_MAX];
+    int count = mirror_urls_for(state, url, urls, FETCH_MAX_SOURCES);
+    log_info("Trying delta transfer of %s against %s", url, seed);
+    const char *list[FETCH_MAX_SOURCES];
+    for (int i = 0; i < count; ++i) {
+        list[i] = urls[i];
+    }
+    int rc = delta_fetch(list, count, &index, seed, destination);
+    delta_index_free(&index);
+    if (rc == 0 && verify_file_digest(destination, expected, NULL) != 0) {
+        log_error("Delta result for %s failed verification; discarding it", destination);
+        unlink(destination);
+        rc = -1;
+    }
+    return rc;
 }
 
 static int download_stage3(InstallerState *state)
@@ -161,6 +559,8 @@ static int download_stage3(InstallerState *state)
         ui_message("Download", "Root partition is not mounted at the install path. Use Disk preparation -> Mount target root partition, then try again.");
         return -1;
     }
+    /* The foreground transfer picks up wherever the prefetcher got to. */
+    prefetch_stop();
 
     char cache_dir[PATH_MAX];
     if (prepare_cache_dir(state, cache_dir, sizeof(cache_dir)) != 0) {
@@ -170,80 +570,80 @@ static int download_stage3(InstallerState *state)
     installer_state_set_cache_dir(state, cache_dir);
 
     if (!state->stage3_url[0]) {
-        if (fetch_stage3_metadata(state) != 0) {
+        if (fetch_stage3_metadata(state, true) != 0) {
             return -1;
         }
     }
-    if (download_file(state->stage3_url, state->stage3_local) != 0) {
-        ui_message("Download", "Failed to download stage3 archive.");
-        return -1;
+    if (download_file(state, state->stage3_digest_url, state->stage3_digest_local) != 0) {
+        /* An earlier copy still names the right archive when offline. */
+        if (access(state->stage3_digest_local, R_OK) != 0) {
+            ui_message("Download", "Failed to download stage3 digest.");
+            return -1;
+        }
+        log_info("Using previously downloaded digest %s", state->stage3_digest_local);
     }
-    if (download_file(state->stage3_digest_url, state->stage3_digest_local) != 0) {
-        ui_message("Download", "Failed to download stage3 digest.");
-        return -1;
+
+    /* The digest names the content, so an identical archive from an earlier
+     * run or from attached cache media can stand in for the download. */
+    DigestSet expected;
+    bool have_digest = hash_parse_digest_file(state->stage3_digest_local, path_basename(state->stage3_local),
+                                              HASH_SHA512, &expected) == 0;
+    if (have_digest && access(state->stage3_local, R_OK) == 0 &&
+        verify_file_digest(state->stage3_local, &expected, NULL) == 0) {
+        cas_store(cache_dir, state->stage3_local, &expected);
+        ui_message("Download", "Stage3 archive was prefetched in the background and verified.");
+        return 0;
+    }
+    if (have_digest && cas_restore(cache_dir, &expected, state->stage3_local) == 0) {
+        cas_store(cache_dir, state->stage3_local, &expected);
+        ui_message("Download", "Stage3 archive restored from the artifact cache; no download needed.");
+        return 0;
+    }
+    if (have_digest && peer_fetch(&expected, state->stage3_local) == 0) {
+        cas_store(cache_dir, state->stage3_local, &expected);
+        ui_message("Download", "Stage3 archive fetched from a LAN peer and verified.");
+        return 0;
+    }
+    if (have_digest && delta_download(state, state->stage3_url, &expected, state->stage3_local) == 0) {
+        cas_store(cache_dir, state->stage3_local, &expected);
+        ui_message("Download", "Stage3 archive rebuilt from the cached release plus changed blocks and verified.");
+        return 0;
     }
-    ui_message("Download", "Stage3 archive and digest downloaded.");
-    return 0;
-}
 
-static int parse_digest_hash(const char *digest_path, char *out_hash, size_t len)
-{
-    FILE *f = fopen(digest_path, "r");
-    if (!f) {
+    if (download_file(state, state->stage3_url, state->stage3_local) != 0) {
+        ui_message("Download", "Failed to download stage3 archive.");
         return -1;
     }
-    char line[512];
-    while (fgets(line, sizeof(line), f)) {
-        if (line[0] == '#' || line[0] == 0 || line[0] == '-') {
-            continue;
-        }
-        if (!strstr(line, ".tar.xz") || strstr(line, ".DIGESTS") || strstr(line, ".CONTENTS")) {
-            continue;
-        }
-        if (strstr(line, "SHA512")) {
-            continue;
-        }
-        char hash[200];
-        char filename[256];
-        if (sscanf(line, "%199s %255s", hash, filename) == 2) {
-            snprintf(out_hash, len, "%s", hash);
-            fclose(f);
-            return 0;
-        }
+    if (have_digest && verify_file_digest(state->stage3_local, &expected, NULL) == 0) {
+        cas_store(cache_dir, state->stage3_local, &expected);
     }
-    fclose(f);
-    return -1;
+    ui_message("Download", "Stage3 archive and digest downloaded.");
+    return 0;
 }
 
 static int verify_stage3(const InstallerState *state)
 {
-    char expected[200];
-    if (parse_digest_hash(state->stage3_digest_local, expected, sizeof(expected)) != 0) {
+    DigestSet expected;
+    if (hash_parse_digest_file(state->stage3_digest_local, path_basename(state->stage3_local),
+                               HASH_SHA512, &expected) != 0) {
         ui_message("Verification", "Unable to parse digest file.");
         return -1;
     }
 
-    char cmd[MAX_CMD_LEN];
-    if (safe_format(cmd, sizeof(cmd), "sha512sum %s", state->stage3_local) != 0) {
+    HashAlgorithm algorithm = HASH_SHA512;
+    int rc = verify_file_digest(state->stage3_local, &expected, &algorithm);
+    if (rc < 0) {
+        ui_message("Verification", "Failed to compute stage3 checksum.");
         return -1;
     }
-    char actual[256];
-    if (capture_command(cmd, actual, sizeof(actual)) != 0) {
-        ui_message("Verification", "Failed to compute sha512 checksum.");
-        return -1;
-    }
-
-    char *space = strchr(actual, ' ');
-    if (space) {
-        *space = '\0';
-    }
-
-    if (strcasecmp(expected, actual) != 0) {
+    if (rc > 0) {
         ui_message("Verification", "Stage3 checksum mismatch!");
         return -1;
     }
 
-    ui_message("Verification", "Stage3 checksum verified.");
+    char message[128];
+    snprintf(message, sizeof(message), "Stage3 checksum verified (%s).", hash_algorithm_name(algorithm));
+    ui_message("Verification", message);
     return 0;
 }
 
@@ -253,6 +653,7 @@ static int download_portage(InstallerState *state)
         ui_message("Portage", "Prepare and mount the target disk before downloading Portage so it is stored on disk.");
         return -1;
     }
+    prefetch_stop();
 
     char cache_dir[PATH_MAX];
     if (prepare_cache_dir(state, cache_dir, sizeof(cache_dir)) != 0) {
@@ -260,16 +661,161 @@ static int download_portage(InstallerState *state)
         return -1;
     }
 
-    safe_format(state->portage_url, sizeof(state->portage_url), "%s/%s", PORTAGE_BASE_URL, PORTAGE_SNAPSHOT_NAME);
+    ensure_mirror_selected(state);
     safe_format(state->portage_local, sizeof(state->portage_local), "%s/%s", cache_dir, PORTAGE_SNAPSHOT_NAME);
-    if (download_file(state->portage_url, state->portage_local) != 0) {
+
+    char digest_url[REMOTE_URL_MAX];
+    char digest_local[PATH_MAX];
+    DigestSet expected;
+    bool have_digest = safe_format(digest_url, sizeof(digest_url), "%s.md5sum", state->portage_url) == 0 &&
+                       safe_format(digest_local, sizeof(digest_local), "%s.md5sum", state->portage_local) == 0 &&
+                       (download_file(state, digest_url, digest_local) == 0 || access(digest_local, R_OK) == 0) &&
+                       hash_parse_digest_file(digest_local, NULL, HASH_MD5, &expected) == 0;
+    if (have_digest && access(state->portage_local, R_OK) == 0 &&
+        verify_file_digest(state->portage_local, &expected, NULL) == 0) {
+        cas_store(cache_dir, state->portage_local, &expected);
+        ui_message("Portage", "Portage snapshot was prefetched in the background and verified.");
+        return 0;
+    }
+    if (have_digest && cas_restore(cache_dir, &expected, state->portage_local) == 0) {
+        cas_store(cache_dir, state->portage_local, &expected);
+        ui_message("Portage", "Portage snapshot restored from the artifact cache; no download needed.");
+        return 0;
+    }
+    if (have_digest && peer_fetch(&expected, state->portage_local) == 0) {
+        cas_store(cache_dir, state->portage_local, &expected);
+        ui_message("Portage", "Portage snapshot fetched from a LAN peer and verified.");
+        return 0;
+    }
+    if (have_digest && delta_download(state, state->portage_url, &expected, state->portage_local) == 0) {
+        cas_store(cache_dir, state->portage_local, &expected);
+        ui_message("Portage", "Portage snapshot rebuilt from the cached copy plus changed blocks and verified.");
+        return 0;
+    }
+
+    if (download_file(state, state->portage_url, state->portage_local) != 0) {
         ui_message("Portage", "Failed to download Portage snapshot.");
         return -1;
     }
+    if (have_digest && verify_file_digest(state->portage_local, &expected, NULL) == 0) {
+        cas_store(cache_dir, state->portage_local, &expected);
+    }
     ui_message("Portage", "Portage snapshot downloaded.");
     return 0;
 }
 
+typedef struct {
+    XzStream *xz;
+    HashContext hash;
+} StreamTargets;
+
+static int stream_targets_write(const char *data, size_t len, void *ctx)
+{
+    StreamTargets *targets = ctx;
+    hash_update(&targets->hash, data, len);
+    return xz_stream_write(targets->xz, data, len);
+}
+
+/* Decodes archive on every core and unpacks the tar stream in-process, with
+ * progress reported in entries and bytes against the size in the xz index. */
+static int unpack_xz_archive(const char *archive, const char *directory, int untar_flags)
+{
+    const char *label = path_basename(archive);
+    Untar *untar = untar_open(directory, untar_flags, label, xz_uncompressed_size(archive));
+    if (!untar) {
+        return -1;
+    }
+    XzStats xz_stats;
+    UntarStats untar_stats;
+    int rc = xz_decompress_file(archive, untar_sink, untar, &xz_stats);
+    if (untar_close(untar, &untar_stats) != 0) {
+        log_error("Extraction of %s into %s failed", archive, directory);
+        rc = -1;
+    }
+    if (rc == 0) {
+        xz_log_stats(label, &xz_stats);
+        untar_log_stats(label, &untar_stats);
+    }
+    return rc;
+}
+
+/* Fetches the published squashfs image when its SHA512 verifies. Anything
+ * else (no image on the mirror, no digest, a mismatch) returns -1 so the
+ * caller can build one from the tarball instead. */
+static int fetch_portage_image(InstallerState *state, const char *image)
+{
+    char cache_dir[PATH_MAX];
+    char url[REMOTE_URL_MAX];
+    char digest_url[REMOTE_URL_MAX];
+    char digest_local[PATH_MAX];
+    char partial[PATH_MAX];
+    ensure_mirror_selected(state);
+    if (prepare_cache_dir(state, cache_dir, sizeof(cache_dir)) != 0 ||
+        safe_format(url, sizeof(url), "%s%s/%s", state->mirror_root, PORTAGE_SQUASHFS_MIRROR_PATH,
+                    PORTAGE_SQUASHFS_NAME) != 0 ||
+        safe_format(digest_url, sizeof(digest_url), "%s%s/%s", state->mirror_root, PORTAGE_SQUASHFS_MIRROR_PATH,
+                    PORTAGE_SQUASHFS_DIGESTS) != 0 ||
+        safe_format(digest_local, sizeof(digest_local), "%s/%s.%s", cache_dir, PORTAGE_SQUASHFS_NAME,
+                    PORTAGE_SQUASHFS_DIGESTS) != 0 ||
+        safe_format(partial, sizeof(partial), "%s.partial", image) != 0) {
+        return -1;
+    }
+
+    DigestSet expected;
+    if (download_file(state, digest_url, digest_local) != 0 ||
+        hash_parse_digest_file(digest_local, PORTAGE_SQUASHFS_NAME, HASH_SHA512, &expected) != 0) {
+        log_info("No published digest for %s; the image will be built locally", PORTAGE_SQUASHFS_NAME);
+        return -1;
+    }
+    if (cas_restore(cache_dir, &expected, partial) != 0 && peer_fetch(&expected, partial) != 0) {
+        if (download_file(state, url, partial) != 0 || verify_file_digest(partial, &expected, NULL) != 0) {
+            unlink(partial);
+            return -1;
+        }
+    }
+    cas_store(cache_dir, partial, &expected);
+    if (rename(partial, image) != 0) {
+        log_error("Unable to move %s into place: %s", partial, strerror(errno));
+        unlink(partial);
+        return -1;
+    }
+    return 0;
+}
+
+/* Puts the Portage tree in place as a read-only squashfs image with a
+ * writable overlay instead of ~150k small files on the target. */
+static int install_portage_image(InstallerState *state)
+{
+    char image[PATH_MAX];
+    char image_dir[PATH_MAX];
+    if (safe_format(image, sizeof(image), "%s%s", state->install_root, PORTAGE_IMAGE_PATH) != 0 ||
+        safe_format(image_dir, sizeof(image_dir), "%s%s", state->install_root, PORTAGE_IMAGE_DIR) != 0 ||
+        ensure_directory(image_dir, 0755) != 0) {
+        return -1;
+    }
+    if (portage_image_mounted(state->install_root) && portage_image_unmount(state->install_root) != 0) {
+        return -1;
+    }
+
+    if (fetch_portage_image(state, image) != 0) {
+        if (access(state->portage_local, R_OK) != 0 && download_portage(state) != 0) {
+            return -1;
+        }
+        if (portage_image_build(state->portage_local, image) != 0) {
+            ui_message("Portage",
+                       "Unable to build the Portage squashfs image. Install squashfs-tools (sqfstar) or "
+                       "squashfs-tools-ng (tar2sqfs), or switch the Portage layout back to plain files.");
+            return -1;
+        }
+    }
+    if (portage_image_mount(state->install_root) != 0) {
+        ui_message("Portage", "Unable to mount the Portage squashfs image. See the installer log.");
+        return -1;
+    }
+    log_info("Portage tree mounted from %s with an overlay on %s", image, PORTAGE_REPO_DIR);
+    return 0;
+}
+
 static int extract_stage3(InstallerState *state)
 {
     if (!state->disk_prepared) {
@@ -280,7 +826,7 @@ static int extract_stage3(InstallerState *state)
         ui_message("Stage3", "Stage3 archive not downloaded yet.");
         return -1;
     }
-    if (access(state->portage_local, R_OK) != 0) {
+    if (!state->portage_squashfs && access(state->portage_local, R_OK) != 0) {
         ui_message("Portage", "Portage snapshot not downloaded yet.");
         return -1;
     }
@@ -288,13 +834,23 @@ static int extract_stage3(InstallerState *state)
         return -1;
     }
 
-    if (run_command("tar xpf %s -C %s --xattrs-include='*.*' --numeric-owner",
-                    state->stage3_local, state->install_root) != 0) {
+    if (unpack_xz_archive(state->stage3_local, state->install_root, UNTAR_XATTRS | UNTAR_NUMERIC_OWNER) != 0) {
         ui_message("Stage3", "Failed to extract stage3.");
         return -1;
     }
 
-    if (run_command("tar xf %s -C %s/usr", state->portage_local, state->install_root) != 0) {
+    if (state->portage_squashfs) {
+        if (install_portage_image(state) != 0) {
+            return -1;
+        }
+        state->stage3_ready = true;
+        ui_message("Extraction", "Stage3 extracted and the Portage image mounted.");
+        return 0;
+    }
+
+    char usr_dir[PATH_MAX];
+    if (safe_format(usr_dir, sizeof(usr_dir), "%s/usr", state->install_root) != 0 ||
+        unpack_xz_archive(state->portage_local, usr_dir, 0) != 0) {
         ui_message("Portage", "Failed to extract Portage snapshot.");
         return -1;
     }
@@ -304,6 +860,172 @@ static int extract_stage3(InstallerState *state)
     return 0;
 }
 
+
+/* Downloads url once, hashing the bytes in-process while they are unpacked into
+ * staging_dir. The staging tree is kept only when the digest matches. */
+static int stream_and_unpack(const InstallerState *state, const char *url, const DigestSet *expected,
+                             const char *staging_dir, int untar_flags)
+{
+    HashAlgorithm algorithm;
+    if (digest_set_select(expected, &algorithm) != 0) {
+        log_error("No usable digest published for %s", url);
+        return -1;
+    }
+    if (remove_tree(staging_dir) != 0 || ensure_directory(staging_dir, 0755) != 0) {
+        log_error("Unable to prepare staging directory %s", staging_dir);
+        return -1;
+    }
+
+    StreamTargets targets = {0};
+    hash_init(&targets.hash, algorithm);
+    Untar *untar = untar_open(staging_dir, untar_flags, path_basename(url), -1);
+    if (untar) {
+        targets.xz = xz_stream_open(untar_sink, untar);
+    }
+
+    /* A LAN peer holding the same digest goes first; the stream digest check
+     * below catches a peer serving anything else. */
+    char urls[FETCH_MAX_SOURCES][REMOTE_URL_MAX];
+    const char *list[FETCH_MAX_SOURCES];
+    int url_count = peer_object_urls(expected, urls, 1);
+    url_count += mirror_urls_for(state, url, urls + url_count, FETCH_MAX_SOURCES - url_count);
+    for (int i = 0; i < url_count; ++i) {
+        list[i] = urls[i];
+    }
+
+    int rc = targets.xz ? fetch_stream_mirrors(list, url_count, stream_targets_write, &targets) : -1;
+    XzStats xz_stats;
+    UntarStats untar_stats;
+    if (targets.xz && xz_stream_close(targets.xz, &xz_stats) != 0) {
+        rc = -1;
+    }
+    if (!untar || untar_close(untar, &untar_stats) != 0) {
+        log_error("Extraction of %s into %s failed", url, staging_dir);
+        rc = -1;
+    }
+    if (rc == 0) {
+        xz_log_stats(path_basename(url), &xz_stats);
+        untar_log_stats(path_basename(url), &untar_stats);
+    }
+
+    if (rc == 0) {
+        char actual[HASH_MAX_HEX];
+        hash_final_hex(&targets.hash, actual, sizeof(actual));
+        if (strcasecmp(expected->hex[algorithm], actual) != 0) {
+            log_error("%s mismatch for %s: expected %s got %s", hash_algorithm_name(algorithm), url,
+                      expected->hex[algorithm], actual);
+            rc = -1;
+        } else {
+            log_info("%s verified with %s", url, hash_algorithm_name(algorithm));
+        }
+    }
+
+    if (rc != 0) {
+        log_info("Rolling back partial extraction in %s", staging_dir);
+        remove_tree(staging_dir);
+    }
+    return rc;
+}
+
+static int stream_stage3(InstallerState *state)
+{
+    if (!state->stage3_url[0]) {
+        if (fetch_stage3_metadata(state, true) != 0) {
+            return -1;
+        }
+    }
+    if (download_file(state, state->stage3_digest_url, state->stage3_digest_local) != 0) {
+        ui_message("Stage3", "Failed to download stage3 digest.");
+        return -1;
+    }
+    DigestSet expected;
+    if (hash_parse_digest_file(state->stage3_digest_local, path_basename(state->stage3_url),
+                               HASH_SHA512, &expected) != 0) {
+        ui_message("Verification", "Unable to parse digest file.");
+        return -1;
+    }
+
+    char staging[PATH_MAX];
+    if (safe_format(staging, sizeof(staging), "%s/.libero-stage3", state->install_root) != 0) {
+        return -1;
+    }
+    if (stream_and_unpack(state, state->stage3_url, &expected, staging, UNTAR_XATTRS | UNTAR_NUMERIC_OWNER) != 0) {
+        ui_message("Stage3", "Streaming stage3 failed or the checksum did not match. Nothing was installed.");
+        return -1;
+    }
+    if (merge_directory_tree(staging, state->install_root) != 0) {
+        ui_message("Stage3", "Unable to move the verified stage3 into place. See the installer log.");
+        return -1;
+    }
+    remove_tree(staging);
+    return 0;
+}
+
+static int stream_portage(InstallerState *state, const char *cache_dir)
+{
+    char digest_url[REMOTE_URL_MAX];
+    char digest_local[PATH_MAX];
+    ensure_mirror_selected(state);
+    if (safe_format(digest_url, sizeof(digest_url), "%s.md5sum", state->portage_url) != 0 ||
+        safe_format(digest_local, sizeof(digest_local), "%s/%s.md5sum", cache_dir, PORTAGE_SNAPSHOT_NAME) != 0) {
+        return -1;
+    }
+    if (download_file(state, digest_url, digest_local) != 0) {
+        ui_message("Portage", "Failed to download Portage snapshot checksum.");
+        return -1;
+    }
+    DigestSet expected;
+    if (hash_parse_digest_file(digest_local, NULL, HASH_MD5, &expected) != 0) {
+        ui_message("Portage", "Unable to parse Portage snapshot checksum.");
+        return -1;
+    }
+
+    char staging[PATH_MAX];
+    char usr_dir[PATH_MAX];
+    if (safe_format(staging, sizeof(staging), "%s/.libero-portage", state->install_root) != 0 ||
+        safe_format(usr_dir, sizeof(usr_dir), "%s/usr", state->install_root) != 0) {
+        return -1;
+    }
+    if (stream_and_unpack(state, state->portage_url, &expected, staging, 0) != 0) {
+        ui_message("Portage", "Streaming Portage failed or the checksum did not match. Nothing was installed.");
+        return -1;
+    }
+    if (ensure_directory(usr_dir, 0755) != 0 || merge_directory_tree(staging, usr_dir) != 0) {
+        ui_message("Portage", "Unable to move the verified Portage tree into place. See the installer log.");
+        return -1;
+    }
+    remove_tree(staging);
+    return 0;
+}
+
+static int stream_install(InstallerState *state)
+{
+    state->disk_prepared = is_path_mounted(state->install_root);
+    if (!state->disk_prepared) {
+        ui_message("Stream", "Root partition is not mounted at the install path. Use Disk preparation -> Mount target root partition, then try again.");
+        return -1;
+    }
+    prefetch_stop();
+
+    char cache_dir[PATH_MAX];
+    if (prepare_cache_dir(state, cache_dir, sizeof(cache_dir)) != 0) {
+        ui_message("Stream", "Unable to prepare cache directory on the target disk.");
+        return -1;
+    }
+    installer_state_set_cache_dir(state, cache_dir);
+
+    if (stream_stage3(state) != 0) {
+        return -1;
+    }
+    if (state->portage_squashfs ? install_portage_image(state) != 0 : stream_portage(state, cache_dir) != 0) {
+        return -1;
+    }
+
+    state->stage3_ready = true;
+    ui_message("Stream", "Stage3 and Portage downloaded, verified and extracted in a single pass.");
+    return 0;
+}
+
 static int prepare_chroot(InstallerState *state)
 {
     if (!state->stage3_ready) {
@@ -344,6 +1066,80 @@ static int prepare_chroot(InstallerState *state)
     return 0;
 }
 
+/* Starts or stops serving the verified artifact cache to other installers.
+ * The target cache is shared even before the disk is mounted so that
+ * artifacts downloaded later are served without restarting the server. */
+static int toggle_peer_sharing(const InstallerState *state)
+{
+    if (peer_server_port() > 0) {
+        peer_server_stop();
+        ui_message("LAN Sharing", "Stopped sharing the artifact cache.");
+        return 0;
+    }
+
+    char cache_dir[PATH_MAX];
+    if (safe_format(cache_dir, sizeof(cache_dir), "%s%s", state->install_root, INSTALL_CACHE_DIR) != 0) {
+        return -1;
+    }
+    int port = peer_default_port();
+    if (peer_server_start(cache_dir, port) != 0) {
+        ui_message("LAN Sharing", "Unable to start the artifact server. See the installer log.");
+        return -1;
+    }
+
+    char message[MAX_MESSAGE_LEN];
+    snprintf(message, sizeof(message),
+             "Serving verified stage3 and Portage archives on port %d.\n\n"
+             "Installers on this network find it automatically, or list this host in %s or LIBERO_PEERS.",
+             port, PEER_LIST_PATH);
+    ui_message("LAN Sharing", message);
+    return 0;
+}
+
+static int add_prefetch_item(const InstallerState *state, const char *url, const char *destination,
+                             PrefetchItem *items, int count)
+{
+    if (count >= PREFETCH_MAX_ITEMS || !url[0] || !destination[0]) {
+        return count;
+    }
+    PrefetchItem *item = &items[count];
+    item->url_count = mirror_urls_for(state, url, item->urls, FETCH_MAX_SOURCES);
+    if (safe_format(item->destination, sizeof(item->destination), "%s", destination) != 0) {
+        return count;
+    }
+    return count + 1;
+}
+
+/* Starts downloading the stage3 archive and Portage snapshot in the
+ * background once the network is up, so the transfer overlaps with disk
+ * preparation. Safe to call again: a stopped run resumes into whatever cache
+ * directory is current. */
+int bootstrap_prefetch(InstallerState *state)
+{
+    if (!state->network_configured || state->stage3_ready || prefetch_running() || prefetch_settled()) {
+        return 0;
+    }
+    if (!state->stage3_url[0] && fetch_stage3_metadata(state, false) != 0) {
+        return -1;
+    }
+
+    PrefetchItem items[PREFETCH_MAX_ITEMS];
+    int count = 0;
+    count = add_prefetch_item(state, state->stage3_digest_url, state->stage3_digest_local, items, count);
+    count = add_prefetch_item(state, state->stage3_url, state->stage3_local, items, count);
+    /* The squashfs layout installs a different artifact straight onto the
+     * target, so there is nothing to stage for it. */
+    if (!state->portage_squashfs) {
+        count = add_prefetch_item(state, state->portage_url, state->portage_local, items, count);
+    }
+    for (int i = 0; i < count; ++i) {
+        if (ensure_parent_directory(items[i].destination) != 0) {
+            return -1;
+        }
+    }
+    return count > 0 ? prefetch_start(items, count) : 0;
+}
+
 int bootstrap_workflow(InstallerState *state)
 {
     while (1) {
@@ -362,10 +1158,16 @@ int bootstrap_workflow(InstallerState *state)
             stage3_label = stage3_buf;
         }
 
+        char sharing[32] = "off";
+        if (peer_server_port() > 0) {
+            snprintf(sharing, sizeof(sharing), "port %d", peer_server_port());
+        }
         snprintf(subtitle, sizeof(subtitle),
-                 "Arch: %s | Stage3: %s",
+                 "Arch: %s | Stage3: %s | Portage: %s | LAN sharing: %s",
                  arch_to_string(state->arch),
-                 stage3_label);
+                 stage3_label,
+                 state->portage_squashfs ? "squashfs" : "files",
+                 sharing);
 
         const char *items[] = {
             "Select Gentoo architecture",
@@ -373,12 +1175,17 @@ int bootstrap_workflow(InstallerState *state)
             "Download stage3",
             "Download Portage snapshot",
             "Extract stage3 and Portage",
+            "Stream stage3 and Portage into target (single pass)",
             "Prepare chroot environment",
+            state->portage_squashfs ? "Portage layout: squashfs image + overlay (switch to plain files)"
+                                    : "Portage layout: plain files (switch to squashfs image)",
+            peer_server_port() > 0 ? "Stop sharing artifact cache with LAN peers"
+                                   : "Share artifact cache with LAN peers",
             "Back to main menu",
         };
 
-        int choice = ui_menu("Bootstrap Gentoo", subtitle, items, 7, 0);
-        if (choice < 0 || choice == 6) {
+        int choice = ui_menu("Bootstrap Gentoo", subtitle, items, 10, 0);
+        if (choice < 0 || choice == 9) {
             return 0;
         }
 
@@ -399,8 +1206,17 @@ int bootstrap_workflow(InstallerState *state)
             extract_stage3(state);
             break;
         case 5:
+            stream_install(state);
+            break;
+        case 6:
             prepare_chroot(state);
             break;
+        case 7:
+            state->portage_squashfs = !state->portage_squashfs;
+            break;
+        case 8:
+            toggle_peer_sharing(state);
+            break;
         default:
             break;
         }
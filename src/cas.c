@@ -0,0 +1,508 @@
+#include "cas.h"
+
+#include <dirent.h>
+#include <fcntl.h>
+#include <glob.h>
+#include <linux/fs.h>
+#include <sys/ioctl.h>
+#include <sys/statvfs.h>
+
+#include "delta.h"
+#include "log.h"
+#include "peer.h"
+#include "system_utils.h"
+#include "ui.h"
+
+#define CAS_MAX_ROOTS 16
+
+typedef struct {
+    char path[PATH_MAX];
+    bool local; /* ours to repair and evict; media caches are only read */
+} CasRoot;
+
+typedef struct {
+    char path[PATH_MAX];
+    dev_t dev;
+    ino_t ino;
+    long long size;
+    time_t last_used;
+} CasEntry;
+
+static const char *const media_patterns[] = {
+    "/run/media/*/*/" CAS_MEDIA_DIR_NAME,
+    "/media/*/" CAS_MEDIA_DIR_NAME,
+    "/media/*/*/" CAS_MEDIA_DIR_NAME,
+    "/mnt/*/" CAS_MEDIA_DIR_NAME,
+};
+
+static int object_dir(const char *root, HashAlgorithm algorithm, char *out, size_t len)
+{
+    char name[16];
+    const char *upper = hash_algorithm_name(algorithm);
+    size_t i = 0;
+    for (; upper[i] && i + 1 < sizeof(name); ++i) {
+        name[i] = (char)tolower((unsigned char)upper[i]);
+    }
+    name[i] = '\0';
+    return snprintf(out, len, "%s/%s/%s", root, CAS_DIR_NAME, name) >= (int)len ? -1 : 0;
+}
+
+static int object_path(const char *root, HashAlgorithm algorithm, const char *hex, char *out, size_t len)
+{
+    char dir[PATH_MAX];
+    if (object_dir(root, algorithm, dir, sizeof(dir)) != 0) {
+        return -1;
+    }
+    return snprintf(out, len, "%s/%s", dir, hex) >= (int)len ? -1 : 0;
+}
+
+static bool root_known(const CasRoot *roots, int count, const char *path)
+{
+    char resolved[PATH_MAX];
+    if (!realpath(path, resolved)) {
+        return true;
+    }
+    for (int i = 0; i < count; ++i) {
+        char existing[PATH_MAX];
+        if (realpath(roots[i].path, existing) && strcmp(existing, resolved) == 0) {
+            return true;
+        }
+    }
+    return false;
+}
+
+static int add_root(CasRoot *roots, int count, const char *path, bool local)
+{
+    struct stat st;
+    if (count >= CAS_MAX_ROOTS || stat(path, &st) != 0 || !S_ISDIR(st.st_mode) || root_known(roots, count, path)) {
+        return count;
+    }
+    snprintf(roots[count].path, sizeof(roots[count].path), "%s", path);
+    roots[count].local = local;
+    return count + 1;
+}
+
+/* Search order: the active cache, the live medium cache, then attached media. */
+static int collect_roots(const char *cache_dir, CasRoot *roots, bool include_live)
+{
+    int count = 0;
+    snprintf(roots[0].path, sizeof(roots[0].path), "%s", cache_dir);
+    roots[0].local = true;
+    count = 1;
+    if (include_live) {
+        count = add_root(roots, count, INSTALL_CACHE_DIR, true);
+    }
+
+    for (size_t p = 0; p < sizeof(media_patterns) / sizeof(media_patterns[0]); ++p) {
+        glob_t matches;
+        if (glob(media_patterns[p], GLOB_ONLYDIR | GLOB_NOSORT, NULL, &matches) != 0) {
+            continue;
+        }
+        for (size_t i = 0; i < matches.gl_pathc; ++i) {
+            count = add_root(roots, count, matches.gl_pathv[i], false);
+        }
+        globfree(&matches);
+    }
+    return count;
+}
+
+static int copy_contents(int src, int dst)
+{
+    if (ioctl(dst, FICLONE, src) == 0) {
+        return 0;
+    }
+
+    struct stat st;
+    if (fstat(src, &st) != 0) {
+        return -1;
+    }
+    long long remaining = st.st_size;
+    while (remaining > 0) {
+        ssize_t copied = copy_file_range(src, NULL, dst, NULL, (size_t)remaining, 0);
+        if (copied < 0 && errno == EINTR) {
+            continue;
+        }
+        if (copied <= 0) {
+            break;
+        }
+        remaining -= copied;
+    }
+    if (remaining == 0) {
+        return 0;
+    }
+
+    /* Kernels without cross-filesystem copy_file_range: plain read/write. */
+    char buffer[1 << 16];
+    off_t offset = (off_t)(st.st_size - remaining);
+    while (remaining > 0) {
+        ssize_t got = pread(src, buffer, sizeof(buffer), offset);
+        if (got < 0 && errno == EINTR) {
+            continue;
+        }
+        if (got <= 0) {
+            return -1;
+        }
+        for (ssize_t done = 0; done < got;) {
+            ssize_t written = pwrite(dst, buffer + done, (size_t)(got - done), offset + done);
+            if (written < 0) {
+                if (errno == EINTR) {
+                    continue;
+                }
+                return -1;
+            }
+            done += written;
+        }
+        offset += got;
+        remaining -= got;
+    }
+    return 0;
+}
+
+/* Hardlinks source to destination, falling back to a reflink or a copy when
+ * the two live on different filesystems or links are not supported. The
+ * destination is replaced atomically. */
+static int link_or_clone(const char *source, const char *destination)
+{
+    char tmp[PATH_MAX];
+    if (snprintf(tmp, sizeof(tmp), "%s.cas-tmp", destination) >= (int)sizeof(tmp)) {
+        return -1;
+    }
+    unlink(tmp);
+    if (link(source, tmp) == 0) {
+        if (rename(tmp, destination) == 0) {
+            return 0;
+        }
+        unlink(tmp);
+        return -1;
+    }
+
+    int src = open(source, O_RDONLY | O_CLOEXEC);
+    if (src < 0) {
+        return -1;
+    }
+    int dst = open(tmp, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+    if (dst < 0) {
+        close(src);
+        return -1;
+    }
+    int rc = copy_contents(src, dst);
+    close(src);
+    if (close(dst) != 0) {
+        rc = -1;
+    }
+    if (rc == 0 && rename(tmp, destination) == 0) {
+        return 0;
+    }
+    log_error("Unable to copy %s to %s: %s", source, destination, strerror(errno));
+    unlink(tmp);
+    return -1;
+}
+
+static void touch_object(const char *path)
+{
+    /* atime doubles as the LRU clock; an explicit update works under relatime. */
+    const struct timespec times[2] = {{0, UTIME_NOW}, {0, UTIME_OMIT}};
+    (void)utimensat(AT_FDCWD, path, times, 0);
+}
+
+int cas_restore(const char *cache_dir, const DigestSet *digests, const char *destination)
+{
+    HashAlgorithm verify_with;
+    if (!cache_dir || !digests || !destination || digest_set_select(digests, &verify_with) != 0) {
+        return -1;
+    }
+
+    CasRoot roots[CAS_MAX_ROOTS];
+    int root_count = collect_roots(cache_dir, roots, true);
+    for (int r = 0; r < root_count; ++r) {
+        for (int a = 0; a < HASH_ALGORITHM_COUNT; ++a) {
+            if (!digests->present[a]) {
+                continue;
+            }
+            char object[PATH_MAX];
+            if (object_path(roots[r].path, (HashAlgorithm)a, digests->hex[a], object, sizeof(object)) != 0 ||
+                access(object, R_OK) != 0) {
+                continue;
+            }
+            if (link_or_clone(object, destination) != 0) {
+                continue;
+            }
+
+            ui_progress("Artifact cache",
+                        roots[r].local ? "Verifying cached copy..." : "Verifying copy from attached media...", 0);
+            char actual[HASH_MAX_HEX];
+            if (hash_file_hex(destination, verify_with, actual, sizeof(actual)) != 0 ||
+                strcmp(actual, digests->hex[verify_with]) != 0) {
+                log_error("Cached object %s does not match its %s digest; ignoring it",
+                          object, hash_algorithm_name(verify_with));
+                unlink(destination);
+                if (roots[r].local) {
+                    unlink(object);
+                }
+                continue;
+            }
+
+            touch_object(object);
+            log_info("Restored %s from artifact cache %s", destination, object);
+            return 0;
+        }
+    }
+    return 1;
+}
+
+/* Finds a stored object by one of its digests, searching the same roots as
+ * cas_restore. The object itself is not re-hashed; callers hand it to
+ * consumers that verify against their own expected digest. */
+int cas_lookup(const char *cache_dir, HashAlgorithm algorithm, const char *hex, char *path, size_t len)
+{
+    if (!cache_dir || !hex || !path || strlen(hex) != hash_digest_size(algorithm) * 2) {
+        return -1;
+    }
+    for (const char *p = hex; *p; ++p) {
+        if (!isxdigit((unsigned char)*p) || isupper((unsigned char)*p)) {
+            return -1;
+        }
+    }
+
+    CasRoot roots[CAS_MAX_ROOTS];
+    int root_count = collect_roots(cache_dir, roots, true);
+    for (int r = 0; r < root_count; ++r) {
+        if (object_path(roots[r].path, algorithm, hex, path, len) == 0 && access(path, R_OK) == 0) {
+            touch_object(path);
+            return 0;
+        }
+    }
+    return 1;
+}
+
+static int store_into_root(const CasRoot *root, const char *path, const DigestSet *digests)
+{
+    char first[PATH_MAX] = {0};
+    for (int a = 0; a < HASH_ALGORITHM_COUNT; ++a) {
+        if (!digests->present[a]) {
+            continue;
+        }
+        char dir[PATH_MAX];
+        char object[PATH_MAX];
+        if (object_dir(root->path, (HashAlgorithm)a, dir, sizeof(dir)) != 0 ||
+            object_path(root->path, (HashAlgorithm)a, digests->hex[a], object, sizeof(object)) != 0 ||
+            ensure_directory(dir, 0755) != 0) {
+            return -1;
+        }
+        if (access(object, F_OK) != 0 && link_or_clone(first[0] ? first : path, object) != 0) {
+            return -1;
+        }
+        touch_object(object);
+        if (!first[0]) {
+            snprintf(first, sizeof(first), "%s", object);
+        }
+    }
+    log_info("Stored %s in artifact cache %s", path, root->path);
+    return 0;
+}
+
+/* Writes the delta index the peer server hands out next to every digest name
+ * of the object in root. An index no older than its object is kept, so the
+ * full read and per-block MD5 only happen once per object. */
+static void index_object(const char *root, const char *path, const DigestSet *digests)
+{
+    DeltaIndex index;
+    bool built = false;
+    char first_index[PATH_MAX + 16] = "";
+    for (int a = 0; a < HASH_ALGORITHM_COUNT; ++a) {
+        char object[PATH_MAX];
+        char index_path[PATH_MAX + 16];
+        char tmp[PATH_MAX + 32];
+        struct stat object_st;
+        struct stat index_st;
+        if (!digests->present[a] ||
+            object_path(root, (HashAlgorithm)a, digests->hex[a], object, sizeof(object)) != 0 ||
+            stat(object, &object_st) != 0) {
+            continue;
+        }
+        snprintf(index_path, sizeof(index_path), "%s%s", object, DELTA_INDEX_SUFFIX);
+        if (stat(index_path, &index_st) == 0 && index_st.st_mtime >= object_st.st_mtime) {
+            if (!first_index[0]) {
+                snprintf(first_index, sizeof(first_index), "%s", index_path);
+            }
+            continue;
+        }
+        if (first_index[0]) {
+            unlink(index_path);
+            link_or_clone(first_index, index_path);
+            continue;
+        }
+        if (!built && delta_index_build(path, &index) != 0) {
+            log_error("Unable to build a block index for %s; peers will fetch it whole", path);
+            return;
+        }
+        built = true;
+        snprintf(tmp, sizeof(tmp), "%s.%d", index_path, (int)getpid());
+        if (delta_index_write(&index, tmp) != 0 || rename(tmp, index_path) != 0) {
+            log_error("Unable to write block index %s", index_path);
+            unlink(tmp);
+            continue;
+        }
+        snprintf(first_index, sizeof(first_index), "%s", index_path);
+    }
+    if (built) {
+        delta_index_free(&index);
+    }
+}
+
+/* Records a verified artifact under every published digest, in the active
+ * cache and in any writable attached media cache. While the cache is shared
+ * with LAN peers the local copy also gets its delta index, so the server
+ * never has to build one for a remote request. */
+int cas_store(const char *cache_dir, const char *path, const DigestSet *digests)
+{
+    if (!cache_dir || !path || !digests) {
+        return -1;
+    }
+    CasRoot roots[CAS_MAX_ROOTS];
+    int root_count = collect_roots(cache_dir, roots, false);
+    int rc = 0;
+    for (int r = 0; r < root_count; ++r) {
+        if (!roots[r].local && access(roots[r].path, W_OK) != 0) {
+            continue;
+        }
+        if (!roots[r].local) {
+            ui_progress("Artifact cache", "Copying artifact to attached cache media...", 0);
+        }
+        if (store_into_root(&roots[r], path, digests) != 0) {
+            log_error("Unable to store %s in artifact cache %s", path, roots[r].path);
+            rc = -1;
+            continue;
+        }
+        if (roots[r].local) {
+            if (peer_server_port() > 0) {
+                index_object(roots[r].path, path, digests);
+            }
+            cas_evict(roots[r].path, path);
+        }
+    }
+    return rc;
+}
+
+static int entry_compare(const void *a, const void *b)
+{
+    const CasEntry *left = a;
+    const CasEntry *right = b;
+    return (left->last_used > right->last_used) - (left->last_used < right->last_used);
+}
+
+static CasEntry *collect_entries(const char *cache_dir, size_t *out_count)
+{
+    char cas_dir[PATH_MAX];
+    if (snprintf(cas_dir, sizeof(cas_dir), "%s/%s", cache_dir, CAS_DIR_NAME) >= (int)sizeof(cas_dir)) {
+        return NULL;
+    }
+    DIR *top = opendir(cas_dir);
+    if (!top) {
+        return NULL;
+    }
+
+    size_t capacity = 8;
+    size_t count = 0;
+    CasEntry *entries = calloc(capacity, sizeof(CasEntry));
+    struct dirent *algo;
+    while (entries && (algo = readdir(top)) != NULL) {
+        if (algo->d_name[0] == '.') {
+            continue;
+        }
+        char algo_dir[PATH_MAX];
+        DIR *dir = NULL;
+        if (snprintf(algo_dir, sizeof(algo_dir), "%s/%s", cas_dir, algo->d_name) < (int)sizeof(algo_dir)) {
+            dir = opendir(algo_dir);
+        }
+        if (!dir) {
+            continue;
+        }
+        struct dirent *object;
+        while ((object = readdir(dir)) != NULL) {
+            struct stat st;
+            char path[PATH_MAX];
+            if (object->d_name[0] == '.' ||
+                snprintf(path, sizeof(path), "%s/%s", algo_dir, object->d_name) >= (int)sizeof(path) ||
+                lstat(path, &st) != 0 || !S_ISREG(st.st_mode)) {
+                continue;
+            }
+            if (count == capacity) {
+                capacity *= 2;
+                CasEntry *tmp = realloc(entries, capacity * sizeof(CasEntry));
+                if (!tmp) {
+                    break;
+                }
+                entries = tmp;
+            }
+            snprintf(entries[count].path, sizeof(entries[count].path), "%s", path);
+            entries[count].dev = st.st_dev;
+            entries[count].ino = st.st_ino;
+            entries[count].size = (long long)st.st_size;
+            entries[count].last_used = st.st_atime;
+            count++;
+        }
+        closedir(dir);
+    }
+    closedir(top);
+    *out_count = count;
+    return entries;
+}
+
+/* Evicts least recently used objects until the store fits its budget: half of
+ * the space it could grow into, capped at CAS_MAX_BUDGET_BYTES. On a live
+ * system /var/tmp is often RAM-backed, which keeps the cache from eating it. */
+void cas_evict(const char *cache_dir, const char *keep_path)
+{
+    size_t count = 0;
+    CasEntry *entries = collect_entries(cache_dir, &count);
+    if (!entries) {
+        return;
+    }
+
+    long long total = 0;
+    for (size_t i = 0; i < count; ++i) {
+        bool first_link = true;
+        for (size_t j = 0; j < i; ++j) {
+            if (entries[j].dev == entries[i].dev && entries[j].ino == entries[i].ino) {
+                first_link = false;
+                break;
+            }
+        }
+        if (first_link) {
+            total += entries[i].size;
+        }
+    }
+
+    struct statvfs vfs;
+    long long budget = CAS_MAX_BUDGET_BYTES;
+    if (statvfs(cache_dir, &vfs) == 0) {
+        long long available = (long long)vfs.f_bavail * (long long)vfs.f_frsize;
+        if ((total + available) / 2 < budget) {
+            budget = (total + available) / 2;
+        }
+    }
+
+    struct stat keep;
+    bool have_keep = keep_path && stat(keep_path, &keep) == 0;
+    qsort(entries, count, sizeof(CasEntry), entry_compare);
+    for (size_t i = 0; i < count && total > budget; ++i) {
+        if (!entries[i].path[0] || (have_keep && entries[i].dev == keep.st_dev && entries[i].ino == keep.st_ino)) {
+            continue;
+        }
+        /* Drop every digest name of the object, not just this one. */
+        for (size_t j = i; j < count; ++j) {
+            if (entries[j].path[0] && entries[j].dev == entries[i].dev && entries[j].ino == entries[i].ino &&
+                j != i) {
+                unlink(entries[j].path);
+                entries[j].path[0] = '\0';
+            }
+        }
+        log_info("Evicting %s from artifact cache (%lld bytes, budget %lld)", entries[i].path,
+                 entries[i].size, budget);
+        unlink(entries[i].path);
+        entries[i].path[0] = '\0';
+        total -= entries[i].size;
+    }
+    free(entries);
+}
@@ -1,4 +1,8 @@
 #include "configure.h"
+#include "bandwidth.h"
+#include "fs_profile.h"
+#include "portage_image.h"
+#include "repo_sync.h"
 
 static const char *const libero_packages[] = {
     "sys-boot/grub",
@@ -219,9 +223,20 @@ static int write_make_conf(const InstallerState *state)
         return -1;
     }
 
+    /* GENTOO_MIRRORS takes mirror roots, not the stage3 autobuilds path. */
+    char mirrors[MIRROR_RANK_MAX * MIRROR_URL_MAX];
+    mirrors[0] = '\0';
+    for (int i = 0; i < state->mirror_ranked_count; ++i) {
+        size_t used = strlen(mirrors);
+        snprintf(mirrors + used, sizeof(mirrors) - used, "%s%s", used ? " " : "", state->mirror_ranked[i]);
+    }
+    if (!mirrors[0]) {
+        snprintf(mirrors, sizeof(mirrors), "%s", state->mirror_root[0] ? state->mirror_root : GENTOO_MIRROR_DEFAULT);
+    }
+
     const char *cflags = (state->arch == ARCH_I486) ? "-march=i486 -O2 -pipe" : "-march=i686 -O2 -pipe";
     const char *chost = (state->arch == ARCH_I486) ? "i486-pc-linux-gnu" : "i686-pc-linux-gnu";
-    char content[1024];
+    char content[1024 + sizeof(mirrors)];
     snprintf(content, sizeof(content),
              "COMMON_FLAGS=\"%s\"\n"
              "CFLAGS=\"${COMMON_FLAGS}\"\n"
@@ -232,7 +247,7 @@ static int write_make_conf(const InstallerState *state)
              "GENTOO_MIRRORS=\"%s\"\n"
              "INPUT_DEVICES=\"libinput\"\n"
              "VIDEO_CARDS=\"\"\n",
-             cflags, chost, state->mirror_url);
+             cflags, chost, mirrors);
 
     return write_text_file(path, content);
 }
@@ -308,7 +323,17 @@ static int write_fstab(const InstallerState *state)
         fclose(f);
         return -1;
     }
-    fprintf(f, "UUID=%s\t/\t%s\tdefaults,noatime\t0 1\n", root_uuid, fs_to_string(state->root_fs));
+    /* Same options the installer mounted root with. fsck.xfs and
+     * fsck.btrfs do nothing, so only ext4 gets a pass number. */
+    char options[128];
+    fs_profile_mount_options(state->fs_profile, state->arch, state->root_fs, options, sizeof(options));
+    if (state->root_fs == FS_BTRFS) {
+        fprintf(f, "UUID=%s\t/\tbtrfs\tsubvol=%s,%s\t0 0\n", root_uuid, FS_PROFILE_BTRFS_ROOT_SUBVOL, options);
+        fprintf(f, "UUID=%s\t/home\tbtrfs\tsubvol=%s,%s\t0 0\n", root_uuid, FS_PROFILE_BTRFS_HOME_SUBVOL, options);
+    } else {
+        fprintf(f, "UUID=%s\t/\t%s\t%s\t0 %d\n", root_uuid, fs_to_string(state->root_fs), options,
+                state->root_fs == FS_EXT4 ? 1 : 0);
+    }
 
     if (state->boot_partition[0] && get_block_uuid(state->boot_partition, boot_uuid, sizeof(boot_uuid)) == 0) {
         fprintf(f, "UUID=%s\t/boot\text2\tdefaults,noatime\t0 2\n", boot_uuid);
@@ -320,6 +345,9 @@ static int write_fstab(const InstallerState *state)
     if (state->swap_size_mb > 0 && swap_device[0] && get_block_uuid(swap_device, swap_uuid, sizeof(swap_uuid)) == 0) {
         fprintf(f, "UUID=%s\tnone\tswap\tsw\t0 0\n", swap_uuid);
     }
+    if (state->portage_squashfs && portage_image_mounted(state->install_root)) {
+        portage_image_write_fstab(f, state->install_root);
+    }
 
     fclose(f);
     return 0;
@@ -337,6 +365,8 @@ static int apply_configuration_files(InstallerState *state)
     if (write_locale_files(state) != 0) {
         return -1;
     }
+    /* A no-op when this session already mounted the target. */
+    fs_profile_resolve(state);
     if (write_fstab(state) != 0) {
         return -1;
     }
@@ -391,6 +421,12 @@ static int apply_libero_profile(InstallerState *state)
     const char *binhost = (state->arch == ARCH_I686) ? LIBERO_BINHOST_I686 : LIBERO_BINHOST_I486;
     shell_escape_single_quotes(binhost, binhost_q, sizeof(binhost_q));
 
+    /* The base install may have run for hours; this only syncs again if the
+     * tree has aged past the limit since. */
+    if (repo_sync_ensure_fresh(state) != 0) {
+        return -1;
+    }
+
     char script[65536] = {0};
     script_append(script, sizeof(script), "set -euo pipefail\n");
     script_append(script, sizeof(script), "source /etc/profile\n");
@@ -435,7 +471,6 @@ static int apply_libero_profile(InstallerState *state)
     script_append(script, sizeof(script), "update_make_conf FEATURES \"getbinpkg binpkg-logs\"\n");
     script_append(script, sizeof(script), "update_make_conf PORTAGE_BINHOST \"$LIBERO_BINHOST\"\n");
     script_append(script, sizeof(script), "update_make_conf EMERGE_DEFAULT_OPTS \"--getbinpkg --usepkg\"\n");
-    script_append(script, sizeof(script), "emerge --sync --quiet\n");
     script_append(script, sizeof(script), "emerge --quiet-build=y =dev-build/cmake-3.31.9-r1\n");
     script_append(script, sizeof(script),
                   "if command -v getuto >/dev/null 2>&1; then\n"
@@ -591,7 +626,7 @@ static int apply_libero_profile(InstallerState *state)
     script_append(script, sizeof(script),
                   "systemctl enable dhcpcd.service NetworkManager.service sshd.service zram-swap.service\n");
 
-    if (chroot_run_script(state->install_root, script) != 0) {
+    if (bandwidth_run_chroot_script(state->install_root, BANDWIDTH_BULK, "Libero profile", script) != 0) {
         return -1;
     }
 
@@ -630,11 +665,14 @@ static int run_base_install(InstallerState *state)
         shell_escape_single_quotes(state->user_password, user_pw_q, sizeof(user_pw_q));
     }
 
+    if (repo_sync_ensure_fresh(state) != 0) {
+        ui_message("Install", "Unable to bring the Portage tree up to date. See the installer log.");
+        return -1;
+    }
+
     char script[8192] = {0};
     script_append(script, sizeof(script), "set -euo pipefail\n");
     script_append(script, sizeof(script), "source /etc/profile\n");
-    script_append(script, sizeof(script), "emerge-webrsync\n");
-    script_append(script, sizeof(script), "emaint sync --auto\n");
     script_append(script, sizeof(script), "eselect profile set default/linux/x86/23.0/systemd\n");
     script_append(script, sizeof(script), "emerge --quiet-build=y --update --deep --newuse @world\n");
     script_append(script, sizeof(script),
@@ -661,7 +699,7 @@ static int run_base_install(InstallerState *state)
                       "echo 'KEYMAP=%s' > /etc/vconsole.conf\n", keymap_q);
     }
 
-    if (chroot_run_script(state->install_root, script) != 0) {
+    if (bandwidth_run_chroot_script(state->install_root, BANDWIDTH_BULK, "Base system install", script) != 0) {
         ui_message("Install", "Base system installation failed.");
         return -1;
     }
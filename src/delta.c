@@ -0,0 +1,457 @@
+#include "delta.h"
+
+#include <fcntl.h>
+#include <sys/mman.h>
+
+#include "fetch.h"
+#include "hash.h"
+#include "log.h"
+#include "ui.h"
+
+#define DELTA_HEADER_MAX 256
+#define DELTA_PROGRESS_MS 250
+
+typedef struct {
+    uint32_t *heads; /* bucket -> first block + 1, 0 when empty */
+    uint32_t *next;  /* block -> next block in the same bucket + 1 */
+    uint32_t mask;
+} BlockTable;
+
+static long long monotonic_ms(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (long long)ts.tv_sec * 1000 + ts.tv_nsec / 1000000;
+}
+
+/* The rsync checksum: a is the byte sum, b the position weighted sum, both
+ * mod 2^16, so the window can slide by one byte in constant time. */
+static void weak_init(const unsigned char *data, size_t len, uint32_t *a, uint32_t *b)
+{
+    uint32_t sa = 0;
+    uint32_t sb = 0;
+    for (size_t i = 0; i < len; ++i) {
+        sa += data[i];
+        sb += (uint32_t)(len - i) * data[i];
+    }
+    *a = sa & 0xffff;
+    *b = sb & 0xffff;
+}
+
+static uint32_t weak_value(uint32_t a, uint32_t b)
+{
+    return a | (b << 16);
+}
+
+static void strong_sum(const unsigned char *data, size_t len, unsigned char *out)
+{
+    HashContext ctx;
+    unsigned char digest[HASH_MAX_DIGEST];
+    hash_init(&ctx, HASH_MD5);
+    hash_update(&ctx, data, len);
+    hash_final(&ctx, digest);
+    memcpy(out, digest, DELTA_STRONG_BYTES);
+}
+
+static long long block_length(const DeltaIndex *index, long long block)
+{
+    long long start = block * index->block_size;
+    long long left = index->length - start;
+    return left < index->block_size ? left : index->block_size;
+}
+
+static int map_file(const char *path, const unsigned char **data, size_t *size)
+{
+    int fd = open(path, O_RDONLY | O_CLOEXEC);
+    if (fd < 0) {
+        log_error("Unable to open %s: %s", path, strerror(errno));
+        return -1;
+    }
+    struct stat st;
+    if (fstat(fd, &st) != 0 || !S_ISREG(st.st_mode)) {
+        close(fd);
+        return -1;
+    }
+    *size = (size_t)st.st_size;
+    *data = NULL;
+    if (*size > 0) {
+        void *map = mmap(NULL, *size, PROT_READ, MAP_PRIVATE, fd, 0);
+        if (map == MAP_FAILED) {
+            log_error("Unable to map %s: %s", path, strerror(errno));
+            close(fd);
+            return -1;
+        }
+        madvise(map, *size, MADV_SEQUENTIAL);
+        *data = map;
+    }
+    close(fd);
+    return 0;
+}
+
+static bool index_alloc(DeltaIndex *index)
+{
+    size_t count = index->block_count > 0 ? (size_t)index->block_count : 1;
+    index->weak = calloc(count, sizeof(*index->weak));
+    index->strong = calloc(count, DELTA_STRONG_BYTES);
+    if (!index->weak || !index->strong) {
+        delta_index_free(index);
+        return false;
+    }
+    return true;
+}
+
+int delta_index_build(const char *path, DeltaIndex *index)
+{
+    memset(index, 0, sizeof(*index));
+    const unsigned char *data;
+    size_t size;
+    if (map_file(path, &data, &size) != 0) {
+        return -1;
+    }
+    index->length = (long long)size;
+    index->block_size = DELTA_BLOCK_SIZE;
+    index->block_count = (index->length + DELTA_BLOCK_SIZE - 1) / DELTA_BLOCK_SIZE;
+    if (!index_alloc(index)) {
+        if (data) {
+            munmap((void *)data, size);
+        }
+        return -1;
+    }
+    for (long long i = 0; i < index->block_count; ++i) {
+        const unsigned char *block = data + i * DELTA_BLOCK_SIZE;
+        size_t len = (size_t)block_length(index, i);
+        uint32_t a;
+        uint32_t b;
+        weak_init(block, len, &a, &b);
+        index->weak[i] = weak_value(a, b);
+        strong_sum(block, len, index->strong + i * DELTA_STRONG_BYTES);
+    }
+    if (data) {
+        munmap((void *)data, size);
+    }
+    return 0;
+}
+
+/* A short text header followed by one big-endian weak checksum and
+ * DELTA_STRONG_BYTES of MD5 per block. */
+int delta_index_write(const DeltaIndex *index, const char *path)
+{
+    FILE *f = fopen(path, "wb");
+    if (!f) {
+        log_error("Unable to write %s: %s", path, strerror(errno));
+        return -1;
+    }
+    fprintf(f, "%s\nlength %lld\nblock-size %d\n\n", DELTA_INDEX_MAGIC, index->length, index->block_size);
+    for (long long i = 0; i < index->block_count; ++i) {
+        unsigned char record[4 + DELTA_STRONG_BYTES];
+        uint32_t weak = index->weak[i];
+        record[0] = (unsigned char)(weak >> 24);
+        record[1] = (unsigned char)(weak >> 16);
+        record[2] = (unsigned char)(weak >> 8);
+        record[3] = (unsigned char)weak;
+        memcpy(record + 4, index->strong + i * DELTA_STRONG_BYTES, DELTA_STRONG_BYTES);
+        fwrite(record, sizeof(record), 1, f);
+    }
+    if (ferror(f) | fclose(f)) {
+        log_error("Unable to write %s", path);
+        unlink(path);
+        return -1;
+    }
+    return 0;
+}
+
+int delta_index_load(const char *path, DeltaIndex *index)
+{
+    memset(index, 0, sizeof(*index));
+    FILE *f = fopen(path, "rb");
+    if (!f) {
+        return -1;
+    }
+    char line[DELTA_HEADER_MAX];
+    bool magic = false;
+    index->length = -1;
+    while (fgets(line, sizeof(line), f)) {
+        line[strcspn(line, "\r\n")] = '\0';
+        if (!line[0]) {
+            break;
+        }
+        if (strcmp(line, DELTA_INDEX_MAGIC) == 0) {
+            magic = true;
+        } else if (strncmp(line, "length ", 7) == 0) {
+            index->length = strtoll(line + 7, NULL, 10);
+        } else if (strncmp(line, "block-size ", 11) == 0) {
+            index->block_size = atoi(line + 11);
+        }
+    }
+    if (!magic || index->length < 0 || index->block_size < 512 || index->block_size > (1 << 20)) {
+        log_error("%s is not a block index", path);
+        fclose(f);
+        return -1;
+    }
+    index->block_count = (index->length + index->block_size - 1) / index->block_size;
+    if (!index_alloc(index)) {
+        fclose(f);
+        return -1;
+    }
+    for (long long i = 0; i < index->block_count; ++i) {
+        unsigned char record[4 + DELTA_STRONG_BYTES];
+        if (fread(record, sizeof(record), 1, f) != 1) {
+            log_error("Block index %s is truncated", path);
+            fclose(f);
+            delta_index_free(index);
+            return -1;
+        }
+        index->weak[i] = (uint32_t)record[0] << 24 | (uint32_t)record[1] << 16 | (uint32_t)record[2] << 8 | record[3];
+        memcpy(index->strong + i * DELTA_STRONG_BYTES, record + 4, DELTA_STRONG_BYTES);
+    }
+    fclose(f);
+    return 0;
+}
+
+void delta_index_free(DeltaIndex *index)
+{
+    free(index->weak);
+    free(index->strong);
+    index->weak = NULL;
+    index->strong = NULL;
+    index->block_count = 0;
+}
+
+/* Chains the full-size blocks by weak checksum; the short tail block is
+ * always fetched, so it never needs to be found. */
+static int table_build(const DeltaIndex *index, long long full_blocks, BlockTable *table)
+{
+    uint32_t buckets = 1024;
+    while (buckets < (uint64_t)full_blocks * 2 && buckets < (1u << 30)) {
+        buckets <<= 1;
+    }
+    table->mask = buckets - 1;
+    table->heads = calloc(buckets, sizeof(*table->heads));
+    table->next = calloc(full_blocks > 0 ? (size_t)full_blocks : 1, sizeof(*table->next));
+    if (!table->heads || !table->next) {
+        free(table->heads);
+        free(table->next);
+        return -1;
+    }
+    for (long long i = full_blocks - 1; i >= 0; --i) {
+        uint32_t w = index->weak[i];
+        uint32_t bucket = (w ^ (w >> 16) * 0x9e37u) & table->mask;
+        table->next[i] = table->heads[bucket];
+        table->heads[bucket] = (uint32_t)i + 1;
+    }
+    return 0;
+}
+
+static int write_at(int fd, const unsigned char *data, size_t len, long long offset)
+{
+    while (len > 0) {
+        ssize_t written = pwrite(fd, data, len, (off_t)offset);
+        if (written < 0 && errno == EINTR) {
+            continue;
+        }
+        if (written <= 0) {
+            return -1;
+        }
+        data += written;
+        len -= (size_t)written;
+        offset += written;
+    }
+    return 0;
+}
+
+/* Slides a block-sized window over the seed and copies every target block
+ * it finds into fd. Returns the number of blocks filled, -1 on error. */
+static long long match_seed(const DeltaIndex *index, long long full_blocks, const unsigned char *seed,
+                            size_t seed_size, int fd, bool *filled)
+{
+    size_t bs = (size_t)index->block_size;
+    if (full_blocks == 0 || seed_size < bs) {
+        return 0;
+    }
+    BlockTable table;
+    if (table_build(index, full_blocks, &table) != 0) {
+        return -1;
+    }
+
+    long long found = 0;
+    long long last_report = 0;
+    size_t pos = 0;
+    uint32_t a;
+    uint32_t b;
+    weak_init(seed, bs, &a, &b);
+    for (;;) {
+        uint32_t weak = weak_value(a, b);
+        uint32_t bucket = (weak ^ (weak >> 16) * 0x9e37u) & table.mask;
+        bool have_strong = false;
+        bool matched = false;
+        unsigned char strong[DELTA_STRONG_BYTES];
+        for (uint32_t link = table.heads[bucket]; link; link = table.next[link - 1]) {
+            uint32_t block = link - 1;
+            if (filled[block] || index->weak[block] != weak) {
+                continue;
+            }
+            if (!have_strong) {
+                strong_sum(seed + pos, bs, strong);
+                have_strong = true;
+            }
+            if (memcmp(strong, index->strong + (size_t)block * DELTA_STRONG_BYTES, DELTA_STRONG_BYTES) != 0) {
+                continue;
+            }
+            if (write_at(fd, seed + pos, bs, (long long)block * index->block_size) != 0) {
+                log_error("Unable to write reused block: %s", strerror(errno));
+                free(table.heads);
+                free(table.next);
+                return -1;
+            }
+            filled[block] = true;
+            found++;
+            matched = true;
+        }
+
+        long long now = monotonic_ms();
+        if (now - last_report >= DELTA_PROGRESS_MS) {
+            last_report = now;
+            char message[128];
+            snprintf(message, sizeof(message), "Scanning cached copy: %lld of %lld blocks reusable", found,
+                     full_blocks);
+            ui_progress("Delta transfer", message, (int)((long long)pos * 100 / (long long)seed_size));
+        }
+
+        if (found == full_blocks) {
+            break;
+        }
+        if (matched && pos + 2 * bs <= seed_size) {
+            /* Blocks rarely overlap; resume right after the match. */
+            pos += bs;
+            weak_init(seed + pos, bs, &a, &b);
+            continue;
+        }
+        if (pos + bs >= seed_size) {
+            break;
+        }
+        uint32_t out = seed[pos];
+        uint32_t in = seed[pos + bs];
+        a = (a - out + in) & 0xffff;
+        b = (b - (uint32_t)bs * out + a) & 0xffff;
+        pos++;
+    }
+    free(table.heads);
+    free(table.next);
+    return found;
+}
+
+/* Turns the unfilled blocks into as few requests as is sensible; refetching a
+ * few present blocks is cheaper than another round trip. */
+static int missing_ranges(const DeltaIndex *index, const bool *filled, FetchRange **out, long long *bytes)
+{
+    int count = 0;
+    int cap = 0;
+    FetchRange *ranges = NULL;
+    *bytes = 0;
+    for (long long i = 0; i < index->block_count; ++i) {
+        if (filled[i]) {
+            continue;
+        }
+        long long start = i * index->block_size;
+        long long end = start + block_length(index, i) - 1;
+        *bytes += end - start + 1;
+        if (count > 0 && start - ranges[count - 1].end - 1 <= DELTA_COALESCE_GAP) {
+            ranges[count - 1].end = end;
+            continue;
+        }
+        if (count == cap) {
+            cap = cap ? cap * 2 : 64;
+            FetchRange *grown = realloc(ranges, (size_t)cap * sizeof(*ranges));
+            if (!grown) {
+                free(ranges);
+                return -1;
+            }
+            ranges = grown;
+        }
+        ranges[count].start = start;
+        ranges[count].end = end;
+        count++;
+    }
+    *out = ranges;
+    return count;
+}
+
+int delta_fetch(const char *const *urls, int url_count, const DeltaIndex *index, const char *seed,
+                const char *destination)
+{
+    if (!urls || url_count < 1 || !index || index->block_count < 1 || !seed || !destination) {
+        return -1;
+    }
+    char partial[PATH_MAX];
+    if (snprintf(partial, sizeof(partial), "%s.delta", destination) >= (int)sizeof(partial)) {
+        return -1;
+    }
+    const unsigned char *seed_data;
+    size_t seed_size;
+    if (map_file(seed, &seed_data, &seed_size) != 0) {
+        return -1;
+    }
+    bool *filled = calloc((size_t)index->block_count, sizeof(*filled));
+    int fd = open(partial, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+    if (!filled || fd < 0 || ftruncate(fd, (off_t)index->length) != 0) {
+        log_error("Unable to prepare %s: %s", partial, strerror(errno));
+        if (fd >= 0) {
+            close(fd);
+            unlink(partial);
+        }
+        free(filled);
+        if (seed_data) {
+            munmap((void *)seed_data, seed_size);
+        }
+        return -1;
+    }
+
+    long long full_blocks = index->length / index->block_size;
+    long long start_ms = monotonic_ms();
+    long long found = match_seed(index, full_blocks, seed_data, seed_size, fd, filled);
+    if (seed_data) {
+        munmap((void *)seed_data, seed_size);
+    }
+
+    int rc = -1;
+    FetchRange *ranges = NULL;
+    long long missing = 0;
+    int range_count = found < 0 ? -1 : missing_ranges(index, filled, &ranges, &missing);
+    long long reused = index->length - missing;
+    if (range_count < 0) {
+        goto out;
+    }
+    log_info("Delta transfer for %s: %.1f of %.1f MB reusable from %s (scan %lld ms), %d range(s) to fetch",
+             destination, reused / 1048576.0, index->length / 1048576.0, seed, monotonic_ms() - start_ms,
+             range_count);
+    if (reused * 100 < index->length * DELTA_MIN_REUSE_PERCENT) {
+        log_info("Too little of %s is reusable; falling back to a full download", seed);
+        goto out;
+    }
+    if (range_count > 0 && fetch_ranges_mirrors(urls, url_count, fd, index->length, ranges, range_count) != 0) {
+        goto out;
+    }
+    if (fsync(fd) != 0) {
+        log_error("Unable to flush %s: %s", partial, strerror(errno));
+        goto out;
+    }
+    rc = 0;
+
+out:
+    free(ranges);
+    free(filled);
+    if (close(fd) != 0) {
+        rc = -1;
+    }
+    if (rc == 0 && rename(partial, destination) != 0) {
+        log_error("Unable to move %s into place: %s", partial, strerror(errno));
+        rc = -1;
+    }
+    if (rc != 0) {
+        unlink(partial);
+        return -1;
+    }
+    log_info("Delta transfer for %s complete: %.1f MB reused, %.1f MB fetched", destination, reused / 1048576.0,
+             missing / 1048576.0);
+    return 0;
+}
@@ -0,0 +1,179 @@
+#include "device_prep.h"
+
+#include <fcntl.h>
+#include <linux/fs.h>
+#include <sys/ioctl.h>
+
+#include "block_probe.h"
+#include "log.h"
+#include "progress.h"
+#include "ui.h"
+
+typedef enum {
+    PREP_MODE_AUTO = 0,
+    PREP_MODE_DISCARD,
+    PREP_MODE_ZEROOUT,
+    PREP_MODE_OFF
+} PrepMode;
+
+static long long monotonic_ms(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (long long)ts.tv_sec * 1000 + ts.tv_nsec / 1000000;
+}
+
+static int parse_mode(const char *text, PrepMode *mode)
+{
+    static const char *names[] = {"auto", "discard", "zeroout", "off"};
+    for (int i = 0; i < 4; ++i) {
+        if (strcmp(text, names[i]) == 0) {
+            *mode = (PrepMode)i;
+            return 0;
+        }
+    }
+    return -1;
+}
+
+static PrepMode configured_mode(void)
+{
+    PrepMode mode = PREP_MODE_AUTO;
+    const char *env = getenv("LIBERO_DEVICE_PREP");
+    if (env && *env) {
+        if (parse_mode(env, &mode) == 0) {
+            return mode;
+        }
+        log_error("Ignoring unknown LIBERO_DEVICE_PREP '%s'", env);
+    }
+    FILE *f = fopen(DEVICE_PREP_CONFIG_PATH, "r");
+    if (!f) {
+        return PREP_MODE_AUTO;
+    }
+    char line[64];
+    while (fgets(line, sizeof(line), f)) {
+        line[strcspn(line, "#\r\n \t")] = '\0';
+        if (line[0]) {
+            if (parse_mode(line, &mode) != 0) {
+                log_error("Ignoring unknown device preparation mode '%s' in %s", line, DEVICE_PREP_CONFIG_PATH);
+                mode = PREP_MODE_AUTO;
+            }
+            break;
+        }
+    }
+    fclose(f);
+    return mode;
+}
+
+const char *device_prep_method_name(DevicePrepMethod method)
+{
+    switch (method) {
+    case DEVICE_PREP_DISCARDED:
+        return "discard";
+    case DEVICE_PREP_ZEROED:
+        return "zero-out";
+    default:
+        return "none";
+    }
+}
+
+/* Issues request over [0, size) in chunk sized ranges. */
+static int issue_ranges(int fd, unsigned long request, uint64_t size, uint64_t chunk, const char *message)
+{
+    ProgressState progress;
+    progress_init(&progress, NULL);
+    progress_update(&progress, 0, (long long)size, -1, -1);
+    for (uint64_t offset = 0; offset < size;) {
+        uint64_t range[2] = {offset, size - offset < chunk ? size - offset : chunk};
+        if (ioctl(fd, request, range) != 0) {
+            return -1;
+        }
+        offset += range[1];
+        progress_update(&progress, (long long)offset, (long long)size, -1, -1);
+        ui_progress_state("Preparing Disk", message, &progress);
+    }
+    return 0;
+}
+
+static void log_throughput(const char *verb, const char *path, uint64_t size, long long elapsed_ms,
+                           const BlockTopology *topology)
+{
+    double seconds = elapsed_ms > 0 ? elapsed_ms / 1000.0 : 0.001;
+    log_info("Device prep: %s %.1f MB of %s in %.2f s (%.1f MB/s, %s, discard granularity %u, "
+             "max discard %llu, max write-zeroes %llu)",
+             verb, size / 1048576.0, path, elapsed_ms / 1000.0, size / 1048576.0 / seconds,
+             topology->rotational ? "rotational" : "non-rotational", topology->discard_granularity,
+             (unsigned long long)topology->discard_max, (unsigned long long)topology->write_zeroes_max);
+}
+
+int device_prepare(const char *path, DevicePrepMethod *method)
+{
+    *method = DEVICE_PREP_SKIPPED;
+    PrepMode mode = configured_mode();
+    if (mode == PREP_MODE_OFF) {
+        log_info("Device prep: disabled by configuration");
+        return 0;
+    }
+
+    BlockTopology topology;
+    if (block_probe_topology(path, &topology) != 0) {
+        return -1;
+    }
+    bool try_discard = topology.discard_max > 0 && (mode == PREP_MODE_DISCARD ||
+                                                    (mode == PREP_MODE_AUTO && !topology.rotational));
+    /* Without offload the kernel writes every zero itself, which is the
+     * slow path this stage exists to avoid; only an explicit request gets
+     * it. */
+    bool try_zeroout = mode == PREP_MODE_ZEROOUT ||
+                       (topology.write_zeroes_max > 0 && (mode == PREP_MODE_DISCARD || !topology.rotational));
+    if (!try_discard && !try_zeroout) {
+        log_info("Device prep: skipped for %s (%s, discard %s, write-zeroes %s)", path,
+                 topology.rotational ? "rotational" : "non-rotational",
+                 topology.discard_max ? "supported" : "unsupported",
+                 topology.write_zeroes_max ? "offloaded" : "not offloaded");
+        return 0;
+    }
+
+    /* Exclusive, so a forgotten mount makes this fail instead of
+     * discarding under a live filesystem. */
+    int fd = open(path, O_WRONLY | O_EXCL | O_CLOEXEC);
+    if (fd < 0) {
+        log_error("Device prep: unable to open %s exclusively: %s", path, strerror(errno));
+        return -1;
+    }
+    uint64_t size = 0;
+    if (ioctl(fd, BLKGETSIZE64, &size) != 0 || size == 0) {
+        log_error("Device prep: unable to read the size of %s: %s", path, strerror(errno));
+        close(fd);
+        return -1;
+    }
+
+    char message[PATH_MAX + 32];
+    long long started = monotonic_ms();
+    if (try_discard) {
+        uint64_t chunk = DEVICE_PREP_DISCARD_CHUNK;
+        if (topology.discard_granularity > 0 && chunk % topology.discard_granularity != 0) {
+            chunk -= chunk % topology.discard_granularity;
+        }
+        snprintf(message, sizeof(message), "Discarding %s", path);
+        if (chunk > 0 && issue_ranges(fd, BLKDISCARD, size, chunk, message) == 0) {
+            log_throughput("discarded", path, size, monotonic_ms() - started, &topology);
+            *method = DEVICE_PREP_DISCARDED;
+            close(fd);
+            return 0;
+        }
+        log_info("Device prep: discard on %s failed (%s)%s", path, strerror(errno),
+                 try_zeroout ? "; zeroing instead" : "");
+        started = monotonic_ms();
+    }
+    if (try_zeroout) {
+        snprintf(message, sizeof(message), "Zeroing %s", path);
+        if (issue_ranges(fd, BLKZEROOUT, size, DEVICE_PREP_ZEROOUT_CHUNK, message) == 0) {
+            log_throughput("zeroed", path, size, monotonic_ms() - started, &topology);
+            *method = DEVICE_PREP_ZEROED;
+        } else {
+            log_info("Device prep: zero-out on %s failed (%s); leaving it to mkfs", path, strerror(errno));
+        }
+    }
+    close(fd);
+    return 0;
+}
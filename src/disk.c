@@ -1,4 +1,15 @@
 #include "disk.h"
+#include "block_probe.h"
+#include "bootstrap.h"
+#include "device_prep.h"
+#include "disk_jobs.h"
+#include "fetch.h"
+#include "fs_profile.h"
+#include "luks_tuning.h"
+#include "partition_table.h"
+#include "prefetch.h"
+#include "report.h"
+#include "uevent.h"
 
 #include <dirent.h>
 #include <fcntl.h>
@@ -17,6 +28,16 @@
 #define LABEL_ROOT "LIBERO_ROOT"
 #define LABEL_SWAP "LIBERO_SWAP"
 
+/* Smaller disks get smaller boot partitions. FAT32 needs 65525 clusters,
+ * which at 4K sectors is just under 260 MiB. */
+#define SMALL_DISK_MB 16384
+#define EFI_SIZE_MB 512
+#define EFI_SIZE_SMALL_MB 260
+#define BOOT_SIZE_MB 512
+#define BOOT_SIZE_SMALL_MB 256
+/* Block size the root filesystems are laid out with. */
+#define FS_BLOCK_SIZE 4096
+
 typedef struct {
     char name[64];
     char path[PATH_MAX];
@@ -24,18 +45,6 @@ typedef struct {
     long size_mb;
 } DiskInfo;
 
-typedef struct {
-    const char *role;
-    const char *label;
-    const char *gpt_type;
-    const char *mbr_type;
-    int part_number;
-    char size_spec[32];
-    char device[PATH_MAX];
-} PartitionSpec;
-
-#define MAX_PARTITION_SPECS 8
-
 static int is_usable_disk(const char *name)
 {
     const char *skip_prefixes[] = {"loop", "ram", "fd", NULL};
@@ -157,6 +166,7 @@ static PartitionSpec *plan_add_partition(PartitionSpec *plan, size_t *count, int
     spec->gpt_type = gpt_type;
     spec->mbr_type = mbr_type;
     spec->part_number = number;
+    spec->bootable = false;
     spec->device[0] = '\0';
     if (size_spec && size_spec[0]) {
         snprintf(spec->size_spec, sizeof(spec->size_spec), "%s", size_spec);
@@ -200,8 +210,20 @@ static const char *role_mountpoint(const char *role)
     return role;
 }
 
+/* Rounds size_mb up to whole alignment grains so the next partition starts
+ * right where this one ends. */
+static long aligned_size_mb(long size_mb, long grain_mb)
+{
+    if (grain_mb <= 1) {
+        return size_mb;
+    }
+    return ((size_mb + grain_mb - 1) / grain_mb) * grain_mb;
+}
+
 static void summarize_partition_plan(const char *disk,
                                      long disk_mb,
+                                     const BlockTopology *topology,
+                                     const PartitionTable *table,
                                      const PartitionSpec *plan,
                                      size_t count,
                                      char *buffer,
@@ -212,23 +234,36 @@ static void summarize_partition_plan(const char *disk,
     }
     buffer[0] = '\0';
 
-    char header[256];
+    char header[512];
     snprintf(header, sizeof(header),
-             "Target: %s (%ld MB)\n\n%-6s %-6s %-12s %-12s %-12s\n%-6s %-6s %-12s %-12s %-12s\n",
-             disk ? disk : "<unknown>", disk_mb,
-             "Role", "Part#", "Size", "Mount", "Label",
-             "-----", "-----", "------------", "------------", "------------");
+             "Target: %s (%ld MB, %s)\n"
+             "Sectors: %u B logical, %u B physical; I/O %u B minimum, %u B optimal\n"
+             "Partitions aligned to %llu KiB\n\n"
+             "%-6s %-6s %-10s %-10s %-12s %-12s\n%-6s %-6s %-10s %-10s %-12s %-12s\n",
+             disk ? disk : "<unknown>", disk_mb, topology->rotational ? "rotational" : "non-rotational",
+             topology->logical_block, topology->physical_block, topology->minimum_io, topology->optimal_io,
+             (unsigned long long)(table->alignment * table->sector_size / 1024),
+             "Role", "Part#", "Start", "Size", "Mount", "Label",
+             "-----", "-----", "----------", "----------", "------------", "------------");
     strncat(buffer, header, len - strlen(buffer) - 1);
 
-    for (size_t i = 0; i < count; ++i) {
+    for (size_t i = 0; i < count && i < (size_t)table->count; ++i) {
         const PartitionSpec *spec = &plan[i];
-        const char *size_text = spec->size_spec[0] ? spec->size_spec : "rest-of-disk";
+        const PartitionTableEntry *entry = &table->entries[i];
         const char *label = spec->label ? spec->label : "";
-
+        unsigned long long start_mb = entry->first_lba * table->sector_size / (1024ULL * 1024ULL);
+        unsigned long long size_mb =
+            (entry->last_lba - entry->first_lba + 1) * table->sector_size / (1024ULL * 1024ULL);
+
+        char start_text[32];
+        char size_text[32];
+        snprintf(start_text, sizeof(start_text), "%llu MB", start_mb);
+        snprintf(size_text, sizeof(size_text), "%llu MB", size_mb);
         char line[256];
-        snprintf(line, sizeof(line), "%-6s %-6d %-12s %-12s %-12s\n",
+        snprintf(line, sizeof(line), "%-6s %-6d %-10s %-10s %-12s %-12s\n",
                  spec->role ? spec->role : "?",
                  spec->part_number,
+                 start_text,
                  size_text,
                  role_mountpoint(spec->role),
                  label);
@@ -239,11 +274,8 @@ static void summarize_partition_plan(const char *disk,
     }
 }
 
-static void migrate_cache_file(const char *old_path, const char *new_path)
+static void move_cache_entry(const char *old_path, const char *new_path)
 {
-    if (!old_path || !new_path || strcmp(old_path, new_path) == 0) {
-        return;
-    }
     if (access(old_path, R_OK) != 0) {
         return;
     }
@@ -264,6 +296,28 @@ static void migrate_cache_file(const char *old_path, const char *new_path)
     log_error("Failed to move cache file from %s to %s: %s", old_path, new_path, strerror(errno));
 }
 
+static void migrate_cache_file(const char *old_path, const char *new_path)
+{
+    static const char *const partial_suffixes[] = {FETCH_PARTIAL_SUFFIX, FETCH_MANIFEST_SUFFIX};
+
+    if (!old_path || !new_path || strcmp(old_path, new_path) == 0) {
+        return;
+    }
+    move_cache_entry(old_path, new_path);
+
+    /* An interrupted download leaves its data and chunk manifest beside the
+     * destination; move them too so the fetch resumes on the target disk. */
+    for (size_t i = 0; i < sizeof(partial_suffixes) / sizeof(partial_suffixes[0]); ++i) {
+        char old_partial[PATH_MAX];
+        char new_partial[PATH_MAX];
+        if (snprintf(old_partial, sizeof(old_partial), "%s%s", old_path, partial_suffixes[i]) >= (int)sizeof(old_partial) ||
+            snprintf(new_partial, sizeof(new_partial), "%s%s", new_path, partial_suffixes[i]) >= (int)sizeof(new_partial)) {
+            continue;
+        }
+        move_cache_entry(old_partial, new_partial);
+    }
+}
+
 static DiskInfo *collect_disks(size_t *out_count)
 {
     DIR *dir = opendir("/sys/block");
@@ -389,57 +443,47 @@ static int deactivate_disk_usage(const char *disk)
         return -1;
     }
 
-    char cmd[PATH_MAX + 64];
-    snprintf(cmd, sizeof(cmd), "lsblk -nrpo NAME,TYPE,MOUNTPOINT %s", disk);
-
-    FILE *fp = popen(cmd, "r");
-    if (!fp) {
-        log_error("Unable to inspect disk usage for %s: %s", disk, strerror(errno));
+    BlockInfo *devices = calloc(BLOCK_PROBE_TREE_MAX, sizeof(BlockInfo));
+    if (!devices) {
+        return -1;
+    }
+    int count = block_probe_tree(disk, devices, BLOCK_PROBE_TREE_MAX);
+    if (count < 0) {
+        log_error("Unable to inspect disk usage for %s", disk);
+        free(devices);
         return -1;
     }
 
-    char line[PATH_MAX * 2];
+    /* Deepest first: a volume is unmounted and deactivated before the
+     * mapping below it is closed. */
     int rc = 0;
-    while (fgets(line, sizeof(line), fp)) {
-        char name[PATH_MAX] = {0};
-        char type[32] = {0};
-        char mountpoint[PATH_MAX] = {0};
-
-        int fields = sscanf(line, "%s %31s %s", name, type, mountpoint);
-        if (fields < 2) {
-            continue;
-        }
-        if (strcmp(type, "disk") == 0) {
-            continue;
-        }
-
-        bool is_swap = (fields == 3 && strcmp(mountpoint, "[SWAP]") == 0);
-        bool is_mounted = (fields == 3 && mountpoint[0] && strcmp(mountpoint, "-") != 0);
-
-        if (is_swap) {
-            if (run_command("swapoff %s", name) != 0) {
+    for (int i = 0; i < count; ++i) {
+        const BlockInfo *device = &devices[i];
+        if (device->swap_active) {
+            if (run_command("swapoff %s", device->path) != 0) {
                 rc = -1;
             }
-        } else if (is_mounted) {
-            if (run_command("umount -f %s", name) != 0) {
+        } else if (device->mountpoint[0]) {
+            /* -A: a btrfs root is mounted once per subvolume. */
+            if (run_command("umount -f -A %s", device->path) != 0) {
                 rc = -1;
             }
         }
 
-        if (strcmp(type, "crypt") == 0) {
-            const char *mapper = strrchr(name, '/');
-            mapper = mapper ? mapper + 1 : name;
+        if (strcmp(device->kind, "crypt") == 0) {
+            const char *mapper = strrchr(device->path, '/');
+            mapper = mapper ? mapper + 1 : device->path;
             if (run_command("cryptsetup close %s", mapper) != 0) {
                 rc = -1;
             }
-        } else if (strcmp(type, "lvm") == 0) {
-            if (run_command("lvchange -an %s", name) != 0) {
+        } else if (strcmp(device->kind, "lvm") == 0) {
+            if (run_command("lvchange -an %s", device->path) != 0) {
                 rc = -1;
             }
         }
     }
+    free(devices);
 
-    pclose(fp);
     if (deactivate_swap_for_disk(disk) != 0) {
         rc = -1;
     }
@@ -452,13 +496,13 @@ static void log_fs_probe(const char *device)
         return;
     }
 
-    char cmd[PATH_MAX + 32];
-    snprintf(cmd, sizeof(cmd), "blkid -o export %s", device);
-    char output[512];
-    if (capture_command(cmd, output, sizeof(output)) == 0 && output[0]) {
-        log_info("blkid export for %s:\n%s", device, output);
+    BlockInfo info;
+    if (block_probe(device, &info) == 0) {
+        log_info("Probe of %s: %s, %.1f MB, TYPE=%s UUID=%s LABEL=%s", device, info.path,
+                 info.size_bytes / 1048576.0, info.fs_type[0] ? info.fs_type : "(none)",
+                 info.uuid[0] ? info.uuid : "(none)", info.label);
     } else {
-        log_error("blkid probe failed for %s", device);
+        log_error("Filesystem probe failed for %s", device);
     }
 }
 
@@ -522,6 +566,31 @@ static int choose_root_fs(InstallerState *state)
     return (choice >= 0) ? 0 : -1;
 }
 
+static int choose_fs_profile(InstallerState *state)
+{
+    char labels[5][128];
+    const char *items[5];
+    snprintf(labels[0], sizeof(labels[0]), "auto - chosen from the disk size and type");
+    for (int i = 0; i < 4; ++i) {
+        snprintf(labels[i + 1], sizeof(labels[i + 1]), "%s - %s", fs_profile_to_string((FsProfile)i),
+                 fs_profile_description((FsProfile)i));
+    }
+    for (int i = 0; i < 5; ++i) {
+        items[i] = labels[i];
+    }
+    int selected = state->fs_profile_pinned ? (int)state->fs_profile + 1 : 0;
+    int choice = ui_menu("Filesystem Profile", "Tunes mkfs, mount and fstab options of the root filesystem", items, 5,
+                         selected);
+    if (choice < 0) {
+        return -1;
+    }
+    state->fs_profile_pinned = choice > 0;
+    if (choice > 0) {
+        state->fs_profile = (FsProfile)(choice - 1);
+    }
+    return 0;
+}
+
 static int configure_swap(InstallerState *state)
 {
     char buffer[32];
@@ -537,36 +606,124 @@ static int configure_swap(InstallerState *state)
     return 0;
 }
 
-static int format_partition(const char *device, const char *type, const char *label)
+/* Options that line filesystems and containers up with the disk: ext4
+ * stride/stripe_width and xfs su/sw describe the RAID chunk and stripe,
+ * sector sizes follow 4K drives, LUKS and LVM start their data on the
+ * partition alignment. Once the device was discarded or zeroed up front,
+ * mkfs does not discard again. Inode tables and journal are written at
+ * mkfs time then, or when the profile asks for it (eager_init), rather
+ * than by the kernel in the background. Each string is empty or starts
+ * with a space; ext covers both the ext2 boot and an ext4 root filesystem
+ * and holds no profile options, which add_root_format_job appends. */
+typedef struct {
+    char ext[160];
+    char xfs[96];
+    char btrfs[32];
+    char luks[48];
+    char lvm[48];
+} FormatGeometry;
+
+static void plan_format_geometry(const char *disk, DevicePrepMethod prepared, bool eager_init,
+                                 FormatGeometry *geometry)
+{
+    memset(geometry, 0, sizeof(*geometry));
+    BlockTopology topology;
+    if (block_probe_topology(disk, &topology) != 0) {
+        return;
+    }
+    PartitionAlignment alignment;
+    partition_table_alignment(&topology, &alignment);
+
+    const unsigned block = FS_BLOCK_SIZE;
+    unsigned chunk = topology.minimum_io;
+    bool striped = topology.optimal_io > chunk && topology.optimal_io % chunk == 0 && chunk % block == 0;
+    char extended[96] = "";
+    if (striped) {
+        snprintf(extended, sizeof(extended), "stride=%u,stripe_width=%u", chunk / block, topology.optimal_io / block);
+    }
+    if (prepared != DEVICE_PREP_SKIPPED) {
+        size_t used = strlen(extended);
+        snprintf(extended + used, sizeof(extended) - used, "%snodiscard", used ? "," : "");
+    }
+    if (prepared != DEVICE_PREP_SKIPPED || eager_init) {
+        size_t used = strlen(extended);
+        snprintf(extended + used, sizeof(extended) - used, "%slazy_itable_init=0,lazy_journal_init=0",
+                 used ? "," : "");
+    }
+    /* Small filesystems would otherwise get 1K blocks. */
+    snprintf(geometry->ext, sizeof(geometry->ext), "%s%s%s", topology.physical_block >= block ? " -b 4096" : "",
+             extended[0] ? " -E " : "", extended);
+
+    if (topology.physical_block > 512) {
+        snprintf(geometry->xfs, sizeof(geometry->xfs), " -s size=%u", topology.physical_block);
+    }
+    if (striped) {
+        size_t used = strlen(geometry->xfs);
+        snprintf(geometry->xfs + used, sizeof(geometry->xfs) - used, " -d su=%u,sw=%u", chunk,
+                 topology.optimal_io / chunk);
+    }
+
+    /* btrfs has no stripe geometry of its own; only its sector size
+     * follows the drive. */
+    if (topology.physical_block >= block && sysconf(_SC_PAGESIZE) == (long)block) {
+        snprintf(geometry->btrfs, sizeof(geometry->btrfs), " --sectorsize %u", block);
+    }
+    if (prepared != DEVICE_PREP_SKIPPED) {
+        size_t used = strlen(geometry->xfs);
+        snprintf(geometry->xfs + used, sizeof(geometry->xfs) - used, " -K");
+        used = strlen(geometry->btrfs);
+        snprintf(geometry->btrfs + used, sizeof(geometry->btrfs) - used, " --nodiscard");
+    }
+
+    if (alignment.grain > PTABLE_ALIGN_BYTES) {
+        snprintf(geometry->luks, sizeof(geometry->luks), " --align-payload=%llu",
+                 (unsigned long long)(alignment.grain / 512));
+        snprintf(geometry->lvm, sizeof(geometry->lvm), " --dataalignment %lluk",
+                 (unsigned long long)(alignment.grain / 1024));
+    }
+    log_info("Filesystem geometry for %s:%s%s%s%s%s", disk, geometry->ext, geometry->xfs, geometry->btrfs,
+             geometry->luks, geometry->lvm);
+}
+
+/* Adds the job(s) formatting device as type; returns the last one. */
+static int add_format_jobs(DiskJobGraph *graph, const FormatGeometry *geometry, const char *device, const char *type,
+                           const char *label)
 {
     const char *fs_label = (label && label[0]) ? label : "LIBERO";
     if (strcmp(type, "boot") == 0) {
-        return run_command("mkfs.ext2 -F -L %s %s", fs_label, device);
+        return disk_jobs_add(graph, "Format boot (ext2)", device, "mkfs.ext2 -F%s -L %s %s", geometry->ext, fs_label,
+                             device);
     }
     if (strcmp(type, "efi") == 0) {
-        return run_command("mkfs.vfat -F32 -n %s %s", fs_label, device);
+        return disk_jobs_add(graph, "Format EFI (vfat)", device, "mkfs.vfat -F32 -n %s %s", fs_label, device);
     }
     if (strcmp(type, "swap") == 0) {
-        if (run_command("mkswap -L %s %s", fs_label, device) != 0) {
-            return -1;
-        }
-        return run_command("swapon %s", device);
+        int mkswap = disk_jobs_add(graph, "Format swap", device, "mkswap -L %s %s", fs_label, device);
+        int swapon = disk_jobs_add(graph, "Enable swap", device, "swapon %s", device);
+        disk_jobs_after(graph, swapon, mkswap);
+        return swapon;
     }
+    graph->broken = true;
     return -1;
 }
 
-static int format_root(const InstallerState *state, const char *label)
+/* profile holds the options of the filesystem profile, see fs_profile.h. */
+static int add_root_format_job(DiskJobGraph *graph, const InstallerState *state, const FormatGeometry *geometry,
+                               const char *profile, const char *device, const char *label)
 {
-    const char *device = state->root_mapper[0] ? state->root_mapper : state->root_partition;
     const char *fs_label = (label && label[0]) ? label : LABEL_ROOT;
     switch (state->root_fs) {
     case FS_EXT4:
-        return run_command("mkfs.ext4 -F -L %s %s", fs_label, device);
+        return disk_jobs_add(graph, "Format root (ext4)", device, "mkfs.ext4 -F%s%s -L %s %s", geometry->ext,
+                             profile, fs_label, device);
     case FS_XFS:
-        return run_command("mkfs.xfs -f -L %s %s", fs_label, device);
+        return disk_jobs_add(graph, "Format root (xfs)", device, "mkfs.xfs -f%s%s -L %s %s", geometry->xfs,
+                             profile, fs_label, device);
     case FS_BTRFS:
-        return run_command("mkfs.btrfs -f -L %s %s", fs_label, device);
+        return disk_jobs_add(graph, "Format root (btrfs)", device, "mkfs.btrfs -f%s%s -L %s %s", geometry->btrfs,
+                             profile, fs_label, device);
     default:
+        graph->broken = true;
         return -1;
     }
 }
@@ -591,80 +748,150 @@ static int prompt_passphrase(char *buffer, size_t len)
     return 0;
 }
 
-static int handle_encryption(InstallerState *state)
+/* Asks for the passphrase up front, so no prompt interrupts the jobs, and
+ * stores it in key_file (a mkstemp template) for cryptsetup. */
+static int write_luks_key_file(char *key_file)
 {
-    if (!state->use_luks) {
-        snprintf(state->root_mapper, sizeof(state->root_mapper), "%s", state->root_partition);
-        return 0;
-    }
-
     char pass[128];
     if (prompt_passphrase(pass, sizeof(pass)) != 0) {
         return -1;
     }
 
-    char key_file[] = "/tmp/libero-luks.keyXXXXXX";
     int fd = mkstemp(key_file);
     if (fd < 0) {
+        memset(pass, 0, sizeof(pass));
         ui_message("Encryption", "Unable to create temporary key file.");
         return -1;
     }
     size_t pass_len = strlen(pass);
     ssize_t written = write(fd, pass, pass_len);
+    memset(pass, 0, sizeof(pass));
     if (written < 0 || (size_t)written != pass_len) {
         ui_message("Encryption", "Unable to write temporary key file.");
         close(fd);
         unlink(key_file);
-        memset(pass, 0, sizeof(pass));
         return -1;
     }
     close(fd);
     chmod(key_file, 0600);
-    memset(pass, 0, sizeof(pass));
+    return 0;
+}
 
-    int rc = run_command("cryptsetup luksFormat --type luks1 --batch-mode --key-file %s %s",
-                         key_file, state->root_partition);
-    if (rc == 0) {
-        rc = run_command("cryptsetup open --key-file %s %s %s",
-                         key_file, state->root_partition, state->luks_name);
-    }
-    unlink(key_file);
+/* luksFormat and open; returns the open job, whose mapping is mapper. */
+static int add_encryption_jobs(DiskJobGraph *graph, const InstallerState *state, const FormatGeometry *geometry,
+                               const LuksTuning *tuning, const char *key_file, char *mapper, size_t mapper_len)
+{
+    int format = disk_jobs_add(graph, "LUKS format root", state->root_partition,
+                               "cryptsetup luksFormat --batch-mode%s%s --key-file %s %s", tuning->format_options,
+                               geometry->luks, key_file, state->root_partition);
+    int open = disk_jobs_add(graph, "LUKS open root", state->root_partition, "cryptsetup open%s --key-file %s %s %s",
+                             tuning->open_options, key_file, state->root_partition, state->luks_name);
+    disk_jobs_after(graph, open, format);
+    snprintf(mapper, mapper_len, "/dev/mapper/%s", state->luks_name);
+    return open;
+}
 
-    if (rc != 0) {
-        return -1;
-    }
-    snprintf(state->root_mapper, sizeof(state->root_mapper), "/dev/mapper/%s", state->luks_name);
-    return 0;
+/* Volume group on pv with an optional swap volume and root taking the rest.
+ * LVM commands share one resource since they all rewrite the same metadata;
+ * root_job and swap_job are the lvcreate jobs of each volume. */
+static void add_lvm_jobs(DiskJobGraph *graph, const InstallerState *state, const FormatGeometry *geometry,
+                         const char *pv, int after, int *root_job, int *swap_job)
+{
+    int pvcreate = disk_jobs_add(graph, "LVM physical volume", pv, "pvcreate%s %s", geometry->lvm, pv);
+    disk_jobs_after(graph, pvcreate, after);
+    int vgcreate = disk_jobs_add(graph, "LVM volume group", NULL, "vgcreate %s %s", state->vg_name, pv);
+    disk_jobs_after(graph, vgcreate, pvcreate);
+    disk_jobs_set_resource(graph, pvcreate, "lvm");
+    disk_jobs_set_resource(graph, vgcreate, "lvm");
+
+    int last = vgcreate;
+    *swap_job = -1;
+    if (state->swap_size_mb > 0) {
+        *swap_job = disk_jobs_add(graph, "LVM swap volume", NULL, "lvcreate -n swap -L %ldM %s",
+                                  state->swap_size_mb, state->vg_name);
+        disk_jobs_after(graph, *swap_job, vgcreate);
+        disk_jobs_set_resource(graph, *swap_job, "lvm");
+        last = *swap_job;
+    }
+    /* 100%FREE has to see the swap volume already allocated. */
+    *root_job = disk_jobs_add(graph, "LVM root volume", NULL, "lvcreate -n root -l 100%%FREE %s", state->vg_name);
+    disk_jobs_after(graph, *root_job, last);
+    disk_jobs_set_resource(graph, *root_job, "lvm");
 }
 
-static int handle_lvm(InstallerState *state)
+/* Formats every partition and volume through one job graph: boot, EFI and
+ * swap partitions start at once, root follows LUKS and LVM where used. */
+static int prepare_filesystems(InstallerState *state, DevicePrepMethod prepared)
 {
-    if (!state->use_lvm) {
-        snprintf(state->root_mapper, sizeof(state->root_mapper), state->root_mapper[0] ? state->root_mapper : state->root_partition);
-        return 0;
+    static DiskJobGraph graph;
+    char key_file[] = "/tmp/libero-luks.keyXXXXXX";
+    if (state->use_luks && write_luks_key_file(key_file) != 0) {
+        return -1;
     }
 
-    const char *pv = state->root_mapper[0] ? state->root_mapper : state->root_partition;
-    if (run_command("pvcreate %s", pv) != 0) {
-        return -1;
+    fs_profile_resolve(state);
+    char profile_mkfs[64];
+    char profile_mount[128];
+    fs_profile_mkfs_options(state->fs_profile, state->root_fs, get_disk_size_mb(state->root_partition), profile_mkfs,
+                            sizeof(profile_mkfs));
+    fs_profile_mount_options(state->fs_profile, state->arch, state->root_fs, profile_mount, sizeof(profile_mount));
+    report_add("Filesystem", "%s root with the %s profile%s (%s): mkfs%s, mount %s", fs_to_string(state->root_fs),
+               fs_profile_to_string(state->fs_profile), state->fs_profile_pinned ? "" : " chosen for the hardware",
+               fs_profile_description(state->fs_profile), profile_mkfs[0] ? profile_mkfs : " defaults",
+               profile_mount);
+
+    FormatGeometry geometry;
+    plan_format_geometry(state->target_disk, prepared, fs_profile_eager_init(state->fs_profile), &geometry);
+    /* Without a separate /boot, GRUB has to unlock root itself. */
+    LuksTuning tuning;
+    if (state->use_luks) {
+        luks_tuning_plan(state->root_partition, !state->boot_partition[0], &tuning);
     }
-    if (run_command("vgcreate %s %s", state->vg_name, pv) != 0) {
-        return -1;
+
+    disk_jobs_init(&graph);
+    if (state->boot_partition[0]) {
+        add_format_jobs(&graph, &geometry, state->boot_partition, "boot", LABEL_BOOT);
+    }
+    if (state->efi_partition[0]) {
+        add_format_jobs(&graph, &geometry, state->efi_partition, "efi", LABEL_EFI);
+    }
+    char swap_device[PATH_MAX] = "";
+    if (!state->use_lvm && state->swap_partition[0] && state->swap_size_mb > 0) {
+        add_format_jobs(&graph, &geometry, state->swap_partition, "swap", LABEL_SWAP);
+        snprintf(swap_device, sizeof(swap_device), "%s", state->swap_partition);
     }
 
-    if (state->swap_size_mb > 0) {
-        if (run_command("lvcreate -n swap -L %ldM %s", state->swap_size_mb, state->vg_name) != 0) {
-            return -1;
+    char root_device[PATH_MAX];
+    snprintf(root_device, sizeof(root_device), "%s", state->root_partition);
+    int root_after = -1;
+    if (state->use_luks) {
+        root_after = add_encryption_jobs(&graph, state, &geometry, &tuning, key_file, root_device, sizeof(root_device));
+    }
+    if (state->use_lvm) {
+        int swap_volume = -1;
+        add_lvm_jobs(&graph, state, &geometry, root_device, root_after, &root_after, &swap_volume);
+        snprintf(root_device, sizeof(root_device), "/dev/%s/root", state->vg_name);
+        if (swap_volume >= 0) {
+            snprintf(swap_device, sizeof(swap_device), "/dev/%s/swap", state->vg_name);
+            int mkswap = disk_jobs_add(&graph, "Format swap", swap_device, "mkswap -L %s %s", LABEL_SWAP,
+                                       swap_device);
+            disk_jobs_after(&graph, mkswap, swap_volume);
+            int swapon = disk_jobs_add(&graph, "Enable swap", swap_device, "swapon %s", swap_device);
+            disk_jobs_after(&graph, swapon, mkswap);
         }
-        snprintf(state->swap_mapper, sizeof(state->swap_mapper), "/dev/%s/swap", state->vg_name);
-    } else {
-        state->swap_mapper[0] = '\0';
     }
+    int root_format = add_root_format_job(&graph, state, &geometry, profile_mkfs, root_device, LABEL_ROOT);
+    disk_jobs_after(&graph, root_format, root_after);
 
-    if (run_command("lvcreate -n root -l 100%%FREE %s", state->vg_name) != 0) {
+    int rc = disk_jobs_run(&graph, "Formatting");
+    if (state->use_luks) {
+        unlink(key_file);
+    }
+    if (rc != 0) {
         return -1;
     }
-    snprintf(state->root_mapper, sizeof(state->root_mapper), "/dev/%s/root", state->vg_name);
+    snprintf(state->root_mapper, sizeof(state->root_mapper), "%s", root_device);
+    snprintf(state->swap_mapper, sizeof(state->swap_mapper), "%s", swap_device);
     return 0;
 }
 
@@ -687,6 +914,10 @@ static int apply_partitioning(InstallerState *state)
         return -1;
     }
 
+    /* A prefetch resumed onto the old target would keep it busy. */
+    if (is_path_mounted(state->install_root)) {
+        prefetch_stop();
+    }
     if (deactivate_disk_usage(state->target_disk) != 0) {
         ui_message("Disk", "Unable to release the disk. Close any mounts or LVM/LUKS mappings and try again.");
         return -1;
@@ -695,21 +926,34 @@ static int apply_partitioning(InstallerState *state)
     if (run_command("/usr/sbin/wipefs -a %s", state->target_disk) != 0) {
         return -1;
     }
+    /* Done once for the whole disk, so mkfs can skip it per partition. */
+    DevicePrepMethod prepared = DEVICE_PREP_SKIPPED;
+    if (device_prepare(state->target_disk, &prepared) != 0) {
+        ui_message("Disk", "Unable to open the disk exclusively. Close anything still using it and try again.");
+        return -1;
+    }
 
     const bool use_gpt = (state->boot_mode == BOOTMODE_UEFI);
     const bool create_swap_partition = (!state->use_lvm && state->swap_size_mb > 0);
 
-    double consumed_mb = 1.0;
-    if (use_gpt) {
-        consumed_mb += 512.0;
-    }
-    consumed_mb += 512.0;
-    if (create_swap_partition) {
-        consumed_mb += state->swap_size_mb;
+    BlockTopology topology;
+    if (block_probe_topology(state->target_disk, &topology) != 0) {
+        ui_message("Partitioning", "Unable to read the disk topology.");
+        return -1;
     }
+    PartitionAlignment alignment;
+    partition_table_alignment(&topology, &alignment);
+    long grain_mb = (long)((alignment.grain + (1 << 20) - 1) >> 20);
 
-    double root_end = state->disk_size_mb - 8;
-    if (root_end <= consumed_mb + 128) {
+    const bool small_disk = state->disk_size_mb < SMALL_DISK_MB;
+    long efi_mb = aligned_size_mb(small_disk ? EFI_SIZE_SMALL_MB : EFI_SIZE_MB, grain_mb);
+    long boot_mb = aligned_size_mb(small_disk ? BOOT_SIZE_SMALL_MB : BOOT_SIZE_MB, grain_mb);
+    long swap_mb = create_swap_partition ? aligned_size_mb(state->swap_size_mb, grain_mb) : 0;
+
+    /* The first boundary, and the backup GPT plus the final partial
+     * boundary at the end. */
+    long consumed_mb = 2 * grain_mb + (use_gpt ? efi_mb + boot_mb : 0) + swap_mb;
+    if (state->disk_size_mb <= consumed_mb + 128) {
         ui_message("Partitioning", "Not enough space for root filesystem.");
         return -1;
     }
@@ -717,14 +961,17 @@ static int apply_partitioning(InstallerState *state)
     PartitionSpec plan[MAX_PARTITION_SPECS] = {0};
     size_t plan_count = 0;
     int next_part = 1;
+    char size_spec[32];
 
     if (use_gpt) {
-        if (!plan_add_partition(plan, &plan_count, next_part++, "efi", "+512M",
+        snprintf(size_spec, sizeof(size_spec), "+%ldM", efi_mb);
+        if (!plan_add_partition(plan, &plan_count, next_part++, "efi", size_spec,
                                 LABEL_EFI, GPT_TYPE_EFI, NULL)) {
             ui_message("Partitioning", "Unable to plan EFI partition.");
             return -1;
         }
-        if (!plan_add_partition(plan, &plan_count, next_part++, "boot", "+512M",
+        snprintf(size_spec, sizeof(size_spec), "+%ldM", boot_mb);
+        if (!plan_add_partition(plan, &plan_count, next_part++, "boot", size_spec,
                                 LABEL_BOOT, GPT_TYPE_LINUX, MBR_TYPE_LINUX)) {
             ui_message("Partitioning", "Unable to plan boot partition.");
             return -1;
@@ -735,9 +982,8 @@ static int apply_partitioning(InstallerState *state)
     }
 
     if (create_swap_partition) {
-        char swap_size[32];
-        snprintf(swap_size, sizeof(swap_size), "+%ldM", state->swap_size_mb);
-        if (!plan_add_partition(plan, &plan_count, next_part++, "swap", swap_size,
+        snprintf(size_spec, sizeof(size_spec), "+%ldM", swap_mb);
+        if (!plan_add_partition(plan, &plan_count, next_part++, "swap", size_spec,
                                 LABEL_SWAP, GPT_TYPE_SWAP, MBR_TYPE_SWAP)) {
             ui_message("Partitioning", "Unable to plan swap partition.");
             return -1;
@@ -746,47 +992,55 @@ static int apply_partitioning(InstallerState *state)
         state->swap_partition[0] = '\0';
     }
 
+    /* Root takes the rest, up to the last alignment boundary. */
     const char *root_gpt = state->use_lvm ? GPT_TYPE_LVM : GPT_TYPE_LINUX;
     const char *root_mbr = state->use_lvm ? MBR_TYPE_LVM : MBR_TYPE_LINUX;
-    if (!plan_add_partition(plan, &plan_count, next_part++, "root", "-8M",
+    if (!plan_add_partition(plan, &plan_count, next_part++, "root", "",
                             LABEL_ROOT, root_gpt, root_mbr)) {
         ui_message("Partitioning", "Unable to plan root partition.");
         return -1;
     }
 
-    char summary[1024];
-    summarize_partition_plan(state->target_disk, state->disk_size_mb, plan, plan_count, summary, sizeof(summary));
-    ui_message("Partition Layout", summary);
-
-    char script_path[] = "/tmp/libero-fdiskXXXXXX";
-    int script_fd = mkstemp(script_path);
-    if (script_fd < 0) {
-        ui_message("Partitioning", "Unable to create script file for fdisk.");
-        return -1;
+    /* Resolve the plan once up front so the summary shows real offsets. */
+    PartitionTable preview;
+    unsigned sector_size = 0;
+    uint64_t total_sectors = 0;
+    int disk_fd = open(state->target_disk, O_RDONLY | O_CLOEXEC);
+    bool planned = disk_fd >= 0 && partition_table_geometry(disk_fd, &sector_size, &total_sectors) == 0 &&
+                   partition_table_build(&preview, use_gpt, sector_size, total_sectors, &alignment, plan,
+                                         plan_count) == 0;
+    if (disk_fd >= 0) {
+        close(disk_fd);
     }
-    for (size_t i = 0; i < plan_count; ++i) {
-        PartitionSpec *spec = &plan[i];
-        dprintf(script_fd, "n\n");
-        if (state->boot_mode == BOOTMODE_LEGACY) {
-            dprintf(script_fd, "p\n");
-        }
-        dprintf(script_fd, "%d\n\n%s\n", spec->part_number, spec->size_spec[0] ? spec->size_spec : "");
+    if (!planned) {
+        ui_message("Partitioning", "The planned layout does not fit the disk. Check the log for details.");
+        return -1;
     }
+
+    char summary[2048];
+    summarize_partition_plan(state->target_disk, state->disk_size_mb, &topology, &preview, plan, plan_count,
+                             summary, sizeof(summary));
+    ui_message("Partition Layout", summary);
+
+    /* Some BIOSes will not boot an MBR disk without an active partition. */
     if (state->boot_mode == BOOTMODE_LEGACY) {
         PartitionSpec *boot_spec = find_partition_spec(plan, plan_count, "boot");
+        if (!boot_spec) {
+            boot_spec = find_partition_spec(plan, plan_count, "root");
+        }
         if (boot_spec) {
-            dprintf(script_fd, "a\n%d\n", boot_spec->part_number);
+            boot_spec->bootable = true;
         }
     }
-    dprintf(script_fd, "w\n");
-    close(script_fd);
 
-    if (run_command("/usr/sbin/fdisk %s < %s", state->target_disk, script_path) != 0) {
-        unlink(script_path);
-        ui_message("Partitioning", "fdisk failed to apply the partition layout.");
+    /* Subscribe before the table changes so no add event slips past. */
+    UeventMonitor monitor;
+    uevent_monitor_open(&monitor);
+    if (partition_table_apply(state->target_disk, use_gpt, &alignment, plan, plan_count) != 0) {
+        uevent_monitor_close(&monitor);
+        ui_message("Partitioning", "Unable to write the partition table. Check the log for details.");
         return -1;
     }
-    unlink(script_path);
 
     for (size_t i = 0; i < plan_count; ++i) {
         PartitionSpec *spec = &plan[i];
@@ -794,6 +1048,7 @@ static int apply_partitioning(InstallerState *state)
         int written = snprintf(spec->device, sizeof(spec->device), "%s%s%d",
                                state->target_disk, suffix, spec->part_number);
         if (written < 0 || written >= (int)sizeof(spec->device)) {
+            uevent_monitor_close(&monitor);
             ui_message("Partitioning", "Generated partition path is too long.");
             return -1;
         }
@@ -808,55 +1063,20 @@ static int apply_partitioning(InstallerState *state)
         }
     }
 
+    const char *nodes[MAX_PARTITION_SPECS];
     for (size_t i = 0; i < plan_count; ++i) {
-        PartitionSpec *spec = &plan[i];
-        const char *type = use_gpt ? spec->gpt_type : spec->mbr_type;
-        if (type && type[0]) {
-            if (run_command("sfdisk --part-type %s %d %s", state->target_disk, spec->part_number, type) != 0) {
-                ui_message("Partitioning", "Unable to set partition type.");
-                return -1;
-            }
-        }
+        nodes[i] = plan[i].device;
     }
-
-    if (run_command("partprobe %s", state->target_disk) != 0) {
+    int ready = uevent_wait_for_devices(&monitor, nodes, (int)plan_count, UEVENT_DEVICE_TIMEOUT_MS);
+    uevent_monitor_close(&monitor);
+    if (ready != 0) {
+        ui_message("Partitioning", "The new partitions did not appear in /dev. Check the log for details.");
         return -1;
     }
 
-    if (state->boot_partition[0]) {
-        if (format_partition(state->boot_partition, "boot", LABEL_BOOT) != 0) {
-            return -1;
-        }
-    }
-    if (state->efi_partition[0]) {
-        if (format_partition(state->efi_partition, "efi", LABEL_EFI) != 0) {
-            return -1;
-        }
-    }
-
-    if (handle_encryption(state) != 0) {
-        return -1;
-    }
-    if (handle_lvm(state) != 0) {
+    if (prepare_filesystems(state, prepared) != 0) {
         return -1;
     }
-    if (format_root(state, LABEL_ROOT) != 0) {
-        return -1;
-    }
-
-    if (!state->use_lvm && state->swap_partition[0] && state->swap_size_mb > 0) {
-        if (format_partition(state->swap_partition, "swap", LABEL_SWAP) != 0) {
-            return -1;
-        }
-        snprintf(state->swap_mapper, sizeof(state->swap_mapper), "%s", state->swap_partition);
-    } else if (state->use_lvm && state->swap_mapper[0]) {
-        if (run_command("mkswap -L %s %s", LABEL_SWAP, state->swap_mapper) != 0) {
-            return -1;
-        }
-        if (run_command("swapon %s", state->swap_mapper) != 0) {
-            return -1;
-        }
-    }
 
     state->disk_prepared = false;
 
@@ -873,10 +1093,11 @@ int disk_workflow(InstallerState *state)
         const char *disk_value = state->target_disk[0] ? state->target_disk : "<not set>";
         copy_with_ellipsis(disk_display, sizeof(disk_display), disk_value);
         snprintf(subtitle, sizeof(subtitle),
-                 "Disk: %s | Mode: %s | FS: %s | Swap: %ld MB | LUKS: %s | LVM: %s",
+                 "Disk: %s | Mode: %s | FS: %s (%s) | Swap: %ld MB | LUKS: %s | LVM: %s",
                  disk_display,
                  boot_mode_to_string(state->boot_mode),
                  fs_to_string(state->root_fs),
+                 state->fs_profile_pinned ? fs_profile_to_string(state->fs_profile) : "auto",
                  state->swap_size_mb,
                  state->use_luks ? "On" : "Off",
                  state->use_lvm ? "On" : "Off");
@@ -885,6 +1106,7 @@ int disk_workflow(InstallerState *state)
             "Select target disk",
             "Select boot mode",
             "Select root filesystem",
+            "Select filesystem profile",
             "Configure swap size",
             "Toggle LUKS encryption",
             "Toggle LVM support",
@@ -893,8 +1115,8 @@ int disk_workflow(InstallerState *state)
             "Back to main menu",
         };
 
-        int choice = ui_menu("Disk Preparation", subtitle, items, 9, 0);
-        if (choice < 0 || choice == 8) {
+        int choice = ui_menu("Disk Preparation", subtitle, items, 10, 0);
+        if (choice < 0 || choice == 9) {
             return 0;
         }
 
@@ -909,18 +1131,21 @@ int disk_workflow(InstallerState *state)
             choose_root_fs(state);
             break;
         case 3:
-            configure_swap(state);
+            choose_fs_profile(state);
             break;
         case 4:
-            state->use_luks = !state->use_luks;
+            configure_swap(state);
             break;
         case 5:
-            state->use_lvm = !state->use_lvm;
+            state->use_luks = !state->use_luks;
             break;
         case 6:
-            apply_partitioning(state);
+            state->use_lvm = !state->use_lvm;
             break;
         case 7:
+            apply_partitioning(state);
+            break;
+        case 8:
             disk_mount_targets(state);
             break;
         default:
@@ -929,6 +1154,41 @@ int disk_workflow(InstallerState *state)
     }
 }
 
+/* Creates the root and /home subvolumes on first use, then mounts them
+ * in place of the top level. */
+static int mount_btrfs_subvolumes(const InstallerState *state, const char *device, const char *options)
+{
+    static const char *const subvolumes[] = {FS_PROFILE_BTRFS_ROOT_SUBVOL, FS_PROFILE_BTRFS_HOME_SUBVOL};
+    if (mount_fs(device, state->install_root, "btrfs", "noatime") != 0) {
+        return -1;
+    }
+    for (size_t i = 0; i < sizeof(subvolumes) / sizeof(subvolumes[0]); ++i) {
+        char path[PATH_MAX + 16];
+        snprintf(path, sizeof(path), "%s/%s", state->install_root, subvolumes[i]);
+        if (access(path, F_OK) != 0 && run_command("btrfs subvolume create %s", path) != 0) {
+            umount_path(state->install_root);
+            return -1;
+        }
+    }
+    if (umount_path(state->install_root) != 0) {
+        return -1;
+    }
+
+    char subvol_options[192];
+    snprintf(subvol_options, sizeof(subvol_options), "subvol=%s,%s", FS_PROFILE_BTRFS_ROOT_SUBVOL, options);
+    if (mount_fs(device, state->install_root, "btrfs", subvol_options) != 0) {
+        return -1;
+    }
+    char home[PATH_MAX + 8];
+    snprintf(home, sizeof(home), "%s/home", state->install_root);
+    snprintf(subvol_options, sizeof(subvol_options), "subvol=%s,%s", FS_PROFILE_BTRFS_HOME_SUBVOL, options);
+    if (mount_fs(device, home, "btrfs", subvol_options) != 0) {
+        umount_path(state->install_root);
+        return -1;
+    }
+    return 0;
+}
+
 int disk_mount_targets(InstallerState *state)
 {
     if (!state) {
@@ -963,13 +1223,22 @@ int disk_mount_targets(InstallerState *state)
              root_device, state->install_root, fs_to_string(state->root_fs));
     log_fs_probe(root_device);
 
-    if (mount_fs(root_device, state->install_root, fs_to_string(state->root_fs), "") != 0) {
+    fs_profile_resolve(state);
+    char options[128];
+    fs_profile_mount_options(state->fs_profile, state->arch, state->root_fs, options, sizeof(options));
+    int mounted = state->root_fs == FS_BTRFS ? mount_btrfs_subvolumes(state, root_device, options)
+                                             : mount_fs(root_device, state->install_root, fs_to_string(state->root_fs),
+                                                        options);
+    if (mounted != 0) {
         ui_message("Mount", "Failed to mount the root partition. Check the log for details.");
         return -1;
     }
 
     state->disk_prepared = true;
 
+    /* Nothing may write to the staged files while they move. */
+    prefetch_stop();
+
     char old_stage3[PATH_MAX];
     char old_digest[PATH_MAX];
     char old_portage[PATH_MAX];
@@ -986,6 +1255,8 @@ int disk_mount_targets(InstallerState *state)
             migrate_cache_file(old_portage, state->portage_local);
         }
     }
+    /* A prefetch cut short carries on straight onto the target disk. */
+    bootstrap_prefetch(state);
 
     log_info("Mounted root device %s on %s", root_device, state->install_root);
     ui_message("Mount", "Root partition mounted at the install root.");
@@ -0,0 +1,324 @@
+#include "disk_jobs.h"
+
+#include <poll.h>
+#include <signal.h>
+#include <sys/wait.h>
+
+#include "log.h"
+#include "ui.h"
+#include "uevent.h"
+
+/* Screen refresh interval while jobs run. */
+#define DISK_JOBS_TICK_MS 120
+
+static long long monotonic_ms(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (long long)ts.tv_sec * 1000 + ts.tv_nsec / 1000000;
+}
+
+void disk_jobs_init(DiskJobGraph *graph)
+{
+    memset(graph, 0, sizeof(*graph));
+}
+
+int disk_jobs_add(DiskJobGraph *graph, const char *label, const char *device, const char *fmt, ...)
+{
+    if (graph->count >= DISK_JOBS_MAX) {
+        log_error("Disk job graph is full; cannot add '%s'", label);
+        graph->broken = true;
+        return -1;
+    }
+    DiskJob *job = &graph->jobs[graph->count];
+    memset(job, 0, sizeof(*job));
+    va_list args;
+    va_start(args, fmt);
+    int written = vsnprintf(job->command, sizeof(job->command), fmt, args);
+    va_end(args);
+    if (written < 0 || written >= (int)sizeof(job->command)) {
+        log_error("Command for disk job '%s' is too long", label);
+        graph->broken = true;
+        return -1;
+    }
+    snprintf(job->label, sizeof(job->label), "%s", label);
+    snprintf(job->device, sizeof(job->device), "%s", device ? device : "");
+    snprintf(job->resource, sizeof(job->resource), "%s", device ? device : "");
+    job->spawned.pid = -1;
+    job->spawned.watcher = -1;
+    job->spawned.watcher_stop = -1;
+    job->spawned.progress_fd = -1;
+    return graph->count++;
+}
+
+int disk_jobs_after(DiskJobGraph *graph, int job, int dependency)
+{
+    if (dependency < 0) {
+        return 0;
+    }
+    if (job < 0 || job >= graph->count || dependency >= job || graph->jobs[job].dep_count >= DISK_JOB_MAX_DEPS) {
+        log_error("Invalid disk job dependency %d -> %d", job, dependency);
+        graph->broken = true;
+        return -1;
+    }
+    DiskJob *entry = &graph->jobs[job];
+    entry->deps[entry->dep_count++] = dependency;
+    return 0;
+}
+
+int disk_jobs_set_resource(DiskJobGraph *graph, int job, const char *resource)
+{
+    if (job < 0 || job >= graph->count) {
+        graph->broken = true;
+        return -1;
+    }
+    snprintf(graph->jobs[job].resource, sizeof(graph->jobs[job].resource), "%s", resource ? resource : "");
+    return 0;
+}
+
+static bool is_block_node(const char *path)
+{
+    struct stat st;
+    return stat(path, &st) == 0 && S_ISBLK(st.st_mode);
+}
+
+/* DISK_JOB_DONE when every dependency succeeded, DISK_JOB_SKIPPED when one
+ * did not, DISK_JOB_WAITING otherwise. */
+static DiskJobState dependency_state(const DiskJobGraph *graph, const DiskJob *job)
+{
+    DiskJobState result = DISK_JOB_DONE;
+    for (int i = 0; i < job->dep_count; ++i) {
+        DiskJobState state = graph->jobs[job->deps[i]].state;
+        if (state == DISK_JOB_FAILED || state == DISK_JOB_SKIPPED) {
+            return DISK_JOB_SKIPPED;
+        }
+        if (state != DISK_JOB_DONE) {
+            result = DISK_JOB_WAITING;
+        }
+    }
+    return result;
+}
+
+static bool resource_busy(const DiskJobGraph *graph, const DiskJob *job)
+{
+    if (!job->resource[0]) {
+        return false;
+    }
+    for (int i = 0; i < graph->count; ++i) {
+        const DiskJob *other = &graph->jobs[i];
+        if (other != job && other->state == DISK_JOB_RUNNING && strcmp(other->resource, job->resource) == 0) {
+            return true;
+        }
+    }
+    return false;
+}
+
+static void start_job(DiskJob *job, long long now)
+{
+    job->started_ms = now;
+    progress_init(&job->progress, NULL);
+    if (spawn_command_on_device(job->device[0] ? job->device : NULL, job->command, &job->spawned) != 0) {
+        job->state = DISK_JOB_FAILED;
+        job->exit_code = -1;
+        job->finished_ms = now;
+        return;
+    }
+    job->state = DISK_JOB_RUNNING;
+}
+
+/* Starts whatever can start; returns the number of jobs still waiting. Once
+ * anything failed, jobs that have not started are skipped. */
+static int schedule(DiskJobGraph *graph, bool *failed, long long now)
+{
+    int waiting = 0;
+    for (int i = 0; i < graph->count; ++i) {
+        DiskJob *job = &graph->jobs[i];
+        if (job->state != DISK_JOB_WAITING) {
+            continue;
+        }
+        DiskJobState deps = dependency_state(graph, job);
+        if (deps == DISK_JOB_SKIPPED || (*failed && deps == DISK_JOB_DONE)) {
+            job->state = DISK_JOB_SKIPPED;
+            continue;
+        }
+        ++waiting;
+        if (deps != DISK_JOB_DONE || resource_busy(graph, job)) {
+            continue;
+        }
+        if (job->ready_ms == 0) {
+            job->ready_ms = now;
+        }
+        if (job->device[0] && !is_block_node(job->device)) {
+            if (now - job->ready_ms >= UEVENT_DEVICE_TIMEOUT_MS) {
+                log_error("Disk job '%s': %s did not appear within %d ms", job->label, job->device,
+                          UEVENT_DEVICE_TIMEOUT_MS);
+                job->state = DISK_JOB_FAILED;
+                job->exit_code = -1;
+                job->finished_ms = now;
+                *failed = true;
+                --waiting;
+            }
+            continue;
+        }
+        start_job(job, now);
+        *failed |= job->state == DISK_JOB_FAILED;
+        --waiting;
+    }
+    return waiting;
+}
+
+/* Returns true when a running job finished and failed. */
+static bool collect(DiskJobGraph *graph, long long now)
+{
+    bool failed = false;
+    for (int i = 0; i < graph->count; ++i) {
+        DiskJob *job = &graph->jobs[i];
+        if (job->state != DISK_JOB_RUNNING) {
+            continue;
+        }
+        if (job->spawned.progress_fd >= 0 && progress_read(&job->progress, job->spawned.progress_fd) != 0) {
+            close(job->spawned.progress_fd);
+            job->spawned.progress_fd = -1;
+        }
+        progress_update(&job->progress, -1, -1, -1, -1);
+
+        int status = 0;
+        pid_t res = waitpid(job->spawned.pid, &status, WNOHANG);
+        if (res == 0 || (res < 0 && errno == EINTR)) {
+            continue;
+        }
+        job->finished_ms = now;
+        if (res < 0) {
+            log_error("Lost track of disk job '%s': %s", job->label, strerror(errno));
+            spawned_command_finish(&job->spawned, 0);
+            job->exit_code = -1;
+        } else {
+            job->exit_code = spawned_command_finish(&job->spawned, status);
+        }
+        if (job->exit_code == 0) {
+            job->state = DISK_JOB_DONE;
+            log_info("Disk job '%s' finished in %.1f s", job->label, (now - job->started_ms) / 1000.0);
+        } else {
+            job->state = DISK_JOB_FAILED;
+            failed = true;
+        }
+    }
+    return failed;
+}
+
+static void draw(const DiskJobGraph *graph, const char *title)
+{
+    static const char *names[] = {"waiting", "running", "done", "failed", "skipped"};
+    UiJobRow rows[DISK_JOBS_MAX];
+    char details[DISK_JOBS_MAX][96];
+    int running = 0;
+    for (int i = 0; i < graph->count; ++i) {
+        const DiskJob *job = &graph->jobs[i];
+        rows[i].label = job->label;
+        rows[i].state = names[job->state];
+        rows[i].detail = details[i];
+        rows[i].percent = -1;
+        details[i][0] = '\0';
+        switch (job->state) {
+        case DISK_JOB_WAITING:
+            if (job->ready_ms > 0 && job->device[0]) {
+                snprintf(details[i], sizeof(details[i]), "waiting for %.*s", (int)sizeof(details[i]) - 13,
+                         job->device);
+            }
+            break;
+        case DISK_JOB_RUNNING:
+            ++running;
+            progress_describe(&job->progress, details[i], sizeof(details[i]));
+            rows[i].percent = progress_percent(&job->progress);
+            break;
+        case DISK_JOB_DONE:
+            rows[i].percent = 100;
+            snprintf(details[i], sizeof(details[i]), "%.1f s", (job->finished_ms - job->started_ms) / 1000.0);
+            break;
+        case DISK_JOB_FAILED:
+            if (job->exit_code > 0) {
+                snprintf(details[i], sizeof(details[i]), "exit %d", job->exit_code);
+            } else {
+                snprintf(details[i], sizeof(details[i]), "see log");
+            }
+            break;
+        default:
+            break;
+        }
+    }
+    char message[64];
+    snprintf(message, sizeof(message), "Preparing disks: %d job%s running", running, running == 1 ? "" : "s");
+    ui_job_status(title, message, rows, graph->count);
+}
+
+int disk_jobs_run(DiskJobGraph *graph, const char *title)
+{
+    if (graph->broken) {
+        ui_error("Disk Preparation", "Unable to plan the disk preparation steps. Check the log for details.");
+        return -1;
+    }
+
+    /* Jobs such as cryptsetup open create the node a later job needs. */
+    UeventMonitor monitor;
+    uevent_monitor_open(&monitor);
+
+    const long long started = monotonic_ms();
+    bool failed = false;
+    for (;;) {
+        long long now = monotonic_ms();
+        failed |= collect(graph, now);
+        int waiting = schedule(graph, &failed, now);
+
+        struct pollfd fds[DISK_JOBS_MAX + 1];
+        int nfds = 0;
+        int running = 0;
+        for (int i = 0; i < graph->count; ++i) {
+            if (graph->jobs[i].state == DISK_JOB_RUNNING) {
+                ++running;
+                if (graph->jobs[i].spawned.progress_fd >= 0) {
+                    fds[nfds++] = (struct pollfd){.fd = graph->jobs[i].spawned.progress_fd, .events = POLLIN};
+                }
+            }
+        }
+        draw(graph, title);
+        if (running == 0 && waiting == 0) {
+            break;
+        }
+        if (monitor.fd >= 0) {
+            fds[nfds++] = (struct pollfd){.fd = monitor.fd, .events = POLLIN};
+        }
+        if (poll(fds, (nfds_t)nfds, DISK_JOBS_TICK_MS) > 0 && monitor.fd >= 0) {
+            UeventMessage message;
+            while (uevent_monitor_read(&monitor, &message) > 0) {
+            }
+        }
+    }
+    uevent_monitor_close(&monitor);
+
+    long long serial = 0;
+    const DiskJob *first_failure = NULL;
+    for (int i = 0; i < graph->count; ++i) {
+        const DiskJob *job = &graph->jobs[i];
+        if (job->started_ms > 0 && job->finished_ms > 0) {
+            serial += job->finished_ms - job->started_ms;
+        }
+        if (job->state == DISK_JOB_FAILED && !first_failure) {
+            first_failure = job;
+        }
+    }
+    log_info("Disk preparation: %d jobs in %.1f s (%.1f s of job time)", graph->count,
+             (monotonic_ms() - started) / 1000.0, serial / 1000.0);
+
+    if (first_failure) {
+        char message[256];
+        if (first_failure->exit_code > 0) {
+            snprintf(message, sizeof(message), "%s failed (exit %d). See log: %s", first_failure->label,
+                     first_failure->exit_code, log_get_path());
+        } else {
+            snprintf(message, sizeof(message), "%s failed. See log: %s", first_failure->label, log_get_path());
+        }
+        ui_error("Disk Preparation", message);
+        return -1;
+    }
+    return 0;
+}
@@ -0,0 +1,1206 @@
+#include "fetch.h"
+
+#include <fcntl.h>
+#include <poll.h>
+#include <signal.h>
+#include <sys/wait.h>
+
+#include "bandwidth.h"
+#include "hash.h"
+#include "log.h"
+#include "progress.h"
+#include "system_utils.h"
+#include "ui.h"
+
+#define FETCH_SEGMENT_RETRIES 3
+#define FETCH_READ_CHUNK (64 * 1024)
+#define FETCH_PROGRESS_INTERVAL_MS 200
+#define FETCH_BACKOFF_BASE_MS 2000
+#define FETCH_BACKOFF_MAX_MS 60000
+#define FETCH_SLOW_CHECK_MS 3000
+#define FETCH_SLOW_RATIO 4
+#define FETCH_PROBE_CACHE 16
+
+typedef struct {
+    long long start;   /* first byte of the range */
+    long long end;     /* last byte of the range, -1 when the length is unknown */
+    long long offset;  /* next byte to be written */
+    pid_t pid;
+    int fd;
+    int attempts;
+    bool done;
+    int source;             /* index into FetchJob.sources */
+    long long window_start; /* throughput window used to spot slow mirrors */
+    long long window_bytes;
+    HashContext chunk_hash; /* running hash of the chunk being written */
+} FetchSegment;
+
+/* One mirror serving the artifact. Failing or slow mirrors are demoted for an
+ * exponentially growing period and only used again once it expires, or when
+ * no healthy mirror is left. */
+typedef struct {
+    const char *url;
+    char quoted[REMOTE_URL_MAX * 2];
+    int failures;
+    long long demoted_until;
+    long long bytes;
+    double rate; /* best throughput seen from this mirror, bytes per second */
+} FetchSource;
+
+/* Per-download record of completed chunks. Lines are appended as chunks
+ * finish, so a torn write can at worst lose the last entry; every listed
+ * chunk is re-hashed before it is trusted again. */
+typedef struct {
+    int fd;
+    HashAlgorithm algorithm;
+    long long chunk_size;
+    long long total;
+    long long chunk_count;
+    bool *have;
+    char (*hex)[HASH_MAX_HEX];
+} FetchManifest;
+
+typedef struct {
+    const char *url;
+    FetchSource *sources;
+    int source_count;
+    int max_attempts;
+    int out_fd;
+    FetchSink sink;
+    void *sink_ctx;
+    FetchManifest *manifest; /* NULL when the transfer cannot be resumed */
+    FetchSegment *segs;
+    int count;
+    int parallel;
+    long long total;
+    long long received;
+    int flow; /* bandwidth scheduler handle, -1 when unthrottled */
+    ProgressState progress;
+} FetchJob;
+
+/* Probe results are kept for the life of the process, so the files fetched
+ * again and again (digests, metadata, retries) pay the round trip once. */
+typedef struct {
+    char url[REMOTE_URL_MAX];
+    int rc;
+    FetchProbe probe;
+} ProbeCacheEntry;
+
+static ProbeCacheEntry probe_cache[FETCH_PROBE_CACHE];
+static int probe_cache_next;
+
+static long long monotonic_ms(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (long long)ts.tv_sec * 1000LL + ts.tv_nsec / 1000000L;
+}
+
+static const char *url_basename(const char *url)
+{
+    const char *slash = strrchr(url, '/');
+    return (slash && slash[1]) ? slash + 1 : url;
+}
+
+static int write_at(int fd, const char *buffer, size_t len, long long offset)
+{
+    while (len > 0) {
+        ssize_t written = pwrite(fd, buffer, len, (off_t)offset);
+        if (written < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            return -1;
+        }
+        buffer += written;
+        len -= (size_t)written;
+        offset += written;
+    }
+    return 0;
+}
+
+static int probe_url(const char *url, FetchProbe *probe)
+{
+    probe->content_length = -1;
+    probe->accepts_ranges = false;
+    probe->validator[0] = '\0';
+
+    char quoted[REMOTE_URL_MAX * 2];
+    if (shell_escape_single_quotes(url, quoted, sizeof(quoted)) != 0) {
+        return -1;
+    }
+    char cmd[MAX_CMD_LEN];
+    if (snprintf(cmd, sizeof(cmd), "wget --spider -S --tries=2 --timeout=20 '%s' 2>&1", quoted) >= (int)sizeof(cmd)) {
+        return -1;
+    }
+
+    FILE *pipe = popen(cmd, "r");
+    if (!pipe) {
+        log_error("popen failed for command '%s': %s", cmd, strerror(errno));
+        return -1;
+    }
+
+    bool seen_response = false;
+    bool have_etag = false;
+    char line[1024];
+    while (fgets(line, sizeof(line), pipe)) {
+        const char *p = line;
+        while (*p == ' ' || *p == '\t') {
+            ++p;
+        }
+        if (strncmp(p, "HTTP/", 5) == 0) {
+            /* Each redirect hop starts a new header block; keep the last one. */
+            seen_response = true;
+            probe->content_length = -1;
+            probe->accepts_ranges = false;
+            probe->validator[0] = '\0';
+            have_etag = false;
+        } else if (strncasecmp(p, "Content-Length:", 15) == 0) {
+            probe->content_length = strtoll(p + 15, NULL, 10);
+        } else if (strncasecmp(p, "Accept-Ranges:", 14) == 0) {
+            probe->accepts_ranges = strcasestr(p + 14, "bytes") != NULL;
+        } else if (strncasecmp(p, "ETag:", 5) == 0 ||
+                   (!have_etag && strncasecmp(p, "Last-Modified:", 14) == 0)) {
+            have_etag = have_etag || tolower((unsigned char)p[0]) == 'e';
+            const char *value = strchr(p, ':') + 1;
+            while (*value == ' ') {
+                ++value;
+            }
+            snprintf(probe->validator, sizeof(probe->validator), "%s", value);
+            probe->validator[strcspn(probe->validator, "\r\n")] = '\0';
+        }
+    }
+
+    int status = pclose(pipe);
+    if (status != 0 || !seen_response) {
+        log_error("Unable to probe %s (status %d)", url, status);
+        return -1;
+    }
+    log_info("Probe %s: length=%lld ranges=%s", url, probe->content_length,
+             probe->accepts_ranges ? "yes" : "no");
+    return 0;
+}
+
+int fetch_probe(const char *url, FetchProbe *probe)
+{
+    if (!url || !url[0] || !probe || strlen(url) >= REMOTE_URL_MAX) {
+        return -1;
+    }
+    for (int i = 0; i < FETCH_PROBE_CACHE; ++i) {
+        if (strcmp(probe_cache[i].url, url) == 0) {
+            *probe = probe_cache[i].probe;
+            return probe_cache[i].rc;
+        }
+    }
+    int rc = probe_url(url, probe);
+    ProbeCacheEntry *entry = &probe_cache[probe_cache_next];
+    probe_cache_next = (probe_cache_next + 1) % FETCH_PROBE_CACHE;
+    snprintf(entry->url, sizeof(entry->url), "%s", url);
+    entry->rc = rc;
+    entry->probe = *probe;
+    return rc;
+}
+
+/* Drops cached probes after a failed transfer: the mirror may have been
+ * down, or the file replaced by a new release of a different size. */
+static void probe_forget(const char *const *urls, int url_count)
+{
+    for (int i = 0; i < url_count; ++i) {
+        for (int j = 0; urls[i] && j < FETCH_PROBE_CACHE; ++j) {
+            if (strcmp(probe_cache[j].url, urls[i]) == 0) {
+                probe_cache[j].url[0] = '\0';
+            }
+        }
+    }
+}
+
+static void copy_header_value(const char *line, char *out, size_t len)
+{
+    const char *value = strchr(line, ':') + 1;
+    while (*value == ' ') {
+        ++value;
+    }
+    snprintf(out, len, "%s", value);
+    out[strcspn(out, "\r\n")] = '\0';
+}
+
+/* Revalidates a small file with If-None-Match / If-Modified-Since. Returns 0
+ * when destination was replaced and validators refreshed, 1 when the server
+ * answered 304 Not Modified (destination untouched), -1 on failure. */
+int fetch_conditional(const char *url, const char *destination, FetchValidators *validators)
+{
+    if (!url || !url[0] || !destination || !validators) {
+        return -1;
+    }
+
+    char temp[PATH_MAX];
+    char quoted_url[REMOTE_URL_MAX * 2];
+    char quoted_temp[PATH_MAX * 2];
+    char quoted_etag[sizeof(validators->etag) * 2];
+    char quoted_since[sizeof(validators->last_modified) * 2];
+    if (snprintf(temp, sizeof(temp), "%s.tmp", destination) >= (int)sizeof(temp) ||
+        shell_escape_single_quotes(url, quoted_url, sizeof(quoted_url)) != 0 ||
+        shell_escape_single_quotes(temp, quoted_temp, sizeof(quoted_temp)) != 0 ||
+        shell_escape_single_quotes(validators->etag, quoted_etag, sizeof(quoted_etag)) != 0 ||
+        shell_escape_single_quotes(validators->last_modified, quoted_since, sizeof(quoted_since)) != 0) {
+        return -1;
+    }
+
+    char if_none_match[sizeof(quoted_etag) + 32] = "";
+    char if_modified_since[sizeof(quoted_since) + 40] = "";
+    if (validators->etag[0]) {
+        snprintf(if_none_match, sizeof(if_none_match), "--header='If-None-Match: %s'", quoted_etag);
+    }
+    if (validators->last_modified[0]) {
+        snprintf(if_modified_since, sizeof(if_modified_since), "--header='If-Modified-Since: %s'", quoted_since);
+    }
+    char cmd[MAX_CMD_LEN];
+    if (snprintf(cmd, sizeof(cmd), "wget -S --tries=2 --timeout=20 -O '%s' %s %s '%s' 2>&1", quoted_temp,
+                 if_none_match, if_modified_since, quoted_url) >= (int)sizeof(cmd)) {
+        return -1;
+    }
+
+    FILE *pipe = popen(cmd, "r");
+    if (!pipe) {
+        log_error("popen failed for command '%s': %s", cmd, strerror(errno));
+        return -1;
+    }
+    int code = 0;
+    FetchValidators fresh = {{0}, {0}};
+    char line[1024];
+    while (fgets(line, sizeof(line), pipe)) {
+        const char *p = line;
+        while (*p == ' ' || *p == '\t') {
+            ++p;
+        }
+        if (strncmp(p, "HTTP/", 5) == 0) {
+            /* Keep only the final hop of a redirect chain. */
+            code = 0;
+            sscanf(p, "HTTP/%*s %d", &code);
+            fresh.etag[0] = '\0';
+            fresh.last_modified[0] = '\0';
+        } else if (strncasecmp(p, "ETag:", 5) == 0) {
+            copy_header_value(p, fresh.etag, sizeof(fresh.etag));
+        } else if (strncasecmp(p, "Last-Modified:", 14) == 0) {
+            copy_header_value(p, fresh.last_modified, sizeof(fresh.last_modified));
+        }
+    }
+    int status = pclose(pipe);
+
+    if (code == 304) {
+        unlink(temp);
+        log_info("%s not modified since last fetch", url);
+        return 1;
+    }
+    if (status != 0 || code != 200 || rename(temp, destination) != 0) {
+        unlink(temp);
+        log_error("Unable to fetch %s (HTTP %d, status %d)", url, code, status);
+        return -1;
+    }
+    *validators = fresh;
+    return 0;
+}
+
+static int source_load(const FetchJob *job, int source)
+{
+    int load = 0;
+    for (int i = 0; i < job->count; ++i) {
+        if (job->segs[i].fd >= 0 && job->segs[i].source == source) {
+            load++;
+        }
+    }
+    return load;
+}
+
+/* Healthy mirrors first, least loaded among them, ties to the higher ranked;
+ * when every mirror is demoted, the one whose backoff ends first. */
+static int pick_source(const FetchJob *job, int exclude)
+{
+    long long now = monotonic_ms();
+    int best = -1;
+    for (int i = 0; i < job->source_count; ++i) {
+        if (i == exclude && job->source_count > 1) {
+            continue;
+        }
+        if (best < 0) {
+            best = i;
+            continue;
+        }
+        const FetchSource *cand = &job->sources[i];
+        const FetchSource *cur = &job->sources[best];
+        bool cand_ok = cand->demoted_until <= now;
+        bool cur_ok = cur->demoted_until <= now;
+        if (cand_ok != cur_ok) {
+            if (cand_ok) {
+                best = i;
+            }
+        } else if (!cand_ok) {
+            if (cand->demoted_until < cur->demoted_until) {
+                best = i;
+            }
+        } else if (source_load(job, i) < source_load(job, best)) {
+            best = i;
+        }
+    }
+    return best;
+}
+
+static void demote_source(FetchJob *job, int source, const char *reason)
+{
+    if (job->source_count < 2) {
+        return;
+    }
+    FetchSource *src = &job->sources[source];
+    src->failures++;
+    int shift = src->failures - 1 < 5 ? src->failures - 1 : 5;
+    long long backoff = (long long)FETCH_BACKOFF_BASE_MS << shift;
+    if (backoff > FETCH_BACKOFF_MAX_MS) {
+        backoff = FETCH_BACKOFF_MAX_MS;
+    }
+    src->demoted_until = monotonic_ms() + backoff;
+    log_info("Demoting mirror %s for %lld ms: %s", src->url, backoff, reason);
+}
+
+static int segment_spawn(FetchSegment *seg, const FetchJob *job, int exclude)
+{
+    int source = pick_source(job, exclude);
+    if (source < 0) {
+        return -1;
+    }
+    const char *quoted_url = job->sources[source].quoted;
+
+    char cmd[MAX_CMD_LEN];
+    int rc;
+    if (seg->end < 0) {
+        rc = snprintf(cmd, sizeof(cmd), "wget -q --tries=2 --timeout=30 -O - '%s'", quoted_url);
+    } else {
+        /* wget only honours ranges it requested itself, so start at the offset
+         * and stop reading once the segment is complete. */
+        rc = snprintf(cmd, sizeof(cmd), "wget -q --tries=2 --timeout=30 -O - --start-pos=%lld '%s'",
+                      seg->offset, quoted_url);
+    }
+    if (rc < 0 || rc >= (int)sizeof(cmd)) {
+        log_error("Download command too long");
+        return -1;
+    }
+
+    seg->pid = spawn_command_reader(cmd, &seg->fd);
+    if (seg->pid < 0) {
+        seg->fd = -1;
+        return -1;
+    }
+    seg->source = source;
+    seg->attempts++;
+    seg->window_start = monotonic_ms();
+    seg->window_bytes = 0;
+    return 0;
+}
+
+static int segment_reap(FetchSegment *seg, bool terminate)
+{
+    if (seg->fd >= 0) {
+        close(seg->fd);
+        seg->fd = -1;
+    }
+    if (seg->pid <= 0) {
+        return 0;
+    }
+    if (terminate) {
+        kill(seg->pid, SIGTERM);
+    }
+
+    int status = 0;
+    while (waitpid(seg->pid, &status, 0) < 0) {
+        if (errno != EINTR) {
+            status = -1;
+            break;
+        }
+    }
+    seg->pid = -1;
+    return (status != -1 && WIFEXITED(status) && WEXITSTATUS(status) == 0) ? 0 : -1;
+}
+
+static void report_progress(FetchJob *job, const char *name, int streams)
+{
+    char message[MAX_MESSAGE_LEN];
+    char allocation[160];
+    bandwidth_describe(allocation, sizeof(allocation));
+    snprintf(message, sizeof(message), "%s (%d stream%s) | %s", name, streams, streams == 1 ? "" : "s", allocation);
+    progress_update(&job->progress, job->received, job->total > 0 ? job->total : -1, -1, -1);
+    ui_progress_state("Downloading", message, &job->progress);
+}
+
+static void manifest_free(FetchManifest *m)
+{
+    if (m->fd >= 0) {
+        close(m->fd);
+        m->fd = -1;
+    }
+    free(m->have);
+    free(m->hex);
+    m->have = NULL;
+    m->hex = NULL;
+}
+
+static int manifest_init(FetchManifest *m, long long total)
+{
+    static const HashAlgorithm candidates[] = {HASH_BLAKE2B, HASH_BLAKE2S, HASH_SHA512, HASH_SHA256};
+    memset(m, 0, sizeof(*m));
+    m->fd = -1;
+    m->algorithm = hash_select_fastest(candidates, sizeof(candidates) / sizeof(candidates[0]));
+    m->chunk_size = FETCH_CHUNK_BYTES;
+    m->total = total;
+    m->chunk_count = (total + m->chunk_size - 1) / m->chunk_size;
+    m->have = calloc((size_t)m->chunk_count, sizeof(*m->have));
+    m->hex = calloc((size_t)m->chunk_count, sizeof(*m->hex));
+    if (!m->have || !m->hex) {
+        manifest_free(m);
+        return -1;
+    }
+    return 0;
+}
+
+static long long manifest_chunk_length(const FetchManifest *m, long long index)
+{
+    long long start = index * m->chunk_size;
+    return (start + m->chunk_size <= m->total) ? m->chunk_size : m->total - start;
+}
+
+static bool manifest_chunk_matches(const FetchManifest *m, int data_fd, long long index, const char *expected)
+{
+    static char buffer[FETCH_READ_CHUNK];
+    long long offset = index * m->chunk_size;
+    long long remaining = manifest_chunk_length(m, index);
+    HashContext ctx;
+    hash_init(&ctx, m->algorithm);
+    while (remaining > 0) {
+        size_t want = remaining < (long long)sizeof(buffer) ? (size_t)remaining : sizeof(buffer);
+        ssize_t got = pread(data_fd, buffer, want, (off_t)offset);
+        if (got < 0 && errno == EINTR) {
+            continue;
+        }
+        if (got <= 0) {
+            return false;
+        }
+        hash_update(&ctx, buffer, (size_t)got);
+        offset += got;
+        remaining -= got;
+    }
+    char actual[HASH_MAX_HEX];
+    hash_final_hex(&ctx, actual, sizeof(actual));
+    return strcmp(actual, expected) == 0;
+}
+
+/* Loads a previous manifest and re-hashes the chunks it lists. Returns the
+ * number of bytes that can be kept; 0 when the manifest is missing, belongs to
+ * a different file or the server copy has changed since. */
+static long long manifest_resume(FetchManifest *m, const char *path, const char *url,
+                                 const FetchProbe *probe, int data_fd)
+{
+    FILE *f = fopen(path, "r");
+    if (!f) {
+        return 0;
+    }
+
+    bool header_ok = true;
+    long long listed = 0;
+    char line[REMOTE_URL_MAX + 64];
+    while (header_ok && fgets(line, sizeof(line), f)) {
+        line[strcspn(line, "\n")] = '\0';
+        if (line[0] == '#' || line[0] == '\0') {
+            continue;
+        }
+        if (strncmp(line, "url ", 4) == 0) {
+            header_ok = strcmp(line + 4, url) == 0;
+        } else if (strncmp(line, "length ", 7) == 0) {
+            header_ok = strtoll(line + 7, NULL, 10) == m->total;
+        } else if (strncmp(line, "validator ", 10) == 0) {
+            header_ok = strcmp(line + 10, probe->validator[0] ? probe->validator : "-") == 0;
+        } else if (strncmp(line, "chunk-size ", 11) == 0) {
+            header_ok = strtoll(line + 11, NULL, 10) == m->chunk_size;
+        } else if (strncmp(line, "hash ", 5) == 0) {
+            header_ok = hash_algorithm_from_name(line + 5, &m->algorithm) == 0;
+        } else if (strncmp(line, "chunk ", 6) == 0) {
+            long long index;
+            char hex[HASH_MAX_HEX + 8];
+            if (sscanf(line + 6, "%lld %136s", &index, hex) == 2 && index >= 0 && index < m->chunk_count &&
+                strlen(hex) == hash_digest_size(m->algorithm) * 2) {
+                snprintf(m->hex[index], sizeof(m->hex[index]), "%s", hex);
+                listed++;
+            }
+        }
+    }
+    fclose(f);
+    if (!header_ok) {
+        log_info("Discarding stale partial download state for %s", url);
+        memset(m->hex, 0, (size_t)m->chunk_count * sizeof(*m->hex));
+        return 0;
+    }
+
+    long long kept = 0;
+    long long intact = 0;
+    for (long long i = 0; i < m->chunk_count; ++i) {
+        if (!m->hex[i][0]) {
+            continue;
+        }
+        ui_progress("Downloading", "Checking previously downloaded data...", (int)((i * 100) / m->chunk_count));
+        if (manifest_chunk_matches(m, data_fd, i, m->hex[i])) {
+            m->have[i] = true;
+            kept += manifest_chunk_length(m, i);
+            intact++;
+        } else {
+            m->hex[i][0] = '\0';
+        }
+    }
+    log_info("Resuming %s: %lld of %lld listed chunks intact (%lld bytes)", url,
+             intact, listed, kept);
+    return kept;
+}
+
+/* Rewrites the manifest with the current header and the chunks that survived
+ * validation, leaving it open for appends. */
+static int manifest_start(FetchManifest *m, const char *path, const char *url, const FetchProbe *probe)
+{
+    m->fd = open(path, O_WRONLY | O_CREAT | O_TRUNC | O_APPEND | O_CLOEXEC, 0644);
+    if (m->fd < 0) {
+        log_error("Unable to create download manifest %s: %s", path, strerror(errno));
+        return -1;
+    }
+    dprintf(m->fd, "# libero-installer partial download\nurl %s\nlength %lld\nvalidator %s\nchunk-size %lld\nhash %s\n",
+            url, m->total, probe->validator[0] ? probe->validator : "-", m->chunk_size,
+            hash_algorithm_name(m->algorithm));
+    for (long long i = 0; i < m->chunk_count; ++i) {
+        if (m->have[i]) {
+            dprintf(m->fd, "chunk %lld %s\n", i, m->hex[i]);
+        }
+    }
+    return 0;
+}
+
+/* Feeds bytes written by seg into its chunk hash and records every chunk the
+ * write completes. Segments always start on a chunk boundary. */
+static void manifest_account(FetchManifest *m, FetchSegment *seg, const char *data, size_t len)
+{
+    long long offset = seg->offset;
+    while (len > 0) {
+        long long index = offset / m->chunk_size;
+        long long chunk_start = index * m->chunk_size;
+        long long chunk_end = chunk_start + manifest_chunk_length(m, index);
+        if (offset == chunk_start) {
+            hash_init(&seg->chunk_hash, m->algorithm);
+        }
+        size_t take = (long long)len < chunk_end - offset ? len : (size_t)(chunk_end - offset);
+        hash_update(&seg->chunk_hash, data, take);
+        offset += (long long)take;
+        data += take;
+        len -= take;
+        if (offset == chunk_end) {
+            hash_final_hex(&seg->chunk_hash, m->hex[index], sizeof(m->hex[index]));
+            m->have[index] = true;
+            dprintf(m->fd, "chunk %lld %s\n", index, m->hex[index]);
+        }
+    }
+}
+
+static void note_source_rate(FetchJob *job, const FetchSegment *seg, long long now)
+{
+    long long elapsed = now - seg->window_start;
+    if (elapsed < FETCH_SLOW_CHECK_MS / 4 || seg->window_bytes <= 0) {
+        return;
+    }
+    double rate = seg->window_bytes * 1000.0 / (double)elapsed;
+    if (rate > job->sources[seg->source].rate) {
+        job->sources[seg->source].rate = rate;
+    }
+}
+
+/* Moves segments off mirrors that fall far behind the fastest one seen so far,
+ * provided a healthy alternative exists. Mirrors that already finished their
+ * share still count, so the tail of a download does not stay on the slowest
+ * mirror. Ranged segments resume from their current offset, so no data is
+ * fetched twice. */
+static int rebalance_slow_segments(FetchJob *job, long long now)
+{
+    double best = 0;
+    double rates[FETCH_MAX_SEGMENTS] = {0};
+    int running[FETCH_MAX_SEGMENTS];
+    int count = 0;
+    for (int i = 0; i < job->count && count < FETCH_MAX_SEGMENTS; ++i) {
+        FetchSegment *seg = &job->segs[i];
+        if (seg->done || seg->fd < 0 || seg->end < 0 || now - seg->window_start < FETCH_SLOW_CHECK_MS) {
+            continue;
+        }
+        rates[count] = seg->window_bytes * 1000.0 / (double)(now - seg->window_start);
+        note_source_rate(job, seg, now);
+        running[count++] = i;
+    }
+    for (int i = 0; i < job->source_count; ++i) {
+        if (job->sources[i].rate > best && job->sources[i].demoted_until <= now) {
+            best = job->sources[i].rate;
+        }
+    }
+
+    for (int k = 0; k < count; ++k) {
+        FetchSegment *seg = &job->segs[running[k]];
+        int from = seg->source;
+        if (rates[k] * FETCH_SLOW_RATIO < best) {
+            int to = pick_source(job, from);
+            if (to != from && job->sources[to].demoted_until <= now) {
+                char reason[96];
+                snprintf(reason, sizeof(reason), "%.0f KB/s against %.0f KB/s on the fastest mirror",
+                         rates[k] / 1024.0, best / 1024.0);
+                demote_source(job, from, reason);
+                segment_reap(seg, true);
+                if (segment_spawn(seg, job, from) != 0) {
+                    return -1;
+                }
+                continue;
+            }
+        }
+        seg->window_start = now;
+        seg->window_bytes = 0;
+    }
+    return 0;
+}
+
+static int run_segments(FetchJob *job)
+{
+    struct pollfd pfds[FETCH_MAX_SEGMENTS];
+    int map[FETCH_MAX_SEGMENTS];
+    char buffer[FETCH_READ_CHUNK];
+    const char *url = job->url;
+    const char *name = url_basename(url);
+    long long last_report = 0;
+    long long last_rebalance = monotonic_ms();
+    int rc = 0;
+    job->flow = bandwidth_register(bandwidth_default_class(), name);
+    progress_init(&job->progress, "download");
+    /* Resumed bytes are not throughput. */
+    job->progress.bytes_done = job->progress.sample_bytes = job->received;
+
+    while (1) {
+        int running = 0;
+        for (int i = 0; i < job->count; ++i) {
+            if (!job->segs[i].done && job->segs[i].fd >= 0) {
+                running++;
+            }
+        }
+        /* Queued ranges start as soon as a stream slot frees up. */
+        for (int i = 0; i < job->count && running < job->parallel; ++i) {
+            FetchSegment *seg = &job->segs[i];
+            if (!seg->done && seg->fd < 0 && seg->attempts == 0) {
+                if (segment_spawn(seg, job, -1) != 0) {
+                    rc = -1;
+                    goto out;
+                }
+                running++;
+            }
+        }
+
+        int active = 0;
+        for (int i = 0; i < job->count && active < FETCH_MAX_SEGMENTS; ++i) {
+            if (!job->segs[i].done && job->segs[i].fd >= 0) {
+                pfds[active].fd = job->segs[i].fd;
+                pfds[active].events = POLLIN;
+                pfds[active].revents = 0;
+                map[active] = i;
+                active++;
+            }
+        }
+        if (active == 0) {
+            break;
+        }
+
+        /* Over budget: leave the data in the pipes so wget, and through it
+         * the TCP window, slows down. */
+        long long hold = bandwidth_wait_ms(job->flow);
+        if (hold > 0) {
+            poll(NULL, 0, hold < 250 ? (int)hold : 250);
+            continue;
+        }
+
+        int ready = poll(pfds, (nfds_t)active, 250);
+        if (ready < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            log_error("poll() failed while downloading %s: %s", url, strerror(errno));
+            rc = -1;
+            goto out;
+        }
+
+        for (int k = 0; k < active; ++k) {
+            if (!(pfds[k].revents & (POLLIN | POLLHUP | POLLERR))) {
+                continue;
+            }
+            FetchSegment *seg = &job->segs[map[k]];
+            ssize_t got = read(seg->fd, buffer, sizeof(buffer));
+            if (got < 0) {
+                if (errno == EINTR || errno == EAGAIN) {
+                    continue;
+                }
+                got = 0;
+            }
+
+            if (got > 0) {
+                size_t len = (size_t)got;
+                if (seg->end >= 0 && (long long)len > seg->end - seg->offset + 1) {
+                    len = (size_t)(seg->end - seg->offset + 1);
+                }
+                if (job->sink) {
+                    if (job->sink(buffer, len, job->sink_ctx) != 0) {
+                        log_error("Stream consumer rejected data from %s", url);
+                        rc = -1;
+                        goto out;
+                    }
+                } else if (write_at(job->out_fd, buffer, len, seg->offset) != 0) {
+                    log_error("Failed to write download data: %s", strerror(errno));
+                    rc = -1;
+                    goto out;
+                }
+                if (job->manifest) {
+                    manifest_account(job->manifest, seg, buffer, len);
+                }
+                bandwidth_consume(job->flow, (long long)len);
+                seg->offset += (long long)len;
+                seg->window_bytes += (long long)len;
+                job->sources[seg->source].bytes += (long long)len;
+                job->received += (long long)len;
+                if (seg->end >= 0 && seg->offset > seg->end) {
+                    note_source_rate(job, seg, monotonic_ms());
+                    segment_reap(seg, true);
+                    seg->done = true;
+                    job->sources[seg->source].failures = 0;
+                }
+                continue;
+            }
+
+            int status = segment_reap(seg, false);
+            if (seg->end < 0 && status == 0) {
+                seg->done = true;
+                continue;
+            }
+            demote_source(job, seg->source, "transfer interrupted");
+            if (seg->attempts >= job->max_attempts) {
+                log_error("Segment %lld-%lld of %s failed after %d attempts",
+                          seg->start, seg->end, url, seg->attempts);
+                rc = -1;
+                goto out;
+            }
+            if (seg->end < 0 && job->sink) {
+                log_error("Stream from %s was interrupted and cannot be resumed", url);
+                rc = -1;
+                goto out;
+            }
+            if (seg->end < 0) {
+                /* Without range support the stream can only restart from zero. */
+                job->received -= seg->offset - seg->start;
+                seg->offset = seg->start;
+                if (ftruncate(job->out_fd, 0) != 0) {
+                    rc = -1;
+                    goto out;
+                }
+            }
+            int failed = seg->source;
+            if (segment_spawn(seg, job, failed) != 0) {
+                rc = -1;
+                goto out;
+            }
+            log_info("Retrying %s from byte %lld on %s (attempt %d)", url, seg->offset,
+                     job->sources[seg->source].url, seg->attempts);
+        }
+
+        long long now = monotonic_ms();
+        if (job->source_count > 1 && now - last_rebalance >= FETCH_SLOW_CHECK_MS) {
+            last_rebalance = now;
+            if (rebalance_slow_segments(job, now) != 0) {
+                rc = -1;
+                goto out;
+            }
+        }
+        if (now - last_report >= FETCH_PROGRESS_INTERVAL_MS) {
+            report_progress(job, name, active);
+            last_report = now;
+        }
+    }
+
+out:
+    for (int i = 0; i < job->count; ++i) {
+        segment_reap(&job->segs[i], true);
+    }
+    bandwidth_release(job->flow);
+    if (job->source_count > 1) {
+        for (int i = 0; i < job->source_count; ++i) {
+            log_info("Mirror %s delivered %lld bytes", job->sources[i].url, job->sources[i].bytes);
+        }
+    }
+    return rc;
+}
+
+static void segment_init(FetchSegment *seg, long long start, long long end)
+{
+    memset(seg, 0, sizeof(*seg));
+    seg->start = start;
+    seg->end = end;
+    seg->offset = start;
+    seg->pid = -1;
+    seg->fd = -1;
+}
+
+/* Turns the chunks still missing into chunk-aligned ranges, splitting the
+ * largest ones until every stream slot has work. Returns the range count. */
+static int plan_missing_ranges(const FetchManifest *m, FetchSegment *segs, int parallel)
+{
+    int count = 0;
+    for (long long i = 0; i < m->chunk_count; ++i) {
+        if (m->have[i]) {
+            continue;
+        }
+        long long first = i;
+        while (i + 1 < m->chunk_count && !m->have[i + 1]) {
+            ++i;
+        }
+        long long end = i * m->chunk_size + manifest_chunk_length(m, i) - 1;
+        segment_init(&segs[count++], first * m->chunk_size, end);
+    }
+
+    while (count < parallel) {
+        int widest = -1;
+        for (int i = 0; i < count; ++i) {
+            long long span = segs[i].end - segs[i].start + 1;
+            if (span >= 2 * FETCH_MIN_SEGMENT_BYTES &&
+                (widest < 0 || span > segs[widest].end - segs[widest].start + 1)) {
+                widest = i;
+            }
+        }
+        if (widest < 0) {
+            break;
+        }
+        FetchSegment *seg = &segs[widest];
+        long long chunks = (seg->end - seg->start + 1 + m->chunk_size - 1) / m->chunk_size;
+        long long split = seg->start + (chunks / 2) * m->chunk_size;
+        segment_init(&segs[count++], split, seg->end);
+        seg->end = split - 1;
+    }
+    return count;
+}
+
+static void source_init(FetchSource *source, const char *url)
+{
+    source->url = url;
+    source->failures = 0;
+    source->demoted_until = 0;
+    source->bytes = 0;
+    source->rate = 0;
+}
+
+/* Probes the mirrors in rank order until one answers; it sets the reference
+ * length and validator. Only an artifact big enough to be segmented is
+ * worth probing the rest for: they join when they serve the same length
+ * with range support, so their bytes are interchangeable. */
+static int prepare_sources(const char *const *urls, int url_count, FetchSource *sources, FetchProbe *probe,
+                           int *max_attempts)
+{
+    int count = 0;
+    for (int i = 0; i < url_count && count < FETCH_MAX_SOURCES; ++i) {
+        if (!urls[i] || !urls[i][0]) {
+            continue;
+        }
+        if (count > 0 && (!probe->accepts_ranges || probe->content_length < FETCH_SEGMENTED_MIN_BYTES)) {
+            break;
+        }
+        FetchProbe candidate;
+        if (fetch_probe(urls[i], &candidate) != 0) {
+            continue;
+        }
+        if (count == 0) {
+            *probe = candidate;
+        } else if (!candidate.accepts_ranges || candidate.content_length != probe->content_length) {
+            log_info("Not using %s alongside %s: size or range support differs", urls[i], sources[0].url);
+            continue;
+        }
+        if (shell_escape_single_quotes(urls[i], sources[count].quoted, sizeof(sources[count].quoted)) != 0) {
+            log_error("Unable to quote URL %s", urls[i]);
+            continue;
+        }
+        source_init(&sources[count], urls[i]);
+        count++;
+    }
+    *max_attempts = FETCH_SEGMENT_RETRIES * count;
+
+    /* No mirror answered the probe: one plain attempt on the best ranked,
+     * rather than retries against mirrors that already failed once. */
+    if (count == 0 && url_count > 0 && urls[0] && urls[0][0] &&
+        shell_escape_single_quotes(urls[0], sources[0].quoted, sizeof(sources[0].quoted)) == 0) {
+        log_info("Falling back to a single stream for %s", urls[0]);
+        probe->content_length = -1;
+        probe->accepts_ranges = false;
+        probe->validator[0] = '\0';
+        source_init(&sources[0], urls[0]);
+        count = 1;
+        *max_attempts = 1;
+    }
+    return count;
+}
+
+int fetch_file(const char *url, const char *destination, int max_segments)
+{
+    return fetch_file_mirrors(&url, 1, destination, max_segments);
+}
+
+int fetch_file_mirrors(const char *const *urls, int url_count, const char *destination, int max_segments)
+{
+    if (!urls || url_count < 1 || !destination || !destination[0]) {
+        return -1;
+    }
+    if (max_segments < 1) {
+        max_segments = 1;
+    } else if (max_segments > FETCH_MAX_SEGMENTS) {
+        max_segments = FETCH_MAX_SEGMENTS;
+    }
+
+    char part_path[PATH_MAX];
+    char manifest_path[PATH_MAX];
+    if (snprintf(part_path, sizeof(part_path), "%s%s", destination, FETCH_PARTIAL_SUFFIX) >= (int)sizeof(part_path) ||
+        snprintf(manifest_path, sizeof(manifest_path), "%s%s", destination, FETCH_MANIFEST_SUFFIX) >= (int)sizeof(manifest_path)) {
+        return -1;
+    }
+
+    FetchSource sources[FETCH_MAX_SOURCES];
+    FetchProbe probe;
+    int max_attempts = 0;
+    int source_count = prepare_sources(urls, url_count, sources, &probe, &max_attempts);
+    if (source_count == 0) {
+        return -1;
+    }
+    const char *url = sources[0].url;
+
+    const long long total = probe.content_length;
+    const bool ranged = probe.accepts_ranges && total > 0;
+    FetchManifest manifest = {.fd = -1};
+    bool resumable = ranged && total >= FETCH_CHUNK_BYTES && manifest_init(&manifest, total) == 0;
+
+    int fd = open(part_path, O_RDWR | O_CREAT | O_CLOEXEC | (resumable ? 0 : O_TRUNC), 0644);
+    if (fd < 0) {
+        log_error("Unable to open %s: %s", part_path, strerror(errno));
+        manifest_free(&manifest);
+        return -1;
+    }
+
+    long long kept = 0;
+    if (resumable) {
+        kept = manifest_resume(&manifest, manifest_path, url, &probe, fd);
+        if ((kept == 0 && ftruncate(fd, 0) != 0) || manifest_start(&manifest, manifest_path, url, &probe) != 0) {
+            resumable = false;
+        }
+    }
+    if (!resumable) {
+        unlink(manifest_path);
+    }
+
+    long long remaining = total - kept;
+    int parallel = 1;
+    if (ranged && remaining >= FETCH_SEGMENTED_MIN_BYTES) {
+        long long by_size = remaining / FETCH_MIN_SEGMENT_BYTES;
+        parallel = (by_size < max_segments) ? (int)by_size : max_segments;
+    }
+    if (ranged && (parallel > 1 || resumable)) {
+        int err = posix_fallocate(fd, 0, (off_t)total);
+        if (err != 0 && ftruncate(fd, (off_t)total) != 0) {
+            log_error("Unable to preallocate %s: %s", part_path, strerror(err));
+            close(fd);
+            unlink(part_path);
+            unlink(manifest_path);
+            manifest_free(&manifest);
+            return -1;
+        }
+    }
+
+    int capacity = resumable ? (int)manifest.chunk_count + FETCH_MAX_SEGMENTS : 1;
+    FetchSegment *segs = calloc((size_t)capacity, sizeof(*segs));
+    if (!segs) {
+        close(fd);
+        manifest_free(&manifest);
+        return -1;
+    }
+    int count = 1;
+    if (resumable) {
+        count = plan_missing_ranges(&manifest, segs, parallel);
+    } else {
+        segment_init(&segs[0], 0, ranged ? total - 1 : -1);
+    }
+
+    log_info("Fetching %s into %s: %d range(s) over %d stream(s) from %d mirror(s), %lld bytes already present",
+             url, destination, count, parallel, source_count, kept);
+    FetchJob job = {
+        .url = url,
+        .sources = sources,
+        .source_count = source_count,
+        .max_attempts = max_attempts,
+        .out_fd = fd,
+        .manifest = resumable ? &manifest : NULL,
+        .segs = segs,
+        .count = count,
+        .parallel = parallel,
+        .total = total,
+        .received = kept,
+    };
+    long long started = monotonic_ms();
+    int rc = run_segments(&job);
+    free(segs);
+
+    if (rc == 0 && resumable) {
+        for (long long i = 0; i < manifest.chunk_count; ++i) {
+            if (!manifest.have[i]) {
+                log_error("Chunk %lld of %s is missing after download", i, url);
+                rc = -1;
+                break;
+            }
+        }
+    }
+    if (rc == 0 && !ranged && total > 0) {
+        struct stat st;
+        if (fstat(fd, &st) != 0 || st.st_size != total) {
+            log_error("Short download for %s: expected %lld bytes", url, total);
+            rc = -1;
+        }
+    }
+    if (close(fd) != 0) {
+        rc = -1;
+    }
+    manifest_free(&manifest);
+    if (rc != 0) {
+        probe_forget(urls, url_count);
+        if (resumable) {
+            log_info("Keeping %s for a later resume (%lld of %lld bytes)", part_path, job.received, total);
+        } else {
+            unlink(part_path);
+        }
+        return -1;
+    }
+    if (rename(part_path, destination) != 0) {
+        log_error("Unable to move %s into place: %s", part_path, strerror(errno));
+        unlink(part_path);
+        unlink(manifest_path);
+        return -1;
+    }
+    unlink(manifest_path);
+
+    long long elapsed = monotonic_ms() - started;
+    long long fetched = job.received - kept;
+    if (elapsed > 0) {
+        log_info("Fetched %s: %lld bytes in %.1fs (%.2f MB/s)", destination, fetched,
+                 elapsed / 1000.0, (fetched / 1048576.0) / (elapsed / 1000.0));
+    }
+    return 0;
+}
+
+/* Fills only the given ranges of fd, for example the blocks a delta transfer
+ * could not take from an older copy. Every mirror must serve exactly
+ * expected_length bytes with range support. */
+int fetch_ranges_mirrors(const char *const *urls, int url_count, int fd, long long expected_length,
+                         const FetchRange *ranges, int range_count)
+{
+    if (!urls || url_count < 1 || fd < 0 || !ranges || range_count < 1) {
+        return -1;
+    }
+    FetchSource sources[FETCH_MAX_SOURCES];
+    FetchProbe probe;
+    int max_attempts = 0;
+    int source_count = prepare_sources(urls, url_count, sources, &probe, &max_attempts);
+    if (source_count == 0) {
+        return -1;
+    }
+    const char *url = sources[0].url;
+    if (!probe.accepts_ranges || probe.content_length != expected_length) {
+        log_error("%s cannot serve ranges of a %lld byte artifact", url, expected_length);
+        return -1;
+    }
+
+    FetchSegment *segs = calloc((size_t)range_count, sizeof(*segs));
+    if (!segs) {
+        return -1;
+    }
+    long long total = 0;
+    for (int i = 0; i < range_count; ++i) {
+        segment_init(&segs[i], ranges[i].start, ranges[i].end);
+        total += ranges[i].end - ranges[i].start + 1;
+    }
+
+    log_info("Fetching %d range(s), %lld bytes, of %s from %d mirror(s)", range_count, total, url, source_count);
+    FetchJob job = {
+        .url = url,
+        .sources = sources,
+        .source_count = source_count,
+        .max_attempts = max_attempts,
+        .out_fd = fd,
+        .segs = segs,
+        .count = range_count,
+        .parallel = range_count < FETCH_DEFAULT_SEGMENTS ? range_count : FETCH_DEFAULT_SEGMENTS,
+        .total = total,
+    };
+    int rc = run_segments(&job);
+    free(segs);
+    if (rc != 0) {
+        probe_forget(urls, url_count);
+    }
+    return rc;
+}
+
+int fetch_stream(const char *url, FetchSink sink, void *ctx)
+{
+    return fetch_stream_mirrors(&url, 1, sink, ctx);
+}
+
+int fetch_stream_mirrors(const char *const *urls, int url_count, FetchSink sink, void *ctx)
+{
+    if (!urls || url_count < 1 || !sink) {
+        return -1;
+    }
+
+    FetchSource sources[FETCH_MAX_SOURCES];
+    FetchProbe probe;
+    int max_attempts = 0;
+    int source_count = prepare_sources(urls, url_count, sources, &probe, &max_attempts);
+    if (source_count == 0) {
+        return -1;
+    }
+    const char *url = sources[0].url;
+
+    /* A single ordered stream; with range support an interrupted transfer
+     * picks up where the consumer left off, on another mirror if needed. */
+    FetchSegment seg;
+    segment_init(&seg, 0, (probe.accepts_ranges && probe.content_length > 0) ? probe.content_length - 1 : -1);
+
+    log_info("Streaming %s", url);
+    FetchJob job = {
+        .url = url,
+        .sources = sources,
+        .source_count = source_count,
+        .max_attempts = max_attempts,
+        .out_fd = -1,
+        .sink = sink,
+        .sink_ctx = ctx,
+        .segs = &seg,
+        .count = 1,
+        .parallel = 1,
+        .total = probe.content_length,
+    };
+    long long started = monotonic_ms();
+    if (run_segments(&job) != 0) {
+        probe_forget(urls, url_count);
+        return -1;
+    }
+    if (probe.content_length > 0 && seg.offset != probe.content_length) {
+        log_error("Short stream for %s: %lld of %lld bytes", url, seg.offset, probe.content_length);
+        probe_forget(urls, url_count);
+        return -1;
+    }
+
+    long long elapsed = monotonic_ms() - started;
+    if (elapsed > 0) {
+        log_info("Streamed %s: %lld bytes in %.1fs (%.2f MB/s)", url, seg.offset,
+                 elapsed / 1000.0, (seg.offset / 1048576.0) / (elapsed / 1000.0));
+    }
+    return 0;
+}
@@ -0,0 +1,155 @@
+#include "fs_profile.h"
+
+#include "block_probe.h"
+#include "log.h"
+
+typedef struct {
+    const char *description;
+    bool eager_init;
+    long big_log_min_mb; /* 0 when ext_mkfs and xfs_mkfs apply at any size */
+    const char *ext_mkfs;
+    const char *ext_mount;
+    const char *xfs_mkfs;
+    const char *xfs_mount;
+    const char *btrfs_mkfs;
+    const char *btrfs_mount;
+    const char *btrfs_compress[2]; /* by GentooArch; NULL leaves data uncompressed */
+} FsProfileSpec;
+
+/* Indexed by FsProfile. */
+static const FsProfileSpec profiles[] = {
+    {
+        /* A bigger journal and log checkpoint less often under the
+         * sustained writes of an emerge; a longer commit batches them. */
+        .description = "Large sequential writes, e.g. building packages on a hard disk",
+        .eager_init = true,
+        .big_log_min_mb = FS_PROFILE_BIG_LOG_MIN_MB,
+        .ext_mkfs = " -J size=256",
+        .ext_mount = "noatime,commit=30",
+        .xfs_mkfs = " -l size=128m",
+        .xfs_mount = "noatime,logbufs=8,logbsize=256k",
+        .btrfs_mkfs = "",
+        .btrfs_mount = "noatime,space_cache=v2",
+        .btrfs_compress = {"lzo", "zstd:1"},
+    },
+    {
+        /* Fast commits turn most fsyncs into a single journal block. */
+        .description = "Short fsync and interactive delays, no compression",
+        .eager_init = true,
+        .ext_mkfs = " -O fast_commit",
+        .ext_mount = "noatime,commit=5",
+        .xfs_mkfs = "",
+        .xfs_mount = "noatime",
+        .btrfs_mkfs = "",
+        .btrfs_mount = "noatime,space_cache=v2",
+        .btrfs_compress = {NULL, NULL},
+    },
+    {
+        /* Fewer, larger metadata writes; trimming is left to fstrim except
+         * on btrfs, whose async discard batches it. Lazy init stays on
+         * since device prep already zeroed the tables where it could. */
+        .description = "SSD, CF and SD cards: fewer and larger writes",
+        .eager_init = false,
+        .ext_mkfs = "",
+        .ext_mount = "noatime,commit=60",
+        .xfs_mkfs = "",
+        .xfs_mount = "noatime,logbsize=256k",
+        .btrfs_mkfs = "",
+        .btrfs_mount = "noatime,space_cache=v2,commit=60,discard=async",
+        .btrfs_compress = {"lzo", "zstd:1"},
+    },
+    {
+        /* Space first: a 1% reserve and a small journal on ext4, mixed
+         * block groups on btrfs so data and metadata share chunks. */
+        .description = "Disks under 16 GB: space over speed",
+        .eager_init = true,
+        .ext_mkfs = " -m 1 -J size=16",
+        .ext_mount = "noatime",
+        .xfs_mkfs = "",
+        .xfs_mount = "noatime",
+        .btrfs_mkfs = " --mixed --nodesize 4096",
+        .btrfs_mount = "noatime,space_cache=v2",
+        .btrfs_compress = {"zstd:1", "zstd:3"},
+    },
+};
+
+static const FsProfileSpec *spec_for(FsProfile profile)
+{
+    if ((int)profile < 0 || (size_t)profile >= sizeof(profiles) / sizeof(profiles[0])) {
+        return &profiles[FS_PROFILE_THROUGHPUT];
+    }
+    return &profiles[profile];
+}
+
+void fs_profile_resolve(InstallerState *state)
+{
+    if (state->fs_profile_pinned) {
+        return;
+    }
+    BlockTopology topology;
+    bool rotational = block_probe_topology(state->target_disk, &topology) != 0 || topology.rotational;
+    FsProfile profile = FS_PROFILE_THROUGHPUT;
+    if (state->disk_size_mb > 0 && state->disk_size_mb < FS_PROFILE_SMALL_DISK_MB) {
+        profile = FS_PROFILE_SMALL_DISK;
+    } else if (!rotational) {
+        profile = FS_PROFILE_FLASH;
+    }
+    if (profile != state->fs_profile) {
+        log_info("Filesystem profile for %s: %s", state->target_disk, fs_profile_to_string(profile));
+    }
+    state->fs_profile = profile;
+}
+
+const char *fs_profile_description(FsProfile profile)
+{
+    return spec_for(profile)->description;
+}
+
+void fs_profile_mkfs_options(FsProfile profile, FilesystemType fs, long root_mb, char *buffer, size_t len)
+{
+    const FsProfileSpec *spec = spec_for(profile);
+    const char *options = "";
+    switch (fs) {
+    case FS_EXT4:
+        options = spec->ext_mkfs;
+        break;
+    case FS_XFS:
+        options = spec->xfs_mkfs;
+        break;
+    case FS_BTRFS:
+        options = spec->btrfs_mkfs;
+        break;
+    default:
+        break;
+    }
+    if (fs != FS_BTRFS && root_mb < spec->big_log_min_mb) {
+        options = "";
+    }
+    snprintf(buffer, len, "%s", options);
+}
+
+bool fs_profile_eager_init(FsProfile profile)
+{
+    return spec_for(profile)->eager_init;
+}
+
+void fs_profile_mount_options(FsProfile profile, GentooArch arch, FilesystemType fs, char *buffer, size_t len)
+{
+    const FsProfileSpec *spec = spec_for(profile);
+    switch (fs) {
+    case FS_EXT4:
+        snprintf(buffer, len, "%s", spec->ext_mount);
+        break;
+    case FS_XFS:
+        snprintf(buffer, len, "%s", spec->xfs_mount);
+        break;
+    case FS_BTRFS: {
+        const char *compress = spec->btrfs_compress[arch == ARCH_I686 ? 1 : 0];
+        snprintf(buffer, len, "%s%s%s", spec->btrfs_mount, compress ? ",compress=" : "", compress ? compress : "");
+        break;
+    }
+    default:
+        snprintf(buffer, len, "noatime");
+        break;
+    }
+}
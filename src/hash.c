@@ -0,0 +1,1009 @@
+#include "hash.h"
+
+#include <fcntl.h>
+
+#include "log.h"
+
+#if defined(__i386__) || defined(__x86_64__)
+#include <emmintrin.h>
+#define HASH_HAVE_SSE2_KERNEL 1
+#endif
+
+#define HASH_BENCH_BYTES (256 * 1024)
+
+static const uint32_t md5_k[64] = {
+    0xd76aa478, 0xe8c7b756, 0x242070db, 0xc1bdceee,
+    0xf57c0faf, 0x4787c62a, 0xa8304613, 0xfd469501,
+    0x698098d8, 0x8b44f7af, 0xffff5bb1, 0x895cd7be,
+    0x6b901122, 0xfd987193, 0xa679438e, 0x49b40821,
+    0xf61e2562, 0xc040b340, 0x265e5a51, 0xe9b6c7aa,
+    0xd62f105d, 0x02441453, 0xd8a1e681, 0xe7d3fbc8,
+    0x21e1cde6, 0xc33707d6, 0xf4d50d87, 0x455a14ed,
+    0xa9e3e905, 0xfcefa3f8, 0x676f02d9, 0x8d2a4c8a,
+    0xfffa3942, 0x8771f681, 0x6d9d6122, 0xfde5380c,
+    0xa4beea44, 0x4bdecfa9, 0xf6bb4b60, 0xbebfbc70,
+    0x289b7ec6, 0xeaa127fa, 0xd4ef3085, 0x04881d05,
+    0xd9d4d039, 0xe6db99e5, 0x1fa27cf8, 0xc4ac5665,
+    0xf4292244, 0x432aff97, 0xab9423a7, 0xfc93a039,
+    0x655b59c3, 0x8f0ccc92, 0xffeff47d, 0x85845dd1,
+    0x6fa87e4f, 0xfe2ce6e0, 0xa3014314, 0x4e0811a1,
+    0xf7537e82, 0xbd3af235, 0x2ad7d2bb, 0xeb86d391,
+};
+
+static const uint8_t md5_shift[16] = {7, 12, 17, 22, 5, 9, 14, 20, 4, 11, 16, 23, 6, 10, 15, 21};
+
+static const uint32_t sha256_k[64] = {
+    0x428a2f98, 0x71374491, 0xb5c0fbcf, 0xe9b5dba5,
+    0x3956c25b, 0x59f111f1, 0x923f82a4, 0xab1c5ed5,
+    0xd807aa98, 0x12835b01, 0x243185be, 0x550c7dc3,
+    0x72be5d74, 0x80deb1fe, 0x9bdc06a7, 0xc19bf174,
+    0xe49b69c1, 0xefbe4786, 0x0fc19dc6, 0x240ca1cc,
+    0x2de92c6f, 0x4a7484aa, 0x5cb0a9dc, 0x76f988da,
+    0x983e5152, 0xa831c66d, 0xb00327c8, 0xbf597fc7,
+    0xc6e00bf3, 0xd5a79147, 0x06ca6351, 0x14292967,
+    0x27b70a85, 0x2e1b2138, 0x4d2c6dfc, 0x53380d13,
+    0x650a7354, 0x766a0abb, 0x81c2c92e, 0x92722c85,
+    0xa2bfe8a1, 0xa81a664b, 0xc24b8b70, 0xc76c51a3,
+    0xd192e819, 0xd6990624, 0xf40e3585, 0x106aa070,
+    0x19a4c116, 0x1e376c08, 0x2748774c, 0x34b0bcb5,
+    0x391c0cb3, 0x4ed8aa4a, 0x5b9cca4f, 0x682e6ff3,
+    0x748f82ee, 0x78a5636f, 0x84c87814, 0x8cc70208,
+    0x90befffa, 0xa4506ceb, 0xbef9a3f7, 0xc67178f2,
+};
+
+/* Also the BLAKE2s IV. */
+static const uint32_t sha256_iv[8] = {
+    0x6a09e667, 0xbb67ae85, 0x3c6ef372, 0xa54ff53a,
+    0x510e527f, 0x9b05688c, 0x1f83d9ab, 0x5be0cd19,
+};
+
+static const uint64_t sha512_k[80] = {
+    0x428a2f98d728ae22ULL, 0x7137449123ef65cdULL,
+    0xb5c0fbcfec4d3b2fULL, 0xe9b5dba58189dbbcULL,
+    0x3956c25bf348b538ULL, 0x59f111f1b605d019ULL,
+    0x923f82a4af194f9bULL, 0xab1c5ed5da6d8118ULL,
+    0xd807aa98a3030242ULL, 0x12835b0145706fbeULL,
+    0x243185be4ee4b28cULL, 0x550c7dc3d5ffb4e2ULL,
+    0x72be5d74f27b896fULL, 0x80deb1fe3b1696b1ULL,
+    0x9bdc06a725c71235ULL, 0xc19bf174cf692694ULL,
+    0xe49b69c19ef14ad2ULL, 0xefbe4786384f25e3ULL,
+    0x0fc19dc68b8cd5b5ULL, 0x240ca1cc77ac9c65ULL,
+    0x2de92c6f592b0275ULL, 0x4a7484aa6ea6e483ULL,
+    0x5cb0a9dcbd41fbd4ULL, 0x76f988da831153b5ULL,
+    0x983e5152ee66dfabULL, 0xa831c66d2db43210ULL,
+    0xb00327c898fb213fULL, 0xbf597fc7beef0ee4ULL,
+    0xc6e00bf33da88fc2ULL, 0xd5a79147930aa725ULL,
+    0x06ca6351e003826fULL, 0x142929670a0e6e70ULL,
+    0x27b70a8546d22ffcULL, 0x2e1b21385c26c926ULL,
+    0x4d2c6dfc5ac42aedULL, 0x53380d139d95b3dfULL,
+    0x650a73548baf63deULL, 0x766a0abb3c77b2a8ULL,
+    0x81c2c92e47edaee6ULL, 0x92722c851482353bULL,
+    0xa2bfe8a14cf10364ULL, 0xa81a664bbc423001ULL,
+    0xc24b8b70d0f89791ULL, 0xc76c51a30654be30ULL,
+    0xd192e819d6ef5218ULL, 0xd69906245565a910ULL,
+    0xf40e35855771202aULL, 0x106aa07032bbd1b8ULL,
+    0x19a4c116b8d2d0c8ULL, 0x1e376c085141ab53ULL,
+    0x2748774cdf8eeb99ULL, 0x34b0bcb5e19b48a8ULL,
+    0x391c0cb3c5c95a63ULL, 0x4ed8aa4ae3418acbULL,
+    0x5b9cca4f7763e373ULL, 0x682e6ff3d6b2b8a3ULL,
+    0x748f82ee5defb2fcULL, 0x78a5636f43172f60ULL,
+    0x84c87814a1f0ab72ULL, 0x8cc702081a6439ecULL,
+    0x90befffa23631e28ULL, 0xa4506cebde82bde9ULL,
+    0xbef9a3f7b2c67915ULL, 0xc67178f2e372532bULL,
+    0xca273eceea26619cULL, 0xd186b8c721c0c207ULL,
+    0xeada7dd6cde0eb1eULL, 0xf57d4f7fee6ed178ULL,
+    0x06f067aa72176fbaULL, 0x0a637dc5a2c898a6ULL,
+    0x113f9804bef90daeULL, 0x1b710b35131c471bULL,
+    0x28db77f523047d84ULL, 0x32caab7b40c72493ULL,
+    0x3c9ebe0a15c9bebcULL, 0x431d67c49c100d4cULL,
+    0x4cc5d4becb3e42b6ULL, 0x597f299cfc657e2aULL,
+    0x5fcb6fab3ad6faecULL, 0x6c44198c4a475817ULL,
+};
+
+/* Also the BLAKE2b IV. */
+static const uint64_t sha512_iv[8] = {
+    0x6a09e667f3bcc908ULL, 0xbb67ae8584caa73bULL,
+    0x3c6ef372fe94f82bULL, 0xa54ff53a5f1d36f1ULL,
+    0x510e527fade682d1ULL, 0x9b05688c2b3e6c1fULL,
+    0x1f83d9abfb41bd6bULL, 0x5be0cd19137e2179ULL,
+};
+
+static const uint8_t blake2_sigma[12][16] = {
+    {0, 1, 2, 3, 4, 5, 6, 7, 8, 9, 10, 11, 12, 13, 14, 15},
+    {14, 10, 4, 8, 9, 15, 13, 6, 1, 12, 0, 2, 11, 7, 5, 3},
+    {11, 8, 12, 0, 5, 2, 15, 13, 10, 14, 3, 6, 7, 1, 9, 4},
+    {7, 9, 3, 1, 13, 12, 11, 14, 2, 6, 5, 10, 4, 0, 15, 8},
+    {9, 0, 5, 7, 2, 4, 10, 15, 14, 1, 11, 12, 6, 8, 3, 13},
+    {2, 12, 6, 10, 0, 11, 8, 3, 4, 13, 7, 5, 15, 14, 1, 9},
+    {12, 5, 1, 15, 14, 13, 4, 10, 0, 7, 6, 3, 9, 2, 8, 11},
+    {13, 11, 7, 14, 12, 1, 3, 9, 5, 0, 15, 4, 8, 6, 2, 10},
+    {6, 15, 14, 9, 11, 3, 0, 8, 12, 2, 13, 7, 1, 4, 10, 5},
+    {10, 2, 8, 4, 7, 6, 1, 5, 15, 11, 9, 14, 3, 12, 13, 0},
+    {0, 1, 2, 3, 4, 5, 6, 7, 8, 9, 10, 11, 12, 13, 14, 15},
+    {14, 10, 4, 8, 9, 15, 13, 6, 1, 12, 0, 2, 11, 7, 5, 3},
+};
+
+static const struct {
+    HashAlgorithm algorithm;
+    const char *name;
+    size_t digest_size;
+} hash_table[HASH_ALGORITHM_COUNT] = {
+    {HASH_MD5, "MD5", 16},
+    {HASH_SHA256, "SHA256", 32},
+    {HASH_SHA512, "SHA512", 64},
+    {HASH_BLAKE2S, "BLAKE2S", 32},
+    {HASH_BLAKE2B, "BLAKE2B", 64},
+};
+
+static uint32_t load32_le(const unsigned char *p)
+{
+    return (uint32_t)p[0] | ((uint32_t)p[1] << 8) | ((uint32_t)p[2] << 16) | ((uint32_t)p[3] << 24);
+}
+
+static uint32_t load32_be(const unsigned char *p)
+{
+    return ((uint32_t)p[0] << 24) | ((uint32_t)p[1] << 16) | ((uint32_t)p[2] << 8) | (uint32_t)p[3];
+}
+
+static uint64_t load64_le(const unsigned char *p)
+{
+    return (uint64_t)load32_le(p) | ((uint64_t)load32_le(p + 4) << 32);
+}
+
+static uint64_t load64_be(const unsigned char *p)
+{
+    return ((uint64_t)load32_be(p) << 32) | (uint64_t)load32_be(p + 4);
+}
+
+static void store32_le(unsigned char *p, uint32_t v)
+{
+    p[0] = (unsigned char)v;
+    p[1] = (unsigned char)(v >> 8);
+    p[2] = (unsigned char)(v >> 16);
+    p[3] = (unsigned char)(v >> 24);
+}
+
+static void store32_be(unsigned char *p, uint32_t v)
+{
+    p[0] = (unsigned char)(v >> 24);
+    p[1] = (unsigned char)(v >> 16);
+    p[2] = (unsigned char)(v >> 8);
+    p[3] = (unsigned char)v;
+}
+
+static void store64_le(unsigned char *p, uint64_t v)
+{
+    store32_le(p, (uint32_t)v);
+    store32_le(p + 4, (uint32_t)(v >> 32));
+}
+
+static void store64_be(unsigned char *p, uint64_t v)
+{
+    store32_be(p, (uint32_t)(v >> 32));
+    store32_be(p + 4, (uint32_t)v);
+}
+
+static uint32_t rotl32(uint32_t x, int n)
+{
+    return (x << n) | (x >> (32 - n));
+}
+
+static uint32_t rotr32(uint32_t x, int n)
+{
+    return (x >> n) | (x << (32 - n));
+}
+
+static uint64_t rotr64(uint64_t x, int n)
+{
+    return (x >> n) | (x << (64 - n));
+}
+
+static void md5_compress(uint32_t h[8], const unsigned char *block)
+{
+    uint32_t m[16];
+    for (int i = 0; i < 16; ++i) {
+        m[i] = load32_le(block + i * 4);
+    }
+
+    uint32_t a = h[0], b = h[1], c = h[2], d = h[3];
+    for (int i = 0; i < 64; ++i) {
+        uint32_t f;
+        int g;
+        if (i < 16) {
+            f = (b & c) | (~b & d);
+            g = i;
+        } else if (i < 32) {
+            f = (d & b) | (~d & c);
+            g = (5 * i + 1) & 15;
+        } else if (i < 48) {
+            f = b ^ c ^ d;
+            g = (3 * i + 5) & 15;
+        } else {
+            f = c ^ (b | ~d);
+            g = (7 * i) & 15;
+        }
+        uint32_t tmp = d;
+        d = c;
+        c = b;
+        b = b + rotl32(a + f + md5_k[i] + m[g], md5_shift[(i >> 4) * 4 + (i & 3)]);
+        a = tmp;
+    }
+    h[0] += a;
+    h[1] += b;
+    h[2] += c;
+    h[3] += d;
+}
+
+static void sha256_compress(uint32_t h[8], const unsigned char *block)
+{
+    uint32_t w[64];
+    for (int i = 0; i < 16; ++i) {
+        w[i] = load32_be(block + i * 4);
+    }
+    for (int i = 16; i < 64; ++i) {
+        uint32_t s0 = rotr32(w[i - 15], 7) ^ rotr32(w[i - 15], 18) ^ (w[i - 15] >> 3);
+        uint32_t s1 = rotr32(w[i - 2], 17) ^ rotr32(w[i - 2], 19) ^ (w[i - 2] >> 10);
+        w[i] = w[i - 16] + s0 + w[i - 7] + s1;
+    }
+
+    uint32_t a = h[0], b = h[1], c = h[2], d = h[3], e = h[4], f = h[5], g = h[6], k = h[7];
+    for (int i = 0; i < 64; ++i) {
+        uint32_t t1 = k + (rotr32(e, 6) ^ rotr32(e, 11) ^ rotr32(e, 25)) + ((e & f) ^ (~e & g)) + sha256_k[i] + w[i];
+        uint32_t t2 = (rotr32(a, 2) ^ rotr32(a, 13) ^ rotr32(a, 22)) + ((a & b) ^ (a & c) ^ (b & c));
+        k = g;
+        g = f;
+        f = e;
+        e = d + t1;
+        d = c;
+        c = b;
+        b = a;
+        a = t1 + t2;
+    }
+    h[0] += a;
+    h[1] += b;
+    h[2] += c;
+    h[3] += d;
+    h[4] += e;
+    h[5] += f;
+    h[6] += g;
+    h[7] += k;
+}
+
+static void sha512_compress(uint64_t h[8], const unsigned char *block)
+{
+    uint64_t w[80];
+    for (int i = 0; i < 16; ++i) {
+        w[i] = load64_be(block + i * 8);
+    }
+    for (int i = 16; i < 80; ++i) {
+        uint64_t s0 = rotr64(w[i - 15], 1) ^ rotr64(w[i - 15], 8) ^ (w[i - 15] >> 7);
+        uint64_t s1 = rotr64(w[i - 2], 19) ^ rotr64(w[i - 2], 61) ^ (w[i - 2] >> 6);
+        w[i] = w[i - 16] + s0 + w[i - 7] + s1;
+    }
+
+    uint64_t a = h[0], b = h[1], c = h[2], d = h[3], e = h[4], f = h[5], g = h[6], k = h[7];
+    for (int i = 0; i < 80; ++i) {
+        uint64_t t1 = k + (rotr64(e, 14) ^ rotr64(e, 18) ^ rotr64(e, 41)) + ((e & f) ^ (~e & g)) + sha512_k[i] + w[i];
+        uint64_t t2 = (rotr64(a, 28) ^ rotr64(a, 34) ^ rotr64(a, 39)) + ((a & b) ^ (a & c) ^ (b & c));
+        k = g;
+        g = f;
+        f = e;
+        e = d + t1;
+        d = c;
+        c = b;
+        b = a;
+        a = t1 + t2;
+    }
+    h[0] += a;
+    h[1] += b;
+    h[2] += c;
+    h[3] += d;
+    h[4] += e;
+    h[5] += f;
+    h[6] += g;
+    h[7] += k;
+}
+
+#define BLAKE2S_G(a, b, c, d, x, y)         \
+    do {                                    \
+        v[a] = v[a] + v[b] + (x);           \
+        v[d] = rotr32(v[d] ^ v[a], 16);     \
+        v[c] = v[c] + v[d];                 \
+        v[b] = rotr32(v[b] ^ v[c], 12);     \
+        v[a] = v[a] + v[b] + (y);           \
+        v[d] = rotr32(v[d] ^ v[a], 8);      \
+        v[c] = v[c] + v[d];                 \
+        v[b] = rotr32(v[b] ^ v[c], 7);      \
+    } while (0)
+
+static void blake2s_compress_generic(uint32_t h[8], const unsigned char *block, uint64_t counter, bool last)
+{
+    uint32_t m[16];
+    uint32_t v[16];
+    for (int i = 0; i < 16; ++i) {
+        m[i] = load32_le(block + i * 4);
+    }
+    for (int i = 0; i < 8; ++i) {
+        v[i] = h[i];
+        v[i + 8] = sha256_iv[i];
+    }
+    v[12] ^= (uint32_t)counter;
+    v[13] ^= (uint32_t)(counter >> 32);
+    if (last) {
+        v[14] = ~v[14];
+    }
+
+    for (int r = 0; r < 10; ++r) {
+        const uint8_t *s = blake2_sigma[r];
+        BLAKE2S_G(0, 4, 8, 12, m[s[0]], m[s[1]]);
+        BLAKE2S_G(1, 5, 9, 13, m[s[2]], m[s[3]]);
+        BLAKE2S_G(2, 6, 10, 14, m[s[4]], m[s[5]]);
+        BLAKE2S_G(3, 7, 11, 15, m[s[6]], m[s[7]]);
+        BLAKE2S_G(0, 5, 10, 15, m[s[8]], m[s[9]]);
+        BLAKE2S_G(1, 6, 11, 12, m[s[10]], m[s[11]]);
+        BLAKE2S_G(2, 7, 8, 13, m[s[12]], m[s[13]]);
+        BLAKE2S_G(3, 4, 9, 14, m[s[14]], m[s[15]]);
+    }
+    for (int i = 0; i < 8; ++i) {
+        h[i] ^= v[i] ^ v[i + 8];
+    }
+}
+
+#ifdef HASH_HAVE_SSE2_KERNEL
+#define SSE2_ROTR32(x, n) _mm_or_si128(_mm_srli_epi32((x), (n)), _mm_slli_epi32((x), 32 - (n)))
+
+#define BLAKE2S_SSE2_G(r1, r2, r3, r4, msg, rot_a, rot_b)                   \
+    do {                                                                    \
+        r1 = _mm_add_epi32(_mm_add_epi32(r1, r2), msg);                     \
+        r4 = SSE2_ROTR32(_mm_xor_si128(r4, r1), rot_a);                     \
+        r3 = _mm_add_epi32(r3, r4);                                         \
+        r2 = SSE2_ROTR32(_mm_xor_si128(r2, r3), rot_b);                     \
+    } while (0)
+
+/* Four G functions per step, one per 32-bit lane. SSE2 has no byte shuffle,
+ * so every rotation is a shift pair; this still beats the scalar code on
+ * register-starved i686 parts. */
+__attribute__((target("sse2")))
+static void blake2s_compress_sse2(uint32_t h[8], const unsigned char *block, uint64_t counter, bool last)
+{
+    int m[16];
+    for (int i = 0; i < 16; ++i) {
+        m[i] = (int)load32_le(block + i * 4);
+    }
+
+    const __m128i h_lo = _mm_loadu_si128((const __m128i *)&h[0]);
+    const __m128i h_hi = _mm_loadu_si128((const __m128i *)&h[4]);
+    __m128i row1 = h_lo;
+    __m128i row2 = h_hi;
+    __m128i row3 = _mm_setr_epi32((int)sha256_iv[0], (int)sha256_iv[1], (int)sha256_iv[2], (int)sha256_iv[3]);
+    __m128i row4 = _mm_xor_si128(_mm_setr_epi32((int)sha256_iv[4], (int)sha256_iv[5], (int)sha256_iv[6], (int)sha256_iv[7]),
+                                 _mm_setr_epi32((int)(uint32_t)counter, (int)(uint32_t)(counter >> 32), last ? -1 : 0, 0));
+
+    for (int r = 0; r < 10; ++r) {
+        const uint8_t *s = blake2_sigma[r];
+        __m128i msg;
+
+        msg = _mm_setr_epi32(m[s[0]], m[s[2]], m[s[4]], m[s[6]]);
+        BLAKE2S_SSE2_G(row1, row2, row3, row4, msg, 16, 12);
+        msg = _mm_setr_epi32(m[s[1]], m[s[3]], m[s[5]], m[s[7]]);
+        BLAKE2S_SSE2_G(row1, row2, row3, row4, msg, 8, 7);
+
+        row2 = _mm_shuffle_epi32(row2, _MM_SHUFFLE(0, 3, 2, 1));
+        row3 = _mm_shuffle_epi32(row3, _MM_SHUFFLE(1, 0, 3, 2));
+        row4 = _mm_shuffle_epi32(row4, _MM_SHUFFLE(2, 1, 0, 3));
+
+        msg = _mm_setr_epi32(m[s[8]], m[s[10]], m[s[12]], m[s[14]]);
+        BLAKE2S_SSE2_G(row1, row2, row3, row4, msg, 16, 12);
+        msg = _mm_setr_epi32(m[s[9]], m[s[11]], m[s[13]], m[s[15]]);
+        BLAKE2S_SSE2_G(row1, row2, row3, row4, msg, 8, 7);
+
+        row2 = _mm_shuffle_epi32(row2, _MM_SHUFFLE(2, 1, 0, 3));
+        row3 = _mm_shuffle_epi32(row3, _MM_SHUFFLE(1, 0, 3, 2));
+        row4 = _mm_shuffle_epi32(row4, _MM_SHUFFLE(0, 3, 2, 1));
+    }
+
+    _mm_storeu_si128((__m128i *)&h[0], _mm_xor_si128(h_lo, _mm_xor_si128(row1, row3)));
+    _mm_storeu_si128((__m128i *)&h[4], _mm_xor_si128(h_hi, _mm_xor_si128(row2, row4)));
+}
+
+static bool cpu_has_sse2(void)
+{
+#if defined(__x86_64__) || defined(__SSE2__)
+    return true;
+#else
+    __builtin_cpu_init();
+    return __builtin_cpu_supports("sse2");
+#endif
+}
+#endif /* HASH_HAVE_SSE2_KERNEL */
+
+typedef void (*Blake2sCompressFn)(uint32_t h[8], const unsigned char *block, uint64_t counter, bool last);
+
+static Blake2sCompressFn blake2s_compress_impl(void)
+{
+    static Blake2sCompressFn impl = NULL;
+    if (!impl) {
+        impl = blake2s_compress_generic;
+#ifdef HASH_HAVE_SSE2_KERNEL
+        if (cpu_has_sse2()) {
+            impl = blake2s_compress_sse2;
+        }
+#endif
+    }
+    return impl;
+}
+
+#define BLAKE2B_G(a, b, c, d, x, y)         \
+    do {                                    \
+        v[a] = v[a] + v[b] + (x);           \
+        v[d] = rotr64(v[d] ^ v[a], 32);     \
+        v[c] = v[c] + v[d];                 \
+        v[b] = rotr64(v[b] ^ v[c], 24);     \
+        v[a] = v[a] + v[b] + (y);           \
+        v[d] = rotr64(v[d] ^ v[a], 16);     \
+        v[c] = v[c] + v[d];                 \
+        v[b] = rotr64(v[b] ^ v[c], 63);     \
+    } while (0)
+
+static void blake2b_compress(uint64_t h[8], const unsigned char *block, const uint64_t counter[2], bool last)
+{
+    uint64_t m[16];
+    uint64_t v[16];
+    for (int i = 0; i < 16; ++i) {
+        m[i] = load64_le(block + i * 8);
+    }
+    for (int i = 0; i < 8; ++i) {
+        v[i] = h[i];
+        v[i + 8] = sha512_iv[i];
+    }
+    v[12] ^= counter[0];
+    v[13] ^= counter[1];
+    if (last) {
+        v[14] = ~v[14];
+    }
+
+    for (int r = 0; r < 12; ++r) {
+        const uint8_t *s = blake2_sigma[r];
+        BLAKE2B_G(0, 4, 8, 12, m[s[0]], m[s[1]]);
+        BLAKE2B_G(1, 5, 9, 13, m[s[2]], m[s[3]]);
+        BLAKE2B_G(2, 6, 10, 14, m[s[4]], m[s[5]]);
+        BLAKE2B_G(3, 7, 11, 15, m[s[6]], m[s[7]]);
+        BLAKE2B_G(0, 5, 10, 15, m[s[8]], m[s[9]]);
+        BLAKE2B_G(1, 6, 11, 12, m[s[10]], m[s[11]]);
+        BLAKE2B_G(2, 7, 8, 13, m[s[12]], m[s[13]]);
+        BLAKE2B_G(3, 4, 9, 14, m[s[14]], m[s[15]]);
+    }
+    for (int i = 0; i < 8; ++i) {
+        h[i] ^= v[i] ^ v[i + 8];
+    }
+}
+
+/* Merkle-Damgard buffering shared by MD5 and SHA-256. */
+static void md32_update(Hash32State *st, const unsigned char *in, size_t len,
+                        void (*compress)(uint32_t h[8], const unsigned char *block))
+{
+    st->length += len;
+    if (st->used > 0) {
+        size_t take = 64 - st->used;
+        if (take > len) {
+            take = len;
+        }
+        memcpy(st->block + st->used, in, take);
+        st->used += take;
+        in += take;
+        len -= take;
+        if (st->used < 64) {
+            return;
+        }
+        compress(st->h, st->block);
+        st->used = 0;
+    }
+    while (len >= 64) {
+        compress(st->h, in);
+        in += 64;
+        len -= 64;
+    }
+    if (len > 0) {
+        memcpy(st->block, in, len);
+        st->used = len;
+    }
+}
+
+static void md32_final(Hash32State *st, bool big_endian,
+                       void (*compress)(uint32_t h[8], const unsigned char *block))
+{
+    uint64_t bits = st->length * 8;
+    st->block[st->used++] = 0x80;
+    if (st->used > 56) {
+        memset(st->block + st->used, 0, 64 - st->used);
+        compress(st->h, st->block);
+        st->used = 0;
+    }
+    memset(st->block + st->used, 0, 56 - st->used);
+    if (big_endian) {
+        store64_be(st->block + 56, bits);
+    } else {
+        store64_le(st->block + 56, bits);
+    }
+    compress(st->h, st->block);
+}
+
+static void sha512_update(Hash64State *st, const unsigned char *in, size_t len)
+{
+    st->length[0] += len;
+    if (st->length[0] < len) {
+        st->length[1]++;
+    }
+    if (st->used > 0) {
+        size_t take = 128 - st->used;
+        if (take > len) {
+            take = len;
+        }
+        memcpy(st->block + st->used, in, take);
+        st->used += take;
+        in += take;
+        len -= take;
+        if (st->used < 128) {
+            return;
+        }
+        sha512_compress(st->h, st->block);
+        st->used = 0;
+    }
+    while (len >= 128) {
+        sha512_compress(st->h, in);
+        in += 128;
+        len -= 128;
+    }
+    if (len > 0) {
+        memcpy(st->block, in, len);
+        st->used = len;
+    }
+}
+
+static void sha512_final(Hash64State *st)
+{
+    uint64_t bits_hi = (st->length[1] << 3) | (st->length[0] >> 61);
+    uint64_t bits_lo = st->length[0] << 3;
+    st->block[st->used++] = 0x80;
+    if (st->used > 112) {
+        memset(st->block + st->used, 0, 128 - st->used);
+        sha512_compress(st->h, st->block);
+        st->used = 0;
+    }
+    memset(st->block + st->used, 0, 112 - st->used);
+    store64_be(st->block + 112, bits_hi);
+    store64_be(st->block + 120, bits_lo);
+    sha512_compress(st->h, st->block);
+}
+
+/* BLAKE2 must keep the last block back until finalisation, so full blocks are
+ * only compressed once more input is known to follow. */
+static void blake2s_update(Hash32State *st, const unsigned char *in, size_t len)
+{
+    Blake2sCompressFn compress = blake2s_compress_impl();
+    while (len > 0) {
+        if (st->used == 64) {
+            st->length += 64;
+            compress(st->h, st->block, st->length, false);
+            st->used = 0;
+        }
+        if (st->used == 0) {
+            while (len > 64) {
+                st->length += 64;
+                compress(st->h, in, st->length, false);
+                in += 64;
+                len -= 64;
+            }
+        }
+        size_t take = 64 - st->used;
+        if (take > len) {
+            take = len;
+        }
+        memcpy(st->block + st->used, in, take);
+        st->used += take;
+        in += take;
+        len -= take;
+    }
+}
+
+static void blake2b_add_counter(Hash64State *st, uint64_t n)
+{
+    st->length[0] += n;
+    if (st->length[0] < n) {
+        st->length[1]++;
+    }
+}
+
+static void blake2b_update(Hash64State *st, const unsigned char *in, size_t len)
+{
+    while (len > 0) {
+        if (st->used == 128) {
+            blake2b_add_counter(st, 128);
+            blake2b_compress(st->h, st->block, st->length, false);
+            st->used = 0;
+        }
+        if (st->used == 0) {
+            while (len > 128) {
+                blake2b_add_counter(st, 128);
+                blake2b_compress(st->h, in, st->length, false);
+                in += 128;
+                len -= 128;
+            }
+        }
+        size_t take = 128 - st->used;
+        if (take > len) {
+            take = len;
+        }
+        memcpy(st->block + st->used, in, take);
+        st->used += take;
+        in += take;
+        len -= take;
+    }
+}
+
+const char *hash_algorithm_name(HashAlgorithm algorithm)
+{
+    if ((int)algorithm < 0 || algorithm >= HASH_ALGORITHM_COUNT) {
+        return "unknown";
+    }
+    return hash_table[algorithm].name;
+}
+
+int hash_algorithm_from_name(const char *name, HashAlgorithm *algorithm)
+{
+    if (!name || !algorithm) {
+        return -1;
+    }
+    /* Accept "SHA512", "sha-512" and similar spellings. */
+    char normalized[32];
+    size_t len = 0;
+    for (const char *p = name; *p && len + 1 < sizeof(normalized); ++p) {
+        if (*p != '-' && *p != '_') {
+            normalized[len++] = (char)toupper((unsigned char)*p);
+        }
+    }
+    normalized[len] = '\0';
+
+    for (int i = 0; i < HASH_ALGORITHM_COUNT; ++i) {
+        if (strcmp(normalized, hash_table[i].name) == 0) {
+            *algorithm = hash_table[i].algorithm;
+            return 0;
+        }
+    }
+    return -1;
+}
+
+size_t hash_digest_size(HashAlgorithm algorithm)
+{
+    if ((int)algorithm < 0 || algorithm >= HASH_ALGORITHM_COUNT) {
+        return 0;
+    }
+    return hash_table[algorithm].digest_size;
+}
+
+const char *hash_backend_name(HashAlgorithm algorithm)
+{
+#ifdef HASH_HAVE_SSE2_KERNEL
+    if (algorithm == HASH_BLAKE2S && blake2s_compress_impl() == blake2s_compress_sse2) {
+        return "sse2";
+    }
+#else
+    (void)algorithm;
+#endif
+    return "generic";
+}
+
+void hash_init(HashContext *ctx, HashAlgorithm algorithm)
+{
+    memset(ctx, 0, sizeof(*ctx));
+    ctx->algorithm = algorithm;
+    switch (algorithm) {
+    case HASH_MD5:
+        ctx->u.s32.h[0] = 0x67452301;
+        ctx->u.s32.h[1] = 0xefcdab89;
+        ctx->u.s32.h[2] = 0x98badcfe;
+        ctx->u.s32.h[3] = 0x10325476;
+        break;
+    case HASH_SHA256:
+        memcpy(ctx->u.s32.h, sha256_iv, sizeof(sha256_iv));
+        break;
+    case HASH_BLAKE2S:
+        memcpy(ctx->u.s32.h, sha256_iv, sizeof(sha256_iv));
+        ctx->u.s32.h[0] ^= 0x01010000U | 32U; /* depth 1, fanout 1, 32-byte digest */
+        break;
+    case HASH_SHA512:
+        memcpy(ctx->u.s64.h, sha512_iv, sizeof(sha512_iv));
+        break;
+    case HASH_BLAKE2B:
+        memcpy(ctx->u.s64.h, sha512_iv, sizeof(sha512_iv));
+        ctx->u.s64.h[0] ^= 0x01010000ULL | 64ULL;
+        break;
+    default:
+        break;
+    }
+}
+
+void hash_update(HashContext *ctx, const void *data, size_t len)
+{
+    const unsigned char *in = data;
+    switch (ctx->algorithm) {
+    case HASH_MD5:
+        md32_update(&ctx->u.s32, in, len, md5_compress);
+        break;
+    case HASH_SHA256:
+        md32_update(&ctx->u.s32, in, len, sha256_compress);
+        break;
+    case HASH_SHA512:
+        sha512_update(&ctx->u.s64, in, len);
+        break;
+    case HASH_BLAKE2S:
+        blake2s_update(&ctx->u.s32, in, len);
+        break;
+    case HASH_BLAKE2B:
+        blake2b_update(&ctx->u.s64, in, len);
+        break;
+    default:
+        break;
+    }
+}
+
+void hash_final(HashContext *ctx, unsigned char *digest)
+{
+    Hash32State *s32 = &ctx->u.s32;
+    Hash64State *s64 = &ctx->u.s64;
+    switch (ctx->algorithm) {
+    case HASH_MD5:
+        md32_final(s32, false, md5_compress);
+        for (int i = 0; i < 4; ++i) {
+            store32_le(digest + i * 4, s32->h[i]);
+        }
+        break;
+    case HASH_SHA256:
+        md32_final(s32, true, sha256_compress);
+        for (int i = 0; i < 8; ++i) {
+            store32_be(digest + i * 4, s32->h[i]);
+        }
+        break;
+    case HASH_SHA512:
+        sha512_final(s64);
+        for (int i = 0; i < 8; ++i) {
+            store64_be(digest + i * 8, s64->h[i]);
+        }
+        break;
+    case HASH_BLAKE2S:
+        s32->length += s32->used;
+        memset(s32->block + s32->used, 0, 64 - s32->used);
+        blake2s_compress_impl()(s32->h, s32->block, s32->length, true);
+        for (int i = 0; i < 8; ++i) {
+            store32_le(digest + i * 4, s32->h[i]);
+        }
+        break;
+    case HASH_BLAKE2B:
+        blake2b_add_counter(s64, s64->used);
+        memset(s64->block + s64->used, 0, 128 - s64->used);
+        blake2b_compress(s64->h, s64->block, s64->length, true);
+        for (int i = 0; i < 8; ++i) {
+            store64_le(digest + i * 8, s64->h[i]);
+        }
+        break;
+    default:
+        break;
+    }
+}
+
+void hash_final_hex(HashContext *ctx, char *hex, size_t len)
+{
+    static const char digits[] = "0123456789abcdef";
+    unsigned char digest[HASH_MAX_DIGEST];
+    size_t size = hash_digest_size(ctx->algorithm);
+    if (!hex || len < size * 2 + 1) {
+        if (hex && len > 0) {
+            hex[0] = '\0';
+        }
+        return;
+    }
+    hash_final(ctx, digest);
+    for (size_t i = 0; i < size; ++i) {
+        hex[i * 2] = digits[digest[i] >> 4];
+        hex[i * 2 + 1] = digits[digest[i] & 0x0f];
+    }
+    hex[size * 2] = '\0';
+}
+
+int hash_file_hex(const char *path, HashAlgorithm algorithm, char *hex, size_t len)
+{
+    int fd = open(path, O_RDONLY | O_CLOEXEC);
+    if (fd < 0) {
+        log_error("Unable to open %s for hashing: %s", path, strerror(errno));
+        return -1;
+    }
+    posix_fadvise(fd, 0, 0, POSIX_FADV_SEQUENTIAL);
+
+    HashContext ctx;
+    hash_init(&ctx, algorithm);
+    static unsigned char buffer[1 << 16];
+    while (1) {
+        ssize_t got = read(fd, buffer, sizeof(buffer));
+        if (got < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            log_error("Read error while hashing %s: %s", path, strerror(errno));
+            close(fd);
+            return -1;
+        }
+        if (got == 0) {
+            break;
+        }
+        hash_update(&ctx, buffer, (size_t)got);
+    }
+    close(fd);
+    hash_final_hex(&ctx, hex, len);
+    return 0;
+}
+
+static double hash_benchmark(HashAlgorithm algorithm)
+{
+    static double measured[HASH_ALGORITHM_COUNT];
+    if (measured[algorithm] > 0) {
+        return measured[algorithm];
+    }
+
+    unsigned char *buffer = malloc(HASH_BENCH_BYTES);
+    if (!buffer) {
+        return 0;
+    }
+    for (size_t i = 0; i < HASH_BENCH_BYTES; ++i) {
+        buffer[i] = (unsigned char)(i * 131u);
+    }
+
+    struct timespec start;
+    struct timespec end;
+    HashContext ctx;
+    unsigned char digest[HASH_MAX_DIGEST];
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    hash_init(&ctx, algorithm);
+    hash_update(&ctx, buffer, HASH_BENCH_BYTES);
+    hash_final(&ctx, digest);
+    clock_gettime(CLOCK_MONOTONIC, &end);
+    free(buffer);
+
+    double seconds = (end.tv_sec - start.tv_sec) + (end.tv_nsec - start.tv_nsec) / 1e9;
+    if (seconds <= 0) {
+        seconds = 1e-9;
+    }
+    measured[algorithm] = (HASH_BENCH_BYTES / 1048576.0) / seconds;
+    log_info("Hash benchmark: %s %.1f MB/s (%s)", hash_algorithm_name(algorithm),
+             measured[algorithm], hash_backend_name(algorithm));
+    return measured[algorithm];
+}
+
+HashAlgorithm hash_select_fastest(const HashAlgorithm *candidates, size_t count)
+{
+    HashAlgorithm best = HASH_SHA512;
+    double best_rate = -1;
+    for (size_t i = 0; i < count; ++i) {
+        double rate = hash_benchmark(candidates[i]);
+        if (rate > best_rate) {
+            best_rate = rate;
+            best = candidates[i];
+        }
+    }
+    return best;
+}
+
+static bool is_hex_digest(const char *text, HashAlgorithm algorithm)
+{
+    size_t expected = hash_digest_size(algorithm) * 2;
+    size_t len = strlen(text);
+    if (len != expected) {
+        return false;
+    }
+    for (size_t i = 0; i < len; ++i) {
+        if (!isxdigit((unsigned char)text[i])) {
+            return false;
+        }
+    }
+    return true;
+}
+
+int hash_parse_digest_file(const char *path, const char *filename, HashAlgorithm default_algorithm, DigestSet *set)
+{
+    if (!path || !set) {
+        return -1;
+    }
+    memset(set, 0, sizeof(*set));
+
+    FILE *f = fopen(path, "r");
+    if (!f) {
+        return -1;
+    }
+
+    /* Gentoo DIGESTS files group hashes under "# <ALGO> HASH" headers and may
+     * be wrapped in a PGP clearsign envelope. Plain *sum files have neither. */
+    HashAlgorithm current = default_algorithm;
+    bool section_known = true;
+    bool in_signature = false;
+    char line[512];
+    while (fgets(line, sizeof(line), f)) {
+        if (strncmp(line, "-----BEGIN PGP SIGNATURE", 24) == 0) {
+            in_signature = true;
+            continue;
+        }
+        if (strncmp(line, "-----END PGP SIGNATURE", 22) == 0) {
+            in_signature = false;
+            continue;
+        }
+        if (in_signature || line[0] == '-' || strncmp(line, "Hash:", 5) == 0) {
+            continue;
+        }
+        if (line[0] == '#') {
+            char name[32];
+            if (strstr(line, " HASH") && sscanf(line, "# %31s", name) == 1) {
+                section_known = hash_algorithm_from_name(name, &current) == 0;
+            }
+            continue;
+        }
+        if (!section_known) {
+            continue;
+        }
+
+        char hash[HASH_MAX_HEX + 8];
+        char name[256];
+        int fields = sscanf(line, "%136s %255s", hash, name);
+        if (fields < 1) {
+            continue;
+        }
+        if (filename && filename[0]) {
+            if (fields < 2) {
+                continue;
+            }
+            const char *entry = (name[0] == '*') ? name + 1 : name;
+            const char *slash = strrchr(entry, '/');
+            entry = slash ? slash + 1 : entry;
+            if (strcmp(entry, filename) != 0) {
+                continue;
+            }
+        }
+        if (!is_hex_digest(hash, current) || set->present[current]) {
+            continue;
+        }
+        for (char *p = hash; *p; ++p) {
+            *p = (char)tolower((unsigned char)*p);
+        }
+        snprintf(set->hex[current], sizeof(set->hex[current]), "%s", hash);
+        set->present[current] = true;
+    }
+    fclose(f);
+
+    for (int i = 0; i < HASH_ALGORITHM_COUNT; ++i) {
+        if (set->present[i]) {
+            return 0;
+        }
+    }
+    return -1;
+}
+
+int digest_set_select(const DigestSet *set, HashAlgorithm *algorithm)
+{
+    if (!set || !algorithm) {
+        return -1;
+    }
+    HashAlgorithm candidates[HASH_ALGORITHM_COUNT];
+    size_t count = 0;
+    for (int i = 0; i < HASH_ALGORITHM_COUNT; ++i) {
+        /* MD5 is only trusted when nothing stronger is published. */
+        if (set->present[i] && i != HASH_MD5) {
+            candidates[count++] = (HashAlgorithm)i;
+        }
+    }
+    if (count == 0) {
+        if (!set->present[HASH_MD5]) {
+            return -1;
+        }
+        *algorithm = HASH_MD5;
+        return 0;
+    }
+    *algorithm = hash_select_fastest(candidates, count);
+    return 0;
+}
@@ -0,0 +1,241 @@
+#include "luks_tuning.h"
+
+#include <sys/utsname.h>
+
+#include "block_probe.h"
+#include "log.h"
+#include "report.h"
+#include "system_utils.h"
+#include "ui.h"
+
+typedef struct {
+    const char *cipher;
+    unsigned key_bits;
+    unsigned security_bits;
+    bool grub; /* GRUB's cryptodisk can unlock it */
+} CipherCandidate;
+
+static const CipherCandidate candidates[] = {
+    {"aes-xts-plain64", 256, 128, true},
+    {"aes-xts-plain64", 512, 256, true},
+    {"serpent-xts-plain64", 256, 128, true},
+    {"serpent-xts-plain64", 512, 256, true},
+    {"twofish-xts-plain64", 256, 128, true},
+    {"twofish-xts-plain64", 512, 256, true},
+    /* Adiantum is built for CPUs without AES instructions. */
+    {"xchacha12,aes-adiantum-plain64", 256, 256, false},
+    {"xchacha20,aes-adiantum-plain64", 256, 256, false},
+};
+#define CANDIDATE_COUNT (sizeof(candidates) / sizeof(candidates[0]))
+
+static unsigned env_unsigned(const char *name, unsigned fallback)
+{
+    const char *env = getenv(name);
+    if (!env || !*env) {
+        return fallback;
+    }
+    char *end = NULL;
+    unsigned long value = strtoul(env, &end, 10);
+    if (*end != '\0' || value == 0 || value > 1000000) {
+        log_error("Ignoring invalid %s '%s'", name, env);
+        return fallback;
+    }
+    return (unsigned)value;
+}
+
+/* Parses the result row of "cryptsetup benchmark", e.g.
+ * "        aes-xts        512b      1234.5 MiB/s      1301.0 MiB/s". */
+static int run_benchmark(const CipherCandidate *candidate, double *encrypt, double *decrypt)
+{
+    char cmd[256];
+    char line[256];
+    snprintf(cmd, sizeof(cmd), "cryptsetup benchmark --cipher %s --key-size %u 2>/dev/null | tail -n 1",
+             candidate->cipher, candidate->key_bits);
+    capture_command(cmd, line, sizeof(line));
+    char name[64];
+    unsigned bits = 0;
+    if (sscanf(line, "%63s %ub %lf MiB/s %lf MiB/s", name, &bits, encrypt, decrypt) != 4 || name[0] == '#' ||
+        *encrypt <= 0 || *decrypt <= 0) {
+        return -1;
+    }
+    return 0;
+}
+
+static double rate(double encrypt, double decrypt)
+{
+    /* The slower direction bounds the disk. */
+    return encrypt < decrypt ? encrypt : decrypt;
+}
+
+static void choose_cipher(bool grub_unlocks, LuksTuning *tuning)
+{
+    const char *forced = getenv("LIBERO_LUKS_CIPHER");
+    if (forced && *forced) {
+        const char *colon = strrchr(forced, ':');
+        unsigned bits = colon ? (unsigned)strtoul(colon + 1, NULL, 10) : 0;
+        if (colon && bits > 0 && (size_t)(colon - forced) < sizeof(tuning->cipher)) {
+            snprintf(tuning->cipher, sizeof(tuning->cipher), "%.*s", (int)(colon - forced), forced);
+            tuning->key_bits = bits;
+            report_add("LUKS", "cipher %s with a %u-bit key set by LIBERO_LUKS_CIPHER, benchmark skipped",
+                       tuning->cipher, bits);
+            return;
+        }
+        log_error("Ignoring invalid LIBERO_LUKS_CIPHER '%s' (expected cipher:bits)", forced);
+    }
+
+    unsigned floor_bits = env_unsigned("LIBERO_LUKS_MIN_BITS", LUKS_MIN_SECURITY_BITS);
+    const CipherCandidate *best = NULL;
+    double best_encrypt = 0.0;
+    double best_decrypt = 0.0;
+    for (size_t i = 0; i < CANDIDATE_COUNT; ++i) {
+        const CipherCandidate *candidate = &candidates[i];
+        char message[128];
+        snprintf(message, sizeof(message), "Benchmarking %s (%u-bit key)", candidate->cipher,
+                 candidate->key_bits);
+        ui_progress("Disk Encryption", message, (int)(i * 100 / CANDIDATE_COUNT));
+        if (grub_unlocks && !candidate->grub) {
+            report_add("LUKS", "%-32s %3ub  skipped, GRUB cannot unlock it", candidate->cipher,
+                       candidate->key_bits);
+            continue;
+        }
+        double encrypt = 0.0;
+        double decrypt = 0.0;
+        if (run_benchmark(candidate, &encrypt, &decrypt) != 0) {
+            report_add("LUKS", "%-32s %3ub  not available", candidate->cipher, candidate->key_bits);
+            continue;
+        }
+        bool secure = candidate->security_bits >= floor_bits;
+        report_add("LUKS", "%-32s %3ub  %8.1f MiB/s encrypt %8.1f MiB/s decrypt%s", candidate->cipher,
+                   candidate->key_bits, encrypt, decrypt, secure ? "" : "  below the security floor");
+        if (!secure) {
+            continue;
+        }
+        bool better = !best;
+        if (best) {
+            double current = rate(best_encrypt, best_decrypt);
+            double measured = rate(encrypt, decrypt);
+            double margin = (100 + LUKS_TIE_PERCENT) / 100.0;
+            if (candidate->security_bits > best->security_bits) {
+                better = measured * margin >= current;
+            } else if (candidate->security_bits < best->security_bits) {
+                better = measured > current * margin;
+            } else {
+                better = measured > current;
+            }
+        }
+        if (better) {
+            best = candidate;
+            best_encrypt = encrypt;
+            best_decrypt = decrypt;
+        }
+    }
+    ui_progress("Disk Encryption", "Cipher benchmark complete", 100);
+
+    if (!best) {
+        snprintf(tuning->cipher, sizeof(tuning->cipher), "aes-xts-plain64");
+        tuning->key_bits = 512;
+        report_add("LUKS", "no cipher could be benchmarked at %u bits or more; using %s with a %u-bit key",
+                   floor_bits, tuning->cipher, tuning->key_bits);
+        return;
+    }
+    snprintf(tuning->cipher, sizeof(tuning->cipher), "%s", best->cipher);
+    tuning->key_bits = best->key_bits;
+    tuning->encrypt_mibs = best_encrypt;
+    tuning->decrypt_mibs = best_decrypt;
+}
+
+static unsigned long mem_total_kib(void)
+{
+    FILE *f = fopen("/proc/meminfo", "r");
+    if (!f) {
+        return 0;
+    }
+    char line[128];
+    unsigned long kib = 0;
+    while (fgets(line, sizeof(line), f)) {
+        if (sscanf(line, "MemTotal: %lu kB", &kib) == 1) {
+            break;
+        }
+    }
+    fclose(f);
+    return kib;
+}
+
+/* dm-crypt takes the no_read/no_write_workqueue flags from 5.9 on. */
+static bool kernel_has_workqueue_flags(void)
+{
+    struct utsname uts;
+    unsigned major = 0;
+    unsigned minor = 0;
+    if (uname(&uts) != 0 || sscanf(uts.release, "%u.%u", &major, &minor) != 2) {
+        return false;
+    }
+    return major > 5 || (major == 5 && minor >= 9);
+}
+
+void luks_tuning_plan(const char *device, bool grub_unlocks, LuksTuning *tuning)
+{
+    memset(tuning, 0, sizeof(*tuning));
+    choose_cipher(grub_unlocks, tuning);
+
+    tuning->luks2 = !grub_unlocks;
+    tuning->iter_time_ms = env_unsigned("LIBERO_LUKS_UNLOCK_MS",
+                                        grub_unlocks ? LUKS_GRUB_UNLOCK_MS : LUKS_UNLOCK_MS);
+    long cpus = sysconf(_SC_NPROCESSORS_ONLN);
+    if (cpus < 1) {
+        cpus = 1;
+    }
+    if (tuning->luks2) {
+        unsigned long memory = mem_total_kib() / 4;
+        if (memory < LUKS_ARGON2_MIN_KIB) {
+            memory = LUKS_ARGON2_MIN_KIB;
+        } else if (memory > LUKS_ARGON2_MAX_KIB) {
+            memory = LUKS_ARGON2_MAX_KIB;
+        }
+        tuning->pbkdf = "argon2id";
+        tuning->pbkdf_memory_kib = (unsigned)memory;
+        tuning->pbkdf_threads = cpus > LUKS_ARGON2_MAX_THREADS ? LUKS_ARGON2_MAX_THREADS : (unsigned)cpus;
+        /* One IV per 4K instead of per 512 bytes; the mapping then
+         * reports 4K logical blocks, which every root filesystem here
+         * uses anyway. */
+        tuning->sector_size = 4096;
+    } else {
+        tuning->pbkdf = "pbkdf2";
+    }
+
+    /* On flash the extra hop through the kcryptd queues only adds latency;
+     * rotational disks keep them so writes are still sorted. */
+    BlockTopology topology;
+    bool flash = block_probe_topology(device, &topology) == 0 && !topology.rotational;
+    tuning->bypass_workqueues = flash && kernel_has_workqueue_flags();
+
+    int used = snprintf(tuning->format_options, sizeof(tuning->format_options),
+                        " --type %s --cipher %s --key-size %u --pbkdf %s --iter-time %u",
+                        tuning->luks2 ? "luks2" : "luks1", tuning->cipher, tuning->key_bits, tuning->pbkdf,
+                        tuning->iter_time_ms);
+    if (tuning->luks2 && used > 0 && (size_t)used < sizeof(tuning->format_options)) {
+        snprintf(tuning->format_options + used, sizeof(tuning->format_options) - (size_t)used,
+                 " --pbkdf-memory %u --pbkdf-parallel %u --sector-size %u", tuning->pbkdf_memory_kib,
+                 tuning->pbkdf_threads, tuning->sector_size);
+    }
+    if (tuning->bypass_workqueues) {
+        /* LUKS1 has nowhere to keep the flags; they only last for the
+         * install there. */
+        snprintf(tuning->open_options, sizeof(tuning->open_options),
+                 " --perf-no_read_workqueue --perf-no_write_workqueue%s", tuning->luks2 ? " --persistent" : "");
+    }
+
+    if (tuning->encrypt_mibs > 0) {
+        report_add("LUKS", "selected %s, %u-bit key (%.1f MiB/s encrypt, %.1f MiB/s decrypt)", tuning->cipher,
+                   tuning->key_bits, tuning->encrypt_mibs, tuning->decrypt_mibs);
+    }
+    if (tuning->luks2) {
+        report_add("LUKS", "LUKS2, argon2id for %u ms with %u KiB and %u thread%s, %u-byte sectors",
+                   tuning->iter_time_ms, tuning->pbkdf_memory_kib, tuning->pbkdf_threads,
+                   tuning->pbkdf_threads == 1 ? "" : "s", tuning->sector_size);
+    } else {
+        report_add("LUKS", "LUKS1 for GRUB, pbkdf2 for %u ms", tuning->iter_time_ms);
+    }
+    report_add("LUKS", "dm-crypt workqueues %s (%s)", tuning->bypass_workqueues ? "bypassed" : "kept",
+               flash ? "non-rotational" : "rotational or unknown");
+}
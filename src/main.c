@@ -1,8 +1,11 @@
+#include "bandwidth.h"
 #include "bootstrap.h"
 #include "configure.h"
 #include "disk.h"
 #include "log.h"
 #include "network.h"
+#include "peer.h"
+#include "prefetch.h"
 #include "state.h"
 #include "system_utils.h"
 #include "ui.h"
@@ -34,6 +37,9 @@ int main(void)
         }
     }
 
+    /* Before anything forks, so every transfer draws on one budget. */
+    bandwidth_init();
+
     if (ui_init() != 0) {
         fprintf(stderr, "Unable to initialize terminal UI.\n");
         log_close();
@@ -43,12 +49,15 @@ int main(void)
     bool running = true;
     while (running) {
         char subtitle[256];
+        char prefetch[64];
+        prefetch_summary(prefetch, sizeof(prefetch));
         snprintf(subtitle, sizeof(subtitle),
-                 "Disk:%s | Net:%s | Stage3:%s | Boot:%s",
+                 "Disk:%s | Net:%s | Stage3:%s | Boot:%s%s%s",
                  state.disk_prepared ? "ready" : "pending",
                  state.network_configured ? "ready" : "pending",
                  state.stage3_ready ? "ready" : "pending",
-                 state.bootloader_installed ? "installed" : "pending");
+                 state.bootloader_installed ? "installed" : "pending",
+                 prefetch[0] ? " | Prefetch:" : "", prefetch);
 
         const char *items[] = {
             "Disk preparation",
@@ -88,6 +97,8 @@ int main(void)
         }
     }
 
+    prefetch_stop();
+    peer_server_stop();
     ui_message("Goodbye", "Installer exiting. Remember to unmount /mnt/gentoo before rebooting.");
     ui_shutdown();
     log_close();
@@ -0,0 +1,401 @@
+#include "mirror.h"
+
+#include <fcntl.h>
+#include <netdb.h>
+#include <poll.h>
+#include <signal.h>
+#include <sys/socket.h>
+#include <sys/wait.h>
+
+#include "log.h"
+#include "system_utils.h"
+#include "ui.h"
+
+/* Well-connected public mirrors; anything in MIRROR_LIST_PATH is tried too. */
+static const char *const builtin_mirrors[] = {
+    GENTOO_MIRROR_DEFAULT,
+    "https://gentoo.osuosl.org",
+    "https://mirror.leaseweb.com/gentoo",
+    "https://ftp.fau.de/gentoo",
+    "https://mirror.bytemark.co.uk/gentoo",
+    "https://ftp.snt.utwente.nl/pub/os/linux/gentoo",
+    "https://mirrors.mit.edu/gentoo-distfiles",
+    "https://mirror.aarnet.edu.au/pub/gentoo",
+};
+
+typedef struct {
+    MirrorResult *result;
+    pid_t pid;
+    int fd;
+    long long started;
+    long long first_byte;
+    long long finished;
+    long long bytes;
+    bool done;
+} MirrorSample;
+
+static long long monotonic_ms(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (long long)ts.tv_sec * 1000LL + ts.tv_nsec / 1000000L;
+}
+
+static int add_candidate(MirrorResult *results, int count, int max, const char *url)
+{
+    char root[MIRROR_URL_MAX];
+    while (*url && isspace((unsigned char)*url)) {
+        ++url;
+    }
+    snprintf(root, sizeof(root), "%s", url);
+    size_t len = strlen(root);
+    while (len > 0 && (isspace((unsigned char)root[len - 1]) || root[len - 1] == '/')) {
+        root[--len] = '\0';
+    }
+    if (count >= max || len == 0 || root[0] == '#' ||
+        (strncmp(root, "http://", 7) != 0 && strncmp(root, "https://", 8) != 0)) {
+        return count;
+    }
+    for (int i = 0; i < count; ++i) {
+        if (strcmp(results[i].root, root) == 0) {
+            return count;
+        }
+    }
+
+    memset(&results[count], 0, sizeof(results[count]));
+    snprintf(results[count].root, sizeof(results[count].root), "%s", root);
+    results[count].connect_ms = -1;
+    results[count].first_byte_ms = -1;
+    return count + 1;
+}
+
+int mirror_candidates(const char *current_root, MirrorResult *results, int max)
+{
+    int count = 0;
+    if (current_root && current_root[0]) {
+        count = add_candidate(results, count, max, current_root);
+    }
+
+    FILE *f = fopen(MIRROR_LIST_PATH, "r");
+    if (f) {
+        char line[MIRROR_URL_MAX];
+        while (fgets(line, sizeof(line), f)) {
+            count = add_candidate(results, count, max, line);
+        }
+        fclose(f);
+    }
+
+    for (size_t i = 0; i < sizeof(builtin_mirrors) / sizeof(builtin_mirrors[0]); ++i) {
+        count = add_candidate(results, count, max, builtin_mirrors[i]);
+    }
+    return count;
+}
+
+static int parse_host_port(const char *url, char *host, size_t host_len, char *port, size_t port_len)
+{
+    const char *p = url;
+    const char *default_port = "80";
+    if (strncmp(p, "https://", 8) == 0) {
+        p += 8;
+        default_port = "443";
+    } else if (strncmp(p, "http://", 7) == 0) {
+        p += 7;
+    } else {
+        return -1;
+    }
+
+    const char *host_start = p;
+    const char *host_end;
+    if (*p == '[') {
+        host_start = p + 1;
+        host_end = strchr(host_start, ']');
+        if (!host_end) {
+            return -1;
+        }
+        p = host_end + 1;
+    } else {
+        host_end = p + strcspn(p, ":/");
+        p = host_end;
+    }
+
+    size_t len = (size_t)(host_end - host_start);
+    if (len == 0 || len >= host_len) {
+        return -1;
+    }
+    memcpy(host, host_start, len);
+    host[len] = '\0';
+
+    if (*p == ':') {
+        ++p;
+        size_t digits = strspn(p, "0123456789");
+        if (digits == 0 || digits >= port_len) {
+            return -1;
+        }
+        memcpy(port, p, digits);
+        port[digits] = '\0';
+    } else {
+        snprintf(port, port_len, "%s", default_port);
+    }
+    return 0;
+}
+
+/* Opens a non-blocking TCP connection to every mirror at once and records how
+ * long each handshake takes. Name resolution happens up front and is not
+ * part of the figure. */
+static void measure_connect(MirrorResult *results, int count)
+{
+    struct pollfd pfds[MIRROR_MAX_CANDIDATES];
+    long long started[MIRROR_MAX_CANDIDATES];
+    int map[MIRROR_MAX_CANDIDATES];
+    int pending = 0;
+
+    for (int i = 0; i < count && i < MIRROR_MAX_CANDIDATES; ++i) {
+        char host[256];
+        char port[8];
+        if (parse_host_port(results[i].root, host, sizeof(host), port, sizeof(port)) != 0) {
+            log_error("Ignoring malformed mirror URL %s", results[i].root);
+            continue;
+        }
+
+        struct addrinfo hints;
+        memset(&hints, 0, sizeof(hints));
+        hints.ai_family = AF_UNSPEC;
+        hints.ai_socktype = SOCK_STREAM;
+        hints.ai_flags = AI_ADDRCONFIG;
+        struct addrinfo *info = NULL;
+        int err = getaddrinfo(host, port, &hints, &info);
+        if (err != 0 || !info) {
+            log_info("Mirror %s: cannot resolve %s (%s)", results[i].root, host, gai_strerror(err));
+            continue;
+        }
+
+        int fd = socket(info->ai_family, info->ai_socktype | SOCK_NONBLOCK | SOCK_CLOEXEC, info->ai_protocol);
+        if (fd >= 0) {
+            started[pending] = monotonic_ms();
+            if (connect(fd, info->ai_addr, info->ai_addrlen) == 0 || errno == EINPROGRESS) {
+                pfds[pending].fd = fd;
+                pfds[pending].events = POLLOUT;
+                map[pending] = i;
+                pending++;
+            } else {
+                close(fd);
+            }
+        }
+        freeaddrinfo(info);
+    }
+
+    long long deadline = monotonic_ms() + MIRROR_CONNECT_TIMEOUT_MS;
+    int remaining = pending;
+    while (remaining > 0) {
+        long long now = monotonic_ms();
+        if (now >= deadline) {
+            break;
+        }
+        for (int k = 0; k < pending; ++k) {
+            pfds[k].revents = 0;
+        }
+        int ready = poll(pfds, (nfds_t)pending, (int)(deadline - now));
+        if (ready < 0 && errno != EINTR) {
+            break;
+        }
+        now = monotonic_ms();
+        for (int k = 0; k < pending && ready > 0; ++k) {
+            if (pfds[k].fd < 0 || !pfds[k].revents) {
+                continue;
+            }
+            int so_error = 0;
+            socklen_t so_len = sizeof(so_error);
+            if (getsockopt(pfds[k].fd, SOL_SOCKET, SO_ERROR, &so_error, &so_len) == 0 && so_error == 0) {
+                results[map[k]].connect_ms = (long)(now - started[k]);
+            }
+            close(pfds[k].fd);
+            pfds[k].fd = -1;
+            remaining--;
+        }
+    }
+
+    for (int k = 0; k < pending; ++k) {
+        if (pfds[k].fd >= 0) {
+            close(pfds[k].fd);
+        }
+    }
+}
+
+static void sample_finish(MirrorSample *sample, long long now)
+{
+    if (sample->done) {
+        return;
+    }
+    sample->done = true;
+    sample->finished = now;
+    if (sample->fd >= 0) {
+        close(sample->fd);
+        sample->fd = -1;
+    }
+    if (sample->pid > 0) {
+        kill(sample->pid, SIGTERM);
+        while (waitpid(sample->pid, NULL, 0) < 0 && errno == EINTR) {
+        }
+        sample->pid = -1;
+    }
+
+    MirrorResult *result = sample->result;
+    if (sample->bytes > 0) {
+        long long span = sample->finished - sample->first_byte;
+        if (span < 1) {
+            span = 1;
+        }
+        result->first_byte_ms = (long)(sample->first_byte - sample->started);
+        result->throughput = (sample->bytes / 1048576.0) / (span / 1000.0);
+    }
+}
+
+/* Downloads the head of the Portage snapshot from each mirror in parallel and
+ * stops after MIRROR_SAMPLE_BYTES, which is as good as a ranged GET here. */
+static void measure_throughput(MirrorResult **targets, int count)
+{
+    MirrorSample samples[MIRROR_SAMPLE_PARALLEL];
+    struct pollfd pfds[MIRROR_SAMPLE_PARALLEL];
+    int map[MIRROR_SAMPLE_PARALLEL];
+    char buffer[64 * 1024];
+
+    if (count > MIRROR_SAMPLE_PARALLEL) {
+        count = MIRROR_SAMPLE_PARALLEL;
+    }
+    for (int i = 0; i < count; ++i) {
+        MirrorSample *sample = &samples[i];
+        memset(sample, 0, sizeof(*sample));
+        sample->result = targets[i];
+        sample->fd = -1;
+        sample->pid = -1;
+
+        char url[REMOTE_URL_MAX];
+        char quoted[REMOTE_URL_MAX * 2];
+        char cmd[MAX_CMD_LEN];
+        if (snprintf(url, sizeof(url), "%s%s/%s", targets[i]->root, PORTAGE_MIRROR_PATH, PORTAGE_SNAPSHOT_NAME) >=
+                (int)sizeof(url) ||
+            shell_escape_single_quotes(url, quoted, sizeof(quoted)) != 0 ||
+            snprintf(cmd, sizeof(cmd), "wget -q --tries=1 --timeout=%d -O - '%s'",
+                     MIRROR_SAMPLE_TIMEOUT_MS / 1000, quoted) >= (int)sizeof(cmd)) {
+            sample->done = true;
+            continue;
+        }
+        sample->started = monotonic_ms();
+        sample->pid = spawn_command_reader(cmd, &sample->fd);
+        if (sample->pid < 0) {
+            sample->done = true;
+        }
+    }
+
+    long long deadline = monotonic_ms() + MIRROR_SAMPLE_TIMEOUT_MS;
+    while (1) {
+        int active = 0;
+        for (int i = 0; i < count; ++i) {
+            if (!samples[i].done) {
+                pfds[active].fd = samples[i].fd;
+                pfds[active].events = POLLIN;
+                pfds[active].revents = 0;
+                map[active] = i;
+                active++;
+            }
+        }
+        long long now = monotonic_ms();
+        if (active == 0 || now >= deadline) {
+            break;
+        }
+
+        int ready = poll(pfds, (nfds_t)active, (int)(deadline - now));
+        if (ready < 0 && errno != EINTR) {
+            break;
+        }
+        now = monotonic_ms();
+        for (int k = 0; k < active; ++k) {
+            if (!(pfds[k].revents & (POLLIN | POLLHUP | POLLERR))) {
+                continue;
+            }
+            MirrorSample *sample = &samples[map[k]];
+            ssize_t got = read(sample->fd, buffer, sizeof(buffer));
+            if (got < 0 && (errno == EINTR || errno == EAGAIN)) {
+                continue;
+            }
+            if (got <= 0) {
+                sample_finish(sample, now);
+                continue;
+            }
+            if (sample->bytes == 0) {
+                sample->first_byte = now;
+            }
+            sample->bytes += got;
+            if (sample->bytes >= MIRROR_SAMPLE_BYTES) {
+                sample_finish(sample, now);
+            }
+        }
+    }
+
+    long long now = monotonic_ms();
+    for (int i = 0; i < count; ++i) {
+        sample_finish(&samples[i], now);
+    }
+}
+
+static int compare_connect(const void *a, const void *b)
+{
+    const MirrorResult *left = *(const MirrorResult *const *)a;
+    const MirrorResult *right = *(const MirrorResult *const *)b;
+    return (left->connect_ms > right->connect_ms) - (left->connect_ms < right->connect_ms);
+}
+
+/* Sampled mirrors by throughput, then the rest by connect time, then the
+ * unreachable ones. */
+static int compare_rank(const void *a, const void *b)
+{
+    const MirrorResult *left = a;
+    const MirrorResult *right = b;
+    bool left_up = left->connect_ms >= 0;
+    bool right_up = right->connect_ms >= 0;
+    if (left_up != right_up) {
+        return left_up ? -1 : 1;
+    }
+    if (left->throughput != right->throughput) {
+        return left->throughput > right->throughput ? -1 : 1;
+    }
+    return (left->connect_ms > right->connect_ms) - (left->connect_ms < right->connect_ms);
+}
+
+int mirror_benchmark(MirrorResult *results, int count)
+{
+    if (!results || count <= 0) {
+        return 0;
+    }
+    if (count > MIRROR_MAX_CANDIDATES) {
+        count = MIRROR_MAX_CANDIDATES;
+    }
+
+    char message[MAX_MESSAGE_LEN];
+    snprintf(message, sizeof(message), "Measuring connect latency to %d mirrors...", count);
+    ui_progress("Mirrors", message, 10);
+    measure_connect(results, count);
+
+    MirrorResult *reachable[MIRROR_MAX_CANDIDATES];
+    int reachable_count = 0;
+    for (int i = 0; i < count; ++i) {
+        if (results[i].connect_ms >= 0) {
+            reachable[reachable_count++] = &results[i];
+        }
+    }
+    qsort(reachable, (size_t)reachable_count, sizeof(reachable[0]), compare_connect);
+
+    if (reachable_count > 0) {
+        int sampled = reachable_count < MIRROR_SAMPLE_PARALLEL ? reachable_count : MIRROR_SAMPLE_PARALLEL;
+        snprintf(message, sizeof(message), "Sampling download speed from the %d closest mirrors...", sampled);
+        ui_progress("Mirrors", message, 50);
+        measure_throughput(reachable, sampled);
+    }
+
+    qsort(results, (size_t)count, sizeof(results[0]), compare_rank);
+    for (int i = 0; i < count; ++i) {
+        log_info("Mirror #%d %s: connect %ld ms, first byte %ld ms, %.2f MB/s", i + 1, results[i].root,
+                 results[i].connect_ms, results[i].first_byte_ms, results[i].throughput);
+    }
+    return reachable_count;
+}
@@ -2,6 +2,9 @@
 
 #include <dirent.h>
 
+#include "bandwidth.h"
+#include "bootstrap.h"
+
 typedef struct {
     char name[64];
     char mac[32];
@@ -144,6 +147,7 @@ static int configure_dhcp(InstallerState *state)
     state->network_dhcp = true;
     state->network_configured = true;
     ui_message("Network", "DHCP configuration applied.");
+    bootstrap_prefetch(state);
     return 0;
 }
 
@@ -224,6 +228,7 @@ static int configure_static(InstallerState *state)
     state->network_dhcp = false;
     state->network_configured = true;
     ui_message("Static IPv4", "Static configuration applied.");
+    bootstrap_prefetch(state);
     return 0;
 }
 
@@ -234,25 +239,56 @@ static int test_connectivity(void)
     return rc;
 }
 
+static int configure_bandwidth(void)
+{
+    char allocation[256];
+    bandwidth_describe(allocation, sizeof(allocation));
+    char prompt[384];
+    snprintf(prompt, sizeof(prompt), "%s. New cap in bytes/s, e.g. 2M or 512K (0 = unlimited)", allocation);
+
+    char value[32];
+    long long limit = bandwidth_limit();
+    if (limit > 0) {
+        snprintf(value, sizeof(value), "%lldK", limit / 1024);
+    } else {
+        snprintf(value, sizeof(value), "0");
+    }
+    if (ui_prompt_input("Bandwidth", prompt, value, sizeof(value), value, false) != 0) {
+        return -1;
+    }
+    long long rate = bandwidth_parse_rate(value);
+    if (rate < 0) {
+        ui_message("Bandwidth", "Use a number of bytes per second with an optional K, M or G suffix.");
+        return -1;
+    }
+    bandwidth_set_limit(rate);
+    bandwidth_describe(allocation, sizeof(allocation));
+    ui_message("Bandwidth", allocation);
+    return 0;
+}
+
 int network_workflow(InstallerState *state)
 {
     while (1) {
+        char allocation[160];
+        bandwidth_describe(allocation, sizeof(allocation));
         char subtitle[256];
         snprintf(subtitle, sizeof(subtitle),
-                 "Interface: %s | Mode: %s",
+                 "Interface: %s | Mode: %s | %s",
                  state->network_interface[0] ? state->network_interface : "<none>",
-                 state->network_dhcp ? "DHCP" : "Static");
+                 state->network_dhcp ? "DHCP" : "Static", allocation);
 
         const char *items[] = {
             "Select network interface",
             "Configure via DHCP",
             "Configure static IPv4",
             "Test connectivity",
+            "Bandwidth cap and allocations",
             "Back to main menu",
         };
 
-        int choice = ui_menu("Network Configuration", subtitle, items, 5, 0);
-        if (choice < 0 || choice == 4) {
+        int choice = ui_menu("Network Configuration", subtitle, items, 6, 0);
+        if (choice < 0 || choice == 5) {
             return 0;
         }
 
@@ -269,6 +305,9 @@ int network_workflow(InstallerState *state)
         case 3:
             test_connectivity();
             break;
+        case 4:
+            configure_bandwidth();
+            break;
         default:
             break;
         }
@@ -0,0 +1,615 @@
+#include "partition_table.h"
+
+#include <dirent.h>
+#include <fcntl.h>
+#include <linux/blkpg.h>
+#include <linux/fs.h>
+#include <sys/ioctl.h>
+#include <sys/random.h>
+#include <sys/sysmacros.h>
+
+#include "block_probe.h"
+#include "log.h"
+
+#define PTABLE_MBR_SIGNATURE_OFFSET 440
+#define PTABLE_MBR_ENTRIES_OFFSET 446
+#define PTABLE_MBR_PROTECTIVE_TYPE 0xEE
+#define PTABLE_GPT_HEADER_SIZE 92
+#define PTABLE_GPT_REVISION 0x00010000u
+#define PTABLE_GPT_ATTR_LEGACY_BOOT (1ULL << 2)
+#define PTABLE_REREAD_ATTEMPTS 5
+#define PTABLE_REREAD_DELAY_US 200000
+
+static void put_le16(uint8_t *p, uint16_t v)
+{
+    p[0] = (uint8_t)v;
+    p[1] = (uint8_t)(v >> 8);
+}
+
+static void put_le32(uint8_t *p, uint32_t v)
+{
+    for (int i = 0; i < 4; ++i) {
+        p[i] = (uint8_t)(v >> (8 * i));
+    }
+}
+
+static void put_le64(uint8_t *p, uint64_t v)
+{
+    for (int i = 0; i < 8; ++i) {
+        p[i] = (uint8_t)(v >> (8 * i));
+    }
+}
+
+/* The reflected IEEE polynomial UEFI uses for header and entry checksums. */
+static uint32_t crc32_ieee(const uint8_t *data, size_t len)
+{
+    uint32_t crc = 0xFFFFFFFFu;
+    for (size_t i = 0; i < len; ++i) {
+        crc ^= data[i];
+        for (int bit = 0; bit < 8; ++bit) {
+            crc = (crc >> 1) ^ (0xEDB88320u & (0u - (crc & 1u)));
+        }
+    }
+    return ~crc;
+}
+
+static void random_bytes(uint8_t *out, size_t len)
+{
+    size_t got = 0;
+    while (got < len) {
+        ssize_t n = getrandom(out + got, len - got, 0);
+        if (n < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            break;
+        }
+        got += (size_t)n;
+    }
+    /* Uniqueness is all that matters here, not secrecy. */
+    for (; got < len; ++got) {
+        out[got] = (uint8_t)rand();
+    }
+}
+
+static void random_guid(uint8_t guid[16])
+{
+    random_bytes(guid, 16);
+    guid[7] = (uint8_t)((guid[7] & 0x0F) | 0x40);
+    guid[8] = (uint8_t)((guid[8] & 0x3F) | 0x80);
+}
+
+/* GUIDs are stored with their first three fields little endian. */
+static int parse_guid(const char *text, uint8_t guid[16])
+{
+    static const int order[16] = {3, 2, 1, 0, 5, 4, 7, 6, 8, 9, 10, 11, 12, 13, 14, 15};
+    uint8_t raw[16];
+    if (!text || strlen(text) != 36) {
+        return -1;
+    }
+    int n = 0;
+    for (int i = 0; i < 36; ++i) {
+        if (i == 8 || i == 13 || i == 18 || i == 23) {
+            if (text[i] != '-') {
+                return -1;
+            }
+            continue;
+        }
+        if (!isxdigit((unsigned char)text[i]) || !isxdigit((unsigned char)text[i + 1])) {
+            return -1;
+        }
+        char pair[3] = {text[i], text[i + 1], '\0'};
+        raw[n++] = (uint8_t)strtoul(pair, NULL, 16);
+        i++;
+    }
+    for (int i = 0; i < 16; ++i) {
+        guid[i] = raw[order[i]];
+    }
+    return 0;
+}
+
+/* Bytes for a number with an optional binary K/M/G/T suffix; a bare number
+ * counts sectors, as in fdisk. */
+static int parse_size(const char *text, unsigned sector_size, uint64_t *bytes)
+{
+    char *end = NULL;
+    errno = 0;
+    unsigned long long value = strtoull(text, &end, 10);
+    if (end == text || errno != 0) {
+        return -1;
+    }
+    unsigned shift = 0;
+    switch (toupper((unsigned char)*end)) {
+    case 'K':
+        shift = 10;
+        break;
+    case 'M':
+        shift = 20;
+        break;
+    case 'G':
+        shift = 30;
+        break;
+    case 'T':
+        shift = 40;
+        break;
+    case '\0':
+        *bytes = (uint64_t)value * sector_size;
+        return 0;
+    default:
+        return -1;
+    }
+    end++;
+    if (*end == 'i' || *end == 'I') {
+        end++;
+    }
+    if (*end == 'B' || *end == 'b') {
+        end++;
+    }
+    if (*end || value > (UINT64_MAX >> shift)) {
+        return -1;
+    }
+    *bytes = (uint64_t)value << shift;
+    return 0;
+}
+
+/* First LBA at or after lba that sits offset past a multiple of alignment. */
+static uint64_t align_up(uint64_t lba, uint64_t alignment, uint64_t offset)
+{
+    if (lba <= offset) {
+        return offset;
+    }
+    return ((lba - offset + alignment - 1) / alignment) * alignment + offset;
+}
+
+static uint64_t gcd_u64(uint64_t a, uint64_t b)
+{
+    while (b) {
+        uint64_t t = a % b;
+        a = b;
+        b = t;
+    }
+    return a;
+}
+
+static uint64_t lcm_u64(uint64_t a, uint64_t b)
+{
+    return a / gcd_u64(a, b) * b;
+}
+
+void partition_table_alignment(const BlockTopology *topology, PartitionAlignment *alignment)
+{
+    uint64_t grain = PTABLE_ALIGN_BYTES;
+    alignment->offset = 0;
+    if (topology) {
+        grain = lcm_u64(grain, topology->physical_block ? topology->physical_block : 512);
+        grain = lcm_u64(grain, topology->minimum_io ? topology->minimum_io : 512);
+        /* Some USB bridges report nonsense such as 33553920; a stripe that
+         * is not made of whole minimum units cannot be real. */
+        if (topology->optimal_io && topology->minimum_io && topology->optimal_io % topology->minimum_io == 0) {
+            uint64_t with_stripe = lcm_u64(grain, topology->optimal_io);
+            if (with_stripe <= PTABLE_ALIGN_MAX_BYTES) {
+                grain = with_stripe;
+            } else {
+                log_info("Ignoring optimal I/O size %u; aligning to it would waste too much space",
+                         topology->optimal_io);
+            }
+        } else if (topology->optimal_io) {
+            log_info("Ignoring optimal I/O size %u, not a multiple of the minimum I/O size %u",
+                     topology->optimal_io, topology->minimum_io);
+        }
+        alignment->offset = topology->alignment_offset % grain;
+    }
+    alignment->grain = grain;
+}
+
+static uint64_t gpt_entry_sectors(unsigned sector_size)
+{
+    return (PTABLE_GPT_ENTRIES * PTABLE_GPT_ENTRY_SIZE + sector_size - 1) / sector_size;
+}
+
+int partition_table_geometry(int fd, unsigned *sector_size, uint64_t *total_sectors)
+{
+    struct stat st;
+    if (fstat(fd, &st) != 0) {
+        return -1;
+    }
+    uint64_t bytes = 0;
+    int logical = 512;
+    if (S_ISBLK(st.st_mode)) {
+        if (ioctl(fd, BLKSSZGET, &logical) != 0 || ioctl(fd, BLKGETSIZE64, &bytes) != 0) {
+            log_error("Unable to query block device geometry: %s", strerror(errno));
+            return -1;
+        }
+    } else if (S_ISREG(st.st_mode)) {
+        bytes = (uint64_t)st.st_size;
+    } else {
+        log_error("Partition tables can only be written to block devices or image files");
+        return -1;
+    }
+    if (logical < 512 || (logical & (logical - 1)) != 0) {
+        log_error("Unsupported logical sector size %d", logical);
+        return -1;
+    }
+    *sector_size = (unsigned)logical;
+    *total_sectors = bytes / (unsigned)logical;
+    return 0;
+}
+
+int partition_table_build(PartitionTable *table, bool gpt, unsigned sector_size, uint64_t total_sectors,
+                          const PartitionAlignment *alignment, const PartitionSpec *plan, size_t count)
+{
+    if (!table || !plan || count == 0 || count > MAX_PARTITION_SPECS || sector_size < 512) {
+        return -1;
+    }
+    memset(table, 0, sizeof(*table));
+    table->gpt = gpt;
+    table->sector_size = sector_size;
+    table->total_sectors = total_sectors;
+    uint64_t grain = alignment && alignment->grain ? alignment->grain : PTABLE_ALIGN_BYTES;
+    table->alignment = grain / sector_size ? grain / sector_size : 1;
+    table->alignment_offset = alignment ? (alignment->offset / sector_size) % table->alignment : 0;
+
+    uint64_t entry_sectors = gpt_entry_sectors(sector_size);
+    if (total_sectors < 2 * (entry_sectors + 2) + table->alignment) {
+        log_error("Disk of %llu sectors is too small to partition", (unsigned long long)total_sectors);
+        return -1;
+    }
+    uint64_t first_usable = gpt ? 2 + entry_sectors : 1;
+    uint64_t last_usable = gpt ? total_sectors - 2 - entry_sectors : total_sectors - 1;
+    if (!gpt && (count > PTABLE_MBR_PRIMARY || last_usable > UINT32_MAX)) {
+        log_error("An MBR holds at most %d partitions within 2 TiB of %u byte sectors", PTABLE_MBR_PRIMARY,
+                  sector_size);
+        return -1;
+    }
+
+    uint64_t next = first_usable;
+    for (size_t i = 0; i < count; ++i) {
+        const PartitionSpec *spec = &plan[i];
+        PartitionTableEntry *entry = &table->entries[i];
+        const char *role = spec->role ? spec->role : "?";
+        int max_number = gpt ? PTABLE_GPT_ENTRIES : PTABLE_MBR_PRIMARY;
+        if (spec->part_number < 1 || spec->part_number > max_number) {
+            log_error("Partition %s has invalid number %d", role, spec->part_number);
+            return -1;
+        }
+        for (size_t j = 0; j < i; ++j) {
+            if (table->entries[j].number == spec->part_number) {
+                log_error("Partition number %d is used twice", spec->part_number);
+                return -1;
+            }
+        }
+
+        entry->number = spec->part_number;
+        entry->first_lba = align_up(next, table->alignment, table->alignment_offset);
+        uint64_t size_bytes = 0;
+        const char *size = spec->size_spec;
+        if (size[0] && (size[0] != '+' && size[0] != '-')) {
+            log_error("Partition %s: size '%s' must start with + or -", role, size);
+            return -1;
+        }
+        if (size[0] && parse_size(size + 1, sector_size, &size_bytes) != 0) {
+            log_error("Partition %s: unable to parse size '%s'", role, size);
+            return -1;
+        }
+        uint64_t size_sectors = (size_bytes + sector_size - 1) / sector_size;
+        if (size[0] == '+') {
+            entry->last_lba = entry->first_lba + size_sectors - 1;
+        } else if (size[0] == '-') {
+            entry->last_lba = size_sectors < last_usable ? last_usable - size_sectors : 0;
+        } else {
+            /* Stop at the last boundary so a later resize or a stacked
+             * mapping keeps its alignment. */
+            uint64_t end = align_up(last_usable + 1, table->alignment, table->alignment_offset);
+            if (end > last_usable + 1) {
+                end -= table->alignment;
+            }
+            entry->last_lba = end > entry->first_lba ? end - 1 : last_usable;
+        }
+        if ((size[0] == '+' && size_sectors == 0) || entry->first_lba > last_usable ||
+            entry->last_lba < entry->first_lba || entry->last_lba > last_usable) {
+            log_error("Partition %s (%s) does not fit on the disk", role, size[0] ? size : "rest of disk");
+            return -1;
+        }
+        next = entry->last_lba + 1;
+
+        if (gpt) {
+            if (parse_guid(spec->gpt_type, entry->type_guid) != 0) {
+                log_error("Partition %s has invalid GPT type '%s'", role, spec->gpt_type ? spec->gpt_type : "");
+                return -1;
+            }
+            random_guid(entry->unique_guid);
+        } else {
+            char *end = NULL;
+            unsigned long type = spec->mbr_type ? strtoul(spec->mbr_type, &end, 16) : 0;
+            if (type == 0 || type > 0xFF || *end) {
+                log_error("Partition %s has invalid MBR type '%s'", role, spec->mbr_type ? spec->mbr_type : "");
+                return -1;
+            }
+            entry->mbr_type = (uint8_t)type;
+        }
+        entry->bootable = spec->bootable;
+        snprintf(entry->name, sizeof(entry->name), "%s", spec->label ? spec->label : "");
+        table->count++;
+    }
+
+    random_guid(table->disk_guid);
+    random_bytes((uint8_t *)&table->mbr_signature, sizeof(table->mbr_signature));
+    return 0;
+}
+
+static void lba_to_chs(uint64_t lba, uint8_t chs[3])
+{
+    const uint64_t heads = 255;
+    const uint64_t sectors = 63;
+    uint64_t cylinder = lba / (heads * sectors);
+    if (cylinder > 1023) {
+        chs[0] = 0xFE;
+        chs[1] = 0xFF;
+        chs[2] = 0xFF;
+        return;
+    }
+    uint64_t head = (lba / sectors) % heads;
+    uint64_t sector = lba % sectors + 1;
+    chs[0] = (uint8_t)head;
+    chs[1] = (uint8_t)((sector & 0x3F) | ((cylinder >> 2) & 0xC0));
+    chs[2] = (uint8_t)(cylinder & 0xFF);
+}
+
+static void mbr_entry(uint8_t *slot, bool bootable, uint8_t type, uint64_t first, uint64_t sectors)
+{
+    slot[0] = bootable ? 0x80 : 0x00;
+    lba_to_chs(first, slot + 1);
+    slot[4] = type;
+    lba_to_chs(first + sectors - 1, slot + 5);
+    put_le32(slot + 8, (uint32_t)first);
+    put_le32(slot + 12, (uint32_t)(sectors > UINT32_MAX ? UINT32_MAX : sectors));
+}
+
+static void gpt_header(uint8_t *header, const PartitionTable *table, uint64_t my_lba, uint64_t alternate_lba,
+                       uint64_t entries_lba, uint32_t entries_crc)
+{
+    uint64_t entry_sectors = gpt_entry_sectors(table->sector_size);
+    memset(header, 0, table->sector_size);
+    memcpy(header, "EFI PART", 8);
+    put_le32(header + 8, PTABLE_GPT_REVISION);
+    put_le32(header + 12, PTABLE_GPT_HEADER_SIZE);
+    put_le64(header + 24, my_lba);
+    put_le64(header + 32, alternate_lba);
+    put_le64(header + 40, 2 + entry_sectors);
+    put_le64(header + 48, table->total_sectors - 2 - entry_sectors);
+    memcpy(header + 56, table->disk_guid, 16);
+    put_le64(header + 72, entries_lba);
+    put_le32(header + 80, PTABLE_GPT_ENTRIES);
+    put_le32(header + 84, PTABLE_GPT_ENTRY_SIZE);
+    put_le32(header + 88, entries_crc);
+    put_le32(header + 16, crc32_ieee(header, PTABLE_GPT_HEADER_SIZE));
+}
+
+static int write_all_at(int fd, const uint8_t *data, size_t len, uint64_t offset)
+{
+    size_t done = 0;
+    while (done < len) {
+        ssize_t n = pwrite(fd, data + done, len - done, (off_t)(offset + done));
+        if (n < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            return -1;
+        }
+        done += (size_t)n;
+    }
+    return 0;
+}
+
+/* The label lives in the first and last few sectors. Both are written in
+ * full so no trace of an earlier GPT or MBR survives next to the new one. */
+int partition_table_write(int fd, const PartitionTable *table)
+{
+    if (!table || table->count < 1) {
+        return -1;
+    }
+    const size_t ss = table->sector_size;
+    const uint64_t entry_sectors = gpt_entry_sectors(table->sector_size);
+    const size_t area_len = ss * (size_t)(2 + entry_sectors);
+    uint8_t *head = calloc(1, area_len);
+    uint8_t *tail = calloc(1, area_len);
+    if (!head || !tail) {
+        free(head);
+        free(tail);
+        return -1;
+    }
+
+    uint8_t *mbr = head;
+    mbr[510] = 0x55;
+    mbr[511] = 0xAA;
+    uint64_t last_used = 0;
+    for (int i = 0; i < table->count; ++i) {
+        if (table->entries[i].last_lba > last_used) {
+            last_used = table->entries[i].last_lba;
+        }
+    }
+
+    if (table->gpt) {
+        uint64_t protective = table->total_sectors - 1;
+        mbr_entry(mbr + PTABLE_MBR_ENTRIES_OFFSET, false, PTABLE_MBR_PROTECTIVE_TYPE, 1, protective);
+
+        uint8_t *entries = head + 2 * ss;
+        for (int i = 0; i < table->count; ++i) {
+            const PartitionTableEntry *entry = &table->entries[i];
+            uint8_t *slot = entries + (size_t)(entry->number - 1) * PTABLE_GPT_ENTRY_SIZE;
+            memcpy(slot, entry->type_guid, 16);
+            memcpy(slot + 16, entry->unique_guid, 16);
+            put_le64(slot + 32, entry->first_lba);
+            put_le64(slot + 40, entry->last_lba);
+            put_le64(slot + 48, entry->bootable ? PTABLE_GPT_ATTR_LEGACY_BOOT : 0);
+            for (size_t c = 0; c < PTABLE_GPT_NAME_CHARS && entry->name[c]; ++c) {
+                put_le16(slot + 56 + 2 * c, (uint8_t)entry->name[c]);
+            }
+        }
+        uint32_t entries_crc = crc32_ieee(entries, PTABLE_GPT_ENTRIES * PTABLE_GPT_ENTRY_SIZE);
+        uint64_t backup_header = table->total_sectors - 1;
+        uint64_t backup_entries = backup_header - entry_sectors;
+        gpt_header(head + ss, table, 1, backup_header, 2, entries_crc);
+
+        memcpy(tail, entries, (size_t)entry_sectors * ss);
+        gpt_header(tail + (size_t)entry_sectors * ss, table, backup_header, 1, backup_entries, entries_crc);
+    } else {
+        put_le32(mbr + PTABLE_MBR_SIGNATURE_OFFSET, table->mbr_signature);
+        for (int i = 0; i < table->count; ++i) {
+            const PartitionTableEntry *entry = &table->entries[i];
+            mbr_entry(mbr + PTABLE_MBR_ENTRIES_OFFSET + 16 * (entry->number - 1), entry->bootable,
+                      entry->mbr_type, entry->first_lba, entry->last_lba - entry->first_lba + 1);
+        }
+    }
+
+    /* The backup entries and header; with an MBR the same sectors are just
+     * cleared, as long as no partition covers them. */
+    uint64_t tail_lba = table->total_sectors - 1 - entry_sectors;
+    int rc = write_all_at(fd, head, area_len, 0);
+    if (rc == 0 && (table->gpt || last_used < tail_lba)) {
+        rc = write_all_at(fd, tail, area_len - ss, tail_lba * ss);
+    }
+    if (rc == 0 && fsync(fd) != 0) {
+        rc = -1;
+    }
+    if (rc != 0) {
+        log_error("Unable to write partition table: %s", strerror(errno));
+    }
+    free(head);
+    free(tail);
+    return rc;
+}
+
+static int blkpg_partition(int fd, int op, int number, long long start, long long length)
+{
+    struct blkpg_partition part;
+    memset(&part, 0, sizeof(part));
+    part.pno = number;
+    part.start = start;
+    part.length = length;
+    struct blkpg_ioctl_arg arg = {.op = op, .flags = 0, .datalen = sizeof(part), .data = &part};
+    return ioctl(fd, BLKPG, &arg);
+}
+
+/* Whether the kernel lists every partition of table under the disk in
+ * sysfs. BLKRRPART succeeds even when the kernel lacks the parser for the
+ * label, leaving no partitions behind. */
+static bool kernel_sees_partitions(dev_t disk, const PartitionTable *table)
+{
+    char path[PATH_MAX];
+    snprintf(path, sizeof(path), "/sys/dev/block/%u:%u", major(disk), minor(disk));
+    DIR *dir = opendir(path);
+    if (!dir) {
+        return false;
+    }
+    bool seen[PTABLE_GPT_ENTRIES + 1] = {false};
+    struct dirent *entry;
+    while ((entry = readdir(dir)) != NULL) {
+        char number_path[PATH_MAX];
+        if (entry->d_name[0] == '.' ||
+            snprintf(number_path, sizeof(number_path), "%s/%s/partition", path, entry->d_name) >=
+                (int)sizeof(number_path)) {
+            continue;
+        }
+        FILE *f = fopen(number_path, "r");
+        int number = 0;
+        if (f) {
+            if (fscanf(f, "%d", &number) == 1 && number > 0 && number <= PTABLE_GPT_ENTRIES) {
+                seen[number] = true;
+            }
+            fclose(f);
+        }
+    }
+    closedir(dir);
+    for (int i = 0; i < table->count; ++i) {
+        if (!seen[table->entries[i].number]) {
+            return false;
+        }
+    }
+    return true;
+}
+
+int partition_table_reread(int fd, const PartitionTable *table)
+{
+    struct stat st;
+    if (fstat(fd, &st) != 0) {
+        return -1;
+    }
+    if (!S_ISBLK(st.st_mode)) {
+        return 0;
+    }
+
+    int rc = -1;
+    for (int attempt = 0; attempt < PTABLE_REREAD_ATTEMPTS; ++attempt) {
+        rc = ioctl(fd, BLKRRPART);
+        if (rc == 0 || errno != EBUSY) {
+            break;
+        }
+        usleep(PTABLE_REREAD_DELAY_US);
+    }
+    if (rc == 0 && kernel_sees_partitions(st.st_rdev, table)) {
+        return 0;
+    }
+    if (rc == 0) {
+        log_info("Kernel did not pick up the new partitions on reread; adding them one by one");
+    } else {
+        log_info("BLKRRPART failed (%s); updating partitions one by one", strerror(errno));
+    }
+
+    /* Stale partitions beyond the new table would otherwise linger. */
+    int highest = PTABLE_MBR_PRIMARY;
+    for (int i = 0; i < table->count; ++i) {
+        if (table->entries[i].number > highest) {
+            highest = table->entries[i].number;
+        }
+    }
+    for (int number = 1; number <= highest + MAX_PARTITION_SPECS; ++number) {
+        if (blkpg_partition(fd, BLKPG_DEL_PARTITION, number, 0, 0) != 0 && errno != ENXIO) {
+            log_info("BLKPG could not remove partition %d: %s", number, strerror(errno));
+        }
+    }
+    const long long ss = table->sector_size;
+    for (int i = 0; i < table->count; ++i) {
+        const PartitionTableEntry *entry = &table->entries[i];
+        if (blkpg_partition(fd, BLKPG_ADD_PARTITION, entry->number, (long long)entry->first_lba * ss,
+                            (long long)(entry->last_lba - entry->first_lba + 1) * ss) != 0) {
+            log_error("BLKPG could not add partition %d: %s%s", entry->number, strerror(errno),
+                      major(st.st_rdev) == 7 ? " (attach loop devices with partition scanning, losetup -P)" : "");
+            return -1;
+        }
+    }
+    return 0;
+}
+
+int partition_table_apply(const char *path, bool gpt, const PartitionAlignment *alignment, const PartitionSpec *plan,
+                          size_t count)
+{
+    int fd = open(path, O_RDWR | O_CLOEXEC);
+    if (fd < 0) {
+        log_error("Unable to open %s: %s", path, strerror(errno));
+        return -1;
+    }
+    unsigned sector_size = 0;
+    uint64_t total_sectors = 0;
+    PartitionTable table;
+    int rc = -1;
+    if (partition_table_geometry(fd, &sector_size, &total_sectors) == 0 &&
+        partition_table_build(&table, gpt, sector_size, total_sectors, alignment, plan, count) == 0 &&
+        partition_table_write(fd, &table) == 0 && partition_table_reread(fd, &table) == 0) {
+        rc = 0;
+    }
+    close(fd);
+    /* Partitions that went away may have been cached under reused numbers. */
+    block_probe_invalidate();
+    if (rc == 0) {
+        log_info("Wrote %s partition table with %d partition%s to %s (%u byte sectors, %llu KiB alignment)",
+                 gpt ? "GPT" : "MBR", table.count, table.count == 1 ? "" : "s", path, sector_size,
+                 (unsigned long long)(table.alignment * sector_size / 1024));
+        for (int i = 0; i < table.count; ++i) {
+            log_info("  #%d sectors %llu-%llu %s", table.entries[i].number,
+                     (unsigned long long)table.entries[i].first_lba, (unsigned long long)table.entries[i].last_lba,
+                     table.entries[i].name);
+        }
+    }
+    return rc;
+}
@@ -0,0 +1,767 @@
+#include "peer.h"
+
+#include <arpa/inet.h>
+#include <fcntl.h>
+#include <netdb.h>
+#include <netinet/in.h>
+#include <poll.h>
+#include <signal.h>
+#include <sys/prctl.h>
+#include <sys/sendfile.h>
+#include <sys/socket.h>
+#include <sys/wait.h>
+
+#include "cas.h"
+#include "delta.h"
+#include "fetch.h"
+#include "log.h"
+#include "system_utils.h"
+#include "ui.h"
+
+#define PEER_QUERY "LIBERO-PEER-QUERY"
+#define PEER_REPLY "LIBERO-PEER"
+#define PEER_REQUEST_MAX 4096
+#define PEER_IO_TIMEOUT_S 30
+/* Peers come and go while a room full of machines is being installed. */
+#define PEER_REFRESH_S 60
+
+static pid_t server_pid = -1;
+static int server_port;
+static char instance_id[40];
+
+static PeerAddress known_peers[PEER_MAX];
+static int known_count;
+static time_t known_at;
+
+static long long monotonic_ms(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (long long)ts.tv_sec * 1000 + ts.tv_nsec / 1000000;
+}
+
+/* Tags discovery traffic so an installer never lists its own server. */
+static const char *peer_instance_id(void)
+{
+    if (!instance_id[0]) {
+        struct timespec ts;
+        clock_gettime(CLOCK_REALTIME, &ts);
+        snprintf(instance_id, sizeof(instance_id), "%lx-%lx-%lx", (unsigned long)getpid(),
+                 (unsigned long)ts.tv_sec, (unsigned long)ts.tv_nsec);
+    }
+    return instance_id;
+}
+
+int peer_default_port(void)
+{
+    const char *env = getenv("LIBERO_PEER_PORT");
+    if (env && *env) {
+        char *end = NULL;
+        long port = strtol(env, &end, 10);
+        if (end && *end == '\0' && port > 0 && port < 65536) {
+            return (int)port;
+        }
+    }
+    return PEER_DEFAULT_PORT;
+}
+
+int peer_server_port(void)
+{
+    return server_pid > 0 ? server_port : 0;
+}
+
+static int write_all(int fd, const char *data, size_t len)
+{
+    while (len > 0) {
+        ssize_t written = write(fd, data, len);
+        if (written < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            return -1;
+        }
+        data += written;
+        len -= (size_t)written;
+    }
+    return 0;
+}
+
+static void send_status(int fd, int code, const char *reason)
+{
+    char header[256];
+    int n = snprintf(header, sizeof(header),
+                     "HTTP/1.1 %d %s\r\nContent-Length: 0\r\nConnection: close\r\nServer: libero-installer\r\n\r\n",
+                     code, reason);
+    if (n > 0 && n < (int)sizeof(header)) {
+        write_all(fd, header, (size_t)n);
+    }
+}
+
+/* Only /cas/<algorithm>/<lowercase hex digest> is served. Anything else,
+ * including traversal attempts, is rejected before touching the filesystem. */
+static int resolve_request(const char *cache_dir, const char *target, char *path, size_t len)
+{
+    static const char prefix[] = "/" CAS_DIR_NAME "/";
+    if (strncmp(target, prefix, sizeof(prefix) - 1) != 0) {
+        return -1;
+    }
+    const char *name = target + sizeof(prefix) - 1;
+    const char *slash = strchr(name, '/');
+    char algorithm_name[16];
+    if (!slash || slash == name || (size_t)(slash - name) >= sizeof(algorithm_name)) {
+        return -1;
+    }
+    memcpy(algorithm_name, name, (size_t)(slash - name));
+    algorithm_name[slash - name] = '\0';
+
+    HashAlgorithm algorithm;
+    if (hash_algorithm_from_name(algorithm_name, &algorithm) != 0) {
+        return -1;
+    }
+    return cas_lookup(cache_dir, algorithm, slash + 1, path, len) == 0 ? 0 : -1;
+}
+
+/* "<object>.blocks" is the delta transfer index of a cached object, written
+ * by cas_store. Only an index that already exists and is not older than its
+ * object is served; a request never makes the server hash or write
+ * anything. */
+static int resolve_index(const char *cache_dir, const char *target, char *path, size_t len)
+{
+    size_t target_len = strlen(target);
+    size_t suffix_len = strlen(DELTA_INDEX_SUFFIX);
+    char object_target[256];
+    char object[PATH_MAX];
+    if (target_len <= suffix_len || target_len - suffix_len >= sizeof(object_target) ||
+        strcmp(target + target_len - suffix_len, DELTA_INDEX_SUFFIX) != 0) {
+        return -1;
+    }
+    memcpy(object_target, target, target_len - suffix_len);
+    object_target[target_len - suffix_len] = '\0';
+    if (resolve_request(cache_dir, object_target, object, sizeof(object)) != 0 ||
+        snprintf(path, len, "%s%s", object, DELTA_INDEX_SUFFIX) >= (int)len) {
+        return -1;
+    }
+    struct stat object_st;
+    struct stat index_st;
+    if (stat(path, &index_st) != 0 || stat(object, &object_st) != 0 || index_st.st_mtime < object_st.st_mtime) {
+        return -1;
+    }
+    return 0;
+}
+
+/* Accepts the single-range forms wget and the fetch engine send:
+ * "bytes=N-" and "bytes=N-M". */
+static int parse_range(const char *value, long long size, long long *start, long long *end)
+{
+    while (*value == ' ') {
+        value++;
+    }
+    if (strncasecmp(value, "bytes=", 6) != 0) {
+        return -1;
+    }
+    char *rest = NULL;
+    long long first = strtoll(value + 6, &rest, 10);
+    if (rest == value + 6 || *rest != '-' || first < 0 || first >= size) {
+        return -1;
+    }
+    long long last = size - 1;
+    if (isdigit((unsigned char)rest[1])) {
+        last = strtoll(rest + 1, NULL, 10);
+        if (last < first) {
+            return -1;
+        }
+        if (last >= size) {
+            last = size - 1;
+        }
+    }
+    *start = first;
+    *end = last;
+    return 0;
+}
+
+static void serve_connection(int fd, const char *cache_dir, const struct sockaddr_in *client)
+{
+    struct timeval timeout = {PEER_IO_TIMEOUT_S, 0};
+    setsockopt(fd, SOL_SOCKET, SO_RCVTIMEO, &timeout, sizeof(timeout));
+    setsockopt(fd, SOL_SOCKET, SO_SNDTIMEO, &timeout, sizeof(timeout));
+
+    char request[PEER_REQUEST_MAX];
+    size_t used = 0;
+    while (used + 1 < sizeof(request)) {
+        ssize_t got = read(fd, request + used, sizeof(request) - 1 - used);
+        if (got < 0 && errno == EINTR) {
+            continue;
+        }
+        if (got <= 0) {
+            return;
+        }
+        used += (size_t)got;
+        request[used] = '\0';
+        if (strstr(request, "\r\n\r\n")) {
+            break;
+        }
+    }
+    request[used] = '\0';
+
+    char method[8];
+    char target[256];
+    if (sscanf(request, "%7s %255s", method, target) != 2) {
+        send_status(fd, 400, "Bad Request");
+        return;
+    }
+    bool head = strcmp(method, "HEAD") == 0;
+    if (!head && strcmp(method, "GET") != 0) {
+        send_status(fd, 405, "Method Not Allowed");
+        return;
+    }
+
+    char path[PATH_MAX];
+    int file = -1;
+    struct stat st;
+    if ((resolve_request(cache_dir, target, path, sizeof(path)) != 0 &&
+         resolve_index(cache_dir, target, path, sizeof(path)) != 0) ||
+        (file = open(path, O_RDONLY | O_CLOEXEC)) < 0 || fstat(file, &st) != 0 || !S_ISREG(st.st_mode)) {
+        if (file >= 0) {
+            close(file);
+        }
+        send_status(fd, 404, "Not Found");
+        return;
+    }
+
+    long long size = (long long)st.st_size;
+    long long start = 0;
+    long long end = size - 1;
+    bool partial = false;
+    for (char *line = strstr(request, "\r\n"); line; line = strstr(line + 2, "\r\n")) {
+        if (strncasecmp(line + 2, "Range:", 6) == 0) {
+            char *eol = strstr(line + 8, "\r\n");
+            if (eol) {
+                *eol = '\0';
+            }
+            if (parse_range(line + 8, size, &start, &end) != 0) {
+                close(file);
+                send_status(fd, 416, "Range Not Satisfiable");
+                return;
+            }
+            partial = true;
+            break;
+        }
+    }
+
+    /* The object name is its digest, so it doubles as a strong validator. */
+    const char *etag = strrchr(target, '/') + 1;
+    char header[512];
+    int n;
+    if (partial) {
+        n = snprintf(header, sizeof(header),
+                     "HTTP/1.1 206 Partial Content\r\nContent-Type: application/octet-stream\r\n"
+                     "Content-Length: %lld\r\nContent-Range: bytes %lld-%lld/%lld\r\nAccept-Ranges: bytes\r\n"
+                     "ETag: \"%.140s\"\r\nConnection: close\r\nServer: libero-installer\r\n\r\n",
+                     end - start + 1, start, end, size, etag);
+    } else {
+        n = snprintf(header, sizeof(header),
+                     "HTTP/1.1 200 OK\r\nContent-Type: application/octet-stream\r\n"
+                     "Content-Length: %lld\r\nAccept-Ranges: bytes\r\n"
+                     "ETag: \"%.140s\"\r\nConnection: close\r\nServer: libero-installer\r\n\r\n",
+                     size, etag);
+    }
+    if (n <= 0 || n >= (int)sizeof(header) || write_all(fd, header, (size_t)n) != 0 || head) {
+        close(file);
+        return;
+    }
+
+    off_t offset = (off_t)start;
+    long long remaining = end - start + 1;
+    while (remaining > 0) {
+        ssize_t sent = sendfile(fd, file, &offset, remaining > (1 << 30) ? (size_t)(1 << 30) : (size_t)remaining);
+        if (sent < 0 && errno == EINTR) {
+            continue;
+        }
+        if (sent <= 0) {
+            break;
+        }
+        remaining -= sent;
+    }
+    close(file);
+
+    char address[INET_ADDRSTRLEN] = "?";
+    inet_ntop(AF_INET, &client->sin_addr, address, sizeof(address));
+    log_info("Peer server: sent %lld of %lld bytes of %s to %s", end - start + 1 - remaining,
+             end - start + 1, target, address);
+}
+
+static void answer_discovery(int udp)
+{
+    char message[128];
+    struct sockaddr_in from;
+    socklen_t from_len = sizeof(from);
+    ssize_t got = recvfrom(udp, message, sizeof(message) - 1, 0, (struct sockaddr *)&from, &from_len);
+    if (got <= 0) {
+        return;
+    }
+    message[got] = '\0';
+
+    char id[sizeof(instance_id)];
+    if (sscanf(message, PEER_QUERY " %39s", id) != 1 || strcmp(id, instance_id) == 0) {
+        return;
+    }
+    char reply[128];
+    int n = snprintf(reply, sizeof(reply), PEER_REPLY " %s %d", instance_id, server_port);
+    if (n > 0 && n < (int)sizeof(reply)) {
+        sendto(udp, reply, (size_t)n, 0, (struct sockaddr *)&from, from_len);
+    }
+}
+
+static void server_main(const char *cache_dir, int tcp, int udp)
+{
+    signal(SIGCHLD, SIG_IGN);
+    signal(SIGPIPE, SIG_IGN);
+    signal(SIGINT, SIG_IGN);
+
+    struct pollfd pfds[2] = {{tcp, POLLIN, 0}, {udp, POLLIN, 0}};
+    nfds_t nfds = udp >= 0 ? 2 : 1;
+    while (1) {
+        if (poll(pfds, nfds, -1) < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            _exit(1);
+        }
+        if (pfds[0].revents & POLLIN) {
+            struct sockaddr_in client;
+            socklen_t client_len = sizeof(client);
+            int fd = accept4(tcp, (struct sockaddr *)&client, &client_len, SOCK_CLOEXEC);
+            if (fd >= 0) {
+                /* One process per transfer keeps a slow client from
+                 * stalling everyone else. */
+                pid_t pid = fork();
+                if (pid == 0) {
+                    close(tcp);
+                    if (udp >= 0) {
+                        close(udp);
+                    }
+                    serve_connection(fd, cache_dir, &client);
+                    close(fd);
+                    _exit(0);
+                }
+                close(fd);
+            }
+        }
+        if (nfds > 1 && (pfds[1].revents & POLLIN)) {
+            answer_discovery(udp);
+        }
+    }
+}
+
+static int bind_socket(int type, int port, bool share)
+{
+    int fd = socket(AF_INET, type | SOCK_CLOEXEC, 0);
+    if (fd < 0) {
+        return -1;
+    }
+    int one = 1;
+    setsockopt(fd, SOL_SOCKET, SO_REUSEADDR, &one, sizeof(one));
+    if (share) {
+        /* Lets several installers on one host (or in one test) all hear
+         * discovery broadcasts. */
+        setsockopt(fd, SOL_SOCKET, SO_REUSEPORT, &one, sizeof(one));
+    }
+    struct sockaddr_in addr;
+    memset(&addr, 0, sizeof(addr));
+    addr.sin_family = AF_INET;
+    addr.sin_addr.s_addr = htonl(INADDR_ANY);
+    addr.sin_port = htons((uint16_t)port);
+    if (bind(fd, (struct sockaddr *)&addr, sizeof(addr)) != 0 || (type == SOCK_STREAM && listen(fd, 16) != 0)) {
+        int saved = errno;
+        close(fd);
+        errno = saved;
+        return -1;
+    }
+    return fd;
+}
+
+/* Serves the verified artifact cache read-only from a background process
+ * until peer_server_stop() or installer exit. */
+int peer_server_start(const char *cache_dir, int port)
+{
+    if (!cache_dir || !cache_dir[0] || port <= 0 || port >= 65536) {
+        return -1;
+    }
+    if (server_pid > 0) {
+        return 0;
+    }
+
+    int tcp = bind_socket(SOCK_STREAM, port, false);
+    if (tcp < 0) {
+        log_error("Peer server: unable to listen on port %d: %s", port, strerror(errno));
+        return -1;
+    }
+    int udp = bind_socket(SOCK_DGRAM, PEER_DISCOVERY_PORT, true);
+    if (udp < 0) {
+        log_info("Peer server: discovery port %d unavailable (%s); peers must list this host explicitly",
+                 PEER_DISCOVERY_PORT, strerror(errno));
+    }
+
+    peer_instance_id();
+    server_port = port;
+    pid_t parent = getpid();
+    pid_t pid = fork();
+    if (pid < 0) {
+        log_error("Peer server: fork failed: %s", strerror(errno));
+        close(tcp);
+        if (udp >= 0) {
+            close(udp);
+        }
+        return -1;
+    }
+    if (pid == 0) {
+        /* A plain fork keeps ncurses' SIGTERM handler and the terminal;
+         * either would let the stop signal run endwin() on the live UI. */
+        signal(SIGTERM, SIG_DFL);
+        int null_fd = open("/dev/null", O_RDWR);
+        if (null_fd >= 0) {
+            dup2(null_fd, STDIN_FILENO);
+            dup2(null_fd, STDOUT_FILENO);
+            dup2(null_fd, STDERR_FILENO);
+            if (null_fd > STDERR_FILENO) {
+                close(null_fd);
+            }
+        }
+        prctl(PR_SET_PDEATHSIG, SIGTERM);
+        if (getppid() != parent) {
+            _exit(0);
+        }
+        server_main(cache_dir, tcp, udp);
+        _exit(0);
+    }
+
+    close(tcp);
+    if (udp >= 0) {
+        close(udp);
+    }
+    server_pid = pid;
+    log_info("Peer server: sharing artifact cache %s on port %d", cache_dir, port);
+    return 0;
+}
+
+void peer_server_stop(void)
+{
+    if (server_pid <= 0) {
+        return;
+    }
+    kill(server_pid, SIGTERM);
+    while (waitpid(server_pid, NULL, 0) < 0 && errno == EINTR) {
+    }
+    log_info("Peer server: stopped");
+    server_pid = -1;
+    server_port = 0;
+}
+
+static int add_peer(PeerAddress *peers, int count, int max, const char *host, int port)
+{
+    if (count >= max || !host[0] || port <= 0 || port >= 65536 || strlen(host) >= PEER_HOST_MAX) {
+        return count;
+    }
+    for (int i = 0; i < count; ++i) {
+        if (peers[i].port == port && strcmp(peers[i].host, host) == 0) {
+            return count;
+        }
+    }
+    snprintf(peers[count].host, sizeof(peers[count].host), "%s", host);
+    peers[count].port = port;
+    return count + 1;
+}
+
+/* "host" or "host:port"; IPv4 addresses and host names only. */
+static int add_peer_spec(PeerAddress *peers, int count, int max, const char *spec)
+{
+    char host[PEER_HOST_MAX];
+    int port = PEER_DEFAULT_PORT;
+    size_t len = strcspn(spec, ":");
+    if (len == 0 || len >= sizeof(host)) {
+        return count;
+    }
+    memcpy(host, spec, len);
+    host[len] = '\0';
+    if (spec[len] == ':') {
+        port = atoi(spec + len + 1);
+    }
+    return add_peer(peers, count, max, host, port);
+}
+
+static int load_configured_peers(PeerAddress *peers, int count, int max)
+{
+    const char *env = getenv("LIBERO_PEERS");
+    if (env && *env) {
+        char list[1024];
+        snprintf(list, sizeof(list), "%s", env);
+        char *save = NULL;
+        for (char *item = strtok_r(list, ", \t", &save); item; item = strtok_r(NULL, ", \t", &save)) {
+            count = add_peer_spec(peers, count, max, item);
+        }
+    }
+
+    FILE *f = fopen(PEER_LIST_PATH, "r");
+    if (f) {
+        char line[256];
+        while (fgets(line, sizeof(line), f)) {
+            char *item = line + strspn(line, " \t");
+            item[strcspn(item, " \t\r\n#")] = '\0';
+            if (item[0]) {
+                count = add_peer_spec(peers, count, max, item);
+            }
+        }
+        fclose(f);
+    }
+    return count;
+}
+
+/* Broadcasts a query on the local segment and collects answers until the
+ * timeout. Installers that are not sharing simply stay silent. */
+static int discover_peers(PeerAddress *peers, int count, int max)
+{
+    int fd = socket(AF_INET, SOCK_DGRAM | SOCK_CLOEXEC, 0);
+    if (fd < 0) {
+        return count;
+    }
+    int one = 1;
+    setsockopt(fd, SOL_SOCKET, SO_BROADCAST, &one, sizeof(one));
+
+    char query[96];
+    int n = snprintf(query, sizeof(query), PEER_QUERY " %s", peer_instance_id());
+    struct sockaddr_in to;
+    memset(&to, 0, sizeof(to));
+    to.sin_family = AF_INET;
+    to.sin_addr.s_addr = htonl(INADDR_BROADCAST);
+    to.sin_port = htons(PEER_DISCOVERY_PORT);
+    if (sendto(fd, query, (size_t)n, 0, (struct sockaddr *)&to, sizeof(to)) < 0) {
+        log_info("Peer discovery: broadcast failed: %s", strerror(errno));
+        close(fd);
+        return count;
+    }
+
+    long long deadline = monotonic_ms() + PEER_DISCOVERY_TIMEOUT_MS;
+    while (count < max) {
+        long long left = deadline - monotonic_ms();
+        if (left <= 0) {
+            break;
+        }
+        struct pollfd pfd = {fd, POLLIN, 0};
+        if (poll(&pfd, 1, (int)left) <= 0) {
+            break;
+        }
+        char reply[128];
+        struct sockaddr_in from;
+        socklen_t from_len = sizeof(from);
+        ssize_t got = recvfrom(fd, reply, sizeof(reply) - 1, 0, (struct sockaddr *)&from, &from_len);
+        if (got <= 0) {
+            continue;
+        }
+        reply[got] = '\0';
+        char id[sizeof(instance_id)];
+        int port = 0;
+        if (sscanf(reply, PEER_REPLY " %39s %d", id, &port) != 2 || strcmp(id, instance_id) == 0) {
+            continue;
+        }
+        char host[INET_ADDRSTRLEN];
+        if (inet_ntop(AF_INET, &from.sin_addr, host, sizeof(host))) {
+            count = add_peer(peers, count, max, host, port);
+        }
+    }
+    close(fd);
+    return count;
+}
+
+int peer_list(PeerAddress *peers, int max)
+{
+    time_t now = time(NULL);
+    if (known_at == 0 || now - known_at >= PEER_REFRESH_S) {
+        known_count = load_configured_peers(known_peers, 0, PEER_MAX);
+        int configured = known_count;
+        known_count = discover_peers(known_peers, known_count, PEER_MAX);
+        known_at = now;
+        log_info("Artifact peers: %d configured, %d discovered", configured, known_count - configured);
+    }
+    int count = known_count < max ? known_count : max;
+    memcpy(peers, known_peers, (size_t)count * sizeof(*peers));
+    return count;
+}
+
+/* Asks one peer whether it holds target, with a short timeout so that a
+ * powered-off peer costs about a second rather than a full fetch timeout. */
+static bool peer_has_object(const PeerAddress *peer, const char *target)
+{
+    struct addrinfo hints;
+    memset(&hints, 0, sizeof(hints));
+    hints.ai_family = AF_INET;
+    hints.ai_socktype = SOCK_STREAM;
+    char port[16];
+    snprintf(port, sizeof(port), "%d", peer->port);
+    struct addrinfo *info = NULL;
+    if (getaddrinfo(peer->host, port, &hints, &info) != 0 || !info) {
+        return false;
+    }
+    int fd = socket(info->ai_family, info->ai_socktype | SOCK_NONBLOCK | SOCK_CLOEXEC, info->ai_protocol);
+    if (fd < 0) {
+        freeaddrinfo(info);
+        return false;
+    }
+    int rc = connect(fd, info->ai_addr, info->ai_addrlen);
+    freeaddrinfo(info);
+    long long deadline = monotonic_ms() + PEER_PROBE_TIMEOUT_MS;
+    struct pollfd pfd = {fd, POLLOUT, 0};
+    int so_error = 0;
+    socklen_t so_len = sizeof(so_error);
+    if ((rc != 0 && errno != EINPROGRESS) ||
+        (rc != 0 && (poll(&pfd, 1, PEER_PROBE_TIMEOUT_MS) <= 0 ||
+                     getsockopt(fd, SOL_SOCKET, SO_ERROR, &so_error, &so_len) != 0 || so_error != 0))) {
+        close(fd);
+        return false;
+    }
+
+    char request[512];
+    int n = snprintf(request, sizeof(request), "HEAD %s HTTP/1.1\r\nHost: %s\r\nConnection: close\r\n\r\n",
+                     target, peer->host);
+    if (n <= 0 || n >= (int)sizeof(request) || write_all(fd, request, (size_t)n) != 0) {
+        close(fd);
+        return false;
+    }
+
+    char response[64] = {0};
+    size_t used = 0;
+    pfd.events = POLLIN;
+    while (used < 12) {
+        long long left = deadline - monotonic_ms();
+        if (left <= 0 || poll(&pfd, 1, (int)left) <= 0) {
+            break;
+        }
+        ssize_t got = read(fd, response + used, sizeof(response) - 1 - used);
+        if (got < 0 && (errno == EINTR || errno == EAGAIN)) {
+            continue;
+        }
+        if (got <= 0) {
+            break;
+        }
+        used += (size_t)got;
+    }
+    close(fd);
+    int status = 0;
+    return sscanf(response, "HTTP/%*s %d", &status) == 1 && status == 200;
+}
+
+/* Server path of the object named by digests, using the same digest the
+ * caller will verify with. */
+static int object_target(const DigestSet *digests, char *target, size_t target_len)
+{
+    HashAlgorithm algorithm;
+    if (!digests || digest_set_select(digests, &algorithm) != 0) {
+        return -1;
+    }
+    char name[16];
+    const char *upper = hash_algorithm_name(algorithm);
+    size_t len = 0;
+    for (; upper[len] && len + 1 < sizeof(name); ++len) {
+        name[len] = (char)tolower((unsigned char)upper[len]);
+    }
+    name[len] = '\0';
+    return snprintf(target, target_len, "/%s/%s/%s", CAS_DIR_NAME, name, digests->hex[algorithm]) >=
+                   (int)target_len
+               ? -1
+               : 0;
+}
+
+/* Lists peer URLs for the object named by digests, checked to be present. */
+int peer_object_urls(const DigestSet *digests, char urls[][REMOTE_URL_MAX], int max)
+{
+    char target[256];
+    if (object_target(digests, target, sizeof(target)) != 0) {
+        return 0;
+    }
+
+    PeerAddress peers[PEER_MAX];
+    int peer_count = peer_list(peers, PEER_MAX);
+    int count = 0;
+    for (int i = 0; i < peer_count && count < max; ++i) {
+        if (!peer_has_object(&peers[i], target)) {
+            continue;
+        }
+        if (snprintf(urls[count], REMOTE_URL_MAX, "http://%s:%d%s", peers[i].host, peers[i].port, target) <
+            REMOTE_URL_MAX) {
+            count++;
+        }
+    }
+    return count;
+}
+
+/* Downloads the delta index of the object named by digests from the first
+ * peer that advertises one. Each peer is asked once and the index fetched
+ * with a single try: without it the artifact is simply downloaded whole. */
+int peer_fetch_index(const DigestSet *digests, const char *destination)
+{
+    char target[256 + sizeof(DELTA_INDEX_SUFFIX)];
+    char quoted_destination[PATH_MAX * 2];
+    if (!destination || object_target(digests, target, sizeof(target)) != 0 ||
+        shell_escape_single_quotes(destination, quoted_destination, sizeof(quoted_destination)) != 0) {
+        return -1;
+    }
+    strcat(target, DELTA_INDEX_SUFFIX);
+
+    PeerAddress peers[PEER_MAX];
+    int peer_count = peer_list(peers, PEER_MAX);
+    for (int i = 0; i < peer_count; ++i) {
+        char url[REMOTE_URL_MAX];
+        char quoted_url[REMOTE_URL_MAX * 2];
+        if (!peer_has_object(&peers[i], target) ||
+            snprintf(url, sizeof(url), "http://%s:%d%s", peers[i].host, peers[i].port, target) >=
+                (int)sizeof(url) ||
+            shell_escape_single_quotes(url, quoted_url, sizeof(quoted_url)) != 0) {
+            continue;
+        }
+        if (run_command("wget -q --tries=1 --timeout=%d -O '%s' '%s'", PEER_INDEX_TIMEOUT_S, quoted_destination,
+                        quoted_url) == 0) {
+            log_info("Fetched block index %s from LAN peer %s", target, peers[i].host);
+            return 0;
+        }
+        unlink(destination);
+    }
+    return -1;
+}
+
+/* Returns 0 when destination now holds a copy from the LAN that matches
+ * digests, 1 when no peer could supply one. */
+int peer_fetch(const DigestSet *digests, const char *destination)
+{
+    HashAlgorithm algorithm;
+    if (!digests || !destination || digest_set_select(digests, &algorithm) != 0) {
+        return 1;
+    }
+    ui_progress("LAN peers", "Looking for installers sharing this artifact...", 0);
+    char urls[FETCH_MAX_SOURCES][REMOTE_URL_MAX];
+    const char *list[FETCH_MAX_SOURCES];
+    int count = peer_object_urls(digests, urls, FETCH_MAX_SOURCES);
+    if (count == 0) {
+        return 1;
+    }
+    for (int i = 0; i < count; ++i) {
+        list[i] = urls[i];
+    }
+
+    log_info("Fetching %s from %d LAN peer(s)", destination, count);
+    if (fetch_file_mirrors(list, count, destination, FETCH_DEFAULT_SEGMENTS) != 0) {
+        log_info("LAN peers could not supply %s; using mirrors", destination);
+        unlink(destination);
+        return 1;
+    }
+
+    ui_progress("LAN peers", "Verifying copy from peer...", 0);
+    char actual[HASH_MAX_HEX];
+    if (hash_file_hex(destination, algorithm, actual, sizeof(actual)) != 0 ||
+        strcmp(actual, digests->hex[algorithm]) != 0) {
+        log_error("Copy of %s from LAN peer does not match its %s digest; discarding it", destination,
+                  hash_algorithm_name(algorithm));
+        unlink(destination);
+        return 1;
+    }
+    log_info("Verified %s from LAN peer (%s)", destination, hash_algorithm_name(algorithm));
+    return 0;
+}
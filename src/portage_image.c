@@ -0,0 +1,234 @@
+#include "portage_image.h"
+
+#include <signal.h>
+#include <sys/wait.h>
+
+#include "log.h"
+#include "system_utils.h"
+#include "ui.h"
+#include "xz.h"
+
+#define PORTAGE_IMAGE_PROGRESS_MS 250
+
+typedef struct {
+    int fd;
+    long long written;
+    long long expected;
+    long long last_report;
+} BuilderPipe;
+
+static long long monotonic_ms(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (long long)ts.tv_sec * 1000 + ts.tv_nsec / 1000000;
+}
+
+static bool program_available(const char *name)
+{
+    const char *path = getenv("PATH");
+    if (!path) {
+        path = "/usr/sbin:/usr/bin:/sbin:/bin";
+    }
+    while (*path) {
+        const char *colon = strchr(path, ':');
+        size_t len = colon ? (size_t)(colon - path) : strlen(path);
+        char candidate[PATH_MAX];
+        if (len > 0 && snprintf(candidate, sizeof(candidate), "%.*s/%s", (int)len, path, name) < (int)sizeof(candidate) &&
+            access(candidate, X_OK) == 0) {
+            return true;
+        }
+        path += len + (colon ? 1 : 0);
+    }
+    return false;
+}
+
+static int builder_sink(const char *data, size_t len, void *ctx)
+{
+    BuilderPipe *pipe_out = ctx;
+    while (len > 0) {
+        ssize_t written = write(pipe_out->fd, data, len);
+        if (written < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            log_error("squashfs builder stopped reading: %s", strerror(errno));
+            return -1;
+        }
+        data += written;
+        len -= (size_t)written;
+        pipe_out->written += written;
+    }
+
+    long long now = monotonic_ms();
+    if (now - pipe_out->last_report >= PORTAGE_IMAGE_PROGRESS_MS) {
+        pipe_out->last_report = now;
+        int percent = pipe_out->expected > 0 ? (int)((pipe_out->written * 100) / pipe_out->expected) : 0;
+        char message[128];
+        snprintf(message, sizeof(message), "Packing Portage tree into a squashfs image: %.1f MB",
+                 pipe_out->written / 1048576.0);
+        ui_progress("Portage", message, percent);
+    }
+    return 0;
+}
+
+/* Converts the snapshot tarball into a squashfs image without unpacking it:
+ * the tar stream is decoded in-process and piped straight into tar2sqfs
+ * (squashfs-tools-ng) or sqfstar (squashfs-tools 4.6+). */
+int portage_image_build(const char *archive, const char *image)
+{
+    char image_q[PATH_MAX * 2];
+    char partial[PATH_MAX];
+    if (shell_escape_single_quotes(image, image_q, sizeof(image_q)) != 0 ||
+        snprintf(partial, sizeof(partial), "%s.partial", image) >= (int)sizeof(partial)) {
+        return -1;
+    }
+
+    const char *builder;
+    if (program_available("tar2sqfs")) {
+        /* The snapshot wraps the tree in "portage/"; make that the image root. */
+        builder = "tar2sqfs -q -f -c xz -r portage";
+    } else if (program_available("sqfstar")) {
+        builder = "sqfstar -quiet -no-progress -comp xz -noappend";
+    } else {
+        log_error("Neither tar2sqfs nor sqfstar is available to build %s", image);
+        return -1;
+    }
+    char cmd[MAX_CMD_LEN];
+    if (snprintf(cmd, sizeof(cmd), "%s '%s.partial'", builder, image_q) >= (int)sizeof(cmd)) {
+        return -1;
+    }
+
+    BuilderPipe pipe_out = {.fd = -1, .expected = xz_uncompressed_size(archive)};
+    pid_t pid = spawn_command_writer(cmd, &pipe_out.fd);
+    if (pid <= 0) {
+        return -1;
+    }
+    void (*previous_sigpipe)(int) = signal(SIGPIPE, SIG_IGN);
+    XzStats stats;
+    int rc = xz_decompress_file(archive, builder_sink, &pipe_out, &stats);
+    close(pipe_out.fd);
+    signal(SIGPIPE, previous_sigpipe);
+
+    ui_progress("Portage", "Finishing squashfs image...", 100);
+    int status = 0;
+    while (waitpid(pid, &status, 0) < 0 && errno == EINTR) {
+    }
+    if (!WIFEXITED(status) || WEXITSTATUS(status) != 0) {
+        log_error("squashfs builder failed for %s", archive);
+        rc = -1;
+    }
+    if (rc == 0 && rename(partial, image) != 0) {
+        log_error("Unable to move %s into place: %s", partial, strerror(errno));
+        rc = -1;
+    }
+    if (rc != 0) {
+        unlink(partial);
+        return -1;
+    }
+    xz_log_stats("portage squashfs build", &stats);
+    return 0;
+}
+
+static int root_path(const char *root, const char *path, char *buffer, size_t len)
+{
+    if (snprintf(buffer, len, "%s%s", root, path) >= (int)len) {
+        log_error("Path too long: %s%s", root, path);
+        return -1;
+    }
+    return 0;
+}
+
+/* Returns the tree inside the mounted image, relative to root. Images built
+ * by sqfstar keep the snapshot's "portage/" prefix; the published images and
+ * tar2sqfs ones have the tree at the top. */
+int portage_image_lowerdir(const char *root, char *buffer, size_t len)
+{
+    char probe[PATH_MAX];
+    struct stat st;
+    if (root_path(root, PORTAGE_IMAGE_LOWER "/portage/profiles", probe, sizeof(probe)) == 0 &&
+        stat(probe, &st) == 0 && S_ISDIR(st.st_mode)) {
+        return snprintf(buffer, len, "%s", PORTAGE_IMAGE_LOWER "/portage") < (int)len ? 0 : -1;
+    }
+    return snprintf(buffer, len, "%s", PORTAGE_IMAGE_LOWER) < (int)len ? 0 : -1;
+}
+
+bool portage_image_mounted(const char *root)
+{
+    char repo[PATH_MAX];
+    return root_path(root, PORTAGE_REPO_DIR, repo, sizeof(repo)) == 0 && is_path_mounted(repo);
+}
+
+/* Mounts the image read-only and an overlay on the repository directory so
+ * emerge --sync, distfiles and local edits land in the upper layer. */
+int portage_image_mount(const char *root)
+{
+    char image[PATH_MAX];
+    char lower[PATH_MAX];
+    char upper[PATH_MAX];
+    char work[PATH_MAX];
+    char repo[PATH_MAX];
+    if (root_path(root, PORTAGE_IMAGE_PATH, image, sizeof(image)) != 0 ||
+        root_path(root, PORTAGE_IMAGE_LOWER, lower, sizeof(lower)) != 0 ||
+        root_path(root, PORTAGE_IMAGE_UPPER, upper, sizeof(upper)) != 0 ||
+        root_path(root, PORTAGE_IMAGE_WORK, work, sizeof(work)) != 0 ||
+        root_path(root, PORTAGE_REPO_DIR, repo, sizeof(repo)) != 0) {
+        return -1;
+    }
+    if (portage_image_mounted(root)) {
+        return 0;
+    }
+    if (ensure_directory(lower, 0755) != 0 || ensure_directory(upper, 0755) != 0 ||
+        ensure_directory(work, 0755) != 0 || ensure_directory(repo, 0755) != 0) {
+        return -1;
+    }
+    if (!is_path_mounted(lower) && run_command("mount -t squashfs -o loop,ro,nodev,nosuid '%s' '%s'", image, lower) != 0) {
+        log_error("Unable to mount Portage image %s", image);
+        return -1;
+    }
+
+    char tree[PATH_MAX];
+    char lowerdir[PATH_MAX];
+    char options[PATH_MAX * 3 + 64];
+    if (portage_image_lowerdir(root, tree, sizeof(tree)) != 0 || root_path(root, tree, lowerdir, sizeof(lowerdir)) != 0 ||
+        snprintf(options, sizeof(options), "lowerdir=%s,upperdir=%s,workdir=%s", lowerdir, upper, work) >=
+            (int)sizeof(options)) {
+        umount_path(lower);
+        return -1;
+    }
+    if (mount_fs("overlay", repo, "overlay", options) != 0) {
+        umount_path(lower);
+        return -1;
+    }
+    return 0;
+}
+
+int portage_image_unmount(const char *root)
+{
+    char lower[PATH_MAX];
+    char repo[PATH_MAX];
+    if (root_path(root, PORTAGE_IMAGE_LOWER, lower, sizeof(lower)) != 0 ||
+        root_path(root, PORTAGE_REPO_DIR, repo, sizeof(repo)) != 0) {
+        return -1;
+    }
+    int rc = 0;
+    if (is_path_mounted(repo) && umount_path(repo) != 0) {
+        rc = -1;
+    }
+    if (is_path_mounted(lower) && umount_path(lower) != 0) {
+        rc = -1;
+    }
+    return rc;
+}
+
+/* Emits the two mounts the installed system needs, in dependency order. */
+void portage_image_write_fstab(FILE *f, const char *root)
+{
+    char tree[PATH_MAX];
+    if (portage_image_lowerdir(root, tree, sizeof(tree)) != 0) {
+        return;
+    }
+    fprintf(f, "%s\t%s\tsquashfs\tro,loop,nodev,nosuid\t0 0\n", PORTAGE_IMAGE_PATH, PORTAGE_IMAGE_LOWER);
+    fprintf(f, "overlay\t%s\toverlay\tlowerdir=%s,upperdir=%s,workdir=%s\t0 0\n", PORTAGE_REPO_DIR, tree,
+            PORTAGE_IMAGE_UPPER, PORTAGE_IMAGE_WORK);
+}
@@ -0,0 +1,343 @@
+#include "prefetch.h"
+
+#include <fcntl.h>
+#include <linux/magic.h>
+#include <signal.h>
+#include <sys/prctl.h>
+#include <sys/vfs.h>
+#include <sys/wait.h>
+
+#include "bandwidth.h"
+#include "log.h"
+#include "progress.h"
+#include "ui.h"
+
+#define PREFETCH_EXIT_DONE 0
+#define PREFETCH_EXIT_FAILED 1
+#define PREFETCH_EXIT_OVER_BUDGET 2
+#define PREFETCH_EXIT_DEFERRED 3
+
+typedef enum {
+    PREFETCH_IDLE = 0,
+    PREFETCH_RUNNING,
+    PREFETCH_STOPPED,
+    PREFETCH_OVER_BUDGET,
+    PREFETCH_DONE,
+    PREFETCH_DEFERRED, /* finished, but some sizes were unknown */
+    PREFETCH_FAILED
+} PrefetchStatus;
+
+static pid_t prefetch_pid = -1;
+static int prefetch_fd = -1;
+static PrefetchStatus prefetch_status = PREFETCH_IDLE;
+static ProgressState prefetch_progress;
+
+/* Returns -1 when no explicit budget is configured. */
+static long long configured_budget(void)
+{
+    const char *env = getenv("LIBERO_PREFETCH_BUDGET");
+    if (env && *env) {
+        long long budget = bandwidth_parse_rate(env);
+        if (budget >= 0) {
+            return budget;
+        }
+        log_error("Ignoring malformed LIBERO_PREFETCH_BUDGET '%s'", env);
+    }
+    FILE *f = fopen(PREFETCH_BUDGET_PATH, "r");
+    if (!f) {
+        return -1;
+    }
+    char line[64];
+    long long budget = -1;
+    while (budget < 0 && fgets(line, sizeof(line), f)) {
+        line[strcspn(line, "#\r\n")] = '\0';
+        budget = bandwidth_parse_rate(line);
+    }
+    fclose(f);
+    return budget;
+}
+
+static long long memory_available(void)
+{
+    FILE *f = fopen("/proc/meminfo", "r");
+    if (!f) {
+        return 0;
+    }
+    char line[128];
+    long long kb = 0;
+    while (fgets(line, sizeof(line), f)) {
+        if (sscanf(line, "MemAvailable: %lld kB", &kb) == 1) {
+            break;
+        }
+    }
+    fclose(f);
+    return kb * 1024;
+}
+
+long long prefetch_budget(const char *directory)
+{
+    struct statfs fs;
+    if (!directory || statfs(directory, &fs) != 0) {
+        return 0;
+    }
+    long long budget = configured_budget();
+    if (budget < 0) {
+        /* Writes to tmpfs, or to the tmpfs upper layer of a live system's
+         * overlay root, come straight out of RAM. */
+        bool in_memory = fs.f_type == TMPFS_MAGIC || fs.f_type == RAMFS_MAGIC || fs.f_type == OVERLAYFS_SUPER_MAGIC;
+        if (in_memory) {
+            long long available = memory_available();
+            long long share = available * PREFETCH_RAM_PERCENT / 100;
+            long long spare = available - PREFETCH_RAM_RESERVE;
+            budget = share < spare ? share : spare;
+        } else {
+            budget = (long long)fs.f_bavail * (long long)fs.f_bsize - PREFETCH_DISK_RESERVE;
+        }
+    }
+    /* ramfs reports no size at all. */
+    long long free_bytes = (long long)fs.f_bavail * (long long)fs.f_bsize;
+    if (fs.f_blocks > 0 && budget > free_bytes) {
+        budget = free_bytes;
+    }
+    return budget > 0 ? budget : 0;
+}
+
+static const char *item_name(const PrefetchItem *item)
+{
+    const char *slash = strrchr(item->destination, '/');
+    return slash ? slash + 1 : item->destination;
+}
+
+/* Space an interrupted earlier run already holds for destination. */
+static long long staged_bytes(const char *destination)
+{
+    char part[PATH_MAX];
+    struct stat st;
+    if (snprintf(part, sizeof(part), "%s%s", destination, FETCH_PARTIAL_SUFFIX) >= (int)sizeof(part) ||
+        stat(part, &st) != 0) {
+        return 0;
+    }
+    return (long long)st.st_blocks * 512;
+}
+
+static int prefetch_main(const PrefetchItem *items, int count, long long budget, int fd)
+{
+    int rc = PREFETCH_EXIT_DONE;
+    for (int i = 0; i < count; ++i) {
+        const PrefetchItem *item = &items[i];
+        const char *name = item_name(item);
+        if (access(item->destination, F_OK) == 0) {
+            continue;
+        }
+        progress_emit(fd, "prefetch", 0, -1, i, count, name);
+
+        /* Without a size the budget cannot be checked; nothing is wrong,
+         * the foreground download simply fetches it. */
+        FetchProbe probe;
+        if (fetch_probe(item->urls[0], &probe) != 0 || probe.content_length <= 0) {
+            log_info("Prefetch: size of %s unknown; leaving it to the foreground download", name);
+            if (rc == PREFETCH_EXIT_DONE) {
+                rc = PREFETCH_EXIT_DEFERRED;
+            }
+            continue;
+        }
+        long long needed = probe.content_length - staged_bytes(item->destination);
+        if (needed > budget) {
+            log_info("Prefetch: %s needs %.1f MB but only %.1f MB of staging budget is left; leaving it for later",
+                     name, needed / 1048576.0, budget / 1048576.0);
+            if (rc == PREFETCH_EXIT_DONE || rc == PREFETCH_EXIT_DEFERRED) {
+                rc = PREFETCH_EXIT_OVER_BUDGET;
+            }
+            continue;
+        }
+        if (needed > 0) {
+            budget -= needed;
+        }
+
+        const char *list[FETCH_MAX_SOURCES];
+        for (int j = 0; j < item->url_count; ++j) {
+            list[j] = item->urls[j];
+        }
+        log_info("Prefetch: fetching %s", name);
+        if (fetch_file_mirrors(list, item->url_count, item->destination, FETCH_DEFAULT_SEGMENTS) != 0) {
+            log_error("Prefetch: %s failed; the foreground download resumes it", name);
+            rc = PREFETCH_EXIT_FAILED;
+        }
+    }
+    progress_emit(fd, "prefetch", -1, -1, count, count, NULL);
+    return rc;
+}
+
+/* Fetches items in order from a background process at background bandwidth
+ * priority, skipping anything that is already complete or would not fit the
+ * staging budget of the first item's directory. */
+int prefetch_start(const PrefetchItem *items, int count)
+{
+    if (!items || count < 1 || count > PREFETCH_MAX_ITEMS) {
+        return -1;
+    }
+    if (prefetch_pid > 0) {
+        return 0;
+    }
+
+    char directory[PATH_MAX];
+    const char *name = item_name(&items[0]);
+    snprintf(directory, sizeof(directory), "%.*s", (int)(name - items[0].destination), items[0].destination);
+    long long budget = prefetch_budget(directory[0] ? directory : ".");
+    if (budget <= 0) {
+        log_info("Prefetch: no staging budget in %s; downloads wait for the foreground", directory);
+        prefetch_status = PREFETCH_OVER_BUDGET;
+        return -1;
+    }
+
+    int pipefd[2];
+    if (pipe2(pipefd, O_CLOEXEC | O_NONBLOCK) != 0) {
+        log_error("Prefetch: unable to create progress pipe: %s", strerror(errno));
+        return -1;
+    }
+    pid_t parent = getpid();
+    pid_t pid = fork();
+    if (pid < 0) {
+        log_error("Prefetch: fork failed: %s", strerror(errno));
+        close(pipefd[0]);
+        close(pipefd[1]);
+        return -1;
+    }
+    if (pid == 0) {
+        prctl(PR_SET_PDEATHSIG, SIGTERM);
+        if (getppid() != parent) {
+            _exit(PREFETCH_EXIT_FAILED);
+        }
+        /* Own process group, so stopping it also stops its wget segments. */
+        setpgid(0, 0);
+        close(pipefd[0]);
+        int null_fd = open("/dev/null", O_RDWR);
+        if (null_fd >= 0) {
+            dup2(null_fd, STDIN_FILENO);
+            dup2(null_fd, STDOUT_FILENO);
+            dup2(null_fd, STDERR_FILENO);
+            if (null_fd > STDERR_FILENO) {
+                close(null_fd);
+            }
+        }
+        ui_detach(pipefd[1]);
+        bandwidth_set_default_class(BANDWIDTH_BACKGROUND);
+        _exit(prefetch_main(items, count, budget, pipefd[1]));
+    }
+
+    setpgid(pid, pid);
+    close(pipefd[1]);
+    prefetch_pid = pid;
+    prefetch_fd = pipefd[0];
+    prefetch_status = PREFETCH_RUNNING;
+    progress_init(&prefetch_progress, "prefetch");
+    progress_update(&prefetch_progress, -1, -1, 0, count);
+    log_info("Prefetch: started %d download%s into %s with a %.1f MB staging budget", count, count == 1 ? "" : "s",
+             directory, budget / 1048576.0);
+    return 0;
+}
+
+static void prefetch_reaped(int wait_status)
+{
+    progress_read(&prefetch_progress, prefetch_fd);
+    close(prefetch_fd);
+    prefetch_fd = -1;
+    prefetch_pid = -1;
+
+    int code = WIFEXITED(wait_status) ? WEXITSTATUS(wait_status) : PREFETCH_EXIT_FAILED;
+    if (code == PREFETCH_EXIT_DONE) {
+        prefetch_status = PREFETCH_DONE;
+        log_info("Prefetch: all downloads complete");
+    } else if (code == PREFETCH_EXIT_OVER_BUDGET) {
+        prefetch_status = PREFETCH_OVER_BUDGET;
+        log_info("Prefetch: finished what fit the staging budget");
+    } else if (code == PREFETCH_EXIT_DEFERRED) {
+        prefetch_status = PREFETCH_DEFERRED;
+        log_info("Prefetch: finished; downloads of unknown size were left to the foreground");
+    } else {
+        prefetch_status = PREFETCH_FAILED;
+        log_info("Prefetch: finished with errors");
+    }
+}
+
+void prefetch_poll(void)
+{
+    if (prefetch_pid <= 0) {
+        return;
+    }
+    progress_read(&prefetch_progress, prefetch_fd);
+    int wait_status = 0;
+    if (waitpid(prefetch_pid, &wait_status, WNOHANG) == prefetch_pid) {
+        prefetch_reaped(wait_status);
+    }
+}
+
+void prefetch_stop(void)
+{
+    prefetch_poll();
+    if (prefetch_pid <= 0) {
+        return;
+    }
+    kill(-prefetch_pid, SIGTERM);
+    int wait_status = 0;
+    while (waitpid(prefetch_pid, &wait_status, 0) < 0 && errno == EINTR) {
+    }
+    close(prefetch_fd);
+    prefetch_fd = -1;
+    prefetch_pid = -1;
+    prefetch_status = PREFETCH_STOPPED;
+    log_info("Prefetch: stopped; partial downloads stay resumable");
+}
+
+bool prefetch_running(void)
+{
+    prefetch_poll();
+    return prefetch_pid > 0;
+}
+
+bool prefetch_settled(void)
+{
+    prefetch_poll();
+    return prefetch_status == PREFETCH_DONE || prefetch_status == PREFETCH_DEFERRED ||
+           prefetch_status == PREFETCH_FAILED;
+}
+
+/* Short status for the main menu, e.g. "2/3 at 45%"; empty when idle. */
+void prefetch_summary(char *buffer, size_t len)
+{
+    if (len == 0) {
+        return;
+    }
+    prefetch_poll();
+    switch (prefetch_status) {
+    case PREFETCH_RUNNING: {
+        long long current = prefetch_progress.items_done + 1;
+        long long total = prefetch_progress.items_total;
+        int percent = progress_percent(&prefetch_progress);
+        if (prefetch_progress.bytes_total > 0 && percent >= 0) {
+            snprintf(buffer, len, "%lld/%lld at %d%%", current > total ? total : current, total, percent);
+        } else {
+            snprintf(buffer, len, "%lld/%lld", current > total ? total : current, total);
+        }
+        break;
+    }
+    case PREFETCH_STOPPED:
+        snprintf(buffer, len, "paused");
+        break;
+    case PREFETCH_OVER_BUDGET:
+        snprintf(buffer, len, "over budget");
+        break;
+    case PREFETCH_DONE:
+        snprintf(buffer, len, "done");
+        break;
+    case PREFETCH_DEFERRED:
+        snprintf(buffer, len, "done, some deferred");
+        break;
+    case PREFETCH_FAILED:
+        snprintf(buffer, len, "failed");
+        break;
+    default:
+        buffer[0] = '\0';
+        break;
+    }
+}
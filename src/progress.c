@@ -0,0 +1,287 @@
+#include "progress.h"
+
+#define PROGRESS_SAMPLE_MS 1000
+#define PROGRESS_SMOOTHING 0.3
+
+static long long monotonic_ms(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (long long)ts.tv_sec * 1000 + ts.tv_nsec / 1000000;
+}
+
+void progress_init(ProgressState *progress, const char *phase)
+{
+    memset(progress, 0, sizeof(*progress));
+    progress->started_ms = monotonic_ms();
+    progress->advanced_ms = progress->started_ms;
+    progress->sample_ms = progress->started_ms;
+    snprintf(progress->phase, sizeof(progress->phase), "%s", phase ? phase : "");
+}
+
+void progress_set_phase(ProgressState *progress, const char *phase, const char *item)
+{
+    if (phase && strcmp(phase, progress->phase) != 0) {
+        /* Counters belong to a phase; a new one starts from scratch. */
+        snprintf(progress->phase, sizeof(progress->phase), "%.*s", (int)sizeof(progress->phase) - 1, phase);
+        progress->bytes_done = progress->bytes_total = 0;
+        progress->items_done = progress->items_total = 0;
+        progress->sample_bytes = progress->sample_items = 0;
+        progress->byte_rate = progress->item_rate = 0;
+        progress->sample_ms = monotonic_ms();
+        progress->advanced_ms = progress->sample_ms;
+    }
+    if (item) {
+        snprintf(progress->item, sizeof(progress->item), "%s", item);
+    }
+}
+
+static double smooth(double current, double sample)
+{
+    return current > 0 ? current + PROGRESS_SMOOTHING * (sample - current) : sample;
+}
+
+/* Negative arguments leave the corresponding counter untouched. */
+void progress_update(ProgressState *progress, long long bytes_done, long long bytes_total, long long items_done,
+                     long long items_total)
+{
+    long long now = monotonic_ms();
+    if ((bytes_done >= 0 && bytes_done != progress->bytes_done) ||
+        (items_done >= 0 && items_done != progress->items_done)) {
+        progress->advanced_ms = now;
+    }
+    if (bytes_done >= 0) {
+        progress->bytes_done = bytes_done;
+    }
+    if (bytes_total >= 0) {
+        progress->bytes_total = bytes_total;
+    }
+    if (items_done >= 0) {
+        progress->items_done = items_done;
+    }
+    if (items_total >= 0) {
+        progress->items_total = items_total;
+    }
+
+    long long elapsed = now - progress->sample_ms;
+    if (elapsed >= PROGRESS_SAMPLE_MS) {
+        double seconds = (double)elapsed / 1000.0;
+        progress->byte_rate = smooth(progress->byte_rate, (double)(progress->bytes_done - progress->sample_bytes) / seconds);
+        progress->item_rate = smooth(progress->item_rate, (double)(progress->items_done - progress->sample_items) / seconds);
+        progress->sample_ms = now;
+        progress->sample_bytes = progress->bytes_done;
+        progress->sample_items = progress->items_done;
+    }
+}
+
+static int parse_pair(const char *value, long long *done, long long *total)
+{
+    char *end = NULL;
+    *done = strtoll(value, &end, 10);
+    if (end == value) {
+        return -1;
+    }
+    *total = -1;
+    if (*end == '/') {
+        const char *start = end + 1;
+        *total = strtoll(start, &end, 10);
+        if (end == start) {
+            return -1;
+        }
+    }
+    return 0;
+}
+
+int progress_parse_line(ProgressState *progress, const char *line)
+{
+    long long bytes = -1;
+    long long bytes_total = -1;
+    long long items = -1;
+    long long items_total = -1;
+    const char *p = line;
+    bool any = false;
+    while (*p) {
+        while (*p == ' ' || *p == '\t') {
+            p++;
+        }
+        if (!*p) {
+            break;
+        }
+        size_t len = strcspn(p, " \t");
+        if (strncmp(p, "item=", 5) == 0) {
+            progress_set_phase(progress, NULL, p + 5);
+            any = true;
+            break;
+        }
+        char field[PROGRESS_LINE_MAX];
+        snprintf(field, sizeof(field), "%.*s", (int)len, p);
+        if (strncmp(field, "phase=", 6) == 0) {
+            progress_set_phase(progress, field + 6, NULL);
+            any = true;
+        } else if (strncmp(field, "bytes=", 6) == 0 && parse_pair(field + 6, &bytes, &bytes_total) == 0) {
+            any = true;
+        } else if (strncmp(field, "items=", 6) == 0 && parse_pair(field + 6, &items, &items_total) == 0) {
+            any = true;
+        }
+        p += len;
+    }
+    if (!any) {
+        return -1;
+    }
+    progress_update(progress, bytes, bytes_total, items, items_total);
+    progress->reported = true;
+    return 0;
+}
+
+/* Drains whatever the job has written so far. Returns 1 once the write end
+ * is closed, 0 otherwise. */
+int progress_read(ProgressState *progress, int fd)
+{
+    char buffer[1024];
+    for (;;) {
+        ssize_t got = read(fd, buffer, sizeof(buffer));
+        if (got < 0) {
+            return (errno == EINTR || errno == EAGAIN) ? 0 : 1;
+        }
+        if (got == 0) {
+            return 1;
+        }
+        for (ssize_t i = 0; i < got; ++i) {
+            if (buffer[i] == '\n') {
+                progress->partial[progress->partial_len] = '\0';
+                progress_parse_line(progress, progress->partial);
+                progress->partial_len = 0;
+            } else if (progress->partial_len + 1 < sizeof(progress->partial)) {
+                progress->partial[progress->partial_len++] = buffer[i];
+            }
+        }
+    }
+}
+
+int progress_percent(const ProgressState *progress)
+{
+    if (progress->bytes_total > 0) {
+        return (int)((progress->bytes_done * 100) / progress->bytes_total);
+    }
+    if (progress->items_total > 0) {
+        return (int)((progress->items_done * 100) / progress->items_total);
+    }
+    return -1;
+}
+
+static void format_duration(long long seconds, char *buffer, size_t len)
+{
+    if (seconds >= 3600) {
+        snprintf(buffer, len, "%lld:%02lld:%02lld", seconds / 3600, (seconds / 60) % 60, seconds % 60);
+    } else {
+        snprintf(buffer, len, "%lld:%02lld", seconds / 60, seconds % 60);
+    }
+}
+
+static size_t append(char *buffer, size_t len, size_t used, const char *fmt, ...)
+{
+    if (used >= len) {
+        return used;
+    }
+    va_list args;
+    va_start(args, fmt);
+    int n = vsnprintf(buffer + used, len - used, fmt, args);
+    va_end(args);
+    return n > 0 ? used + (size_t)n : used;
+}
+
+/* e.g. "412.0 / 980.5 MB at 11.2 MB/s, ETA 0:51 | 3/40 items | 2:14 elapsed" */
+void progress_describe(const ProgressState *progress, char *buffer, size_t len)
+{
+    if (len == 0) {
+        return;
+    }
+    buffer[0] = '\0';
+    long long now = monotonic_ms();
+    size_t used = 0;
+    char eta[32] = "";
+    if (progress->bytes_done > 0 || progress->bytes_total > 0) {
+        used = append(buffer, len, used, "%.1f", progress->bytes_done / 1048576.0);
+        if (progress->bytes_total > 0) {
+            used = append(buffer, len, used, " / %.1f", progress->bytes_total / 1048576.0);
+        }
+        used = append(buffer, len, used, " MB");
+        if (progress->byte_rate > 0) {
+            used = append(buffer, len, used, " at %.1f MB/s", progress->byte_rate / 1048576.0);
+            if (progress->bytes_total > progress->bytes_done) {
+                format_duration((long long)((progress->bytes_total - progress->bytes_done) / progress->byte_rate), eta,
+                                sizeof(eta));
+            }
+        }
+        if (eta[0]) {
+            used = append(buffer, len, used, ", ETA %s", eta);
+        }
+    }
+    if (progress->items_done > 0 || progress->items_total > 0) {
+        used = append(buffer, len, used, "%s%lld", used ? " | " : "", progress->items_done);
+        if (progress->items_total > 0) {
+            used = append(buffer, len, used, "/%lld", progress->items_total);
+        }
+        used = append(buffer, len, used, " items");
+        if (!eta[0] && progress->item_rate > 0 && progress->items_total > progress->items_done) {
+            format_duration((long long)((progress->items_total - progress->items_done) / progress->item_rate), eta,
+                            sizeof(eta));
+            used = append(buffer, len, used, ", ETA %s", eta);
+        }
+    }
+    char elapsed[32];
+    format_duration((now - progress->started_ms) / 1000, elapsed, sizeof(elapsed));
+    used = append(buffer, len, used, "%s%s elapsed", used ? " | " : "", elapsed);
+    if (progress->reported && now - progress->advanced_ms >= PROGRESS_IDLE_MS) {
+        char idle[32];
+        format_duration((now - progress->advanced_ms) / 1000, idle, sizeof(idle));
+        append(buffer, len, used, " | no progress for %s", idle);
+    }
+}
+
+int progress_channel(void)
+{
+    const char *env = getenv(PROGRESS_FD_ENV);
+    if (!env || !*env) {
+        return -1;
+    }
+    char *end = NULL;
+    long fd = strtol(env, &end, 10);
+    return (end != env && *end == '\0' && fd > STDERR_FILENO && fd < 1024) ? (int)fd : -1;
+}
+
+/* Writes one record; negative counters are left out. */
+int progress_emit(int fd, const char *phase, long long bytes_done, long long bytes_total, long long items_done,
+                  long long items_total, const char *item)
+{
+    if (fd < 0) {
+        return -1;
+    }
+    char line[PROGRESS_LINE_MAX];
+    size_t used = 0;
+    if (phase && phase[0]) {
+        used = append(line, sizeof(line), used, "phase=%s ", phase);
+    }
+    if (bytes_done >= 0) {
+        used = append(line, sizeof(line), used, "bytes=%lld", bytes_done);
+        used = bytes_total > 0 ? append(line, sizeof(line), used, "/%lld ", bytes_total)
+                               : append(line, sizeof(line), used, " ");
+    }
+    if (items_done >= 0) {
+        used = append(line, sizeof(line), used, "items=%lld", items_done);
+        used = items_total > 0 ? append(line, sizeof(line), used, "/%lld ", items_total)
+                               : append(line, sizeof(line), used, " ");
+    }
+    if (item && item[0]) {
+        used = append(line, sizeof(line), used, "item=%s ", item);
+    }
+    if (used == 0) {
+        return 0;
+    }
+    if (used >= sizeof(line)) {
+        used = sizeof(line) - 1;
+    }
+    line[used - 1] = '\n';
+    /* Records are far below PIPE_BUF, so each write lands whole. */
+    return write(fd, line, used) == (ssize_t)used ? 0 : -1;
+}
@@ -0,0 +1,370 @@
+#include "repo_sync.h"
+
+#include <fcntl.h>
+#include <netdb.h>
+#include <poll.h>
+#include <sys/socket.h>
+
+#include "bandwidth.h"
+#include "log.h"
+#include "portage_image.h"
+#include "system_utils.h"
+#include "ui.h"
+
+static const char *const method_names[REPO_SYNC_METHOD_COUNT] = {"webrsync", "rsync", "git"};
+
+typedef struct {
+    long connect_ms;     /* -1 when the endpoint is unreachable */
+    double last_seconds; /* duration of the last sync with this method, 0 when never measured */
+} MethodEstimate;
+
+const char *repo_sync_method_name(RepoSyncMethod method)
+{
+    return (method >= 0 && method < REPO_SYNC_METHOD_COUNT) ? method_names[method] : "unknown";
+}
+
+static long long monotonic_ms(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (long long)ts.tv_sec * 1000 + ts.tv_nsec / 1000000;
+}
+
+static long long max_age_seconds(void)
+{
+    const char *env = getenv("LIBERO_SYNC_MAX_AGE_HOURS");
+    if (env && *env) {
+        char *end = NULL;
+        long hours = strtol(env, &end, 10);
+        if (end && *end == '\0' && hours >= 0) {
+            return (long long)hours * 3600;
+        }
+        log_error("Ignoring invalid LIBERO_SYNC_MAX_AGE_HOURS=%s", env);
+    }
+    return (long long)REPO_SYNC_DEFAULT_MAX_AGE_HOURS * 3600;
+}
+
+/* Reads the snapshot time from metadata/timestamp.x (epoch first) or
+ * metadata/timestamp.chk (an RFC 2822 date in UTC). Returns -1 when the tree
+ * has neither. */
+long long repo_snapshot_timestamp(const char *tree)
+{
+    char path[PATH_MAX];
+    char line[128];
+    if (snprintf(path, sizeof(path), "%s/metadata/timestamp.x", tree) < (int)sizeof(path)) {
+        FILE *f = fopen(path, "r");
+        if (f) {
+            bool have_line = fgets(line, sizeof(line), f) != NULL;
+            fclose(f);
+            char *end = NULL;
+            long long value = have_line ? strtoll(line, &end, 10) : 0;
+            if (have_line && end != line && value > 0) {
+                return value;
+            }
+        }
+    }
+    if (snprintf(path, sizeof(path), "%s/metadata/timestamp.chk", tree) < (int)sizeof(path)) {
+        FILE *f = fopen(path, "r");
+        if (f) {
+            bool have_line = fgets(line, sizeof(line), f) != NULL;
+            fclose(f);
+            struct tm tm;
+            memset(&tm, 0, sizeof(tm));
+            if (have_line && strptime(line, "%a, %d %b %Y %H:%M:%S", &tm)) {
+                return (long long)timegm(&tm);
+            }
+        }
+    }
+    return -1;
+}
+
+/* TCP handshake time to host:port, or -1 when it cannot be reached within
+ * REPO_SYNC_CONNECT_TIMEOUT_MS. */
+static long probe_connect(const char *host, const char *port)
+{
+    struct addrinfo hints;
+    memset(&hints, 0, sizeof(hints));
+    hints.ai_family = AF_UNSPEC;
+    hints.ai_socktype = SOCK_STREAM;
+    struct addrinfo *addrs = NULL;
+    if (getaddrinfo(host, port, &hints, &addrs) != 0 || !addrs) {
+        return -1;
+    }
+
+    long result = -1;
+    int fd = socket(addrs->ai_family, addrs->ai_socktype | SOCK_NONBLOCK | SOCK_CLOEXEC, addrs->ai_protocol);
+    if (fd >= 0) {
+        long long started = monotonic_ms();
+        int rc = connect(fd, addrs->ai_addr, addrs->ai_addrlen);
+        if (rc != 0 && errno == EINPROGRESS) {
+            struct pollfd pfd = {.fd = fd, .events = POLLOUT};
+            int error = 0;
+            socklen_t error_len = sizeof(error);
+            if (poll(&pfd, 1, REPO_SYNC_CONNECT_TIMEOUT_MS) == 1 &&
+                getsockopt(fd, SOL_SOCKET, SO_ERROR, &error, &error_len) == 0 && error == 0) {
+                rc = 0;
+            }
+        }
+        if (rc == 0) {
+            result = (long)(monotonic_ms() - started);
+        }
+        close(fd);
+    }
+    freeaddrinfo(addrs);
+    return result;
+}
+
+static void mirror_host(const char *url, char *host, size_t host_len, char *port, size_t port_len)
+{
+    const char *p = strstr(url, "://");
+    p = p ? p + 3 : url;
+    snprintf(port, port_len, "%s", strncmp(url, "http://", 7) == 0 ? "80" : "443");
+    size_t len = strcspn(p, ":/");
+    snprintf(host, host_len, "%.*s", (int)(len < host_len ? len : host_len - 1), p);
+    if (p[len] == ':') {
+        size_t digits = strspn(p + len + 1, "0123456789");
+        if (digits > 0 && digits < port_len) {
+            snprintf(port, port_len, "%.*s", (int)digits, p + len + 1);
+        }
+    }
+}
+
+static int timings_path(char *buffer, size_t len)
+{
+    return snprintf(buffer, len, "%s/%s", INSTALL_CACHE_DIR, REPO_SYNC_TIMINGS_NAME) < (int)len ? 0 : -1;
+}
+
+static void load_timings(MethodEstimate *estimates)
+{
+    char path[PATH_MAX];
+    if (timings_path(path, sizeof(path)) != 0) {
+        return;
+    }
+    FILE *f = fopen(path, "r");
+    if (!f) {
+        return;
+    }
+    char name[32];
+    double seconds;
+    while (fscanf(f, "%31s %lf", name, &seconds) == 2) {
+        for (int m = 0; m < REPO_SYNC_METHOD_COUNT; ++m) {
+            if (strcmp(name, method_names[m]) == 0 && seconds > 0) {
+                estimates[m].last_seconds = seconds;
+            }
+        }
+    }
+    fclose(f);
+}
+
+static void save_timing(RepoSyncMethod method, double seconds)
+{
+    MethodEstimate estimates[REPO_SYNC_METHOD_COUNT];
+    memset(estimates, 0, sizeof(estimates));
+    load_timings(estimates);
+    estimates[method].last_seconds = seconds;
+
+    char path[PATH_MAX];
+    if (timings_path(path, sizeof(path)) != 0 || ensure_directory(INSTALL_CACHE_DIR, 0755) != 0) {
+        return;
+    }
+    FILE *f = fopen(path, "w");
+    if (!f) {
+        log_error("Unable to record sync timings in %s: %s", path, strerror(errno));
+        return;
+    }
+    for (int m = 0; m < REPO_SYNC_METHOD_COUNT; ++m) {
+        if (estimates[m].last_seconds > 0) {
+            fprintf(f, "%s %.1f\n", method_names[m], estimates[m].last_seconds);
+        }
+    }
+    fclose(f);
+}
+
+/* Measured durations decide whenever one exists for a reachable method.
+ * Before the first sync on this machine there is nothing to compare, so
+ * fall back to what each method costs: rsync only moves the delta of an
+ * existing tree, webrsync fetches one snapshot over the already ranked
+ * HTTP mirror, and a shallow git clone needs an empty location. */
+static int choose_method(const MethodEstimate *estimates, bool have_tree, long long age)
+{
+    int best = -1;
+    for (int m = 0; m < REPO_SYNC_METHOD_COUNT; ++m) {
+        if (estimates[m].connect_ms < 0 || estimates[m].last_seconds <= 0) {
+            continue;
+        }
+        if (m == REPO_SYNC_GIT && have_tree) {
+            continue;
+        }
+        if (best < 0 || estimates[m].last_seconds < estimates[best].last_seconds) {
+            best = m;
+        }
+    }
+    if (best >= 0) {
+        return best;
+    }
+
+    if (have_tree && age <= (long long)REPO_SYNC_RSYNC_MAX_AGE_DAYS * 86400 &&
+        estimates[REPO_SYNC_RSYNC].connect_ms >= 0) {
+        return REPO_SYNC_RSYNC;
+    }
+    if (estimates[REPO_SYNC_WEBRSYNC].connect_ms >= 0) {
+        return REPO_SYNC_WEBRSYNC;
+    }
+    if (estimates[REPO_SYNC_RSYNC].connect_ms >= 0) {
+        return REPO_SYNC_RSYNC;
+    }
+    if (!have_tree && estimates[REPO_SYNC_GIT].connect_ms >= 0) {
+        return REPO_SYNC_GIT;
+    }
+    return -1;
+}
+
+/* The extracted or mounted tree that portage must use; the freshest one wins
+ * when more than one location holds a tree. */
+static long long find_tree(const char *root, char *location, size_t len)
+{
+    static const char *const candidates[] = {PORTAGE_REPO_DIR, REPO_SYNC_DEFAULT_LOCATION};
+    long long best = -1;
+    snprintf(location, len, "%s", REPO_SYNC_DEFAULT_LOCATION);
+    for (size_t i = 0; i < sizeof(candidates) / sizeof(candidates[0]); ++i) {
+        char tree[PATH_MAX];
+        if (snprintf(tree, sizeof(tree), "%s%s", root, candidates[i]) >= (int)sizeof(tree)) {
+            continue;
+        }
+        long long stamp = repo_snapshot_timestamp(tree);
+        if (stamp > best) {
+            best = stamp;
+            snprintf(location, len, "%s", candidates[i]);
+        }
+    }
+    return best;
+}
+
+static int write_repos_conf(const char *root, const char *location, RepoSyncMethod method)
+{
+    char dir[PATH_MAX];
+    char path[PATH_MAX];
+    if (snprintf(dir, sizeof(dir), "%s/etc/portage/repos.conf", root) >= (int)sizeof(dir) ||
+        snprintf(path, sizeof(path), "%s%s", root, REPO_SYNC_REPOS_CONF) >= (int)sizeof(path) ||
+        ensure_directory(dir, 0755) != 0) {
+        return -1;
+    }
+
+    const char *uri = "";
+    const char *extra = "";
+    if (method == REPO_SYNC_RSYNC) {
+        uri = "sync-uri = " REPO_SYNC_RSYNC_URI "\n";
+    } else if (method == REPO_SYNC_GIT) {
+        uri = "sync-uri = " REPO_SYNC_GIT_URI "\n";
+        extra = "sync-depth = 1\n";
+    }
+    char content[1024];
+    snprintf(content, sizeof(content),
+             "[DEFAULT]\n"
+             "main-repo = gentoo\n"
+             "\n"
+             "[gentoo]\n"
+             "location = %s\n"
+             "sync-type = %s\n"
+             "%s%s"
+             "auto-sync = yes\n",
+             location, method_names[method], uri, extra);
+    return write_text_file(path, content);
+}
+
+static void record_state(const char *root, const char *location, long long snapshot, const char *action)
+{
+    char path[PATH_MAX];
+    char dir[PATH_MAX];
+    if (snprintf(path, sizeof(path), "%s%s", root, REPO_SYNC_STATE_PATH) >= (int)sizeof(path)) {
+        return;
+    }
+    snprintf(dir, sizeof(dir), "%s", path);
+    char *slash = strrchr(dir, '/');
+    if (slash) {
+        *slash = '\0';
+        ensure_directory(dir, 0755);
+    }
+    char content[PATH_MAX + 256];
+    snprintf(content, sizeof(content), "location=%s\nsnapshot=%lld\nchecked=%lld\nlast_action=%s\n", location, snapshot,
+             (long long)time(NULL), action);
+    write_text_file(path, content);
+}
+
+/* Single entry point for every step that needs a current Portage tree.
+ * Syncs at most once per REPO_SYNC_DEFAULT_MAX_AGE_HOURS, whichever step
+ * asks first, and records the snapshot time in the target. */
+int repo_sync_ensure_fresh(const InstallerState *state)
+{
+    const char *root = state->install_root;
+    char location[PATH_MAX];
+    long long snapshot = find_tree(root, location, sizeof(location));
+    long long now = (long long)time(NULL);
+    long long age = snapshot > 0 ? now - snapshot : -1;
+    long long limit = max_age_seconds();
+
+    if (snapshot > 0 && age <= limit) {
+        log_info("Portage tree in %s is %lld minutes old (limit %lld); skipping sync", location, age / 60,
+                 limit / 60);
+        write_repos_conf(root, location, REPO_SYNC_WEBRSYNC);
+        record_state(root, location, snapshot, "skipped");
+        return 0;
+    }
+
+    ui_progress("Portage", "Measuring Portage sync endpoints...", 5);
+    MethodEstimate estimates[REPO_SYNC_METHOD_COUNT];
+    memset(estimates, 0, sizeof(estimates));
+    char host[256];
+    char port[8];
+    mirror_host(state->mirror_root[0] ? state->mirror_root : GENTOO_MIRROR_DEFAULT, host, sizeof(host), port,
+                sizeof(port));
+    estimates[REPO_SYNC_WEBRSYNC].connect_ms = probe_connect(host, port);
+    estimates[REPO_SYNC_RSYNC].connect_ms = probe_connect(REPO_SYNC_RSYNC_HOST, "873");
+    estimates[REPO_SYNC_GIT].connect_ms = probe_connect(REPO_SYNC_GIT_HOST, "443");
+    load_timings(estimates);
+    for (int m = 0; m < REPO_SYNC_METHOD_COUNT; ++m) {
+        log_info("Sync method %s: connect %ld ms, last run %.1f s", method_names[m], estimates[m].connect_ms,
+                 estimates[m].last_seconds);
+    }
+
+    int method = choose_method(estimates, snapshot > 0, age);
+    if (method < 0 && snapshot > 0) {
+        log_error("No Portage sync endpoint is reachable; continuing with the %lld hour old tree", age / 3600);
+        record_state(root, location, snapshot, "offline");
+        return 0;
+    }
+    if (method < 0) {
+        log_error("No Portage sync endpoint is reachable");
+        return -1;
+    }
+    if (write_repos_conf(root, location, (RepoSyncMethod)method) != 0) {
+        return -1;
+    }
+
+    char message[MAX_MESSAGE_LEN];
+    if (snapshot > 0) {
+        snprintf(message, sizeof(message), "Portage tree is %lld hours old; syncing with %s...", age / 3600,
+                 method_names[method]);
+    } else {
+        snprintf(message, sizeof(message), "No Portage tree found; syncing with %s...", method_names[method]);
+    }
+    ui_progress("Portage", message, 20);
+    log_info("%s", message);
+
+    long long started = monotonic_ms();
+    if (bandwidth_run_chroot_script(root, BANDWIDTH_CRITICAL, "Portage sync",
+                                    "source /etc/profile\nlibero_progress 'phase=sync item=emaint sync -r gentoo'\n"
+                                    "emaint sync -r gentoo\n") != 0) {
+        log_error("Portage sync with %s failed", method_names[method]);
+        return -1;
+    }
+    double seconds = (double)(monotonic_ms() - started) / 1000.0;
+    save_timing((RepoSyncMethod)method, seconds);
+
+    char tree[PATH_MAX];
+    snapshot = snprintf(tree, sizeof(tree), "%s%s", root, location) < (int)sizeof(tree) ? repo_snapshot_timestamp(tree)
+                                                                                       : -1;
+    record_state(root, location, snapshot, method_names[method]);
+    log_info("Portage sync with %s took %.1f s", method_names[method], seconds);
+    return 0;
+}
@@ -0,0 +1,26 @@
+#include "report.h"
+
+#include "log.h"
+
+void report_add(const char *section, const char *fmt, ...)
+{
+    char line[MAX_MESSAGE_LEN];
+    va_list args;
+    va_start(args, fmt);
+    vsnprintf(line, sizeof(line), fmt, args);
+    va_end(args);
+    log_info("Report [%s] %s", section, line);
+
+    FILE *f = fopen(INSTALL_REPORT_PATH, "a");
+    if (!f) {
+        log_error("Unable to append to %s: %s", INSTALL_REPORT_PATH, strerror(errno));
+        return;
+    }
+    time_t raw = time(NULL);
+    struct tm tm_info;
+    localtime_r(&raw, &tm_info);
+    char timestamp[32];
+    strftime(timestamp, sizeof(timestamp), "%Y-%m-%d %H:%M:%S", &tm_info);
+    fprintf(f, "%s [%s] %s\n", timestamp, section, line);
+    fclose(f);
+}
@@ -10,6 +10,8 @@ void installer_state_init(InstallerState *state)
 
     state->arch = ARCH_I486;
     state->root_fs = FS_EXT4;
+    state->fs_profile = FS_PROFILE_THROUGHPUT;
+    state->fs_profile_pinned = false;
     state->swap_size_mb = 1024;
     state->boot_mode = (access("/sys/firmware/efi/efivars", F_OK) == 0) ? BOOTMODE_UEFI : BOOTMODE_LEGACY;
     state->use_luks = false;
@@ -17,12 +19,12 @@ void installer_state_init(InstallerState *state)
     state->disk_prepared = false;
     state->network_configured = false;
     state->stage3_ready = false;
+    state->portage_squashfs = false;
     state->bootloader_installed = false;
     state->static_prefix = 24;
 
     snprintf(state->install_root, sizeof(state->install_root), "%s", INSTALL_ROOT_DEFAULT);
-    snprintf(state->mirror_url, sizeof(state->mirror_url), "%s", STAGE3_BASE_URL);
-    snprintf(state->portage_url, sizeof(state->portage_url), "%s/%s", PORTAGE_BASE_URL, PORTAGE_SNAPSHOT_NAME);
+    installer_state_set_mirror(state, GENTOO_MIRROR_DEFAULT);
     snprintf(state->stage3_local, sizeof(state->stage3_local), INSTALL_CACHE_DIR "/stage3.tar.xz");
     snprintf(state->stage3_digest_local, sizeof(state->stage3_digest_local), INSTALL_CACHE_DIR "/stage3.tar.xz.DIGESTS");
     snprintf(state->portage_local, sizeof(state->portage_local), INSTALL_CACHE_DIR "/%s", PORTAGE_SNAPSHOT_NAME);
@@ -98,6 +100,22 @@ const char *fs_to_string(FilesystemType fs)
     }
 }
 
+const char *fs_profile_to_string(FsProfile profile)
+{
+    switch (profile) {
+    case FS_PROFILE_THROUGHPUT:
+        return "throughput";
+    case FS_PROFILE_LOW_LATENCY:
+        return "low-latency";
+    case FS_PROFILE_FLASH:
+        return "flash";
+    case FS_PROFILE_SMALL_DISK:
+        return "small-disk";
+    default:
+        return "unknown";
+    }
+}
+
 static void filename_from_path(const char *path, const char *fallback, char *out, size_t len)
 {
     if (!out || len == 0) {
@@ -167,3 +185,24 @@ void installer_state_set_cache_dir(InstallerState *state, const char *cache_dir)
     build_cache_path(state->stage3_digest_local, sizeof(state->stage3_digest_local), cache_dir, digest_name);
     build_cache_path(state->portage_local, sizeof(state->portage_local), cache_dir, portage_name);
 }
+
+void installer_state_set_mirror(InstallerState *state, const char *mirror_root)
+{
+    if (!state || !mirror_root || !mirror_root[0]) {
+        return;
+    }
+
+    size_t len = strnlen(mirror_root, sizeof(state->mirror_root) - 1);
+    while (len > 0 && mirror_root[len - 1] == '/') {
+        --len;
+    }
+    memcpy(state->mirror_root, mirror_root, len);
+    state->mirror_root[len] = '\0';
+
+    if (snprintf(state->mirror_url, sizeof(state->mirror_url), "%s%s", state->mirror_root, STAGE3_MIRROR_PATH) >=
+        (int)sizeof(state->mirror_url)) {
+        state->mirror_url[0] = '\0';
+    }
+    snprintf(state->portage_url, sizeof(state->portage_url), "%s%s/%s", state->mirror_root, PORTAGE_MIRROR_PATH,
+             PORTAGE_SNAPSHOT_NAME);
+}
@@ -1,10 +1,17 @@
 #include "system_utils.h"
 
+#include <dirent.h>
 #include <fcntl.h>
+#include <ftw.h>
+#include <poll.h>
+#include <signal.h>
 #include <sys/mount.h>
+#include <sys/syscall.h>
 #include <sys/wait.h>
 
+#include "block_probe.h"
 #include "log.h"
+#include "progress.h"
 #include "ui.h"
 
 bool is_path_mounted(const char *path)
@@ -156,6 +163,68 @@ int capture_command(const char *cmd, char *output, size_t output_len)
     return status;
 }
 
+static pid_t spawn_with_pipe(const char *cmd, int child_fd, int *parent_fd)
+{
+    if (!cmd || !parent_fd) {
+        return -1;
+    }
+
+    ensure_command_path();
+
+    int fds[2];
+    if (pipe2(fds, O_CLOEXEC) != 0) {
+        log_error("pipe() failed for %s: %s", cmd, strerror(errno));
+        return -1;
+    }
+    const int parent_end = (child_fd == STDIN_FILENO) ? fds[1] : fds[0];
+    const int child_end = (child_fd == STDIN_FILENO) ? fds[0] : fds[1];
+
+    const char *log_path = log_get_path();
+    pid_t pid = fork();
+    if (pid < 0) {
+        log_error("fork() failed for %s: %s", cmd, strerror(errno));
+        close(fds[0]);
+        close(fds[1]);
+        return -1;
+    }
+
+    if (pid == 0) {
+        int log_fd = -1;
+        if (log_path && *log_path) {
+            log_fd = open(log_path, O_WRONLY | O_APPEND | O_CREAT, 0644);
+        }
+        if (log_fd < 0) {
+            log_fd = open("/dev/null", O_WRONLY);
+        }
+        /* The installer ignores SIGPIPE while streaming; children must not. */
+        signal(SIGPIPE, SIG_DFL);
+        dup2(child_end, child_fd);
+        if (log_fd >= 0) {
+            if (child_fd != STDOUT_FILENO) {
+                dup2(log_fd, STDOUT_FILENO);
+            }
+            dup2(log_fd, STDERR_FILENO);
+        }
+        execl("/bin/sh", "sh", "-c", cmd, (char *)NULL);
+        _exit(127);
+    }
+
+    close(child_end);
+    *parent_fd = parent_end;
+    log_info("Executing: %s", cmd);
+    return pid;
+}
+
+pid_t spawn_command_reader(const char *cmd, int *stdout_fd)
+{
+    return spawn_with_pipe(cmd, STDOUT_FILENO, stdout_fd);
+}
+
+pid_t spawn_command_writer(const char *cmd, int *stdin_fd)
+{
+    return spawn_with_pipe(cmd, STDIN_FILENO, stdin_fd);
+}
+
 static void shorten_for_display(const char *input, char *output, size_t output_len)
 {
     if (!output || output_len == 0) {
@@ -182,90 +251,280 @@ static void shorten_for_display(const char *input, char *output, size_t output_l
     memcpy(output + keep, "...", 4);
 }
 
-static int run_formatted_command(char *buffer, size_t buffer_len, const char *fmt, va_list args)
+/* Sectors written to a block device so far, from its sysfs stat file. */
+static long long device_bytes_written(const char *stat_path)
+{
+    FILE *f = fopen(stat_path, "r");
+    if (!f) {
+        return -1;
+    }
+    unsigned long long fields[7] = {0};
+    int n = fscanf(f, "%llu %llu %llu %llu %llu %llu %llu", &fields[0], &fields[1], &fields[2], &fields[3],
+                   &fields[4], &fields[5], &fields[6]);
+    fclose(f);
+    return n == 7 ? (long long)fields[6] * 512 : -1;
+}
+
+/* Closes every descriptor from 3 up except keep_a and keep_b. */
+static void close_other_fds(int keep_a, int keep_b)
+{
+    if (keep_a > keep_b) {
+        int swap = keep_a;
+        keep_a = keep_b;
+        keep_b = swap;
+    }
+#ifdef SYS_close_range
+    if ((keep_a <= 3 || syscall(SYS_close_range, 3U, (unsigned)keep_a - 1, 0U) == 0) &&
+        (keep_b <= keep_a + 1 || syscall(SYS_close_range, (unsigned)keep_a + 1, (unsigned)keep_b - 1, 0U) == 0) &&
+        syscall(SYS_close_range, (unsigned)keep_b + 1, ~0U, 0U) == 0) {
+        return;
+    }
+#endif
+    long max = sysconf(_SC_OPEN_MAX);
+    if (max < 0 || max > 65536) {
+        max = 65536;
+    }
+    for (int fd = 3; fd < max; ++fd) {
+        if (fd != keep_a && fd != keep_b) {
+            close(fd);
+        }
+    }
+}
+
+/* Reports the I/O a tool without progress output of its own, such as mkfs,
+ * does on device, until the write end of its stop pipe (*stop_fd) is
+ * closed. No signal is involved: the child is a plain fork of the ncurses
+ * process, and a handler it inherited would run endwin() on the shared
+ * terminal. */
+static pid_t spawn_device_watcher(const char *device, const char *phase, int progress_fd, int *stop_fd)
+{
+    *stop_fd = -1;
+    char resolved[PATH_MAX];
+    char stat_path[PATH_MAX];
+    if (!realpath(device, resolved)) {
+        return -1;
+    }
+    const char *name = strrchr(resolved, '/');
+    name = name ? name + 1 : resolved;
+    if (snprintf(stat_path, sizeof(stat_path), "/sys/class/block/%s/stat", name) >= (int)sizeof(stat_path)) {
+        return -1;
+    }
+    long long base = device_bytes_written(stat_path);
+    if (base < 0) {
+        return -1;
+    }
+
+    int stop[2];
+    if (pipe2(stop, O_CLOEXEC) != 0) {
+        return -1;
+    }
+    pid_t pid = fork();
+    if (pid != 0) {
+        close(stop[0]);
+        if (pid < 0) {
+            close(stop[1]);
+            return -1;
+        }
+        *stop_fd = stop[1];
+        return pid;
+    }
+
+    signal(SIGPIPE, SIG_DFL);
+    signal(SIGTERM, SIG_DFL);
+    signal(SIGINT, SIG_DFL);
+    int null_fd = open("/dev/null", O_RDWR);
+    if (null_fd >= 0) {
+        dup2(null_fd, STDIN_FILENO);
+        dup2(null_fd, STDOUT_FILENO);
+        dup2(null_fd, STDERR_FILENO);
+    }
+    /* Stop pipes of other jobs' watchers must not stay open in here. */
+    close_other_fds(progress_fd, stop[0]);
+
+    progress_emit(progress_fd, phase, 0, -1, -1, -1, device);
+    struct pollfd stop_poll = {.fd = stop[0], .events = POLLIN};
+    while (1) {
+        int ready = poll(&stop_poll, 1, 500);
+        if (ready > 0 || (ready < 0 && errno != EINTR)) {
+            _exit(0);
+        }
+        long long written = device_bytes_written(stat_path);
+        if (written < 0 || progress_emit(progress_fd, NULL, written - base, -1, -1, -1, NULL) != 0) {
+            _exit(0);
+        }
+    }
+}
+
+/* The child inherits the write end of a progress pipe as PROGRESS_CHILD_FD
+ * and its number in PROGRESS_FD_ENV; watch_device, when set, is reported on
+ * the same channel. */
+int spawn_command_on_device(const char *device, const char *cmd, SpawnedCommand *spawned)
 {
     ensure_command_path();
 
-    if (vsnprintf(buffer, buffer_len, fmt, args) >= (int)buffer_len) {
+    spawned->pid = -1;
+    spawned->watcher = -1;
+    spawned->watcher_stop = -1;
+    spawned->progress_fd = -1;
+    if (snprintf(spawned->command, sizeof(spawned->command), "%s", cmd) >= (int)sizeof(spawned->command)) {
         log_error("Command too long");
         return -1;
     }
 
-    log_info("Executing: %s", buffer);
+    log_info("Executing: %s", cmd);
 
     const char *log_path = log_get_path();
     char cmd_with_redirection[MAX_CMD_LEN * 2];
 
     if (log_path && *log_path) {
-        if (snprintf(cmd_with_redirection, sizeof(cmd_with_redirection), "%s >> '%s' 2>&1", buffer, log_path) >= (int)sizeof(cmd_with_redirection)) {
+        if (snprintf(cmd_with_redirection, sizeof(cmd_with_redirection), "%s >> '%s' 2>&1", cmd, log_path) >= (int)sizeof(cmd_with_redirection)) {
             log_error("Redirected command too long");
             return -1;
         }
     } else {
-        if (snprintf(cmd_with_redirection, sizeof(cmd_with_redirection), "%s >/dev/null 2>&1", buffer) >= (int)sizeof(cmd_with_redirection)) {
+        if (snprintf(cmd_with_redirection, sizeof(cmd_with_redirection), "%s >/dev/null 2>&1", cmd) >= (int)sizeof(cmd_with_redirection)) {
             log_error("Redirected command too long");
             return -1;
         }
     }
 
+    int progress[2] = {-1, -1};
+    if (pipe2(progress, O_CLOEXEC) != 0) {
+        log_error("Unable to create progress channel: %s", strerror(errno));
+        progress[0] = progress[1] = -1;
+    }
+
     pid_t pid = fork();
     if (pid < 0) {
-        log_error("fork() failed for %s: %s", buffer, strerror(errno));
+        log_error("fork() failed for %s: %s", cmd, strerror(errno));
+        if (progress[0] >= 0) {
+            close(progress[0]);
+            close(progress[1]);
+        }
         return -1;
     }
 
     if (pid == 0) {
+        if (progress[1] >= 0 && dup2(progress[1], PROGRESS_CHILD_FD) == PROGRESS_CHILD_FD) {
+            char fd_text[16];
+            snprintf(fd_text, sizeof(fd_text), "%d", PROGRESS_CHILD_FD);
+            setenv(PROGRESS_FD_ENV, fd_text, 1);
+        }
         execl("/bin/sh", "sh", "-c", cmd_with_redirection, (char *)NULL);
         _exit(127);
     }
 
+    if (progress[1] >= 0) {
+        if (device) {
+            char phase[32];
+            snprintf(phase, sizeof(phase), "%.*s", (int)strcspn(cmd, " "), cmd);
+            spawned->watcher = spawn_device_watcher(device, phase, progress[1], &spawned->watcher_stop);
+        }
+        close(progress[1]);
+        fcntl(progress[0], F_SETFL, O_NONBLOCK);
+    }
+    spawned->pid = pid;
+    spawned->progress_fd = progress[0];
+    return 0;
+}
+
+/* Call once pid has been reaped. */
+int spawned_command_finish(SpawnedCommand *spawned, int wait_status)
+{
+    /* Whatever it was, it may have written a superblock. */
+    block_probe_invalidate();
+    if (spawned->watcher_stop >= 0) {
+        close(spawned->watcher_stop);
+        spawned->watcher_stop = -1;
+    }
+    if (spawned->watcher > 0) {
+        while (waitpid(spawned->watcher, NULL, 0) < 0 && errno == EINTR) {
+        }
+        spawned->watcher = -1;
+    }
+    if (spawned->progress_fd >= 0) {
+        close(spawned->progress_fd);
+        spawned->progress_fd = -1;
+    }
+    spawned->pid = -1;
+
+    if (WIFEXITED(wait_status)) {
+        int code = WEXITSTATUS(wait_status);
+        if (code == 127) {
+            const char *path = getenv("PATH");
+            log_error("Command not found: '%s' (PATH=%s)", spawned->command, path ? path : "(unset)");
+        } else if (code != 0) {
+            log_error("Command '%s' exited with %d", spawned->command, code);
+        }
+        return code;
+    }
+    if (WIFSIGNALED(wait_status)) {
+        log_error("Command '%s' terminated by signal %d", spawned->command, WTERMSIG(wait_status));
+    } else {
+        log_error("Command '%s' terminated abnormally", spawned->command);
+    }
+    return -1;
+}
+
+static int run_formatted_command(const char *watch_device, const char *fmt, va_list args)
+{
+    char buffer[MAX_CMD_LEN];
+    if (vsnprintf(buffer, sizeof(buffer), fmt, args) >= (int)sizeof(buffer)) {
+        log_error("Command too long");
+        return -1;
+    }
+
+    SpawnedCommand spawned;
+    if (spawn_command_on_device(watch_device, buffer, &spawned) != 0) {
+        return -1;
+    }
+
     char display_cmd[96];
     shorten_for_display(buffer, display_cmd, sizeof(display_cmd));
 
-    int status = ui_wait_for_process("Running command", display_cmd, pid);
+    /* ui_wait_for_process closes the channel itself. */
+    int status = ui_wait_for_process("Running command", display_cmd, spawned.pid, spawned.progress_fd);
+    spawned.progress_fd = -1;
     if (status < 0) {
         int saved_errno = errno;
+        spawned_command_finish(&spawned, 0);
         log_error("Failed to wait for %s: %s", buffer, strerror(saved_errno));
         ui_error("Command Failed", "Unable to monitor child process. Check the installer log.");
         return -1;
     }
 
-    if (WIFEXITED(status)) {
-        int code = WEXITSTATUS(status);
-        if (code != 0) {
-            if (code == 127) {
-                const char *path = getenv("PATH");
-                log_error("Command not found: '%s' (PATH=%s)", buffer, path ? path : "(unset)");
-            } else {
-                log_error("Command '%s' exited with %d", buffer, code);
-            }
-            char message[256];
-            if (code == 127) {
-                snprintf(message, sizeof(message), "'%s' is not available (exit 127). See log: %s", display_cmd, log_get_path());
-            } else {
-                snprintf(message, sizeof(message), "'%s' failed (exit %d). See log: %s", display_cmd, code, log_get_path());
-            }
-            ui_error("Command Failed", message);
-            return -code;
+    int code = spawned_command_finish(&spawned, status);
+    if (code > 0) {
+        char message[256];
+        if (code == 127) {
+            snprintf(message, sizeof(message), "'%s' is not available (exit 127). See log: %s", display_cmd, log_get_path());
+        } else {
+            snprintf(message, sizeof(message), "'%s' failed (exit %d). See log: %s", display_cmd, code, log_get_path());
         }
-        return 0;
+        ui_error("Command Failed", message);
+        return -code;
     }
-
-    if (WIFSIGNALED(status)) {
-        log_error("Command '%s' terminated by signal %d", buffer, WTERMSIG(status));
-    } else {
-        log_error("Command '%s' terminated abnormally", buffer);
+    if (code < 0) {
+        ui_error("Command Failed", "Process terminated unexpectedly. See the installer log for details.");
+        return -1;
     }
-    ui_error("Command Failed", "Process terminated unexpectedly. See the installer log for details.");
-    return -1;
+    return 0;
 }
 
 int run_command(const char *fmt, ...)
 {
-    char cmd[MAX_CMD_LEN];
     va_list args;
     va_start(args, fmt);
-    int rc = run_formatted_command(cmd, sizeof(cmd), fmt, args);
+    int rc = run_formatted_command(NULL, fmt, args);
+    va_end(args);
+    return rc;
+}
+
+int run_command_on_device(const char *device, const char *fmt, ...)
+{
+    va_list args;
+    va_start(args, fmt);
+    int rc = run_formatted_command(device, fmt, args);
     va_end(args);
     return rc;
 }
@@ -329,6 +588,39 @@ int run_command_chroot(const char *root, const char *fmt, ...)
     return run_command("chroot %s /bin/bash -lc '%s'", root, escaped);
 }
 
+/* Scripts report through the progress channel with libero_progress. emerge
+ * is wrapped so the package it is on, out of how many, is read from
+ * emerge.log while it runs. */
+static const char chroot_script_prologue[] =
+    "libero_progress() {\n"
+    "    if [ -n \"${" PROGRESS_FD_ENV ":-}\" ]; then\n"
+    "        printf '%s\\n' \"$*\" >&\"${" PROGRESS_FD_ENV "}\" 2>/dev/null || true\n"
+    "    fi\n"
+    "}\n"
+    "emerge() {\n"
+    "    if [ -z \"${" PROGRESS_FD_ENV ":-}\" ]; then\n"
+    "        command emerge \"$@\"\n"
+    "        return\n"
+    "    fi\n"
+    "    touch /var/log/emerge.log\n"
+    "    local start=$(( $(stat -c %s /var/log/emerge.log) + 1 ))\n"
+    "    command emerge \"$@\" &\n"
+    "    local pid=$!\n"
+    "    libero_progress \"phase=emerge items=0 item=emerge $*\"\n"
+    "    tail -c \"+$start\" -F --pid=\"$pid\" /var/log/emerge.log 2>/dev/null | while IFS= read -r line; do\n"
+    "        if [[ $line =~ \\>\\>\\>\\ emerge\\ \\(([0-9]+)\\ of\\ ([0-9]+)\\)\\ ([^ ]+) ]]; then\n"
+    "            libero_progress \"items=$((BASH_REMATCH[1] - 1))/${BASH_REMATCH[2]} item=${BASH_REMATCH[3]}\"\n"
+    "        elif [[ $line =~ :::\\ completed\\ emerge\\ \\(([0-9]+)\\ of\\ ([0-9]+)\\)\\ ([^ ]+) ]]; then\n"
+    "            libero_progress \"items=${BASH_REMATCH[1]}/${BASH_REMATCH[2]} item=${BASH_REMATCH[3]}\"\n"
+    "        fi\n"
+    "    done &\n"
+    "    local watcher=$!\n"
+    "    local rc=0\n"
+    "    wait \"$pid\" || rc=$?\n"
+    "    wait \"$watcher\" 2>/dev/null || true\n"
+    "    return \"$rc\"\n"
+    "}\n";
+
 int chroot_run_script(const char *root, const char *script_body)
 {
     if (!root || !script_body) {
@@ -351,7 +643,9 @@ int chroot_run_script(const char *root, const char *script_body)
         return -1;
     }
 
-    fprintf(f, "#!/bin/bash\nset -euo pipefail\n%s\n", script_body);
+    fprintf(f, "#!/bin/bash\nset -euo pipefail\n");
+    fputs(chroot_script_prologue, f);
+    fprintf(f, "%s\n", script_body);
     fclose(f);
     chmod(script_path, 0700);
 
@@ -417,6 +711,23 @@ int append_text_file(const char *path, const char *content)
     return 0;
 }
 
+/* Options mount(8) turns into flags rather than filesystem data. */
+static const struct {
+    const char *name;
+    unsigned long flag;
+} mount_flag_names[] = {
+    {"defaults", 0},
+    {"rw", 0},
+    {"ro", MS_RDONLY},
+    {"noatime", MS_NOATIME},
+    {"nodiratime", MS_NODIRATIME},
+    {"relatime", MS_RELATIME},
+    {"lazytime", MS_LAZYTIME},
+    {"nosuid", MS_NOSUID},
+    {"nodev", MS_NODEV},
+    {"noexec", MS_NOEXEC},
+};
+
 int mount_fs(const char *device, const char *mountpoint, const char *fstype, const char *options)
 {
     if (ensure_directory(mountpoint, 0755) != 0) {
@@ -429,13 +740,43 @@ int mount_fs(const char *device, const char *mountpoint, const char *fstype, con
     if (!opts[0]) {
         flags = MS_NOATIME;
     }
-    if (mount(device, mountpoint, fstype, flags, opts[0] ? opts : NULL) != 0) {
-        log_error("Failed to mount %s on %s (type=%s opts=%s): %s", device, mountpoint, fstype, opts, strerror(errno));
+    /* fstab style options, so the same string serves both. */
+    char *data = strdup(opts);
+    if (!data) {
         return -1;
     }
+    size_t used = 0;
+    char *save = NULL;
+    for (char *token = strtok_r(data, ",", &save); token; token = strtok_r(NULL, ",", &save)) {
+        bool generic = false;
+        for (size_t i = 0; i < sizeof(mount_flag_names) / sizeof(mount_flag_names[0]); ++i) {
+            if (strcmp(token, mount_flag_names[i].name) == 0) {
+                flags |= mount_flag_names[i].flag;
+                generic = true;
+                break;
+            }
+        }
+        if (!generic) {
+            /* token never starts before the write position, so this
+             * compacts data in place. */
+            if (used > 0) {
+                data[used++] = ',';
+            }
+            size_t token_len = strlen(token);
+            memmove(data + used, token, token_len);
+            used += token_len;
+        }
+    }
+    data[used] = '\0';
 
-    log_info("Mounted %s on %s (%s)", device, mountpoint, fstype);
-    return 0;
+    int rc = mount(device, mountpoint, fstype, flags, data[0] ? data : NULL);
+    if (rc != 0) {
+        log_error("Failed to mount %s on %s (type=%s opts=%s): %s", device, mountpoint, fstype, opts, strerror(errno));
+    } else {
+        log_info("Mounted %s on %s (%s%s%s)", device, mountpoint, fstype, opts[0] ? ", " : "", opts);
+    }
+    free(data);
+    return rc == 0 ? 0 : -1;
 }
 
 int umount_path(const char *path)
@@ -450,28 +791,142 @@ int umount_path(const char *path)
 
 int get_block_uuid(const char *device, char *buffer, size_t buffer_len)
 {
-    char cmd[PATH_MAX + 64];
-    snprintf(cmd, sizeof(cmd), "blkid -s UUID -o value %s", device);
-    int rc = capture_command(cmd, buffer, buffer_len);
-    if (rc != 0 || buffer[0] == '\0') {
+    BlockInfo info;
+    if (block_probe(device, &info) != 0 || !info.uuid[0]) {
         log_error("Unable to read UUID for %s", device);
         return -1;
     }
+    snprintf(buffer, buffer_len, "%s", info.uuid);
     return 0;
 }
 
 long get_disk_size_mb(const char *device)
 {
-    char cmd[PATH_MAX + 64];
-    snprintf(cmd, sizeof(cmd), "blockdev --getsize64 %s", device);
-    char output[128];
-    if (capture_command(cmd, output, sizeof(output)) != 0) {
+    BlockInfo info;
+    if (block_probe(device, &info) != 0 || info.size_bytes == 0) {
         return -1;
     }
-    errno = 0;
-    unsigned long long bytes = strtoull(output, NULL, 10);
-    if (errno != 0) {
+    return (long)(info.size_bytes / (1024ULL * 1024ULL));
+}
+
+static int remove_tree_entry(const char *path, const struct stat *st, int type, struct FTW *ftw)
+{
+    (void)st;
+    (void)ftw;
+    int rc = (type == FTW_DP) ? rmdir(path) : unlink(path);
+    if (rc != 0 && errno != ENOENT) {
+        log_error("Unable to remove %s: %s", path, strerror(errno));
+    }
+    return 0;
+}
+
+int remove_tree(const char *path)
+{
+    if (!path || !path[0] || strcmp(path, "/") == 0) {
+        return -1;
+    }
+    struct stat st;
+    if (lstat(path, &st) != 0) {
+        return (errno == ENOENT) ? 0 : -1;
+    }
+    if (nftw(path, remove_tree_entry, 32, FTW_DEPTH | FTW_PHYS) != 0) {
+        return -1;
+    }
+    return (lstat(path, &st) == 0) ? -1 : 0;
+}
+
+/* True when path, with symlinks resolved, is a directory inside root. */
+static bool resolves_within(const char *path, const char *root, char *resolved)
+{
+    struct stat st;
+    size_t root_len = strlen(root);
+    return realpath(path, resolved) && stat(resolved, &st) == 0 && S_ISDIR(st.st_mode) &&
+           strncmp(resolved, root, root_len) == 0 && (resolved[root_len] == '/' || resolved[root_len] == '\0' ||
+                                                     strcmp(root, "/") == 0);
+}
+
+static int merge_tree(const char *source, const char *destination, const char *root)
+{
+    DIR *dir = opendir(source);
+    if (!dir) {
+        log_error("Unable to open %s: %s", source, strerror(errno));
+        return -1;
+    }
+
+    int rc = 0;
+    struct dirent *entry;
+    while ((entry = readdir(dir)) != NULL) {
+        if (strcmp(entry->d_name, ".") == 0 || strcmp(entry->d_name, "..") == 0) {
+            continue;
+        }
+
+        char src_path[PATH_MAX];
+        char dst_path[PATH_MAX];
+        if (snprintf(src_path, sizeof(src_path), "%s/%s", source, entry->d_name) >= (int)sizeof(src_path) ||
+            snprintf(dst_path, sizeof(dst_path), "%s/%s", destination, entry->d_name) >= (int)sizeof(dst_path)) {
+            rc = -1;
+            continue;
+        }
+
+        struct stat src_st;
+        struct stat dst_st;
+        if (lstat(src_path, &src_st) != 0) {
+            rc = -1;
+            continue;
+        }
+        bool dst_exists = lstat(dst_path, &dst_st) == 0;
+
+        if (dst_exists && S_ISDIR(src_st.st_mode) && S_ISDIR(dst_st.st_mode)) {
+            /* Both sides are directories: merge and keep the incoming metadata. */
+            if (merge_tree(src_path, dst_path, root) != 0) {
+                rc = -1;
+            }
+            if (lchown(dst_path, src_st.st_uid, src_st.st_gid) != 0 ||
+                chmod(dst_path, src_st.st_mode & 07777) != 0) {
+                log_error("Unable to copy directory metadata to %s: %s", dst_path, strerror(errno));
+            }
+            rmdir(src_path);
+            continue;
+        }
+        if (dst_exists && S_ISDIR(src_st.st_mode) && S_ISLNK(dst_st.st_mode)) {
+            /* A directory symlink such as merged-usr's lib -> usr/lib: merge
+             * through it, as extracting with tar -C did, as long as it stays
+             * inside the tree being merged into. */
+            char resolved[PATH_MAX];
+            if (!resolves_within(dst_path, root, resolved)) {
+                log_error("Refusing to merge %s: %s is a symlink that does not lead to a directory inside %s",
+                          src_path, dst_path, root);
+                rc = -1;
+                continue;
+            }
+            if (merge_tree(src_path, resolved, root) != 0) {
+                rc = -1;
+            }
+            rmdir(src_path);
+            continue;
+        }
+        if (dst_exists && S_ISDIR(dst_st.st_mode) && remove_tree(dst_path) != 0) {
+            rc = -1;
+            continue;
+        }
+        if (rename(src_path, dst_path) != 0) {
+            log_error("Unable to move %s to %s: %s", src_path, dst_path, strerror(errno));
+            rc = -1;
+        }
+    }
+
+    closedir(dir);
+    return rc;
+}
+
+/* Moves everything under source into destination. Directories present on
+ * both sides are merged; anything else in the way is replaced. */
+int merge_directory_tree(const char *source, const char *destination)
+{
+    char root[PATH_MAX];
+    if (!realpath(destination, root)) {
+        log_error("Unable to resolve %s: %s", destination, strerror(errno));
         return -1;
     }
-    return (long)(bytes / (1024ULL * 1024ULL));
+    return merge_tree(source, destination, root);
 }
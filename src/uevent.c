@@ -0,0 +1,200 @@
+#include "uevent.h"
+
+#include <arpa/inet.h>
+#include <linux/netlink.h>
+#include <poll.h>
+#include <sys/socket.h>
+
+#include "log.h"
+
+#define UEVENT_GROUP_KERNEL 1u
+#define UEVENT_GROUP_UDEV 2u
+#define UEVENT_BUFFER_SIZE 8192
+#define UEVENT_RECEIVE_BUFFER (1024 * 1024)
+#define UEVENT_UDEV_PREFIX "libudev"
+#define UEVENT_UDEV_MAGIC 0xfeedcafeu
+/* Safety net for events lost to a full socket buffer; without netlink this
+ * is simply the polling interval. */
+#define UEVENT_RECHECK_MS 1000
+#define UEVENT_POLL_MS 100
+
+static long long monotonic_ms(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (long long)ts.tv_sec * 1000 + ts.tv_nsec / 1000000;
+}
+
+int uevent_monitor_open(UeventMonitor *monitor)
+{
+    monitor->fd = socket(AF_NETLINK, SOCK_DGRAM | SOCK_CLOEXEC | SOCK_NONBLOCK, NETLINK_KOBJECT_UEVENT);
+    if (monitor->fd < 0) {
+        log_info("uevent monitor unavailable (%s); polling for device nodes instead", strerror(errno));
+        return -1;
+    }
+    int size = UEVENT_RECEIVE_BUFFER;
+    if (setsockopt(monitor->fd, SOL_SOCKET, SO_RCVBUFFORCE, &size, sizeof(size)) != 0) {
+        setsockopt(monitor->fd, SOL_SOCKET, SO_RCVBUF, &size, sizeof(size));
+    }
+
+    /* udev's group only carries anything when udevd runs; the kernel's is
+     * enough to learn that a node exists. */
+    struct sockaddr_nl addr;
+    memset(&addr, 0, sizeof(addr));
+    addr.nl_family = AF_NETLINK;
+    addr.nl_groups = UEVENT_GROUP_KERNEL | UEVENT_GROUP_UDEV;
+    if (bind(monitor->fd, (struct sockaddr *)&addr, sizeof(addr)) != 0) {
+        addr.nl_groups = UEVENT_GROUP_KERNEL;
+        if (bind(monitor->fd, (struct sockaddr *)&addr, sizeof(addr)) != 0) {
+            log_info("Unable to subscribe to uevents (%s); polling for device nodes instead", strerror(errno));
+            close(monitor->fd);
+            monitor->fd = -1;
+            return -1;
+        }
+    }
+    return 0;
+}
+
+void uevent_monitor_close(UeventMonitor *monitor)
+{
+    if (monitor && monitor->fd >= 0) {
+        close(monitor->fd);
+        monitor->fd = -1;
+    }
+}
+
+static void copy_field(char *dest, size_t len, const char *value)
+{
+    snprintf(dest, len, "%s", value);
+}
+
+static void parse_properties(const char *data, size_t len, UeventMessage *message)
+{
+    const char *end = data + len;
+    while (data < end) {
+        size_t field_len = strnlen(data, (size_t)(end - data));
+        if (strncmp(data, "ACTION=", 7) == 0) {
+            copy_field(message->action, sizeof(message->action), data + 7);
+        } else if (strncmp(data, "SUBSYSTEM=", 10) == 0) {
+            copy_field(message->subsystem, sizeof(message->subsystem), data + 10);
+        } else if (strncmp(data, "DEVTYPE=", 8) == 0) {
+            copy_field(message->devtype, sizeof(message->devtype), data + 8);
+        } else if (strncmp(data, "DEVNAME=", 8) == 0) {
+            /* The kernel sends "sda1", udev "/dev/sda1". */
+            const char *name = data + 8;
+            if (strncmp(name, "/dev/", 5) == 0) {
+                name += 5;
+            }
+            copy_field(message->devname, sizeof(message->devname), name);
+        }
+        data += field_len + 1;
+    }
+}
+
+/* Events only ever prompt another look at /dev, so a forged one can at
+ * worst cause a spurious recheck; kernel messages are still required to
+ * come from the kernel. */
+int uevent_monitor_read(UeventMonitor *monitor, UeventMessage *message)
+{
+    if (!monitor || monitor->fd < 0) {
+        return -1;
+    }
+    char buffer[UEVENT_BUFFER_SIZE + 1];
+    struct sockaddr_nl sender;
+    for (;;) {
+        socklen_t sender_len = sizeof(sender);
+        ssize_t got = recvfrom(monitor->fd, buffer, UEVENT_BUFFER_SIZE, MSG_DONTWAIT, (struct sockaddr *)&sender,
+                               &sender_len);
+        if (got < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            /* ENOBUFS means events were dropped; the caller rechecks anyway. */
+            return (errno == EAGAIN || errno == ENOBUFS) ? 0 : -1;
+        }
+        buffer[got] = '\0';
+        memset(message, 0, sizeof(*message));
+
+        if ((size_t)got >= sizeof(UEVENT_UDEV_PREFIX) &&
+            memcmp(buffer, UEVENT_UDEV_PREFIX, sizeof(UEVENT_UDEV_PREFIX)) == 0) {
+            uint32_t header[5];
+            if ((size_t)got < 8 + sizeof(header)) {
+                continue;
+            }
+            memcpy(header, buffer + 8, sizeof(header));
+            uint32_t offset = header[2];
+            uint32_t length = header[3];
+            if (ntohl(header[0]) != UEVENT_UDEV_MAGIC || offset > (uint32_t)got || length > (uint32_t)got - offset) {
+                continue;
+            }
+            message->from_udev = true;
+            parse_properties(buffer + offset, length, message);
+            return 1;
+        }
+
+        if (sender.nl_pid != 0 || !memchr(buffer, '@', strnlen(buffer, (size_t)got))) {
+            continue;
+        }
+        size_t header_len = strlen(buffer) + 1;
+        if (header_len < (size_t)got) {
+            parse_properties(buffer + header_len, (size_t)got - header_len, message);
+        }
+        return 1;
+    }
+}
+
+static bool is_block_node(const char *path)
+{
+    struct stat st;
+    return stat(path, &st) == 0 && S_ISBLK(st.st_mode);
+}
+
+int uevent_wait_for_devices(UeventMonitor *monitor, const char *const *paths, int count, int timeout_ms)
+{
+    const long long started = monotonic_ms();
+    const long long deadline = started + timeout_ms;
+    bool waited = false;
+    for (;;) {
+        int missing = -1;
+        for (int i = 0; i < count && missing < 0; ++i) {
+            if (paths[i] && paths[i][0] && !is_block_node(paths[i])) {
+                missing = i;
+            }
+        }
+        long long now = monotonic_ms();
+        if (missing < 0) {
+            if (waited) {
+                log_info("Device nodes ready after %lld ms", now - started);
+            }
+            return 0;
+        }
+        if (now >= deadline) {
+            log_error("Timed out after %d ms waiting for %s to appear", timeout_ms, paths[missing]);
+            return -1;
+        }
+
+        waited = true;
+        bool listening = monitor && monitor->fd >= 0;
+        long long wait = deadline - now;
+        long long cap = listening ? UEVENT_RECHECK_MS : UEVENT_POLL_MS;
+        if (wait > cap) {
+            wait = cap;
+        }
+        if (!listening) {
+            poll(NULL, 0, (int)wait);
+            continue;
+        }
+        struct pollfd pfd = {.fd = monitor->fd, .events = POLLIN, .revents = 0};
+        if (poll(&pfd, 1, (int)wait) > 0) {
+            UeventMessage message;
+            while (uevent_monitor_read(monitor, &message) > 0) {
+            }
+        }
+    }
+}
+
+int uevent_wait_for_device(UeventMonitor *monitor, const char *path, int timeout_ms)
+{
+    const char *paths[] = {path};
+    return uevent_wait_for_devices(monitor, paths, 1, timeout_ms);
+}
@@ -1,4 +1,5 @@
 #include <ncurses.h>
+#include <poll.h>
 #include <pty.h>
 #include <signal.h>
 #include <sys/ioctl.h>
@@ -15,6 +16,7 @@
 #define UI_MIN_HEIGHT 12
 
 static bool g_ui_ready = false;
+static int g_detached_fd = -1;
 static WINDOW *main_win = NULL;
 static WINDOW *status_win = NULL;
 static int layout_width = 0;
@@ -216,7 +218,10 @@ static void draw_progress_bar(int row, int col, int width, int percent)
     waddch(main_win, ']');
 }
 
-static void draw_loading_frame(const char *title, const char *message, int percent, char spinner)
+/* A negative percent means the job reports no total: the bar stays empty
+ * rather than pretending to move. */
+static void draw_loading_frame(const char *title, const char *message, const char *detail, int percent,
+                               char spinner)
 {
     if (!ui_begin_frame()) {
         return;
@@ -226,6 +231,10 @@ static void draw_loading_frame(const char *title, const char *message, int perce
 
     int msg_row = clamp_row(4);
     mvwprintw(main_win, msg_row, clamp_col(2), "%s", message ? message : "Working...");
+    if (detail && detail[0]) {
+        msg_row = clamp_row(msg_row + 1);
+        mvwprintw(main_win, msg_row, clamp_col(2), "%.*s", layout_width > 4 ? layout_width - 4 : 0, detail);
+    }
 
     int bar_row = clamp_row(msg_row + 2);
     int bar_col = clamp_col(2);
@@ -243,15 +252,19 @@ static void draw_loading_frame(const char *title, const char *message, int perce
     }
 
     wattron(main_win, COLOR_PAIR(1));
-    draw_progress_bar(bar_row, bar_col, bar_width, percent);
+    draw_progress_bar(bar_row, bar_col, bar_width, percent < 0 ? 0 : percent);
     wattroff(main_win, COLOR_PAIR(1));
 
-    mvwprintw(main_win,
-              clamp_row(bar_row + 1),
-              bar_col,
-              "%3d%% %c",
-              percent,
-              spinner);
+    if (percent < 0) {
+        mvwprintw(main_win, clamp_row(bar_row + 1), bar_col, " --%% %c", spinner);
+    } else {
+        mvwprintw(main_win,
+                  clamp_row(bar_row + 1),
+                  bar_col,
+                  "%3d%% %c",
+                  percent,
+                  spinner);
+    }
 
     wrefresh(main_win);
 }
@@ -320,6 +333,15 @@ void ui_shutdown(void)
     g_ui_ready = false;
 }
 
+/* For forked helpers that keep running beside the menus: they give up the
+ * screen without resetting the terminal the parent still draws on, and
+ * report progress through progress_fd instead. */
+void ui_detach(int progress_fd)
+{
+    g_ui_ready = false;
+    g_detached_fd = progress_fd;
+}
+
 void ui_status(const char *message)
 {
     if (!g_ui_ready) {
@@ -448,48 +470,150 @@ int ui_run_shell_command(const char *title, const char *command)
     return -1;
 }
 
-int ui_wait_for_process(const char *title, const char *message, pid_t pid)
+/* Waits for pid while drawing what it reports on progress_fd (see
+ * progress.h); without reports only the elapsed time is shown. */
+int ui_wait_for_process(const char *title, const char *message, pid_t pid, int progress_fd)
 {
     if (pid <= 0) {
         return -1;
     }
 
     int status = 0;
-    int percent = 0;
     const char spinner[] = "|/-\\";
     int spinner_idx = 0;
     bool interactive = ui_layout_ready();
     struct timespec sleep_time = {.tv_sec = 0, .tv_nsec = 120 * 1000000};
-    int wait_flags = interactive ? WNOHANG : 0;
+    /* The channel is drained even without a screen so the job never blocks
+     * on a full pipe. */
+    int wait_flags = (interactive || progress_fd >= 0) ? WNOHANG : 0;
+    ProgressState progress;
+    progress_init(&progress, NULL);
 
     while (1) {
         pid_t res = waitpid(pid, &status, wait_flags);
         if (res == 0) {
-            percent = (percent + 3);
-            if (percent > 92) {
-                percent = 65 + (percent % 30);
+            if (progress_fd >= 0) {
+                struct pollfd pfd = {.fd = progress_fd, .events = POLLIN};
+                if (poll(&pfd, 1, 120) > 0 && progress_read(&progress, progress_fd) != 0) {
+                    close(progress_fd);
+                    progress_fd = -1;
+                }
+            } else {
+                nanosleep(&sleep_time, NULL);
+            }
+            progress_update(&progress, -1, -1, -1, -1);
+            if (!interactive) {
+                continue;
+            }
+            char detail[MAX_MESSAGE_LEN];
+            char line[MAX_MESSAGE_LEN];
+            progress_describe(&progress, detail, sizeof(detail));
+            if (progress.phase[0] || progress.item[0]) {
+                snprintf(line, sizeof(line), "%s%s%s | %.*s", progress.phase,
+                         progress.phase[0] && progress.item[0] ? ": " : "", progress.item,
+                         (int)(sizeof(line) - sizeof(progress.phase) - sizeof(progress.item) - 8), detail);
+            } else {
+                snprintf(line, sizeof(line), "%s", detail);
             }
-            draw_loading_frame(title, message, percent, spinner[spinner_idx++ % 4]);
-            nanosleep(&sleep_time, NULL);
+            draw_loading_frame(title, message, line, progress_percent(&progress), spinner[spinner_idx++ % 4]);
             continue;
         }
         if (res < 0) {
             if (errno == EINTR) {
                 continue;
             }
+            if (progress_fd >= 0) {
+                close(progress_fd);
+            }
             return -1;
         }
         break;
     }
+    if (progress_fd >= 0) {
+        close(progress_fd);
+    }
 
     if (interactive) {
-        draw_loading_frame(title, message, 100, ' ');
+        draw_loading_frame(title, message, NULL, 100, ' ');
         napms(120);
     }
 
     return status;
 }
 
+/* For in-process jobs that keep their own ProgressState. */
+void ui_progress_state(const char *title, const char *message, const ProgressState *progress)
+{
+    static int spinner_idx = 0;
+    const char spinner[] = "|/-\\";
+
+    if (!ui_layout_ready()) {
+        if (g_detached_fd >= 0) {
+            progress_emit(g_detached_fd, NULL, progress->bytes_done, progress->bytes_total, -1, -1, NULL);
+        }
+        return;
+    }
+    char detail[MAX_MESSAGE_LEN];
+    progress_describe(progress, detail, sizeof(detail));
+    int percent = progress_percent(progress);
+    draw_loading_frame(title, message, detail, percent > 100 ? 100 : percent, spinner[spinner_idx++ % 4]);
+}
+
+void ui_progress(const char *title, const char *message, int percent)
+{
+    static int spinner_idx = 0;
+    const char spinner[] = "|/-\\";
+
+    if (!ui_layout_ready()) {
+        return;
+    }
+    if (percent < 0) {
+        percent = 0;
+    } else if (percent > 100) {
+        percent = 100;
+    }
+    draw_loading_frame(title, message, NULL, percent, spinner[spinner_idx++ % 4]);
+}
+
+/* One line per job: label, state, a short bar and what it last reported. */
+void ui_job_status(const char *title, const char *message, const UiJobRow *rows, int count)
+{
+    static int spinner_idx = 0;
+    const char spinner[] = "|/-\\";
+
+    if (!ui_layout_ready() || !ui_begin_frame()) {
+        return;
+    }
+    draw_header(title ? title : INSTALLER_NAME, NULL);
+    mvwprintw(main_win, clamp_row(4), clamp_col(2), "%s %c", message ? message : "Working...",
+              spinner[spinner_idx++ % 4]);
+
+    const int label_width = 22;
+    const int state_width = 9;
+    const int bar_width = 14;
+    for (int i = 0; i < count; ++i) {
+        int row = 6 + i;
+        if (row >= layout_height - 1) {
+            break;
+        }
+        int col = clamp_col(2);
+        mvwprintw(main_win, row, col, "%-*.*s %-*s", label_width, label_width, rows[i].label, state_width,
+                  rows[i].state);
+        col += label_width + state_width + 2;
+        if (col + bar_width + 6 < layout_width) {
+            wattron(main_win, COLOR_PAIR(1));
+            draw_progress_bar(row, col, bar_width, rows[i].percent < 0 ? 0 : rows[i].percent);
+            wattroff(main_win, COLOR_PAIR(1));
+            col += bar_width + 1;
+        }
+        int room = layout_width - col - 2;
+        if (rows[i].detail && rows[i].detail[0] && room > 0) {
+            mvwprintw(main_win, row, col, "%.*s", room, rows[i].detail);
+        }
+    }
+    wrefresh(main_win);
+}
+
 bool ui_confirm(const char *title, const char *message)
 {
     const char *items[] = {"Yes", "No"};
@@ -0,0 +1,1356 @@
+#include "untar.h"
+
+#include <fcntl.h>
+#include <grp.h>
+#include <pwd.h>
+#include <sys/sysmacros.h>
+#include <sys/xattr.h>
+
+#include "log.h"
+#include "ui.h"
+
+#define UNTAR_BLOCK 512
+/* Upper bound for pax headers and GNU long names; anything larger is not a
+ * stage3 or Portage archive. */
+#define UNTAR_META_MAX (1024 * 1024)
+#define UNTAR_OWNER_CACHE 32
+
+typedef enum {
+    STATE_HEADER = 0,
+    STATE_SPARSE_EXT, /* GNU old-style sparse extension blocks */
+    STATE_DATA,
+    STATE_PADDING,
+    STATE_END,
+} UntarState;
+
+typedef enum {
+    SINK_SKIP = 0,
+    SINK_FILE,
+    SINK_META,       /* pax header or GNU long name/link */
+    SINK_SPARSE_MAP, /* pax 1.0 sparse map ahead of the file data */
+} UntarSinkKind;
+
+typedef struct {
+    long long offset;
+    long long length;
+} SparseRegion;
+
+/* The entry being extracted, including overrides collected from the pax or
+ * GNU headers that precede it. */
+typedef struct {
+    char *path;
+    char *link;
+    bool have_size;
+    long long size;
+    bool have_uid;
+    long long uid;
+    bool have_gid;
+    long long gid;
+    char uname[33];
+    char gname[33];
+    bool have_mtime;
+    struct timespec mtime;
+    char *xattrs; /* packed: name NUL, uint32 length, value */
+    size_t xattr_len;
+    size_t xattr_cap;
+
+    int sparse_major; /* -1 when not a pax sparse entry */
+    long long realsize;
+    SparseRegion *regions;
+    int region_count;
+    size_t region_cap;
+
+    char type;
+    mode_t mode;
+    long long devmajor;
+    long long devminor;
+    int fd;
+    int region;
+    long long region_pos;
+} UntarEntry;
+
+/* Metadata applied after all data is written. Regular files are finished
+ * through their open descriptor instead and never appear here. */
+typedef struct {
+    size_t path;   /* arena offsets */
+    size_t xattrs;
+    size_t xattr_len;
+    uid_t uid;
+    gid_t gid;
+    mode_t mode;
+    char type;
+    int depth;
+    long long order;
+    struct timespec mtime;
+} UntarMeta;
+
+/* A symlink held back as an empty placeholder file until every other entry
+ * is written, so no later entry can be extracted through it. */
+typedef struct {
+    size_t path; /* arena offsets */
+    size_t target;
+    dev_t dev;
+    ino_t ino;
+} UntarSymlink;
+
+typedef struct {
+    char name[33];
+    long long id;
+} OwnerCacheEntry;
+
+struct Untar {
+    char root[PATH_MAX];
+    int root_fd;
+    int flags;
+    char label[64];
+    long long expected;
+    mode_t saved_umask;
+    uid_t euid;
+    gid_t egid;
+
+    UntarState state;
+    UntarSinkKind sink;
+    unsigned char block[UNTAR_BLOCK];
+    size_t block_fill;
+    int zero_blocks;
+    long long remaining;
+    long long padding;
+    char meta_type;
+    char *meta;
+    size_t meta_used;
+    size_t meta_cap;
+    UntarEntry cur;
+
+    char parent[PATH_MAX]; /* directory of the last entry, relative to root */
+    size_t parent_len;
+    int parent_fd;
+
+    char *arena;
+    size_t arena_used;
+    size_t arena_cap;
+    UntarMeta *deferred;
+    size_t deferred_count;
+    size_t deferred_cap;
+    UntarSymlink *symlinks;
+    size_t symlink_count;
+    size_t symlink_cap;
+
+    OwnerCacheEntry users[UNTAR_OWNER_CACHE];
+    int user_count;
+    OwnerCacheEntry groups[UNTAR_OWNER_CACHE];
+    int group_count;
+
+    long long consumed;
+    long long errors;
+    long long last_report;
+    ProgressState progress;
+    struct timespec started;
+    UntarStats stats;
+};
+
+static long long monotonic_ms(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (long long)ts.tv_sec * 1000 + ts.tv_nsec / 1000000;
+}
+
+static int grow(void **buffer, size_t *cap, size_t need, size_t item)
+{
+    if (need <= *cap) {
+        return 0;
+    }
+    size_t next = *cap ? *cap : 64;
+    while (next < need) {
+        next *= 2;
+    }
+    void *resized = realloc(*buffer, next * item);
+    if (!resized) {
+        return -1;
+    }
+    *buffer = resized;
+    *cap = next;
+    return 0;
+}
+
+static long long parse_number(const unsigned char *field, size_t len)
+{
+    if (field[0] & 0x80) {
+        /* GNU base-256 for values that do not fit in octal. */
+        long long value = field[0] & 0x3f;
+        for (size_t i = 1; i < len; ++i) {
+            value = (value << 8) | field[i];
+        }
+        return value;
+    }
+    size_t i = 0;
+    while (i < len && (field[i] == ' ' || field[i] == '\0')) {
+        ++i;
+    }
+    long long value = 0;
+    for (; i < len && field[i] >= '0' && field[i] <= '7'; ++i) {
+        value = value * 8 + (field[i] - '0');
+    }
+    return value;
+}
+
+static void copy_field(char *out, size_t out_len, const unsigned char *field, size_t len)
+{
+    size_t n = strnlen((const char *)field, len);
+    if (n >= out_len) {
+        n = out_len - 1;
+    }
+    memcpy(out, field, n);
+    out[n] = '\0';
+}
+
+static bool checksum_ok(const unsigned char *h)
+{
+    long long expected = parse_number(h + 148, 8);
+    long long unsigned_sum = 0;
+    long long signed_sum = 0;
+    for (int i = 0; i < UNTAR_BLOCK; ++i) {
+        unsigned char c = (i >= 148 && i < 156) ? ' ' : h[i];
+        unsigned_sum += c;
+        signed_sum += (signed char)c;
+    }
+    return expected == unsigned_sum || expected == signed_sum;
+}
+
+/* Strips leading "/" and "./" and refuses any ".." component; open_parent()
+ * keeps symlinks from doing the same. Returns NULL for rejected names. */
+static char *sanitize_path(const char *name)
+{
+    while (*name == '/' || (name[0] == '.' && name[1] == '/')) {
+        name += (*name == '/') ? 1 : 2;
+    }
+    char *path = strdup(name[0] ? name : ".");
+    if (!path) {
+        return NULL;
+    }
+    size_t len = strlen(path);
+    while (len > 1 && path[len - 1] == '/') {
+        path[--len] = '\0';
+    }
+    for (const char *p = path; *p;) {
+        const char *slash = strchr(p, '/');
+        size_t part = slash ? (size_t)(slash - p) : strlen(p);
+        if (part == 2 && p[0] == '.' && p[1] == '.') {
+            free(path);
+            return NULL;
+        }
+        p += part + (slash ? 1 : 0);
+    }
+    return path;
+}
+
+static void entry_reset(UntarEntry *e)
+{
+    free(e->path);
+    free(e->link);
+    free(e->xattrs);
+    free(e->regions);
+    memset(e, 0, sizeof(*e));
+    e->sparse_major = -1;
+    e->fd = -1;
+}
+
+static int entry_add_region(UntarEntry *e, long long offset, long long length)
+{
+    if (offset < 0 || length < 0 ||
+        grow((void **)&e->regions, &e->region_cap, (size_t)e->region_count + 1, sizeof(*e->regions)) != 0) {
+        return -1;
+    }
+    e->regions[e->region_count].offset = offset;
+    e->regions[e->region_count].length = length;
+    e->region_count++;
+    return 0;
+}
+
+static int entry_add_xattr(UntarEntry *e, const char *name, size_t name_len, const char *value, size_t value_len)
+{
+    size_t need = e->xattr_len + name_len + 1 + sizeof(uint32_t) + value_len;
+    if (value_len > UINT32_MAX || grow((void **)&e->xattrs, &e->xattr_cap, need, 1) != 0) {
+        return -1;
+    }
+    char *p = e->xattrs + e->xattr_len;
+    memcpy(p, name, name_len);
+    p[name_len] = '\0';
+    uint32_t length = (uint32_t)value_len;
+    memcpy(p + name_len + 1, &length, sizeof(length));
+    memcpy(p + name_len + 1 + sizeof(length), value, value_len);
+    e->xattr_len = need;
+    return 0;
+}
+
+typedef int (*XattrSetter)(const void *target, const char *name, const void *value, size_t size);
+
+static int set_xattr_fd(const void *target, const char *name, const void *value, size_t size)
+{
+    return fsetxattr(*(const int *)target, name, value, size, 0);
+}
+
+static int set_xattr_path(const void *target, const char *name, const void *value, size_t size)
+{
+    return lsetxattr((const char *)target, name, value, size, 0);
+}
+
+static int apply_xattrs(Untar *u, const char *xattrs, size_t len, XattrSetter setter, const void *target,
+                        const char *path)
+{
+    size_t pos = 0;
+    while (pos < len) {
+        const char *name = xattrs + pos;
+        size_t name_len = strlen(name);
+        uint32_t value_len;
+        memcpy(&value_len, name + name_len + 1, sizeof(value_len));
+        const char *value = name + name_len + 1 + sizeof(value_len);
+        if (setter(target, name, value, value_len) != 0) {
+            log_error("Unable to set xattr %s on %s: %s", name, path, strerror(errno));
+            u->errors++;
+        }
+        u->stats.metadata_ops++;
+        pos += name_len + 1 + sizeof(value_len) + value_len;
+    }
+    return 0;
+}
+
+static size_t arena_store(Untar *u, const void *data, size_t len, bool terminate)
+{
+    size_t need = u->arena_used + len + (terminate ? 1 : 0);
+    if (grow((void **)&u->arena, &u->arena_cap, need, 1) != 0) {
+        return 0;
+    }
+    size_t offset = u->arena_used;
+    memcpy(u->arena + offset, data, len);
+    if (terminate) {
+        u->arena[offset + len] = '\0';
+    }
+    u->arena_used = need;
+    return offset;
+}
+
+/* Opens the directory holding path one component at a time with O_NOFOLLOW,
+ * creating missing ones, so a symlink already on disk cannot lead an entry
+ * outside the root. *name is set to the last component. The descriptor is
+ * cached for the next entry, which usually shares the directory; callers
+ * must not close it. */
+static int open_parent(Untar *u, const char *path, const char **name)
+{
+    const char *slash = strrchr(path, '/');
+    size_t len = slash ? (size_t)(slash - path) : 0;
+    *name = slash ? slash + 1 : path;
+    if (len == 0) {
+        return u->root_fd;
+    }
+    if (len >= sizeof(u->parent)) {
+        log_error("Path too long in archive: %s", path);
+        return -1;
+    }
+    if (u->parent_fd >= 0 && len == u->parent_len && memcmp(u->parent, path, len) == 0) {
+        return u->parent_fd;
+    }
+
+    /* Descend from the cached directory when path lies below it. */
+    int fd = u->root_fd;
+    size_t pos = 0;
+    if (u->parent_fd >= 0 && len > u->parent_len && path[u->parent_len] == '/' &&
+        memcmp(u->parent, path, u->parent_len) == 0) {
+        fd = u->parent_fd;
+        pos = u->parent_len + 1;
+    }
+    while (pos < len) {
+        const char *end = memchr(path + pos, '/', len - pos);
+        size_t part = end ? (size_t)(end - path) - pos : len - pos;
+        if (part == 0) {
+            pos++;
+            continue;
+        }
+        int next = -1;
+        char component[NAME_MAX + 1];
+        if (part > NAME_MAX) {
+            errno = ENAMETOOLONG;
+        } else {
+            memcpy(component, path + pos, part);
+            component[part] = '\0';
+            next = openat(fd, component, O_RDONLY | O_DIRECTORY | O_NOFOLLOW | O_CLOEXEC);
+            if (next < 0 && errno == ENOENT && (mkdirat(fd, component, 0755) == 0 || errno == EEXIST)) {
+                next = openat(fd, component, O_RDONLY | O_DIRECTORY | O_NOFOLLOW | O_CLOEXEC);
+            }
+        }
+        int saved = errno;
+        if (fd != u->root_fd && fd != u->parent_fd) {
+            close(fd);
+        }
+        if (next < 0) {
+            log_error("Unable to open directory %s/%.*s: %s", u->root, (int)(pos + part), path, strerror(saved));
+            return -1;
+        }
+        fd = next;
+        pos += part + 1;
+    }
+    if (fd == u->root_fd) {
+        return fd;
+    }
+    if (fd != u->parent_fd) {
+        if (u->parent_fd >= 0) {
+            close(u->parent_fd);
+        }
+        u->parent_fd = fd;
+    }
+    memcpy(u->parent, path, len);
+    u->parent[len] = '\0';
+    u->parent_len = len;
+    return fd;
+}
+
+/* An existing non-directory in the way of a new entry is replaced, as tar
+ * does by default. */
+static bool make_room(int dir_fd, const char *name, int error)
+{
+    return error == EEXIST && unlinkat(dir_fd, name, 0) == 0;
+}
+
+static long long lookup_owner(Untar *u, const char *name, long long fallback, bool group)
+{
+    if ((u->flags & UNTAR_NUMERIC_OWNER) || !name[0]) {
+        return fallback;
+    }
+    OwnerCacheEntry *cache = group ? u->groups : u->users;
+    int *count = group ? &u->group_count : &u->user_count;
+    for (int i = 0; i < *count; ++i) {
+        if (strcmp(cache[i].name, name) == 0) {
+            return cache[i].id;
+        }
+    }
+    long long id = fallback;
+    if (group) {
+        struct group *gr = getgrnam(name);
+        if (gr) {
+            id = gr->gr_gid;
+        }
+    } else {
+        struct passwd *pw = getpwnam(name);
+        if (pw) {
+            id = pw->pw_uid;
+        }
+    }
+    if (*count < UNTAR_OWNER_CACHE) {
+        snprintf(cache[*count].name, sizeof(cache[*count].name), "%s", name);
+        cache[*count].id = id;
+        (*count)++;
+    }
+    return id;
+}
+
+static void defer_metadata(Untar *u, const UntarEntry *e)
+{
+    if (grow((void **)&u->deferred, &u->deferred_cap, u->deferred_count + 1, sizeof(*u->deferred)) != 0) {
+        u->errors++;
+        return;
+    }
+    UntarMeta *m = &u->deferred[u->deferred_count];
+    memset(m, 0, sizeof(*m));
+    m->path = arena_store(u, e->path, strlen(e->path), true);
+    if (e->xattr_len > 0) {
+        m->xattrs = arena_store(u, e->xattrs, e->xattr_len, false);
+        m->xattr_len = e->xattr_len;
+    }
+    m->uid = (uid_t)e->uid;
+    m->gid = (gid_t)e->gid;
+    m->mode = e->mode;
+    m->type = e->type;
+    m->mtime = e->mtime;
+    m->order = (long long)u->deferred_count;
+    for (const char *p = e->path; *p; ++p) {
+        m->depth += (*p == '/');
+    }
+    u->deferred_count++;
+}
+
+/* Ownership first (it clears set-id bits and file capabilities), then
+ * xattrs, then the full mode, then the timestamp. */
+static void finish_file(Untar *u, UntarEntry *e)
+{
+    if (e->sparse_major >= 0 || e->type == 'S') {
+        if (ftruncate(e->fd, (off_t)e->realsize) != 0) {
+            log_error("Unable to size sparse file %s: %s", e->path, strerror(errno));
+            u->errors++;
+        }
+    }
+    bool chowned = false;
+    if ((uid_t)e->uid != u->euid || (gid_t)e->gid != u->egid) {
+        if (fchown(e->fd, (uid_t)e->uid, (gid_t)e->gid) != 0) {
+            log_error("Unable to set owner of %s: %s", e->path, strerror(errno));
+            u->errors++;
+        }
+        chowned = true;
+        u->stats.metadata_ops++;
+    }
+    if (e->xattr_len > 0 && (u->flags & UNTAR_XATTRS)) {
+        apply_xattrs(u, e->xattrs, e->xattr_len, set_xattr_fd, &e->fd, e->path);
+    }
+    if ((e->mode & 07000) || (chowned && (e->mode & 06000))) {
+        if (fchmod(e->fd, e->mode) != 0) {
+            u->errors++;
+        }
+        u->stats.metadata_ops++;
+    }
+    const struct timespec times[2] = {{0, UTIME_OMIT}, e->mtime};
+    if (futimens(e->fd, times) != 0) {
+        u->errors++;
+    }
+    u->stats.metadata_ops++;
+    close(e->fd);
+    e->fd = -1;
+}
+
+static int open_file(Untar *u, UntarEntry *e)
+{
+    const char *name;
+    int dir_fd = open_parent(u, e->path, &name);
+    if (dir_fd < 0) {
+        return -1;
+    }
+    for (int attempt = 0; attempt < 2; ++attempt) {
+        e->fd = openat(dir_fd, name, O_WRONLY | O_CREAT | O_EXCL | O_NOFOLLOW | O_CLOEXEC, e->mode & 0777);
+        if (e->fd >= 0) {
+            return 0;
+        }
+        if (!make_room(dir_fd, name, errno)) {
+            break;
+        }
+    }
+    log_error("Unable to create %s/%s: %s", u->root, e->path, strerror(errno));
+    return -1;
+}
+
+static void create_directory(Untar *u, UntarEntry *e)
+{
+    if (strcmp(e->path, ".") != 0) {
+        const char *name;
+        int dir_fd = open_parent(u, e->path, &name);
+        if (dir_fd < 0) {
+            u->errors++;
+            return;
+        }
+        for (int attempt = 0; attempt < 2; ++attempt) {
+            if (mkdirat(dir_fd, name, (e->mode & 0777) | 0700) == 0) {
+                break;
+            }
+            if (errno == EEXIST) {
+                struct stat st;
+                if (fstatat(dir_fd, name, &st, AT_SYMLINK_NOFOLLOW) == 0 && S_ISDIR(st.st_mode)) {
+                    break;
+                }
+            }
+            if (attempt > 0 || !make_room(dir_fd, name, errno)) {
+                log_error("Unable to create directory %s/%s: %s", u->root, e->path, strerror(errno));
+                u->errors++;
+                return;
+            }
+        }
+    }
+    u->stats.directories++;
+    defer_metadata(u, e);
+}
+
+/* Hardlinks are resolved beneath the root like any other path and link the
+ * target itself, never what it points to. Symlinks start as an empty
+ * placeholder and are made real by create_symlinks() once the archive is
+ * done, so an entry such as "x -> /etc" followed by "x/shadow" fails on the
+ * placeholder instead of writing into the live system. */
+static void create_link(Untar *u, UntarEntry *e)
+{
+    bool hard = e->type == '1';
+    char *target = NULL;
+    int target_fd = -1;
+    const char *target_name = NULL;
+    if (hard) {
+        target = sanitize_path(e->link ? e->link : "");
+        if (!target) {
+            log_error("Refusing hardlink %s to %s outside the archive", e->path, e->link ? e->link : "");
+            u->errors++;
+            return;
+        }
+        int fd = open_parent(u, target, &target_name);
+        target_fd = fd == u->root_fd ? fd : fcntl(fd, F_DUPFD_CLOEXEC, 0);
+        if (target_fd < 0) {
+            u->errors++;
+            free(target);
+            return;
+        }
+    }
+
+    const char *name;
+    int dir_fd = open_parent(u, e->path, &name);
+    int rc = -1;
+    struct stat st;
+    for (int attempt = 0; dir_fd >= 0 && attempt < 2 && rc != 0; ++attempt) {
+        if (hard) {
+            rc = linkat(target_fd, target_name, dir_fd, name, 0);
+        } else {
+            int fd = openat(dir_fd, name, O_WRONLY | O_CREAT | O_EXCL | O_NOFOLLOW | O_CLOEXEC, 0);
+            rc = fd >= 0 && fstat(fd, &st) == 0 ? 0 : -1;
+            if (fd >= 0) {
+                close(fd);
+            }
+        }
+        if (rc != 0 && !make_room(dir_fd, name, errno)) {
+            break;
+        }
+    }
+    if (dir_fd < 0) {
+        u->errors++;
+    } else if (rc != 0) {
+        log_error("Unable to create %s %s/%s: %s", hard ? "hardlink" : "symlink", u->root, e->path,
+                  strerror(errno));
+        u->errors++;
+    } else if (hard) {
+        u->stats.hardlinks++;
+    } else if (grow((void **)&u->symlinks, &u->symlink_cap, u->symlink_count + 1, sizeof(*u->symlinks)) != 0) {
+        u->errors++;
+    } else {
+        UntarSymlink *link = &u->symlinks[u->symlink_count++];
+        link->path = arena_store(u, e->path, strlen(e->path), true);
+        link->target = arena_store(u, e->link ? e->link : "", e->link ? strlen(e->link) : 0, true);
+        link->dev = st.st_dev;
+        link->ino = st.st_ino;
+        u->stats.symlinks++;
+        defer_metadata(u, e);
+    }
+    if (target_fd >= 0 && target_fd != u->root_fd) {
+        close(target_fd);
+    }
+    free(target);
+}
+
+static void create_node(Untar *u, UntarEntry *e)
+{
+    mode_t kind = e->type == '3' ? S_IFCHR : e->type == '4' ? S_IFBLK : S_IFIFO;
+    dev_t dev = makedev((unsigned int)e->devmajor, (unsigned int)e->devminor);
+    const char *name;
+    int dir_fd = open_parent(u, e->path, &name);
+    if (dir_fd < 0) {
+        u->errors++;
+        return;
+    }
+    for (int attempt = 0; attempt < 2; ++attempt) {
+        if (mknodat(dir_fd, name, kind | (e->mode & 0777), kind == S_IFIFO ? 0 : dev) == 0) {
+            defer_metadata(u, e);
+            return;
+        }
+        if (!make_room(dir_fd, name, errno)) {
+            break;
+        }
+    }
+    log_error("Unable to create device node %s/%s: %s", u->root, e->path, strerror(errno));
+    u->errors++;
+}
+
+static void begin_data(Untar *u, long long size, UntarSinkKind sink)
+{
+    u->sink = sink;
+    u->remaining = size;
+    u->padding = (UNTAR_BLOCK - size % UNTAR_BLOCK) % UNTAR_BLOCK;
+    u->state = STATE_DATA;
+    if (size == 0) {
+        u->state = STATE_HEADER;
+    }
+}
+
+/* Creates the entry once its header (and any sparse map) is complete. */
+static void start_entry(Untar *u, long long size)
+{
+    UntarEntry *e = &u->cur;
+    u->stats.entries++;
+    switch (e->type) {
+    case '0':
+    case '\0':
+    case '7':
+    case 'S':
+        if (e->region_count == 0 && e->sparse_major < 0 && e->type != 'S') {
+            entry_add_region(e, 0, size);
+        }
+        if (open_file(u, e) != 0) {
+            u->errors++;
+            begin_data(u, size, SINK_SKIP);
+            break;
+        }
+        u->stats.files++;
+        if (e->sparse_major >= 0 || e->type == 'S') {
+            u->stats.sparse_files++;
+        }
+        u->meta_used = 0;
+        begin_data(u, size, e->sparse_major == 1 ? SINK_SPARSE_MAP : SINK_FILE);
+        if (size == 0) {
+            finish_file(u, e);
+            entry_reset(e);
+        }
+        return;
+    case '5':
+        create_directory(u, e);
+        break;
+    case '1':
+    case '2':
+        create_link(u, e);
+        break;
+    case '3':
+    case '4':
+    case '6':
+        create_node(u, e);
+        break;
+    default:
+        log_info("Skipping unsupported tar entry type '%c' for %s", e->type, e->path);
+        break;
+    }
+    begin_data(u, size, SINK_SKIP);
+    entry_reset(e);
+}
+
+static void set_pax_string(char **field, const char *value, size_t len)
+{
+    free(*field);
+    *field = strndup(value, len);
+}
+
+static void parse_sparse_map(UntarEntry *e, const char *value)
+{
+    /* GNU.sparse.map (format 0.1): "offset,size,offset,size,..." */
+    char *end = NULL;
+    while (*value) {
+        long long offset = strtoll(value, &end, 10);
+        if (*end != ',') {
+            return;
+        }
+        long long length = strtoll(end + 1, &end, 10);
+        entry_add_region(e, offset, length);
+        if (*end != ',') {
+            return;
+        }
+        value = end + 1;
+    }
+}
+
+static void apply_pax_record(Untar *u, const char *key, size_t key_len, const char *value, size_t value_len)
+{
+    UntarEntry *e = &u->cur;
+    char number[64];
+    size_t copy = value_len < sizeof(number) - 1 ? value_len : sizeof(number) - 1;
+    memcpy(number, value, copy);
+    number[copy] = '\0';
+
+#define KEY_IS(literal) (key_len == sizeof(literal) - 1 && memcmp(key, literal, key_len) == 0)
+    if (KEY_IS("path")) {
+        set_pax_string(&e->path, value, value_len);
+    } else if (KEY_IS("linkpath")) {
+        set_pax_string(&e->link, value, value_len);
+    } else if (KEY_IS("size")) {
+        e->have_size = true;
+        e->size = strtoll(number, NULL, 10);
+    } else if (KEY_IS("uid")) {
+        e->have_uid = true;
+        e->uid = strtoll(number, NULL, 10);
+    } else if (KEY_IS("gid")) {
+        e->have_gid = true;
+        e->gid = strtoll(number, NULL, 10);
+    } else if (KEY_IS("uname")) {
+        snprintf(e->uname, sizeof(e->uname), "%.*s", (int)(value_len < 32 ? value_len : 32), value);
+    } else if (KEY_IS("gname")) {
+        snprintf(e->gname, sizeof(e->gname), "%.*s", (int)(value_len < 32 ? value_len : 32), value);
+    } else if (KEY_IS("mtime")) {
+        char *frac = NULL;
+        e->have_mtime = true;
+        e->mtime.tv_sec = (time_t)strtoll(number, &frac, 10);
+        e->mtime.tv_nsec = 0;
+        if (frac && *frac == '.') {
+            long scale = 100000000;
+            for (const char *p = frac + 1; *p >= '0' && *p <= '9' && scale > 0; ++p, scale /= 10) {
+                e->mtime.tv_nsec += (*p - '0') * scale;
+            }
+        }
+    } else if (key_len > 13 && memcmp(key, "SCHILY.xattr.", 13) == 0) {
+        if (entry_add_xattr(e, key + 13, key_len - 13, value, value_len) != 0) {
+            u->errors++;
+        }
+    } else if (KEY_IS("GNU.sparse.major")) {
+        e->sparse_major = atoi(number);
+    } else if (KEY_IS("GNU.sparse.name")) {
+        set_pax_string(&e->path, value, value_len);
+    } else if (KEY_IS("GNU.sparse.realsize") || KEY_IS("GNU.sparse.size")) {
+        e->realsize = strtoll(number, NULL, 10);
+        if (e->sparse_major < 0) {
+            e->sparse_major = 0;
+        }
+    } else if (KEY_IS("GNU.sparse.map")) {
+        char *map = strndup(value, value_len);
+        if (map) {
+            parse_sparse_map(e, map);
+            free(map);
+        }
+        if (e->sparse_major < 0) {
+            e->sparse_major = 0;
+        }
+    } else if (KEY_IS("GNU.sparse.offset")) {
+        entry_add_region(e, strtoll(number, NULL, 10), 0);
+    } else if (KEY_IS("GNU.sparse.numbytes") && e->region_count > 0) {
+        e->regions[e->region_count - 1].length = strtoll(number, NULL, 10);
+    }
+#undef KEY_IS
+}
+
+static int parse_pax(Untar *u, const char *data, size_t len)
+{
+    size_t pos = 0;
+    while (pos < len && data[pos] != '\0') {
+        char *end = NULL;
+        long long record = strtoll(data + pos, &end, 10);
+        if (record <= 0 || pos + (size_t)record > len || *end != ' ') {
+            log_error("Malformed pax header in archive for %s", u->root);
+            return -1;
+        }
+        const char *key = end + 1;
+        const char *stop = data + pos + record - 1; /* the trailing newline */
+        const char *eq = memchr(key, '=', (size_t)(stop - key));
+        if (!eq) {
+            return -1;
+        }
+        apply_pax_record(u, key, (size_t)(eq - key), eq + 1, (size_t)(stop - eq - 1));
+        pos += (size_t)record;
+    }
+    return 0;
+}
+
+static void finish_meta(Untar *u)
+{
+    u->meta[u->meta_used] = '\0';
+    switch (u->meta_type) {
+    case 'x':
+        if (parse_pax(u, u->meta, u->meta_used) != 0) {
+            u->errors++;
+        }
+        break;
+    case 'L':
+        set_pax_string(&u->cur.path, u->meta, strnlen(u->meta, u->meta_used));
+        break;
+    case 'K':
+        set_pax_string(&u->cur.link, u->meta, strnlen(u->meta, u->meta_used));
+        break;
+    default:
+        /* Global pax headers carry nothing stage3 or Portage rely on. */
+        break;
+    }
+}
+
+static void read_gnu_sparse(UntarEntry *e, const unsigned char *p, int count)
+{
+    for (int i = 0; i < count; ++i, p += 24) {
+        if (p[0] == '\0') {
+            break;
+        }
+        entry_add_region(e, parse_number(p, 12), parse_number(p + 12, 12));
+    }
+}
+
+static int handle_header(Untar *u)
+{
+    const unsigned char *h = u->block;
+    bool zero = true;
+    for (int i = 0; i < UNTAR_BLOCK && zero; ++i) {
+        zero = h[i] == 0;
+    }
+    if (zero) {
+        if (++u->zero_blocks >= 2) {
+            u->state = STATE_END;
+        }
+        return 0;
+    }
+    u->zero_blocks = 0;
+    if (!checksum_ok(h)) {
+        log_error("Corrupt tar header while extracting into %s", u->root);
+        return -1;
+    }
+
+    char type = (char)h[156];
+    UntarEntry *e = &u->cur;
+    long long size = e->have_size ? e->size : parse_number(h + 124, 12);
+
+    if (type == 'x' || type == 'g' || type == 'L' || type == 'K') {
+        if (size < 0 || size >= UNTAR_META_MAX || grow((void **)&u->meta, &u->meta_cap, (size_t)size + 1, 1) != 0) {
+            log_error("Oversized tar metadata header in archive for %s", u->root);
+            return -1;
+        }
+        e->have_size = false;
+        u->meta_type = type;
+        u->meta_used = 0;
+        begin_data(u, size, SINK_META);
+        if (size == 0) {
+            finish_meta(u);
+        }
+        return 0;
+    }
+
+    bool posix = memcmp(h + 257, "ustar\0", 6) == 0;
+    if (!e->path) {
+        char name[101];
+        char prefix[156] = "";
+        copy_field(name, sizeof(name), h, 100);
+        if (posix) {
+            copy_field(prefix, sizeof(prefix), h + 345, 155);
+        }
+        char full[PATH_MAX];
+        snprintf(full, sizeof(full), "%s%s%s", prefix, prefix[0] ? "/" : "", name);
+        e->path = strdup(full);
+    }
+    if (!e->link) {
+        char link[101];
+        copy_field(link, sizeof(link), h + 157, 100);
+        e->link = strdup(link);
+    }
+    char *clean = e->path ? sanitize_path(e->path) : NULL;
+    if (!clean) {
+        log_error("Refusing unsafe tar entry %s", e->path ? e->path : "(null)");
+        u->errors++;
+        entry_reset(e);
+        begin_data(u, size, SINK_SKIP);
+        return 0;
+    }
+    free(e->path);
+    e->path = clean;
+
+    e->type = type;
+    e->mode = (mode_t)(parse_number(h + 100, 8) & 07777);
+    long long uid = e->have_uid ? e->uid : parse_number(h + 108, 8);
+    long long gid = e->have_gid ? e->gid : parse_number(h + 116, 8);
+    if (!e->uname[0]) {
+        copy_field(e->uname, sizeof(e->uname), h + 265, 32);
+    }
+    if (!e->gname[0]) {
+        copy_field(e->gname, sizeof(e->gname), h + 297, 32);
+    }
+    e->uid = lookup_owner(u, e->uname, uid, false);
+    e->gid = lookup_owner(u, e->gname, gid, true);
+    if (!e->have_mtime) {
+        e->mtime.tv_sec = (time_t)parse_number(h + 136, 12);
+        e->mtime.tv_nsec = 0;
+    }
+    e->devmajor = parse_number(h + 329, 8);
+    e->devminor = parse_number(h + 337, 8);
+
+    if (type == 'S' && !posix) {
+        /* Old GNU sparse: map in the header, continued in extension blocks. */
+        e->realsize = parse_number(h + 483, 12);
+        read_gnu_sparse(e, h + 386, 4);
+        if (h[482]) {
+            u->remaining = size;
+            u->state = STATE_SPARSE_EXT;
+            return 0;
+        }
+    }
+    start_entry(u, size);
+    return 0;
+}
+
+/* pax 1.0 sparse files start their data with a decimal map: the region
+ * count, then offset/length pairs, one per line, padded to a block. */
+static int try_parse_sparse_map(UntarEntry *e, const char *text, size_t len, bool *complete)
+{
+    *complete = false;
+    e->region_count = 0;
+    const char *p = text;
+    const char *end = text + len;
+    long long values[2];
+    long long count = -1;
+    int have = 0;
+    while (p < end) {
+        const char *nl = memchr(p, '\n', (size_t)(end - p));
+        if (!nl) {
+            return 0;
+        }
+        long long value = strtoll(p, NULL, 10);
+        p = nl + 1;
+        if (count < 0) {
+            count = value;
+            if (count == 0) {
+                *complete = true;
+                return 0;
+            }
+            continue;
+        }
+        values[have++] = value;
+        if (have == 2) {
+            if (entry_add_region(e, values[0], values[1]) != 0) {
+                return -1;
+            }
+            have = 0;
+            if (e->region_count == count) {
+                *complete = true;
+                return 0;
+            }
+        }
+    }
+    return 0;
+}
+
+static int write_file_data(Untar *u, const char *data, size_t len)
+{
+    UntarEntry *e = &u->cur;
+    while (len > 0) {
+        while (e->region < e->region_count && e->region_pos >= e->regions[e->region].length) {
+            e->region++;
+            e->region_pos = 0;
+        }
+        if (e->region >= e->region_count) {
+            /* More data than the map describes: corrupt entry. */
+            return -1;
+        }
+        const SparseRegion *r = &e->regions[e->region];
+        size_t chunk = len;
+        if ((long long)chunk > r->length - e->region_pos) {
+            chunk = (size_t)(r->length - e->region_pos);
+        }
+        ssize_t written = pwrite(e->fd, data, chunk, (off_t)(r->offset + e->region_pos));
+        if (written < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            log_error("Write failed for %s/%s: %s", u->root, e->path, strerror(errno));
+            return -1;
+        }
+        e->region_pos += written;
+        u->stats.bytes += written;
+        data += written;
+        len -= (size_t)written;
+    }
+    return 0;
+}
+
+static int consume_data(Untar *u, const char *data, size_t len)
+{
+    switch (u->sink) {
+    case SINK_FILE:
+        if (u->cur.fd >= 0 && write_file_data(u, data, len) != 0) {
+            u->errors++;
+            close(u->cur.fd);
+            u->cur.fd = -1;
+        }
+        break;
+    case SINK_META:
+        memcpy(u->meta + u->meta_used, data, len);
+        u->meta_used += len;
+        break;
+    case SINK_SPARSE_MAP: {
+        if (grow((void **)&u->meta, &u->meta_cap, u->meta_used + len + 1, 1) != 0) {
+            return -1;
+        }
+        memcpy(u->meta + u->meta_used, data, len);
+        u->meta_used += len;
+        if (u->meta_used % UNTAR_BLOCK == 0) {
+            bool complete = false;
+            if (try_parse_sparse_map(&u->cur, u->meta, u->meta_used, &complete) != 0) {
+                return -1;
+            }
+            if (complete) {
+                u->sink = SINK_FILE;
+                u->meta_used = 0;
+            } else if (u->meta_used >= UNTAR_META_MAX) {
+                log_error("Sparse map too large for %s", u->cur.path);
+                return -1;
+            }
+        }
+        break;
+    }
+    case SINK_SKIP:
+        break;
+    }
+    return 0;
+}
+
+static void finish_data(Untar *u)
+{
+    if (u->sink == SINK_META) {
+        finish_meta(u);
+        return;
+    }
+    if (u->sink == SINK_FILE || u->sink == SINK_SPARSE_MAP) {
+        if (u->cur.fd >= 0) {
+            finish_file(u, &u->cur);
+        }
+        entry_reset(&u->cur);
+    }
+}
+
+static void report_progress(Untar *u)
+{
+    if (!u->label[0]) {
+        return;
+    }
+    long long now = monotonic_ms();
+    if (now - u->last_report < UNTAR_PROGRESS_INTERVAL_MS) {
+        return;
+    }
+    u->last_report = now;
+    char message[160];
+    snprintf(message, sizeof(message), "Unpacking %.48s: %lld entries, %.1f MB written", u->label,
+             u->stats.entries, u->stats.bytes / 1048576.0);
+    progress_update(&u->progress, u->consumed, u->expected > 0 ? u->expected : -1, u->stats.entries, -1);
+    ui_progress_state("Extracting", message, &u->progress);
+}
+
+int untar_sink(const char *data, size_t len, void *untar)
+{
+    Untar *u = untar;
+    u->consumed += (long long)len;
+    while (len > 0) {
+        size_t n;
+        switch (u->state) {
+        case STATE_HEADER:
+        case STATE_SPARSE_EXT:
+            n = UNTAR_BLOCK - u->block_fill;
+            if (n > len) {
+                n = len;
+            }
+            memcpy(u->block + u->block_fill, data, n);
+            u->block_fill += n;
+            if (u->block_fill == UNTAR_BLOCK) {
+                u->block_fill = 0;
+                if (u->state == STATE_HEADER) {
+                    if (handle_header(u) != 0) {
+                        return -1;
+                    }
+                } else {
+                    read_gnu_sparse(&u->cur, u->block, 21);
+                    if (!u->block[504]) {
+                        start_entry(u, u->remaining);
+                    }
+                }
+            }
+            break;
+        case STATE_DATA:
+            n = (long long)len < u->remaining ? len : (size_t)u->remaining;
+            if (u->sink == SINK_SPARSE_MAP) {
+                size_t to_boundary = UNTAR_BLOCK - u->meta_used % UNTAR_BLOCK;
+                if (n > to_boundary) {
+                    n = to_boundary;
+                }
+            }
+            if (consume_data(u, data, n) != 0) {
+                return -1;
+            }
+            u->remaining -= (long long)n;
+            if (u->remaining == 0) {
+                finish_data(u);
+                u->state = u->padding > 0 ? STATE_PADDING : STATE_HEADER;
+            }
+            break;
+        case STATE_PADDING:
+            n = (long long)len < u->padding ? len : (size_t)u->padding;
+            u->padding -= (long long)n;
+            if (u->padding == 0) {
+                u->state = STATE_HEADER;
+            }
+            break;
+        case STATE_END:
+        default:
+            /* Record padding after the end-of-archive marker. */
+            n = len;
+            break;
+        }
+        data += n;
+        len -= n;
+    }
+    report_progress(u);
+    return 0;
+}
+
+Untar *untar_open(const char *root, int flags, const char *label, long long expected_bytes)
+{
+    Untar *u = calloc(1, sizeof(*u));
+    if (!u) {
+        return NULL;
+    }
+    if (snprintf(u->root, sizeof(u->root), "%s", root) >= (int)sizeof(u->root)) {
+        free(u);
+        return NULL;
+    }
+    u->root_fd = open(root, O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+    if (u->root_fd < 0) {
+        log_error("Unable to open extraction root %s: %s", root, strerror(errno));
+        free(u);
+        return NULL;
+    }
+    u->parent_fd = -1;
+    u->flags = flags;
+    snprintf(u->label, sizeof(u->label), "%s", label ? label : "");
+    u->expected = expected_bytes;
+    progress_init(&u->progress, "extract");
+    u->euid = geteuid();
+    u->egid = getegid();
+    u->arena_used = 1; /* offset 0 means "none" */
+    entry_reset(&u->cur);
+    /* Modes come from the archive, not from the installer's umask. */
+    u->saved_umask = umask(0);
+    clock_gettime(CLOCK_MONOTONIC, &u->started);
+    return u;
+}
+
+static int compare_deferred(const void *a, const void *b)
+{
+    const UntarMeta *x = a;
+    const UntarMeta *y = b;
+    /* Non-directories in archive order, then directories deepest first so a
+     * parent's timestamp is set after everything inside it. */
+    bool xd = x->type == '5';
+    bool yd = y->type == '5';
+    if (xd != yd) {
+        return xd ? 1 : -1;
+    }
+    if (xd && x->depth != y->depth) {
+        return y->depth - x->depth;
+    }
+    return (x->order > y->order) - (x->order < y->order);
+}
+
+/* Turns the symlink placeholders into real links. A placeholder that a later
+ * entry replaced is left alone, so the last entry for a path wins. */
+static void create_symlinks(Untar *u)
+{
+    for (size_t i = 0; i < u->symlink_count; ++i) {
+        const UntarSymlink *link = &u->symlinks[i];
+        if (link->path == 0 || link->target == 0) {
+            u->errors++;
+            continue;
+        }
+        const char *path = u->arena + link->path;
+        const char *name;
+        int dir_fd = open_parent(u, path, &name);
+        struct stat st;
+        if (dir_fd < 0 || fstatat(dir_fd, name, &st, AT_SYMLINK_NOFOLLOW) != 0 || st.st_dev != link->dev ||
+            st.st_ino != link->ino) {
+            continue;
+        }
+        if (unlinkat(dir_fd, name, 0) != 0 || symlinkat(u->arena + link->target, dir_fd, name) != 0) {
+            log_error("Unable to create symlink %s/%s: %s", u->root, path, strerror(errno));
+            u->errors++;
+        }
+    }
+}
+
+/* Applies deferred metadata through the entry's parent directory, never
+ * following a symlink in the last component either. */
+static void apply_deferred(Untar *u)
+{
+    if (u->deferred_count == 0) {
+        return;
+    }
+    qsort(u->deferred, u->deferred_count, sizeof(*u->deferred), compare_deferred);
+
+    for (size_t i = 0; i < u->deferred_count; ++i) {
+        const UntarMeta *m = &u->deferred[i];
+        const char *path = u->arena + m->path;
+        const char *name;
+        int dir_fd = open_parent(u, path, &name);
+        if (dir_fd < 0) {
+            u->errors++;
+            continue;
+        }
+
+        bool chowned = false;
+        if (m->uid != u->euid || m->gid != u->egid) {
+            if (fchownat(dir_fd, name, m->uid, m->gid, AT_SYMLINK_NOFOLLOW) != 0) {
+                log_error("Unable to set owner of %s/%s: %s", u->root, path, strerror(errno));
+                u->errors++;
+            }
+            chowned = true;
+            u->stats.metadata_ops++;
+        }
+        if (m->xattr_len > 0 && (u->flags & UNTAR_XATTRS)) {
+            /* The directory is reached through our own descriptor; only the
+             * last component is looked up, and lsetxattr does not follow it. */
+            char full[PATH_MAX];
+            if (snprintf(full, sizeof(full), "/proc/self/fd/%d/%s", dir_fd, name) < (int)sizeof(full)) {
+                apply_xattrs(u, u->arena + m->xattrs, m->xattr_len, set_xattr_path, full, path);
+            }
+        }
+        if (m->type != '2') {
+            mode_t created = m->type == '5' ? ((m->mode & 0777) | 0700) : (m->mode & 0777);
+            if (m->mode != created || (chowned && (m->mode & 06000))) {
+                if (fchmodat(dir_fd, name, m->mode, AT_SYMLINK_NOFOLLOW) != 0) {
+                    u->errors++;
+                }
+                u->stats.metadata_ops++;
+            }
+        }
+        const struct timespec times[2] = {{0, UTIME_OMIT}, m->mtime};
+        if (utimensat(dir_fd, name, times, AT_SYMLINK_NOFOLLOW) != 0) {
+            u->errors++;
+        }
+        u->stats.metadata_ops++;
+    }
+}
+
+/* Finishes extraction: creates the held-back symlinks, applies deferred
+ * metadata, then one syncfs() for the whole tree. Returns 0 when the archive
+ * ended cleanly without errors. */
+int untar_close(Untar *u, UntarStats *stats)
+{
+    if (!u) {
+        return -1;
+    }
+    bool complete = u->state == STATE_END || (u->state == STATE_HEADER && u->block_fill == 0 && u->zero_blocks > 0);
+    if (u->cur.fd >= 0) {
+        close(u->cur.fd);
+    }
+    entry_reset(&u->cur);
+
+    if (u->label[0]) {
+        ui_progress("Extracting", "Applying ownership, permissions and timestamps...", 100);
+    }
+    create_symlinks(u);
+    apply_deferred(u);
+    if (u->label[0]) {
+        ui_progress("Extracting", "Flushing extracted files to disk...", 100);
+    }
+    if (syncfs(u->root_fd) != 0) {
+        log_error("syncfs failed for %s: %s", u->root, strerror(errno));
+        u->errors++;
+    }
+    umask(u->saved_umask);
+
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    u->stats.seconds = (double)(now.tv_sec - u->started.tv_sec) + (double)(now.tv_nsec - u->started.tv_nsec) / 1e9;
+    if (stats) {
+        *stats = u->stats;
+    }
+    if (!complete) {
+        log_error("Archive for %s ended before the end-of-archive marker", u->root);
+    }
+    int rc = (complete && u->errors == 0) ? 0 : -1;
+    if (u->errors > 0) {
+        log_error("%lld error(s) while extracting into %s", u->errors, u->root);
+    }
+
+    if (u->parent_fd >= 0) {
+        close(u->parent_fd);
+    }
+    free(u->arena);
+    free(u->symlinks);
+    free(u->deferred);
+    free(u->meta);
+    close(u->root_fd);
+    free(u);
+    return rc;
+}
+
+void untar_log_stats(const char *label, const UntarStats *stats)
+{
+    if (!stats) {
+        return;
+    }
+    double rate = stats->seconds > 0 ? stats->entries / stats->seconds : 0;
+    log_info("Extracted %s: %lld entries (%lld files, %lld dirs, %lld symlinks, %lld hardlinks, %lld sparse), "
+             "%.1f MB, %lld metadata updates in %.2fs (%.0f entries/s)",
+             label, stats->entries, stats->files, stats->directories, stats->symlinks, stats->hardlinks,
+             stats->sparse_files, stats->bytes / 1048576.0, stats->metadata_ops, stats->seconds, rate);
+}
@@ -0,0 +1,294 @@
+#include "xz.h"
+
+#include <fcntl.h>
+#include <lzma.h>
+
+#include "log.h"
+
+/* Leaves room for tar and the page cache on small machines; the decoder drops
+ * to fewer threads (down to one) rather than exceed this. */
+#define XZ_THREADING_MEM_DIVISOR 4
+#define XZ_THREADING_MEM_MIN (64ULL * 1024 * 1024)
+#define XZ_INPUT_CHUNK (256 * 1024)
+
+struct XzStream {
+    lzma_stream strm;
+    XzSink sink;
+    void *sink_ctx;
+    bool failed;
+    bool finished;
+    unsigned int threads;
+    long long in_bytes;
+    long long out_bytes;
+    struct timespec wall_start;
+    struct timespec cpu_start;
+    uint8_t out[XZ_OUTPUT_CHUNK];
+};
+
+static double elapsed_seconds(clockid_t clock, const struct timespec *start)
+{
+    struct timespec now;
+    clock_gettime(clock, &now);
+    return (double)(now.tv_sec - start->tv_sec) + (double)(now.tv_nsec - start->tv_nsec) / 1e9;
+}
+
+static unsigned int worker_count(void)
+{
+    long online = sysconf(_SC_NPROCESSORS_ONLN);
+    if (online < 1) {
+        return 1;
+    }
+    return online > 64 ? 64 : (unsigned int)online;
+}
+
+static const char *lzma_error_text(lzma_ret ret)
+{
+    switch (ret) {
+    case LZMA_MEM_ERROR:
+        return "out of memory";
+    case LZMA_MEMLIMIT_ERROR:
+        return "memory limit reached";
+    case LZMA_FORMAT_ERROR:
+        return "not in .xz format";
+    case LZMA_OPTIONS_ERROR:
+        return "unsupported compression options";
+    case LZMA_DATA_ERROR:
+        return "compressed data is corrupt";
+    case LZMA_BUF_ERROR:
+        return "compressed data is truncated";
+    default:
+        return "unexpected decoder error";
+    }
+}
+
+XzStream *xz_stream_open(XzSink sink, void *ctx)
+{
+    if (!sink) {
+        return NULL;
+    }
+    XzStream *xz = calloc(1, sizeof(*xz));
+    if (!xz) {
+        return NULL;
+    }
+    xz->strm = (lzma_stream)LZMA_STREAM_INIT;
+    xz->sink = sink;
+    xz->sink_ctx = ctx;
+    xz->threads = worker_count();
+
+    uint64_t threading_limit = lzma_physmem() / XZ_THREADING_MEM_DIVISOR;
+    if (threading_limit < XZ_THREADING_MEM_MIN) {
+        threading_limit = XZ_THREADING_MEM_MIN;
+    }
+    lzma_mt options = {
+        .flags = LZMA_CONCATENATED,
+        .threads = xz->threads,
+        .timeout = 0,
+        .memlimit_threading = threading_limit,
+        .memlimit_stop = UINT64_MAX,
+    };
+    lzma_ret ret = lzma_stream_decoder_mt(&xz->strm, &options);
+    if (ret != LZMA_OK) {
+        log_info("Threaded xz decoder unavailable (%s); decoding on one core", lzma_error_text(ret));
+        xz->threads = 1;
+        ret = lzma_stream_decoder(&xz->strm, UINT64_MAX, LZMA_CONCATENATED);
+    }
+    if (ret != LZMA_OK) {
+        log_error("Unable to initialise xz decoder: %s", lzma_error_text(ret));
+        free(xz);
+        return NULL;
+    }
+
+    clock_gettime(CLOCK_MONOTONIC, &xz->wall_start);
+    clock_gettime(CLOCK_PROCESS_CPUTIME_ID, &xz->cpu_start);
+    return xz;
+}
+
+static int xz_run(XzStream *xz, lzma_action action)
+{
+    while (!xz->failed && !xz->finished) {
+        xz->strm.next_out = xz->out;
+        xz->strm.avail_out = sizeof(xz->out);
+        lzma_ret ret = lzma_code(&xz->strm, action);
+
+        size_t produced = sizeof(xz->out) - xz->strm.avail_out;
+        if (produced > 0) {
+            if (xz->sink((const char *)xz->out, produced, xz->sink_ctx) != 0) {
+                log_error("Archive consumer stopped accepting decoded data");
+                xz->failed = true;
+                return -1;
+            }
+            xz->out_bytes += (long long)produced;
+        }
+
+        if (ret == LZMA_STREAM_END) {
+            xz->finished = true;
+            break;
+        }
+        if (ret != LZMA_OK) {
+            log_error("xz decoding failed: %s", lzma_error_text(ret));
+            xz->failed = true;
+            return -1;
+        }
+        /* Everything consumed and the output buffer not filled: more input
+         * is needed (or, when finishing, the workers are still busy). */
+        if (xz->strm.avail_in == 0 && produced < sizeof(xz->out) && action == LZMA_RUN) {
+            break;
+        }
+    }
+    return xz->failed ? -1 : 0;
+}
+
+int xz_stream_write(XzStream *xz, const void *data, size_t len)
+{
+    if (!xz || xz->failed) {
+        return -1;
+    }
+    if (xz->finished) {
+        /* Trailing bytes after the final stream are not ours to unpack. */
+        return 0;
+    }
+    xz->strm.next_in = data;
+    xz->strm.avail_in = len;
+    xz->in_bytes += (long long)len;
+    return xz_run(xz, LZMA_RUN);
+}
+
+/* Flushes the decoder and frees it. Returns 0 only when a complete stream
+ * was decoded and written out. */
+int xz_stream_close(XzStream *xz, XzStats *stats)
+{
+    if (!xz) {
+        return -1;
+    }
+    if (!xz->failed && !xz->finished) {
+        xz->strm.next_in = NULL;
+        xz->strm.avail_in = 0;
+        xz_run(xz, LZMA_FINISH);
+    }
+    int rc = (!xz->failed && xz->finished) ? 0 : -1;
+    if (stats) {
+        stats->in_bytes = xz->in_bytes;
+        stats->out_bytes = xz->out_bytes;
+        stats->seconds = elapsed_seconds(CLOCK_MONOTONIC, &xz->wall_start);
+        stats->cpu_seconds = elapsed_seconds(CLOCK_PROCESS_CPUTIME_ID, &xz->cpu_start);
+        stats->threads = xz->threads;
+    }
+    lzma_end(&xz->strm);
+    free(xz);
+    return rc;
+}
+
+int xz_decompress_file(const char *path, XzSink sink, void *ctx, XzStats *stats)
+{
+    int fd = open(path, O_RDONLY | O_CLOEXEC);
+    if (fd < 0) {
+        log_error("Unable to open %s: %s", path, strerror(errno));
+        return -1;
+    }
+    (void)posix_fadvise(fd, 0, 0, POSIX_FADV_SEQUENTIAL);
+
+    XzStream *xz = xz_stream_open(sink, ctx);
+    if (!xz) {
+        close(fd);
+        return -1;
+    }
+
+    static uint8_t buffer[XZ_INPUT_CHUNK];
+    int rc = 0;
+    while (rc == 0) {
+        ssize_t got = read(fd, buffer, sizeof(buffer));
+        if (got < 0 && errno == EINTR) {
+            continue;
+        }
+        if (got < 0) {
+            log_error("Read error on %s: %s", path, strerror(errno));
+            rc = -1;
+            break;
+        }
+        if (got == 0) {
+            break;
+        }
+        rc = xz_stream_write(xz, buffer, (size_t)got);
+    }
+    close(fd);
+
+    XzStats local;
+    if (xz_stream_close(xz, &local) != 0) {
+        rc = -1;
+    }
+    if (stats) {
+        *stats = local;
+    }
+    return rc;
+}
+
+/* Reads the stream index from the end of the file, so consumers can report
+ * progress against the real output size. Returns -1 when it is unknown. */
+long long xz_uncompressed_size(const char *path)
+{
+    int fd = open(path, O_RDONLY | O_CLOEXEC);
+    struct stat st;
+    if (fd < 0) {
+        return -1;
+    }
+    if (fstat(fd, &st) != 0) {
+        close(fd);
+        return -1;
+    }
+
+    lzma_stream strm = LZMA_STREAM_INIT;
+    lzma_index *index = NULL;
+    if (lzma_file_info_decoder(&strm, &index, UINT64_MAX, (uint64_t)st.st_size) != LZMA_OK) {
+        close(fd);
+        return -1;
+    }
+    uint8_t buffer[8192];
+    long long size = -1;
+    while (1) {
+        if (strm.avail_in == 0) {
+            ssize_t got = read(fd, buffer, sizeof(buffer));
+            if (got <= 0) {
+                break;
+            }
+            strm.next_in = buffer;
+            strm.avail_in = (size_t)got;
+        }
+        lzma_ret ret = lzma_code(&strm, LZMA_RUN);
+        if (ret == LZMA_SEEK_NEEDED) {
+            if (lseek(fd, (off_t)strm.seek_pos, SEEK_SET) < 0) {
+                break;
+            }
+            strm.avail_in = 0;
+            continue;
+        }
+        if (ret == LZMA_STREAM_END) {
+            size = (long long)lzma_index_uncompressed_size(index);
+            break;
+        }
+        if (ret != LZMA_OK) {
+            break;
+        }
+    }
+    if (index) {
+        lzma_index_end(index, NULL);
+    }
+    lzma_end(&strm);
+    close(fd);
+    return size;
+}
+
+/* Records wall-clock and per-core throughput so runs on different machines,
+ * or the same machine with different thread counts, can be compared. */
+void xz_log_stats(const char *label, const XzStats *stats)
+{
+    if (!stats || stats->seconds <= 0) {
+        return;
+    }
+    double out_mb = stats->out_bytes / 1048576.0;
+    double rate = out_mb / stats->seconds;
+    double per_core = stats->cpu_seconds > 0 ? out_mb / stats->cpu_seconds : rate;
+    log_info("xz %s: %.1f MB -> %.1f MB in %.2fs on %u thread(s): %.1f MB/s total, %.1f MB/s per core "
+             "(%.2f cores busy)",
+             label, stats->in_bytes / 1048576.0, out_mb, stats->seconds, stats->threads, rate, per_core,
+             stats->cpu_seconds / stats->seconds);
+}